@@ -6,10 +6,20 @@
 
 #include "AimIO/Definitions.h"
 #include "AimIO/Exception.h"
+#include "AimIO/Calibration.h"
+#include "AimIO/Binning.h"
+#include "AimIO/SeekIndex.h"
+#include "AimIO/ThreadPool.h"
+#include "AimIO/DataSource.h"
+#include "AimIO/IOBackend.h"
 #include <n88util/tuplet.hpp>
 #include <string>
 #include <vector>
 #include <fstream>
+#include <istream>
+#include <functional>
+#include <memory>
+#include <future>
 #include <boost/cstdint.hpp>
 
 #include "aimio_export.h"
@@ -18,6 +28,7 @@
 namespace AimIO
 {
 
+class Encoder;
 
 // For internal use.
 struct MemoryBlock
@@ -57,6 +68,28 @@ class AIMIO_EXPORT AimFile
       */ 
     void ReadImageInfo ();
 
+    /** Read the AIM file header from an already open stream.
+      *
+      * The stream must be positioned such that offset 0 corresponds to the
+      * start of the AIM file, and it must be seekable. Exceptions are
+      * enabled on the stream. The public member variable filename is
+      * neither used nor modified, but must be set if ReadImageData is to be
+      * called afterwards.
+      */
+    void ReadImageInfo (std::istream& s);
+
+    /** Read the AIM file header from an AIM file in memory.
+      *
+      * The bytes are not copied: they are parsed in place, and the methods
+      * that read image data subsequently decode directly from them, so they
+      * must remain valid while this object reads from them. Equivalent to
+      * SetSource with a MemorySource, followed by ReadImageInfo.
+      *
+      * To write an AIM file to memory, set a MemorySink or BufferSink with
+      * SetSink.
+      */
+    void ReadImageInfoFromMemory (const void* data, size_t size);
+
     /** Read the AIM image data.
       *
       * You must previously have called ReadImageInfo.
@@ -74,6 +107,86 @@ class AIMIO_EXPORT AimFile
     void ReadImageData (short* data, size_t size);
     void ReadImageData (float* data, size_t size);
 
+    /** Read the AIM image data, binned by bin in each direction.
+      *
+      * You must previously have called ReadImageInfo. As for ReadImageData,
+      * the pointer type must correspond to buffer_type.
+      *
+      * Each output voxel combines a block of bin x bin x bin voxels; see
+      * BinImageData. The data are decoded and binned bin slices at a time,
+      * so that only the binned image is allocated in full.
+      *
+      * The value of 'size' must be long_product(BinnedDimensions(dimensions,bin)).
+      */
+    void ReadBinnedImageData (char* data, size_t size, int bin, bin_method_t method = BIN_MAXIMUM);
+    void ReadBinnedImageData (short* data, size_t size, int bin, bin_method_t method = BIN_AVERAGE);
+    void ReadBinnedImageData (float* data, size_t size, int bin, bin_method_t method = BIN_AVERAGE);
+
+    /** Read number_of_slices z slices, starting at first_slice.
+      *
+      * You must previously have called ReadImageInfo. As for ReadImageData,
+      * the pointer type must correspond to buffer_type.
+      *
+      * Uncompressed data are read directly. For D1TcharCmp and D1TbinCmp
+      * data, decoding starts at the nearest preceding checkpoint of the
+      * seek index, and only the corresponding part of the compressed data
+      * is read; the index is built on the first call if none has been set
+      * (see GetSeekIndex).
+      *
+      * The value of 'size' must be dimensions[0]*dimensions[1]*number_of_slices.
+      */
+    void ReadSlices (int first_slice, int number_of_slices, char* data, size_t size);
+    void ReadSlices (int first_slice, int number_of_slices, short* data, size_t size);
+    void ReadSlices (int first_slice, int number_of_slices, float* data, size_t size);
+
+    /** The seek index of D1TcharCmp or D1TbinCmp data.
+      *
+      * If none has been set with SetSeekIndex, an index with a checkpoint
+      * every 16 slices is built by decoding the data once, and is retained
+      * until ReadImageInfo is called again.
+      */
+    const AimSeekIndex& GetSeekIndex ();
+
+    /// Use an existing seek index, for example one loaded from a sidecar file.
+    void SetSeekIndex (const AimSeekIndex& index);
+
+    /** Read a half-resolution preview of D3Tbit8 data.
+      *
+      * You must previously have called ReadImageInfo, and aim_type must be
+      * AIMFILE_TYPE_D3Tbit8.
+      *
+      * In D3Tbit8 data each byte encodes a 2x2x2 cube of voxels, so a
+      * preview of dimensions (dimensions+1)/2 is obtained directly from the
+      * stored bytes, without expanding them to full resolution. The data
+      * are read straight into the output buffer; no other memory is used.
+      *
+      * The value of 'size' must be long_product((dimensions+1)/2).
+      */
+    void ReadBit8Preview (char* data, size_t size, bit8_preview_t mode = BIT8_PREVIEW_OCCUPANCY);
+
+    /** Calibration parameters, as given in the processing log.
+      *
+      * You must previously have called ReadImageInfo.
+      */
+    Calibration GetCalibration () const;
+
+    /** Read short AIM image data and convert to calibrated values.
+      *
+      * You must previously have called ReadImageInfo, and buffer_type must
+      * be AIMFILE_TYPE_SHORT.
+      *
+      * The conversion is done in the same pass as reading the data, so that
+      * no intermediate short buffer of the size of the image is required.
+      * If no calibration is given, that of the processing log is used.
+      *
+      * The value of 'size' must be the product of the dimensions.
+      */
+    void ReadCalibratedImageData (float* data, size_t size, calibration_unit_t unit);
+    void ReadCalibratedImageData (float* data,
+                                  size_t size,
+                                  calibration_unit_t unit,
+                                  const Calibration& calibration);
+
     /** Write an AIM file.
       *
       * Before calling this, you must set any relevant public member variables.
@@ -100,6 +213,43 @@ class AIMIO_EXPORT AimFile
     void WriteImageData (const short* data);
     void WriteImageData (const float* data);
 
+    /** Asynchronous versions of ReadImageData and WriteImageData, which run
+      * on the AimIO thread pool (see ThreadPool.h).
+      *
+      * Either a future is returned, which rethrows any exception from get(),
+      * or done is called on completion from a pool thread. This object and
+      * data must remain valid, and this object must not otherwise be used,
+      * until the operation is complete. If AimIO is single-threaded, a
+      * returned future runs the operation when get() or wait() is called,
+      * and done is called before returning.
+      */
+    std::future<void> ReadImageDataAsync (char* data, size_t size);
+    std::future<void> ReadImageDataAsync (short* data, size_t size);
+    std::future<void> ReadImageDataAsync (float* data, size_t size);
+    void ReadImageDataAsync (char* data, size_t size, const completion_callback_t& done);
+    void ReadImageDataAsync (short* data, size_t size, const completion_callback_t& done);
+    void ReadImageDataAsync (float* data, size_t size, const completion_callback_t& done);
+    std::future<void> WriteImageDataAsync (const char* data);
+    std::future<void> WriteImageDataAsync (const short* data);
+    std::future<void> WriteImageDataAsync (const float* data);
+    void WriteImageDataAsync (const char* data, const completion_callback_t& done);
+    void WriteImageDataAsync (const short* data, const completion_callback_t& done);
+    void WriteImageDataAsync (const float* data, const completion_callback_t& done);
+
+    /** Read from source instead of the file given by filename.
+      *
+      * This applies to ReadImageInfo and to all methods that read image
+      * data. Set a null pointer to read the file again. See DataSource.h.
+      */
+    void SetSource (const std::shared_ptr<const DataSource>& source);
+
+    /** Write to sink instead of the file given by filename.
+      *
+      * This applies to WriteImageData and WriteImageDataAsync. Set a null
+      * pointer to write the file again. See DataSource.h.
+      */
+    void SetSink (const std::shared_ptr<DataSink>& sink);
+
     std::string               filename;
 
     // The following are public variables that correspond to meta-data
@@ -190,17 +340,85 @@ class AIMIO_EXPORT AimFile
     /// and for AIX compatibility
     int                       byte_offset;
 
+    /// Image data larger than twice this many bytes are read in chunks of
+    /// this size on the AimIO thread pool. (A chunk needed before a worker
+    /// has read it is read by the decoding thread itself.) Uncompressed
+    /// data are converted, in parallel, chunk by chunk while the following
+    /// chunks are read. Compressed data are decoded in parallel once all
+    /// chunks have been read, except that with a pool of a single worker,
+    /// D1TcharCmp and D1TbinCmp data are decoded chunk by chunk as they
+    /// arrive. Set to 0 to read all the data with one read before decoding.
+    /// Has no effect if AimIO is single-threaded (see ThreadPool.h).
+    size_t                    read_chunk_size;
+
+    /// How the file is read and written with respect to the page cache;
+    /// see io_policy_t in IOBackend.h. The default is IO_POLICY_BUFFERED.
+    /// Does not apply to sources and sinks set with SetSource and SetSink.
+    io_policy_t               io_policy;
+
   protected:
 
-    void ReadBlockList (std::ifstream& f);
-    void ReadHeader (std::ifstream& f);
-    void ReadProcessingLog (std::ifstream& f);
+    void ReadBlockList (std::istream& f);
+    void ReadHeader (std::istream& f);
+    void ReadProcessingLog (std::istream& f);
     buffer_format_t GetTransferBufferType (aim_storage_format_t storage_type);
     void ReadAnyData (void* data, int buffer_number, aim_storage_format_t type);
+    void ReadAnyDataFrom (const DataSource& file,
+                          void* data,
+                          int buffer_number,
+                          aim_storage_format_t type) const;
+    void ReadAnyDataPipelined (const DataSource& file,
+                               void* data,
+                               int buffer_number,
+                               aim_storage_format_t type) const;
+    template <typename T> void ReadBinnedAnyData (T* data, size_t size, int bin, bin_method_t method);
+
+    /// Decodes the image data a slab of slab_thickness z slices at a time
+    /// (the last slab may be thinner), passing each slab to consume.
+    /// Used by the streaming methods, so that the full image is never
+    /// decoded in memory. Instantiated for char, short and float.
+    template <typename T> void ForEachSlab (
+        int slab_thickness,
+        const std::function<void(T* slab, int first_slice, int number_of_slices)>& consume);
+    template <typename T> void ReadAnySlices (int first_slice, int number_of_slices, T* data, size_t size);
+    /// Reads slices using file, which must be open on this file. For
+    /// D1TcharCmp and D1TbinCmp data, index is required. Arguments are not
+    /// checked. Does not modify this object, so may be called concurrently.
+    template <typename T> void ReadSlicesFrom (const DataSource& file,
+                                               const AimSeekIndex* index,
+                                               int first_slice,
+                                               int number_of_slices,
+                                               T* data) const;
+    /// Reads the box of dimensions extent at start, using file. As for
+    /// ReadSlicesFrom, arguments are not checked and this is not modified.
+    template <typename T> void ReadRegionFrom (const DataSource& file,
+                                               const AimSeekIndex* index,
+                                               const n88::tuplet<3,int>& start,
+                                               const n88::tuplet<3,int>& extent,
+                                               T* data) const;
+    /// The source set with SetSource, or otherwise the file.
+    std::shared_ptr<const DataSource> OpenSource () const;
     void FillHeader (std::vector<char>& header);
     void WriteAnyData (const void* data);
+    void WriteEncoded (DataSink& sink, const Encoder& encoded);
+    /// Writes the pre-header, header and processing log. The processing
+    /// log block is padded with nulls so that the data block starts at a
+    /// multiple of data_alignment bytes.
+    void WritePreamble (std::ostream& f, size_t data_size, size_t data_alignment = 1);
 
     BlockList block_list;
+    std::shared_ptr<const AimSeekIndex> seek_index;
+    std::shared_ptr<const DataSource> source;
+    std::shared_ptr<DataSink> sink;
+
+    friend class AimSliceWriter;
+    friend class AimMappedWriter;
+    friend class AimPyramid;
+    friend class AimBrickFile;
+    friend class AimSeekIndex;
+    friend class PackedAimFile;
+    friend class AimReader;
+    friend class Prefetcher;
 };
 
 }  // namespace
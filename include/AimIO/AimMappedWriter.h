@@ -0,0 +1,104 @@
+// Copyright (c) Eric Nodwell
+// See LICENSE for details.
+
+#ifndef __AimIO_AimMappedWriter_h
+#define __AimIO_AimMappedWriter_h
+
+#include "AimIO/AimIO.h"
+#include <memory>
+#include <string>
+
+#include "aimio_export.h"
+
+namespace AimIO
+{
+
+/** Writes an uncompressed AIM file by mapping it into memory.
+  *
+  * The file is created at its final size, with the header and processing
+  * log already written, and the data block is mapped writable. The
+  * application fills the image directly in the mapping, for example from
+  * several threads each computing part of the result, so that no
+  * intermediate buffer and no copy is required.
+  *
+  * Only uncompressed storage types (AIMFILE_TYPE_D1Tchar,
+  * AIMFILE_TYPE_D1Tshort and AIMFILE_TYPE_D1Tfloat) are supported, as
+  * otherwise the size of the file is not known in advance.
+  *
+  * Example:
+  *
+  *   AimIO::AimFile header ("out.aim");
+  *   header.dimensions = ...;
+  *   header.element_size = ...;
+  *   header.aim_type = AimIO::AIMFILE_TYPE_D1Tfloat;
+  *   AimIO::AimMappedWriter writer (header);
+  *   float* data = writer.FloatData();
+  *   // Fill data[0] to data[writer.NumberOfValues()-1], in any order.
+  *   writer.Close();
+  *
+  * Values are written in native format. AIM files store floats in VAX
+  * format (and shorts little-endian), so Close converts the values in
+  * place where necessary.
+  */
+class AIMIO_EXPORT AimMappedWriter
+{
+  public:
+
+    /** Constructor. Creates the file, writes the header, allocates the
+      * space for the data and maps it.
+      *
+      * The meta-data must be set in header as for AimFile::WriteImageData
+      * (in particular filename, dimensions and element_size). The storage
+      * type is given by aim_type or, if that is not set, by buffer_type.
+      * If the file system cannot allocate the space for the data, an
+      * exception is thrown here rather than when the mapping is written.
+      */
+    AimMappedWriter (AimFile& header);
+
+    /** Destructor. Unmaps the file if Close has not been called. The
+      * contents of the file are then undefined.
+      */
+    ~AimMappedWriter ();
+
+    /// Storage type of the file.
+    aim_storage_format_t Type () const {return this->type;}
+
+    /// Number of values in the image.
+    size_t NumberOfValues () const {return this->number_of_values;}
+
+    /// The data block, which holds NumberOfValues values of type Type.
+    /// The pointer is aligned for any type. Valid until Close is called.
+    void* Data () {return this->data;}
+
+    /// As Data. Type must be AIMFILE_TYPE_D1Tchar.
+    char* CharData ();
+
+    /// As Data. Type must be AIMFILE_TYPE_D1Tshort.
+    short* ShortData ();
+
+    /// As Data. Type must be AIMFILE_TYPE_D1Tfloat.
+    float* FloatData ();
+
+    /** Converts the values to the storage format, writes the data to the
+      * file and unmaps it. Throws an exception if there was an error.
+      */
+    void Close ();
+
+  protected:
+
+    struct Mapping;
+    std::string                 filename;
+    aim_storage_format_t        type;
+    size_t                      number_of_values;
+    std::unique_ptr<Mapping>    mapping;
+    char*                       data;
+
+  private:
+
+    AimMappedWriter (const AimMappedWriter&);
+    AimMappedWriter& operator= (const AimMappedWriter&);
+};
+
+}  // namespace
+
+#endif
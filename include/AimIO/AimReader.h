@@ -0,0 +1,114 @@
+// Copyright (c) Eric Nodwell
+// See LICENSE for details.
+
+#ifndef __AimIO_AimReader_h
+#define __AimIO_AimReader_h
+
+#include "AimIO/AimIO.h"
+#include <n88util/tuplet.hpp>
+#include <string>
+#include <memory>
+#include <mutex>
+
+#include "aimio_export.h"
+
+
+namespace AimIO
+{
+
+/** A read-only handle on an AIM file that may be shared between threads.
+  *
+  * AimFile holds the meta-data, the block list and the state of the I/O
+  * in one mutable object, so that it cannot be used from several threads
+  * at once. An AimReader is instead created once, from an AimFile on which
+  * ReadImageInfo has been called, and is thereafter immutable: all reading
+  * methods are const, and may be called concurrently. The file is kept
+  * open, and is read with positional reads, so that there is no shared
+  * file position.
+  *
+  * For D1TcharCmp and D1TbinCmp data, a seek index is built on the first
+  * call that requires it (once only, even with concurrent callers), unless
+  * the AimFile already had one.
+  *
+  * Example:
+  *
+  *   AimIO::AimFile header ("image.aim");
+  *   header.ReadImageInfo();
+  *   const AimIO::AimReader reader (header);
+  *   // From any thread:
+  *   std::vector<short> roi (long_product(extent));
+  *   reader.ReadRegion (start, extent, roi.data(), roi.size());
+  */
+class AIMIO_EXPORT AimReader
+{
+  public:
+
+    /// Create a reader from header, on which ReadImageInfo must have been called.
+    explicit AimReader (const AimFile& header);
+
+    /// Create a reader for filename, reading the header.
+    explicit AimReader (const std::string& filename);
+
+    ~AimReader ();
+
+    /// The meta-data of the file.
+    const AimFile& Info () const
+      { return this->header; }
+
+    /// Read the image data. As for AimFile::ReadImageData.
+    void ReadImageData (char* data, size_t size) const;
+    void ReadImageData (short* data, size_t size) const;
+    void ReadImageData (float* data, size_t size) const;
+
+    /// Read z slices. As for AimFile::ReadSlices.
+    void ReadSlices (int first_slice, int number_of_slices, char* data, size_t size) const;
+    void ReadSlices (int first_slice, int number_of_slices, short* data, size_t size) const;
+    void ReadSlices (int first_slice, int number_of_slices, float* data, size_t size) const;
+
+    /** Read a box-shaped region of the image, of dimensions extent starting
+      * at voxel start.
+      *
+      * For uncompressed data, only the rows of the region are read. For
+      * compressed data, the slices overlapping the region are decoded.
+      *
+      * The pointer type must correspond to buffer_type, and 'size' must be
+      * long_product(extent).
+      */
+    void ReadRegion (const n88::tuplet<3,int>& start,
+                     const n88::tuplet<3,int>& extent,
+                     char* data,
+                     size_t size) const;
+    void ReadRegion (const n88::tuplet<3,int>& start,
+                     const n88::tuplet<3,int>& extent,
+                     short* data,
+                     size_t size) const;
+    void ReadRegion (const n88::tuplet<3,int>& start,
+                     const n88::tuplet<3,int>& extent,
+                     float* data,
+                     size_t size) const;
+
+  protected:
+
+    void Open ();
+    /// The seek index for compressed data, or null for other types.
+    const AimSeekIndex* Index () const;
+    template <typename T> void ReadAnySlices (int first_slice, int number_of_slices, T* data, size_t size) const;
+    template <typename T> void ReadAnyRegion (const n88::tuplet<3,int>& start,
+                                              const n88::tuplet<3,int>& extent,
+                                              T* data,
+                                              size_t size) const;
+
+    AimFile                                       header;
+    std::shared_ptr<const DataSource>             file;
+    mutable std::once_flag                        index_built;
+    mutable std::shared_ptr<const AimSeekIndex>   index;
+
+  private:
+
+    AimReader (const AimReader&);
+    AimReader& operator= (const AimReader&);
+};
+
+}  // namespace
+
+#endif
@@ -0,0 +1,80 @@
+// Copyright (c) Eric Nodwell
+// See LICENSE for details.
+
+#ifndef __AimIO_AimSliceWriter_h
+#define __AimIO_AimSliceWriter_h
+
+#include "AimIO/AimIO.h"
+#include <fstream>
+#include <vector>
+
+#include "aimio_export.h"
+
+namespace AimIO
+{
+
+/** Writes a short AIM file incrementally, a few z slices at a time.
+  *
+  * This allows an image to be written without ever having all of it in
+  * memory. The data are stored uncompressed (AIMFILE_TYPE_D1Tshort), so
+  * the size of the file is known in advance and the header and processing
+  * log can be written immediately.
+  *
+  * Example:
+  *
+  *   AimIO::AimFile header ("out.aim");
+  *   header.dimensions = ...;
+  *   header.element_size = ...;
+  *   header.processing_log = ...;
+  *   AimIO::AimSliceWriter writer (header);
+  *   for (...)
+  *     writer.WriteSlices (slab, number_of_slices);
+  *   writer.Close();
+  */
+class AIMIO_EXPORT AimSliceWriter
+{
+  public:
+
+    /** Constructor. Opens the file and writes the header.
+      *
+      * The meta-data must be set in header as for AimFile::WriteImageData
+      * (in particular filename, dimensions and element_size). aim_type is
+      * set to AIMFILE_TYPE_D1Tshort.
+      */
+    AimSliceWriter (AimFile& header);
+
+    /** Destructor. Closes the file if Close has not been called, but
+      * does not report errors; call Close to check for a complete file.
+      */
+    ~AimSliceWriter ();
+
+    /** Write the next number_of_slices z slices.
+      *
+      * data must contain dimensions[0]*dimensions[1]*number_of_slices values.
+      */
+    void WriteSlices (const short* data, int number_of_slices);
+
+    /// Number of z slices written so far.
+    int SlicesWritten () const {return this->slices_written;}
+
+    /** Closes the file. Throws an exception if not all slices have been
+      * written or if there was a write error.
+      */
+    void Close ();
+
+  protected:
+
+    std::ofstream       f;
+    n88::tuplet<3,int>  dimensions;
+    int                 slices_written;
+    std::vector<short>  buffer;  // only used on big-endian platforms
+
+  private:
+
+    AimSliceWriter (const AimSliceWriter&);
+    AimSliceWriter& operator= (const AimSliceWriter&);
+};
+
+}  // namespace
+
+#endif
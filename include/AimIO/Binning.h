@@ -0,0 +1,61 @@
+// Copyright (c) Eric Nodwell
+// See LICENSE for details.
+
+#ifndef __AimIO_Binning_h
+#define __AimIO_Binning_h
+
+#include <n88util/tuplet.hpp>
+
+#include "aimio_export.h"
+
+
+namespace AimIO
+{
+
+/// Methods of combining the voxels of a block when binning.
+enum bin_method_t {
+  BIN_AVERAGE,     // mean, rounded to nearest for integer types
+  BIN_MAXIMUM,     // largest value
+  BIN_MAJORITY};   // most frequent value (ties go to the larger value); char only
+
+/** Dimensions of an image of dimensions dims after binning by bin.
+  *
+  * Partial blocks at the upper edges are discarded, so this is dims/bin,
+  * rounded down.
+  */
+AIMIO_EXPORT n88::tuplet<3,int> BinnedDimensions (const n88::tuplet<3,int>& dims, int bin);
+
+/** Bins a block of image data.
+  *
+  * Output voxel (i,j,k) combines the bin x bin x bin input voxels starting
+  * at start + bin*(i,j,k). The input has dimensions in_dims and the output
+  * out_dims; the input must contain all the voxels required.
+  *
+  * This is used by the binned read methods of AimFile and IsqFile, which
+  * call it for slabs of bin slices as the data are decoded.
+  */
+AIMIO_EXPORT void BinImageData (const char* in,
+                                const n88::tuplet<3,int>& in_dims,
+                                const n88::tuplet<3,int>& start,
+                                const n88::tuplet<3,int>& out_dims,
+                                int bin,
+                                bin_method_t method,
+                                char* out);
+AIMIO_EXPORT void BinImageData (const short* in,
+                                const n88::tuplet<3,int>& in_dims,
+                                const n88::tuplet<3,int>& start,
+                                const n88::tuplet<3,int>& out_dims,
+                                int bin,
+                                bin_method_t method,
+                                short* out);
+AIMIO_EXPORT void BinImageData (const float* in,
+                                const n88::tuplet<3,int>& in_dims,
+                                const n88::tuplet<3,int>& start,
+                                const n88::tuplet<3,int>& out_dims,
+                                int bin,
+                                bin_method_t method,
+                                float* out);
+
+}  // namespace
+
+#endif
@@ -0,0 +1,138 @@
+// Copyright (c) Eric Nodwell
+// See LICENSE for details.
+
+#ifndef __AimIO_BrickFile_h
+#define __AimIO_BrickFile_h
+
+#include "AimIO/AimIO.h"
+#include <n88util/tuplet.hpp>
+#include <string>
+#include <vector>
+#include <ctime>
+#include <boost/cstdint.hpp>
+
+#include "aimio_export.h"
+
+
+namespace AimIO
+{
+
+/** A bricked random-access cache of an AIM image.
+  *
+  * The decoded image is stored as cubic bricks (64^3 voxels by default),
+  * each compressed independently and located through a brick offset
+  * table. A region can therefore be read by decoding only the bricks that
+  * overlap it, rather than the entire image as is required for compressed
+  * AIM data.
+  *
+  * Bricks of char data are run-length encoded, and bricks of short data
+  * are delta encoded along x with variable length integers. A brick is
+  * stored raw if encoding would not make it smaller, and float bricks are
+  * always stored raw.
+  *
+  * The interface resembles that of AimFile: after ReadImageInfo, the
+  * public meta-data are set, and ReadImageData or ReadRegion may be called.
+  *
+  * Example:
+  *
+  *   AimIO::AimFile reader ("image.aim");
+  *   reader.ReadImageInfo();
+  *   std::string cache = AimIO::AimBrickFile::SidecarName (reader.filename);
+  *   AimIO::AimBrickFile::Create (reader, cache);
+  *
+  *   AimIO::AimBrickFile bricks (cache.c_str());
+  *   bricks.ReadImageInfo();
+  *   bricks.ReadRegion (start, extent, data.data(), data.size());
+  */
+class AIMIO_EXPORT AimBrickFile
+{
+  public:
+
+    AimBrickFile ();
+    AimBrickFile (const char* filename);
+
+    /// The conventional cache file name for an AIM file: aim_filename + ".bricks" .
+    static std::string SidecarName (const std::string& aim_filename);
+
+    /** Create a brick cache file from an AIM file.
+      *
+      * ReadImageInfo must previously have been called on reader. The AIM
+      * image is decoded a layer of bricks at a time. A brick of raw data
+      * must not exceed 4 GB. On failure, no file is left behind.
+      */
+    static void Create (AimFile& reader, const std::string& filename, int brick_size = 64);
+
+    /// Read the header and brick table.
+    void ReadImageInfo ();
+
+    /** Returns true if the cache was generated from aim_filename as it
+      * currently is (same size and modification time).
+      */
+    bool IsCurrent (const std::string& aim_filename) const;
+
+    /** Read a box-shaped region of the image, of dimensions extent starting
+      * at voxel start. Only the overlapping bricks are read and decoded:
+      * the reads of each layer of bricks are issued as one batch, and the
+      * bricks are decoded in parallel.
+      *
+      * The pointer type must correspond to buffer_type, and 'size' must be
+      * long_product(extent).
+      */
+    void ReadRegion (const n88::tuplet<3,int>& start,
+                     const n88::tuplet<3,int>& extent,
+                     char* data,
+                     size_t size);
+    void ReadRegion (const n88::tuplet<3,int>& start,
+                     const n88::tuplet<3,int>& extent,
+                     short* data,
+                     size_t size);
+    void ReadRegion (const n88::tuplet<3,int>& start,
+                     const n88::tuplet<3,int>& extent,
+                     float* data,
+                     size_t size);
+
+    /// Read the entire image. As for AimFile::ReadImageData.
+    void ReadImageData (char* data, size_t size);
+    void ReadImageData (short* data, size_t size);
+    void ReadImageData (float* data, size_t size);
+
+    /// Number of bricks in each direction.
+    n88::tuplet<3,int> BrickGridDimensions () const;
+
+    std::string                 filename;
+
+    // The following are set by ReadImageInfo, and correspond to the
+    // members of AimFile of the same name.
+    AimFile::buffer_format_t    buffer_type;
+    n88::tuplet<3,int>          dimensions;
+    n88::tuplet<3,int>          position;
+    n88::tuplet<3,int>          offset;
+    n88::tuplet<3,float>        element_size;
+    std::string                 processing_log;
+    int                         brick_size;
+    boost::uint64_t             source_size;
+    std::time_t                 source_modification_time;
+
+  protected:
+
+    struct BrickEntry
+    {
+      boost::uint64_t  offset;
+      boost::uint32_t  size;
+      boost::uint8_t   codec;
+    };
+
+    template <typename T> void ReadAnyRegion (const n88::tuplet<3,int>& start,
+                                              const n88::tuplet<3,int>& extent,
+                                              T* data,
+                                              size_t size);
+    template <typename T> static void CreateAny (AimFile& reader,
+                                                 const std::string& filename,
+                                                 int brick_size);
+
+    std::vector<BrickEntry>     bricks;
+};
+
+}  // namespace
+
+#endif
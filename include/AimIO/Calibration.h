@@ -0,0 +1,76 @@
+// Copyright (c) Eric Nodwell
+// See LICENSE for details.
+
+#ifndef __AimIO_Calibration_h
+#define __AimIO_Calibration_h
+
+#include <string>
+#include <cstddef>
+
+#include "aimio_export.h"
+
+
+namespace AimIO
+{
+
+/// Units for calibrated image values.
+enum calibration_unit_t {
+  CALIBRATION_NATIVE,              // stored value, unscaled
+  CALIBRATION_LINEAR_ATTENUATION,  // linear attenuation in 1/cm
+  CALIBRATION_HU,                  // Hounsfield units
+  CALIBRATION_DENSITY};            // density, typically in mg HA/ccm
+
+/** Scanco calibration parameters.
+  *
+  * Stored values are converted as follows:
+  *
+  *   linear attenuation = value / mu_scaling
+  *   HU                 = 1000 * (linear attenuation - mu_water) / mu_water
+  *   density            = density_slope * linear attenuation + density_intercept
+  *
+  * These are all linear in the stored value, so a conversion is fully
+  * described by a scale and a shift; see GetLinearTransform.
+  *
+  * A value of zero for any parameter indicates that it is unknown.
+  */
+struct AIMIO_EXPORT Calibration
+{
+  double  mu_scaling;
+  double  mu_water;
+  double  density_slope;
+  double  density_intercept;
+  std::string density_unit;
+
+  Calibration ();
+
+  /** Obtain calibration parameters from the fields Mu_Scaling, HU: mu water,
+    * Density: slope, Density: intercept and Density: unit of a Scanco
+    * processing log. Missing fields are left as zero.
+    */
+  static Calibration FromProcessingLog (const std::string& log);
+
+  /** Calculates scale and shift such that the calibrated value in
+    * the requested unit is scale*value + shift.
+    *
+    * Throws an exception if a required parameter is unknown.
+    */
+  void GetLinearTransform (calibration_unit_t unit, double& scale, double& shift) const;
+};
+
+/** Converts n stored values to calibrated values in the requested unit.
+  *
+  * This is a single pass over the data; it is used by the calibrated
+  * read methods of AimFile and IsqFile.
+  */
+AIMIO_EXPORT void CalibrateData
+  (
+  const short* in,
+  float* out,
+  size_t n,
+  const Calibration& calibration,
+  calibration_unit_t unit
+  );
+
+}  // namespace
+
+#endif
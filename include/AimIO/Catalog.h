@@ -0,0 +1,149 @@
+// Copyright (c) Eric Nodwell
+// See LICENSE for details.
+
+#ifndef __AimIO_Catalog_h
+#define __AimIO_Catalog_h
+
+#include "AimIO/Definitions.h"
+#include "AimIO/Exception.h"
+#include "AimIO/HeaderScanner.h"
+#include "AimIO/ProcessingLog.h"
+#include <n88util/tuplet.hpp>
+#include <string>
+#include <vector>
+#include <functional>
+#include <ctime>
+#include <boost/cstdint.hpp>
+
+#include "aimio_export.h"
+
+
+namespace AimIO
+{
+
+/** The metadata of one file in a Catalog.
+  *
+  * For AIM files, fields contains the parsed processing log (see
+  * ParseProcessingLog). ISQ files have no processing log; the equivalent
+  * fields are synthesized from the header using the same names as a log
+  * written by ISQ_TO_AIM, for example "Patient Name", "Index Measurement",
+  * "Site", "Scanner type" and "Mu_Scaling", so that the same queries
+  * apply to both formats.
+  */
+struct AIMIO_EXPORT CatalogEntry
+{
+  CatalogEntry ();
+
+  std::string                   path;
+  HeaderRecord::file_format_t   format;
+  boost::uint64_t               file_size;
+  std::time_t                   modification_time;
+  aim_version_t                 version;
+  aim_storage_format_t          aim_type;
+  n88::tuplet<3,int>            dimensions;
+  n88::tuplet<3,int>            position;
+  n88::tuplet<3,int>            offset;
+  n88::tuplet<3,float>          element_size;
+  boost::int64_t                byte_offset;
+  LogFields                     fields;
+
+  /// Returns the value of a field, or an empty string if not present.
+  std::string Field (const std::string& name) const;
+
+  /// Returns the value of a field converted to a number, or default_value
+  /// if the field is not present or not numeric.
+  double NumericField (const std::string& name, double default_value = 0) const;
+};
+
+
+/** A persistent catalog of AIM and ISQ header metadata.
+  *
+  * The catalog is stored in a compact binary file. Once built, queries
+  * operate entirely on the catalog and do not open any image file.
+  *
+  * A refresh compares the size and modification time of each file against
+  * the catalog, and re-reads the headers only of files that are new or that
+  * have changed.
+  *
+  * Example:
+  *
+  *   AimIO::Catalog catalog ("archive.aimcat");
+  *   if (boost::filesystem::exists (catalog.filename))
+  *     catalog.Load();
+  *   catalog.RefreshDirectory ("/data/archive");
+  *   catalog.Save();
+  *   std::vector<AimIO::CatalogEntry> hits = catalog.Query (
+  *     [] (const AimIO::CatalogEntry& e)
+  *       { return e.NumericField ("Scanner type") == 9 &&
+  *                e.Field ("Site") == "38" &&
+  *                e.dimensions[2] > 160; });
+  */
+class AIMIO_EXPORT Catalog
+{
+  public:
+
+    /// Counts of what happened during a refresh.
+    struct RefreshStatistics
+    {
+      RefreshStatistics () : added(0), updated(0), unchanged(0), removed(0), failed(0) {}
+      size_t added;
+      size_t updated;
+      size_t unchanged;
+      size_t removed;
+      size_t failed;     // files whose header could not be read; not cataloged
+    };
+
+    /// Constructors.
+    Catalog ();
+    Catalog (const char* filename);
+
+    /// Reads the catalog from the file given by the member variable filename.
+    void Load ();
+
+    /// Writes the catalog to the file given by the member variable filename.
+    ///
+    /// The file is replaced atomically, so that concurrent readers never see
+    /// a partially written catalog.
+    void Save () const;
+
+    /** Brings the catalog up to date with respect to a list of files.
+      *
+      * After the refresh, the catalog contains exactly those files in paths
+      * whose header could be read. Headers are read (concurrently,
+      * according to options) only for files that are not yet in the catalog
+      * or whose size or modification time has changed.
+      */
+    RefreshStatistics Refresh (
+        const std::vector<std::string>& paths,
+        const ScanOptions& options = ScanOptions());
+
+    /// As Refresh, for all the AIM and ISQ files in a directory.
+    /// See ListImageFiles.
+    RefreshStatistics RefreshDirectory (
+        const std::string& directory,
+        const ScanOptions& options = ScanOptions());
+
+    /// Returns all entries for which predicate returns true.
+    std::vector<CatalogEntry> Query (
+        const std::function<bool(const CatalogEntry&)>& predicate) const;
+
+    /// Returns the entry for path, or null if not present.
+    const CatalogEntry* Find (const std::string& path) const;
+
+    /// All entries, sorted by path.
+    const std::vector<CatalogEntry>& Entries () const
+      { return this->entries; }
+
+    std::string               filename;
+
+  protected:
+
+    std::vector<CatalogEntry> entries;
+};
+
+/// Creates a catalog entry from a header record.
+AIMIO_EXPORT void MakeCatalogEntry (const HeaderRecord& record, CatalogEntry& entry);
+
+}  // namespace
+
+#endif
@@ -0,0 +1,246 @@
+// Copyright (c) Eric Nodwell
+// See LICENSE for details.
+
+#ifndef __AimIO_DataSource_h
+#define __AimIO_DataSource_h
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <memory>
+#include <boost/cstdint.hpp>
+
+#include "aimio_export.h"
+
+
+namespace AimIO
+{
+
+/** A source of bytes, such as the contents of an AIM or ISQ file, that can
+  * be read at any offset.
+  *
+  * By default AimFile and IsqFile read the file given by their filename.
+  * A source set with SetSource is read instead, so that, for example, an
+  * image received over the network can be decoded without a temporary
+  * file:
+  *
+  *   AimIO::AimFile reader;
+  *   reader.SetSource (std::make_shared<AimIO::MemorySource> (bytes, size));
+  *   reader.ReadImageInfo();
+  *   reader.ReadImageData (data.data(), data.size());
+  *
+  * ReadAt may be called concurrently from several threads.
+  */
+class AIMIO_EXPORT DataSource
+{
+  public:
+
+    virtual ~DataSource ();
+
+    /// Size in bytes.
+    virtual boost::uint64_t Size () const = 0;
+
+    /** Reads up to size bytes starting at offset. Returns the number of
+      * bytes read, which is less than size only at the end of the data.
+      * Throws AimIOException on error.
+      */
+    virtual size_t ReadAt (void* buffer, size_t size, boost::uint64_t offset) const = 0;
+
+    /// As ReadAt, but throws AimIOException if fewer than size bytes
+    /// are available.
+    void ReadExactlyAt (void* buffer, size_t size, boost::uint64_t offset) const;
+
+    /// A description for error messages, such as a file name.
+    virtual std::string Name () const;
+
+    /// Pointer to the bytes if they are all in memory; otherwise null.
+    virtual const char* Data () const;
+
+    /// A file descriptor that can be read with pread, or -1.
+    virtual int Descriptor () const;
+};
+
+
+/// Bytes in memory. The bytes are not copied, and must remain valid for
+/// the lifetime of this object.
+class AIMIO_EXPORT MemorySource : public DataSource
+{
+  public:
+
+    MemorySource (const void* data, size_t size);
+
+    boost::uint64_t Size () const;
+    size_t ReadAt (void* buffer, size_t size, boost::uint64_t offset) const;
+    std::string Name () const;
+    const char* Data () const;
+
+  protected:
+
+    const char*   data;
+    size_t        size;
+};
+
+
+/// An open file descriptor, read with positional reads. The descriptor is
+/// not closed by this object.
+class AIMIO_EXPORT DescriptorSource : public DataSource
+{
+  public:
+
+    explicit DescriptorSource (int fd);
+
+    boost::uint64_t Size () const;
+    size_t ReadAt (void* buffer, size_t size, boost::uint64_t offset) const;
+    std::string Name () const;
+    int Descriptor () const;
+
+  protected:
+
+    int   fd;
+};
+
+
+/// A file mapped into memory.
+class AIMIO_EXPORT MappedSource : public DataSource
+{
+  public:
+
+    explicit MappedSource (const std::string& filename);
+    ~MappedSource ();
+
+    boost::uint64_t Size () const;
+    size_t ReadAt (void* buffer, size_t size, boost::uint64_t offset) const;
+    std::string Name () const;
+    const char* Data () const;
+
+  protected:
+
+    struct Mapping;
+    std::string                 filename;
+    std::unique_ptr<Mapping>    mapping;
+
+  private:
+
+    MappedSource (const MappedSource&);
+    MappedSource& operator= (const MappedSource&);
+};
+
+
+/// Bytes obtained from a function with the same semantics as ReadAt,
+/// except that it may return fewer bytes than requested before the end of
+/// the data, as long as it returns 0 only at the end.
+class AIMIO_EXPORT CallbackSource : public DataSource
+{
+  public:
+
+    typedef std::function<size_t(void* buffer, size_t size, boost::uint64_t offset)> read_function_t;
+
+    CallbackSource (boost::uint64_t size, const read_function_t& read);
+
+    boost::uint64_t Size () const;
+    size_t ReadAt (void* buffer, size_t size, boost::uint64_t offset) const;
+
+  protected:
+
+    boost::uint64_t   size;
+    read_function_t   read;
+};
+
+
+/** A destination for bytes, written sequentially.
+  *
+  * By default AimFile writes the file given by its filename. If a sink is
+  * set with SetSink, the AIM file is written to it instead.
+  */
+class AIMIO_EXPORT DataSink
+{
+  public:
+
+    virtual ~DataSink ();
+
+    /// Appends size bytes. Throws AimIOException on error.
+    virtual void Write (const void* data, size_t size) = 0;
+
+    /// Called before writing, with the total number of bytes that will be
+    /// written. The default does nothing.
+    virtual void Reserve (size_t size);
+};
+
+
+/// Bytes appended to a buffer in memory, which is grown as required.
+class AIMIO_EXPORT MemorySink : public DataSink
+{
+  public:
+
+    void Write (const void* data, size_t size);
+    void Reserve (size_t size);
+
+    std::vector<char>& Buffer ()
+      { return this->buffer; }
+    const std::vector<char>& Buffer () const
+      { return this->buffer; }
+
+  protected:
+
+    std::vector<char>   buffer;
+};
+
+
+/// Bytes written to a buffer in memory provided by the caller. Writing
+/// more than capacity bytes throws AimIOException.
+class AIMIO_EXPORT BufferSink : public DataSink
+{
+  public:
+
+    BufferSink (void* data, size_t capacity);
+
+    void Write (const void* data, size_t size);
+    void Reserve (size_t size);
+
+    /// The number of bytes written so far.
+    size_t Size () const
+      { return this->size; }
+
+  protected:
+
+    char*     data;
+    size_t    capacity;
+    size_t    size;
+};
+
+
+/// An open file descriptor, written at its current position. The
+/// descriptor is not closed by this object.
+class AIMIO_EXPORT DescriptorSink : public DataSink
+{
+  public:
+
+    explicit DescriptorSink (int fd);
+
+    void Write (const void* data, size_t size);
+
+  protected:
+
+    int   fd;
+};
+
+
+/// Bytes passed to a function.
+class AIMIO_EXPORT CallbackSink : public DataSink
+{
+  public:
+
+    typedef std::function<void(const void* data, size_t size)> write_function_t;
+
+    explicit CallbackSink (const write_function_t& write);
+
+    void Write (const void* data, size_t size);
+
+  protected:
+
+    write_function_t  write;
+};
+
+}  // namespace
+
+#endif
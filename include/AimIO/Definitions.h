@@ -30,6 +30,13 @@ enum aim_storage_format_t {
   AIMFILE_TYPE_D1Tfloat    = (4<<16) + sizeof(float)
 };
 
+// Kinds of half-resolution preview obtainable from D3Tbit8 data, where
+// each compressed byte encodes a 2x2x2 cube of voxels.
+enum bit8_preview_t {
+  BIT8_PREVIEW_OCCUPANCY,  // the object value if any voxel of the cube is set, else 0
+  BIT8_PREVIEW_COUNT       // the number of voxels of the cube that are set (0 to 8)
+};
+
 }  // namespace
 
 #endif
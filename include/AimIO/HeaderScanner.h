@@ -0,0 +1,150 @@
+// Copyright (c) Eric Nodwell
+// See LICENSE for details.
+
+#ifndef __AimIO_HeaderScanner_h
+#define __AimIO_HeaderScanner_h
+
+#include "AimIO/Definitions.h"
+#include "AimIO/Exception.h"
+#include <n88util/tuplet.hpp>
+#include <string>
+#include <vector>
+#include <ctime>
+#include <boost/cstdint.hpp>
+
+#include "aimio_export.h"
+
+
+namespace AimIO
+{
+
+class IsqFile;
+
+/** Lightweight summary of the header of an AIM or ISQ file.
+  *
+  * The values are those of the corresponding public member variables of
+  * AimFile or IsqFile. For ISQ files, dimensions are dimensions_p,
+  * element_size is the spacing converted to mm, and byte_offset is
+  * data_offset.
+  */
+struct AIMIO_EXPORT HeaderRecord
+{
+  enum file_format_t {
+    FORMAT_UNKNOWN,
+    FORMAT_AIM,
+    FORMAT_ISQ};
+
+  HeaderRecord ();
+
+  std::string               path;
+  file_format_t             format;
+
+  /// Size in bytes and time of last modification of the file.
+  boost::uint64_t           file_size;
+  std::time_t               modification_time;
+
+  aim_version_t             version;
+  aim_storage_format_t      aim_type;      // D1Tshort for ISQ files
+  n88::tuplet<3,int>        dimensions;
+  n88::tuplet<3,int>        position;
+  n88::tuplet<3,int>        offset;
+  n88::tuplet<3,float>      element_size;  // mm
+  boost::int64_t            byte_offset;
+
+  /// AIM only. Empty unless ScanOptions::read_processing_log is set.
+  std::string               processing_log;
+
+  /// ISQ only.
+  std::string               name;
+  boost::int32_t            patient_index;
+  boost::int32_t            index_measurement;
+  boost::int32_t            site;
+  boost::int32_t            scanner_id;
+  boost::int32_t            scanner_type;
+  boost::int32_t            mu_scaling;
+  std::string               creation_date_string;
+
+  /// Empty on success. Otherwise the reason the header could not be read,
+  /// in which case the other fields (except path) are not valid.
+  std::string               error;
+};
+
+
+/** Options for ScanHeaders. */
+struct AIMIO_EXPORT ScanOptions
+{
+  ScanOptions ();
+
+  /// Maximum number of threads, including the calling thread. The threads
+  /// are those of the global AimIO pool (see ThreadPool.h). 0 uses all of
+  /// them.
+  int       number_of_threads;
+
+  /// Maximum number of file reads in flight at any one time. As each
+  /// thread has at least one read in flight, this also limits the number
+  /// of threads. 0 means no limit beyond the number of threads.
+  int       max_outstanding_reads;
+
+  /// Size of the initial read of each file. Headers (including the
+  /// processing log) that fit into this are read with a single read.
+  size_t    initial_read_size;
+
+  /// If false, the AIM processing log is not retained in the records.
+  bool      read_processing_log;
+
+  /// Whether ListImageFiles descends into sub-directories.
+  bool      recursive;
+};
+
+
+/** Reads the headers of many AIM and/or ISQ files concurrently.
+  *
+  * The file format is determined from the file contents, not from the
+  * extension. Each file is opened once and, for typical headers, read with
+  * a single positional read.
+  *
+  * The records are returned in the same order as paths. Failure to read
+  * any individual file does not throw, but is reported in the error field
+  * of its record.
+  */
+AIMIO_EXPORT std::vector<HeaderRecord> ScanHeaders (
+    const std::vector<std::string>& paths,
+    const ScanOptions& options = ScanOptions());
+
+/** As ScanHeaders, for all the AIM and ISQ files in a directory.
+  *
+  * See ListImageFiles.
+  */
+AIMIO_EXPORT std::vector<HeaderRecord> ScanHeaderDirectory (
+    const std::string& directory,
+    const ScanOptions& options = ScanOptions());
+
+/** Returns the sorted paths of files in a directory with an extension of
+  * .aim or .isq (in any case, optionally followed by a VMS version number
+  * such as ;1).
+  */
+AIMIO_EXPORT std::vector<std::string> ListImageFiles (
+    const std::string& directory,
+    bool recursive = false);
+
+/** Reads the complete headers of many ISQ files concurrently.
+  *
+  * On return, headers and errors have the same size as paths. For each file,
+  * either errors[i] is empty and headers[i] has been filled in by
+  * IsqFile::ReadImageInfo, or errors[i] describes the failure.
+  */
+AIMIO_EXPORT void ScanIsqHeaders (
+    const std::vector<std::string>& paths,
+    std::vector<IsqFile>& headers,
+    std::vector<std::string>& errors,
+    const ScanOptions& options = ScanOptions());
+
+/** Reads the header of a single file into a record. Throws on error. */
+AIMIO_EXPORT void ReadHeaderRecord (
+    const std::string& path,
+    HeaderRecord& record,
+    const ScanOptions& options = ScanOptions());
+
+}  // namespace
+
+#endif
@@ -0,0 +1,61 @@
+// Copyright (c) Eric Nodwell
+// See LICENSE for details.
+
+#ifndef __AimIO_IOBackend_h
+#define __AimIO_IOBackend_h
+
+#include "aimio_export.h"
+
+
+namespace AimIO
+{
+
+/** Means by which AimIO performs batches of positional reads.
+  *
+  * Header scans (ScanHeaders, ScanIsqHeaders) read the start of many files
+  * at once, and region reads (IsqFile::ReadRegion, AimReader::ReadRegion)
+  * read many spans of one file. With IO_BACKEND_IO_URING (Linux only,
+  * if enabled at build time with AIMIO_WITH_IO_URING), each batch is
+  * submitted with a single system call. IO_BACKEND_PREAD performs the
+  * reads one at a time, and is always available.
+  */
+enum io_backend_t {
+  IO_BACKEND_DEFAULT,    // io_uring if available, otherwise pread
+  IO_BACKEND_PREAD,
+  IO_BACKEND_IO_URING};
+
+/** How a file is read or written, with respect to the operating system's
+  * page cache. Selected per file with AimFile::io_policy and
+  * IsqFile::io_policy.
+  *
+  * IO_POLICY_DIRECT bypasses the cache (O_DIRECT on Linux, F_NOCACHE on
+  * macOS). O_DIRECT transfers go through aligned buffers, so the caller's
+  * buffers need not be aligned. IO_POLICY_STREAMING uses the cache, but
+  * declares the access sequential and drops each range from the cache once
+  * it has been read or written (posix_fadvise POSIX_FADV_SEQUENTIAL and
+  * POSIX_FADV_DONTNEED). Both are intended for large files that are read
+  * or written once, and that should not evict other data from the cache.
+  *
+  * Where a policy is not supported by the platform or the file system, the
+  * nearest supported one is used: IO_POLICY_DIRECT falls back to
+  * IO_POLICY_STREAMING, and that to IO_POLICY_BUFFERED.
+  */
+enum io_policy_t {
+  IO_POLICY_BUFFERED,
+  IO_POLICY_DIRECT,
+  IO_POLICY_STREAMING};
+
+/// Select the I/O backend. Throws AimIOException if it is not available.
+AIMIO_EXPORT void SetIOBackend (io_backend_t backend);
+
+/// The I/O backend in use (never IO_BACKEND_DEFAULT).
+AIMIO_EXPORT io_backend_t GetIOBackend ();
+
+/** True if backend can be used: it was enabled at build time, and is
+  * supported (and permitted) by the running kernel.
+  */
+AIMIO_EXPORT bool IsIOBackendAvailable (io_backend_t backend);
+
+}  // namespace
+
+#endif
@@ -7,17 +7,24 @@
 #include "AimIO/Definitions.h"
 #include "AimIO/Exception.h"
 #include "AimIO/AimIO.h"
+#include "AimIO/Calibration.h"
+#include "AimIO/ThreadPool.h"
 #include <n88util/tuplet.hpp>
 #include <string>
 #include <vector>
 #include <fstream>
+#include <istream>
+#include <future>
 #include <boost/cstdint.hpp>
+#include <memory>
 
 #include "aimio_export.h"
 
 namespace AimIO
 {
 
+class MappedFile;
+
 /** Class for reading and writing Scanco ISQ files.
   *
   * Refer to the README.md file for limitations and examples.
@@ -43,6 +50,14 @@ class AIMIO_EXPORT IsqFile
       */ 
     void ReadImageInfo ();
 
+    /** Read the ISQ file header from an already open stream.
+      *
+      * The stream must be positioned such that offset 0 corresponds to the
+      * start of the ISQ file, and it must be seekable. Exceptions are
+      * enabled on the stream.
+      */
+    void ReadImageInfo (std::istream& s);
+
     /** Read the ISQ image data.
       *
       * You must previously have called ReadImageInfo.
@@ -50,6 +65,126 @@ class AIMIO_EXPORT IsqFile
       */
     void ReadImageData (short* data, size_t size);
 
+    /** Asynchronous version of ReadImageData, which runs on the AimIO
+      * thread pool. As for AimFile::ReadImageDataAsync.
+      */
+    std::future<void> ReadImageDataAsync (short* data, size_t size);
+    void ReadImageDataAsync (short* data, size_t size, const completion_callback_t& done);
+
+    /** Read the ISQ image data, binned by bin in each direction.
+      *
+      * You must previously have called ReadImageInfo.
+      *
+      * Each output voxel combines a block of bin x bin x bin voxels; see
+      * BinImageData. The file is read bin slices at a time, so that only
+      * the binned image is allocated in full.
+      *
+      * The value of 'size' must be long_product(BinnedDimensions(dimensions_p,bin)).
+      */
+    void ReadBinnedImageData (short* data, size_t size, int bin, bin_method_t method = BIN_AVERAGE);
+
+    /** Calibration parameters.
+      *
+      * You must previously have called ReadImageInfo.
+      *
+      * Only mu_scaling is available from an ISQ header. For HU or density,
+      * set the remaining parameters (for example from the log of a
+      * corresponding AIM file; see Calibration::FromProcessingLog).
+      */
+    Calibration GetCalibration () const;
+
+    /** Read the ISQ image data and convert to calibrated values.
+      *
+      * You must previously have called ReadImageInfo.
+      *
+      * The conversion is done in the same pass as reading the data, so that
+      * no intermediate short buffer of the size of the image is required.
+      * If no calibration is given, that of GetCalibration is used.
+      */
+    void ReadCalibratedImageData (float* data, size_t size, calibration_unit_t unit);
+    void ReadCalibratedImageData (float* data,
+                                  size_t size,
+                                  calibration_unit_t unit,
+                                  const Calibration& calibration);
+
+    /** Read a range of z slices of the ISQ image data.
+      *
+      * You must previously have called ReadImageInfo.
+      *
+      * Only the requested slices are read from the file (with a single
+      * positional read at SliceOffset(first_slice)), so this is efficient
+      * for inspecting a few slices of a large scan.
+      *
+      * The value of 'size' must be
+      * dimensions_p[0]*dimensions_p[1]*number_of_slices.
+      */
+    void ReadSlices (int first_slice, int number_of_slices, short* data, size_t size);
+
+    /// Read a single z slice. See ReadSlices.
+    void ReadSlice (int slice, short* data, size_t size)
+      { this->ReadSlices (slice, 1, data, size); }
+
+    /** Read a box-shaped region of the ISQ image data, optionally sub-sampled.
+      *
+      * You must previously have called ReadImageInfo.
+      *
+      * The region starts at voxel 'start' and covers 'extent' voxels in each
+      * direction. Only every stride[i]-th voxel in direction i is returned,
+      * so that the result has dimensions RegionDimensions(extent,stride).
+      * For example, a 4x decimated preview of the whole image is obtained
+      * with start (0,0,0), extent dimensions_p and stride (4,4,4).
+      *
+      * Only the rows that contribute to the result are read. Nearby rows are
+      * coalesced into larger positional reads, so that a large number of
+      * small reads is avoided.
+      *
+      * The value of 'size' must be long_product(RegionDimensions(extent,stride)).
+      */
+    void ReadRegion (const n88::tuplet<3,int>& start,
+                     const n88::tuplet<3,int>& extent,
+                     const n88::tuplet<3,int>& stride,
+                     short* data,
+                     size_t size);
+
+    /// The dimensions of the result of ReadRegion.
+    static n88::tuplet<3,int> RegionDimensions (const n88::tuplet<3,int>& extent,
+                                                const n88::tuplet<3,int>& stride);
+
+    /// The offset in bytes in the file of the first voxel of z slice 'slice'.
+    boost::uint64_t SliceOffset (int slice) const;
+
+    /** Memory-map the ISQ image data and return a pointer to it.
+      *
+      * You must previously have called ReadImageInfo.
+      *
+      * This provides zero-copy access to the image data, which is
+      * long_product(dimensions_p) values of type short in x-fastest order.
+      * No memory is allocated for the image: pages are read from
+      * the file on demand by the operating system.
+      *
+      * The pointer remains valid until UnmapImageData is called, or until
+      * this object and any copies of it are destroyed.
+      *
+      * Since ISQ data are stored little endian, this is only available on
+      * little-endian platforms; elsewhere an exception is thrown. Use
+      * ReadImageData instead in that case. If a source has been set with
+      * SetSource, it must be in memory (see DataSource::Data).
+      */
+    const short* MapImageData ();
+
+    /// Release the mapping created by MapImageData.
+    void UnmapImageData ();
+
+    /// Size in bytes of the image data, as determined from dimensions_p.
+    boost::uint64_t ImageDataSize () const;
+
+    /** Read from source instead of the file given by filename.
+      *
+      * This applies to ReadImageInfo and to all methods that read image
+      * data. Set a null pointer to read the file again. See DataSource.h.
+      */
+    void SetSource (const std::shared_ptr<const DataSource>& source);
+
     std::string               filename;
 
     // The following are public variables that correspond to meta-data
@@ -69,6 +204,9 @@ class AIMIO_EXPORT IsqFile
                                          //   PSQ = ?
                                          //   MSQ = ?
     
+    // Note that nr_of_bytes is a 32 bit quantity and hence not meaningful for
+    // files larger than 2 GB. The size of the image data is instead
+    // calculated from dimensions_p; see ImageDataSize.
     boost::int32_t            nr_of_bytes;
     boost::int32_t            nr_of_blocks;
     boost::int32_t            patient_index;
@@ -108,21 +246,32 @@ class AIMIO_EXPORT IsqFile
     boost::int32_t            intensity;
     boost::int32_t            holder;
 
-    // The data offset for the start of image data.
-    boost::int32_t            data_offset;
+    // The data offset for the start of image data, in bytes.
+    boost::int64_t            data_offset;
 
     // The type of data read/written by this class.
     //
     // ISQ files are always 2 byte unsigned integers
     buffer_format_t           buffer_type;
 
+    // How the file is read with respect to the page cache; see io_policy_t
+    // in IOBackend.h. The default is IO_POLICY_BUFFERED.
+    io_policy_t               io_policy;
+
   protected:
 
-    void ReadBlockList (std::ifstream& f);
-    void ReadHeader (std::ifstream& f);
+    void ReadBlockList (std::istream& f);
+    void ReadHeader (std::istream& f);
     void ReadAnyIsqData (void* data, int buffer_number, AimIO::aim_storage_format_t type);
+    /// The source set with SetSource, or otherwise the file.
+    std::shared_ptr<const DataSource> OpenSource () const;
 
     BlockList block_list;
+
+    std::shared_ptr<MappedFile> mapped_data;
+    std::shared_ptr<const DataSource> source;
+
+    friend class IsqSlabReader;
 };
 
 }  // namespace
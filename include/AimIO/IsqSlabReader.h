@@ -0,0 +1,90 @@
+// Copyright (c) Steven Boyd
+// See LICENSE for details.
+
+#ifndef __AimIO_IsqSlabReader_h
+#define __AimIO_IsqSlabReader_h
+
+#include "AimIO/IsqIO.h"
+#include <n88util/tuplet.hpp>
+#include <deque>
+#include <memory>
+#include <vector>
+#include <boost/cstdint.hpp>
+
+#include "aimio_export.h"
+
+namespace AimIO
+{
+
+/** Sequential slab-by-slab reader for ISQ image data, with read-ahead.
+  *
+  * The image is delivered as consecutive slabs of slab_thickness z slices
+  * (the last slab may be thinner). While the application processes one
+  * slab, up to read_ahead following slabs are read in the background by
+  * the AimIO thread pool, so that I/O overlaps with computation. A slab
+  * that no worker has started to read when it is needed is read by Next
+  * itself.
+  *
+  * Memory use is bounded by read_ahead+1 slabs, regardless of the size of
+  * the image: the slabs being read ahead, and the slab last returned by
+  * Next. This requires that the same vector be passed to each call of
+  * Next, as its previous contents are released before further reads are
+  * started.
+  *
+  * Example:
+  *
+  *   AimIO::IsqSlabReader slabs (reader, 16);
+  *   std::vector<short> slab;
+  *   int z0, nz;
+  *   while (slabs.Next (slab, z0, nz))
+  *     process (slab, z0, nz);
+  */
+class AIMIO_EXPORT IsqSlabReader
+{
+  public:
+
+    /** Constructor.
+      *
+      * ReadImageInfo must previously have been called on reader. Only the
+      * header values are copied from reader, so it need not outlive this
+      * object.
+      */
+    IsqSlabReader (const IsqFile& reader, int slab_thickness, int read_ahead = 2);
+
+    /// Waits for any reads in progress; reads not yet started are discarded.
+    ~IsqSlabReader ();
+
+    /** Obtain the next slab.
+      *
+      * Returns false if there are no more slabs. Otherwise slab is resized to
+      * dimensions_p[0]*dimensions_p[1]*number_of_slices and filled with the
+      * slices beginning at first_slice.
+      */
+    bool Next (std::vector<short>& slab, int& first_slice, int& number_of_slices);
+
+    /// Continue with the slab beginning at 'slice'. Any read-ahead is discarded.
+    void Seek (int slice);
+
+  protected:
+
+    struct PendingSlab;
+
+    void ScheduleReads (size_t count);
+
+    std::shared_ptr<const DataSource>  file;
+    n88::tuplet<3,int>                 dimensions;
+    boost::uint64_t                    data_offset;
+    int                                slab_thickness;
+    int                                read_ahead;
+    int                                next_slice;    // first slice not yet scheduled
+    std::deque<std::unique_ptr<PendingSlab> >  pending;
+
+  private:
+
+    IsqSlabReader (const IsqSlabReader&);
+    IsqSlabReader& operator= (const IsqSlabReader&);
+};
+
+}  // namespace
+
+#endif
@@ -0,0 +1,134 @@
+// Copyright (c) Eric Nodwell
+// See LICENSE for details.
+
+#ifndef __AimIO_PackedAimFile_h
+#define __AimIO_PackedAimFile_h
+
+#include "AimIO/AimIO.h"
+#include <n88util/tuplet.hpp>
+#include <string>
+#include <vector>
+#include <ostream>
+#include <boost/cstdint.hpp>
+
+#include "aimio_export.h"
+
+
+namespace AimIO
+{
+
+/** Class for reading and writing short images in a compressed container
+  * native to AimIO.
+  *
+  * D1Tshort AIM data are stored uncompressed. This container instead
+  * stores each z slice as an independently decodable chunk. Each value
+  * is predicted from its neighbour in x (or, for the first value of a
+  * row, from the first value of the previous row), and the differences
+  * are zig-zag coded and bit-packed in blocks of 128 values, with the
+  * bit width chosen per block. Compression is lossless, and requires no
+  * external libraries.
+  *
+  * The interface mirrors that of AimFile. All the AIM header meta-data are
+  * preserved, so that an AIM file can be recovered exactly:
+  *
+  *   AimIO::AimFile reader ("image.aim");
+  *   reader.ReadImageInfo();
+  *   AimIO::PackedAimFile::Pack (reader, "image.aimpk");
+  *
+  *   AimIO::PackedAimFile packed ("image.aimpk");
+  *   packed.ReadImageInfo();
+  *   std::vector<short> data (long_product(packed.dimensions));
+  *   packed.ReadImageData (data.data(), data.size());
+  *   AimIO::AimFile writer ("copy.aim");
+  *   packed.GetImageInfo (writer);
+  *   writer.WriteImageData (data.data());
+  */
+class AIMIO_EXPORT PackedAimFile
+{
+  public:
+
+    /// Constructors.
+    PackedAimFile ();
+    PackedAimFile (const char* filename);
+
+    /** Create a packed file from a D1Tshort AIM file.
+      *
+      * ReadImageInfo must previously have been called on reader. The image
+      * is read and compressed a slab at a time, so that it is never held in
+      * memory in full.
+      */
+    static void Pack (AimFile& reader, const std::string& filename);
+
+    /// Read the header and chunk table; sets the public member variables.
+    void ReadImageInfo ();
+
+    /** Read the image data.
+      *
+      * The value of 'size' must be the product of the dimensions.
+      */
+    void ReadImageData (short* data, size_t size);
+
+    /** Read number_of_slices z slices, starting at first_slice. Only the
+      * corresponding chunks are read, with a single read, and they are
+      * decoded in parallel.
+      *
+      * The value of 'size' must be dimensions[0]*dimensions[1]*number_of_slices.
+      */
+    void ReadSlices (int first_slice, int number_of_slices, short* data, size_t size);
+
+    /** Write a packed file.
+      *
+      * Before calling this, set filename, dimensions, element_size, and any
+      * other relevant public member variables (for example with
+      * SetImageInfo).
+      */
+    void WriteImageData (const short* data);
+
+    /// Copy the meta-data of an AIM file.
+    void SetImageInfo (const AimFile& aim);
+
+    /// Copy the meta-data to an AIM file, for example before writing it.
+    void GetImageInfo (AimFile& aim) const;
+
+    std::string               filename;
+
+    // The following correspond to the members of AimFile of the same name.
+    std::string               processing_log;
+    boost::int32_t            id;
+    boost::int32_t            reference;
+    n88::tuplet<3,int>        position;
+    n88::tuplet<3,int>        dimensions;
+    n88::tuplet<3,int>        offset;
+    n88::tuplet<3,int>        supdim;
+    n88::tuplet<3,int>        suppos;
+    n88::tuplet<3,int>        subdim;
+    n88::tuplet<3,int>        testoff;
+    n88::tuplet<3,float>      element_size;
+    boost::int32_t            assoc_id;
+    boost::int32_t            assoc_nr;
+    boost::int32_t            assoc_size;
+    boost::int32_t            assoc_type;
+
+  protected:
+
+    struct ChunkEntry
+    {
+      boost::uint64_t  offset;
+      boost::uint32_t  size;
+    };
+
+    /// Writes the header, with space reserved for the chunk table.
+    void WriteHeader (std::ostream& f);
+    /// Compresses and appends number_of_slices slices.
+    void WriteSlices (std::ostream& f, const short* data, int number_of_slices);
+    /// Fills in the chunk table, once all slices are written.
+    void WriteChunkTable (std::ostream& f);
+
+    std::vector<ChunkEntry>   chunks;
+    boost::uint64_t           table_offset;
+    boost::uint64_t           write_position;
+};
+
+}  // namespace
+
+#endif
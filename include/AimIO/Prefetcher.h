@@ -0,0 +1,152 @@
+// Copyright (c) Eric Nodwell
+// See LICENSE for details.
+
+#ifndef __AimIO_Prefetcher_h
+#define __AimIO_Prefetcher_h
+
+#include "AimIO/AimIO.h"
+#include "AimIO/IsqIO.h"
+#include "AimIO/HeaderScanner.h"
+#include <string>
+#include <vector>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <thread>
+
+#include "aimio_export.h"
+
+
+namespace AimIO
+{
+
+/** An AIM or ISQ file that has been read ahead by a Prefetcher.
+  *
+  * The header has been read, so that the public member variables of aim
+  * (for an AIM file) or isq (for an ISQ file) are set, and normally the
+  * image data are held in memory, still compressed, so that ReadImageData
+  * requires no I/O.
+  */
+class AIMIO_EXPORT PrefetchedImage
+{
+  public:
+
+    PrefetchedImage ();
+
+    std::string                   filename;
+
+    /// FORMAT_AIM or FORMAT_ISQ.
+    HeaderRecord::file_format_t   format;
+
+    /// The header of an AIM file, as after AimFile::ReadImageInfo.
+    AimFile                       aim;
+
+    /// The header of an ISQ file, as after IsqFile::ReadImageInfo.
+    IsqFile                       isq;
+
+    /** True if the image data are held in memory. They are not if they
+      * alone exceed the memory budget of the Prefetcher, in which case
+      * ReadImageData reads the file.
+      */
+    bool IsInMemory () const
+      { return this->in_memory; }
+
+    /** Decode the image data. As for AimFile::ReadImageData or
+      * IsqFile::ReadImageData: the pointer type must correspond to the
+      * buffer_type of aim or isq.
+      */
+    void ReadImageData (char* data, size_t size);
+    void ReadImageData (short* data, size_t size);
+    void ReadImageData (float* data, size_t size);
+
+  protected:
+
+    std::vector<char>             image_data;   // the data block as stored
+    bool                          in_memory;
+
+    friend class Prefetcher;
+};
+
+
+/** Reads ahead through an ordered list of AIM and/or ISQ files.
+  *
+  * A background thread reads the files in order, parsing each header and
+  * loading its image data into memory, while the application processes
+  * earlier files.
+  *
+  * Each Prefetcher owns this thread, which is not part of the AimIO thread
+  * pool and is not counted by SetNumThreads. It does no computation: it
+  * waits on I/O, and on the application when depth files or memory_budget
+  * bytes are held ready, which would otherwise occupy a pool worker for as
+  * long as the application takes to process a file. Decoding in
+  * PrefetchedImage::ReadImageData runs on the pool as usual.
+  *
+  * At most depth files are held ready, and the image data held ready total
+  * at most memory_budget bytes. (An image that the application has already
+  * obtained with Next no longer counts.) The file format is determined from
+  * the file contents.
+  *
+  *   AimIO::Prefetcher prefetcher (paths, 2);
+  *   while (std::shared_ptr<AimIO::PrefetchedImage> image = prefetcher.Next())
+  *   {
+  *     std::vector<short> data (long_product(image->aim.dimensions));
+  *     image->ReadImageData (data.data(), data.size());
+  *     ...
+  *   }
+  */
+class AIMIO_EXPORT Prefetcher
+{
+  public:
+
+    /// Starts the background thread, which begins reading ahead.
+    Prefetcher (const std::vector<std::string>& filenames,
+                int depth = 2,
+                size_t memory_budget = size_t(1) << 30);
+
+    /// Stops reading ahead (after the current file), and joins the thread.
+    ~Prefetcher ();
+
+    /** The next file, in order, waiting for it if necessary. Returns null
+      * once all files have been returned.
+      *
+      * If the file could not be read, the exception is rethrown, and the
+      * following call continues with the next file.
+      */
+    std::shared_ptr<PrefetchedImage> Next ();
+
+  protected:
+
+    struct Entry
+    {
+      std::shared_ptr<PrefetchedImage>  image;
+      std::exception_ptr                error;
+      size_t                            bytes;
+    };
+
+    void Run ();
+    /// Reads the header, and the data if reserve returns true for their size.
+    void Load (PrefetchedImage& image, const std::function<bool(size_t)>& reserve);
+
+    std::vector<std::string>    filenames;
+    int                         depth;
+    size_t                      memory_budget;
+    std::mutex                  mutex;
+    std::condition_variable     changed;
+    std::deque<Entry>           ready;
+    size_t                      bytes_held;
+    size_t                      number_returned;
+    bool                        stopped;
+    std::thread                 thread;
+
+  private:
+
+    Prefetcher (const Prefetcher&);
+    Prefetcher& operator= (const Prefetcher&);
+};
+
+}  // namespace
+
+#endif
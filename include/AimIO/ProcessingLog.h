@@ -0,0 +1,39 @@
+// Copyright (c) Eric Nodwell
+// See LICENSE for details.
+
+#ifndef __AimIO_ProcessingLog_h
+#define __AimIO_ProcessingLog_h
+
+#include <string>
+#include <map>
+
+#include "aimio_export.h"
+
+
+namespace AimIO
+{
+
+typedef std::map<std::string,std::string> LogFields;
+
+/** Parses a Scanco processing log into name/value pairs.
+  *
+  * Each line of the log of the form
+  *
+  *   Index Measurement                                4818
+  *
+  * gives a field. The name is the text before the first run of two or more
+  * spaces and the value is the remainder, with surrounding blanks removed.
+  * Separator lines (beginning with '!') are ignored. If a name occurs more
+  * than once, as happens for logs of filtered images, the first value is
+  * retained.
+  */
+AIMIO_EXPORT LogFields ParseProcessingLog (const std::string& log);
+
+/** Returns the value of a single field of a processing log, or an empty
+  * string if the field is not present.
+  */
+AIMIO_EXPORT std::string GetLogField (const std::string& log, const std::string& name);
+
+}  // namespace
+
+#endif
@@ -0,0 +1,132 @@
+// Copyright (c) Eric Nodwell
+// See LICENSE for details.
+
+#ifndef __AimIO_Pyramid_h
+#define __AimIO_Pyramid_h
+
+#include "AimIO/AimIO.h"
+#include "AimIO/Binning.h"
+#include <n88util/tuplet.hpp>
+#include <string>
+#include <vector>
+#include <ctime>
+#include <boost/cstdint.hpp>
+#include <memory>
+
+#include "aimio_export.h"
+
+
+namespace AimIO
+{
+
+class MappedFile;
+
+/** A multi-resolution pyramid of an AIM image, stored in a sidecar file.
+  *
+  * Level 1 has half the resolution of the AIM image, level 2 a quarter,
+  * and so on; each level is obtained by binning the previous one by 2 (see
+  * BinImageData). Levels are stored uncompressed and aligned to pages, so
+  * that they can be memory-mapped: a viewer can open a low-resolution
+  * level instantly, without reading the AIM image.
+  *
+  * The pyramid is generated in a single pass over the AIM image data,
+  * which is decoded a slab at a time, so memory use is small.
+  *
+  * Example:
+  *
+  *   AimIO::AimFile reader ("image.aim");
+  *   reader.ReadImageInfo();
+  *   std::string sidecar = AimIO::AimPyramid::SidecarName (reader.filename);
+  *   AimIO::AimPyramid::Create (reader, sidecar);
+  *
+  *   AimIO::AimPyramid pyramid (sidecar.c_str());
+  *   pyramid.Open();
+  *   const short* overview = static_cast<const short*>(pyramid.MapLevel (3));
+  */
+class AIMIO_EXPORT AimPyramid
+{
+  public:
+
+    struct Level
+    {
+      n88::tuplet<3,int>     dimensions;
+      n88::tuplet<3,float>   element_size;
+      boost::uint64_t        offset;   // in the sidecar file, in bytes
+      boost::uint64_t        size;     // in bytes
+    };
+
+    AimPyramid ();
+    AimPyramid (const char* filename);
+
+    /// The conventional sidecar file name for an AIM file: aim_filename + ".pyr" .
+    static std::string SidecarName (const std::string& aim_filename);
+
+    /** Generate a pyramid sidecar file.
+      *
+      * ReadImageInfo must previously have been called on reader. Levels
+      * are generated until a dimension would become zero, or until
+      * max_levels levels exist (if max_levels is positive).
+      *
+      * By default, char data take the maximum of each block, so that thin
+      * structures remain visible, and short and float data are averaged.
+      */
+    static void Create (AimFile& reader, const std::string& filename, int max_levels = 0);
+    static void Create (AimFile& reader,
+                        const std::string& filename,
+                        int max_levels,
+                        bin_method_t method);
+
+    /// Read the header of the pyramid file.
+    void Open ();
+
+    /** Returns true if the pyramid was generated from aim_filename as it
+      * currently is (same size and modification time).
+      */
+    bool IsCurrent (const std::string& aim_filename) const;
+
+    /// Number of levels, not counting the full-resolution image.
+    int NumberOfLevels () const {return int(this->levels.size());}
+
+    /// Information for level 1 to NumberOfLevels.
+    const Level& GetLevel (int level) const;
+
+    /** Memory-map a level and return a pointer to its data, which are of
+      * type buffer_type in x-fastest order.
+      *
+      * The pointer remains valid until Close is called or this object is
+      * destroyed. As for IsqFile::MapImageData, this is only available on
+      * little-endian platforms; elsewhere use ReadLevel.
+      */
+    const void* MapLevel (int level);
+
+    /// Read a level. The pointer type must correspond to buffer_type.
+    void ReadLevel (int level, char* data, size_t size);
+    void ReadLevel (int level, short* data, size_t size);
+    void ReadLevel (int level, float* data, size_t size);
+
+    /// Release any memory maps.
+    void Close ();
+
+    std::string                 filename;
+
+    // The following are set by Open.
+    AimFile::buffer_format_t    buffer_type;
+    bin_method_t                method;
+    boost::uint64_t             source_size;
+    std::time_t                 source_modification_time;
+
+  protected:
+
+    void ReadAnyLevel (int level, void* data, size_t size, AimFile::buffer_format_t type);
+    template <typename T> static void CreateAny (AimFile& reader,
+                                                 const std::string& filename,
+                                                 int max_levels,
+                                                 bin_method_t method);
+
+    std::vector<Level>                          levels;
+    std::vector<std::shared_ptr<MappedFile> >   maps;
+};
+
+}  // namespace
+
+#endif
@@ -0,0 +1,103 @@
+// Copyright (c) Eric Nodwell
+// See LICENSE for details.
+
+#ifndef __AimIO_SeekIndex_h
+#define __AimIO_SeekIndex_h
+
+#include "AimIO/Definitions.h"
+#include <string>
+#include <vector>
+#include <ctime>
+#include <boost/cstdint.hpp>
+
+#include "aimio_export.h"
+
+
+namespace AimIO
+{
+
+class AimFile;
+
+/** An index of z slices in a run-length compressed AIM data stream.
+  *
+  * D1TcharCmp and D1TbinCmp data can otherwise only be decoded from the
+  * start of the image. The index records, for every interval-th z slice,
+  * the byte offset within the compressed data and the state of the
+  * decoder (the partially consumed run), so that decoding can be started
+  * at any checkpoint.
+  *
+  * AimFile builds an index in memory the first time ReadSlices is called
+  * on compressed data. An index can also be built explicitly, and saved
+  * to a sidecar file to avoid the initial decoding pass later:
+  *
+  *   AimIO::AimSeekIndex index;
+  *   index.Build (reader);
+  *   index.Save (AimIO::AimSeekIndex::SidecarName (reader.filename));
+  *
+  *   ...
+  *   index.Load (AimIO::AimSeekIndex::SidecarName (reader.filename));
+  *   if (index.IsCurrent (reader.filename))
+  *     { reader.SetSeekIndex (index); }
+  */
+class AIMIO_EXPORT AimSeekIndex
+{
+  public:
+
+    /// Decoder state at the start of a z slice.
+    struct Checkpoint
+    {
+      boost::uint64_t  offset;         // in the compressed data block, in bytes
+      boost::uint8_t   length;         // remaining length of the current run
+      char             value;          // value of the current run
+      char             value_1;        // D1TbinCmp only
+      char             value_2;        // D1TbinCmp only
+      bool             is_value_1;     // D1TbinCmp only
+      bool             change_value;   // D1TbinCmp only
+
+      Checkpoint ();
+    };
+
+    AimSeekIndex ();
+
+    /// The conventional index file name for an AIM file: aim_filename + ".idx" .
+    static std::string SidecarName (const std::string& aim_filename);
+
+    /** Build the index for an AIM file, with a checkpoint every interval
+      * z slices.
+      *
+      * ReadImageInfo must previously have been called on reader. The
+      * compressed data are decoded once, without storing the output.
+      */
+    void Build (const AimFile& reader, int interval = 16);
+
+    /// Write the index to a file.
+    void Save (const std::string& filename) const;
+
+    /// Read an index written by Save.
+    void Load (const std::string& filename);
+
+    /** Returns true if the index was generated from aim_filename as it
+      * currently is (same size and modification time).
+      */
+    bool IsCurrent (const std::string& aim_filename) const;
+
+    /// The checkpoint at or before slice, and its slice number.
+    const Checkpoint& Find (int slice, int& checkpoint_slice) const;
+
+    /** Offset in the compressed data beyond which no data are required to
+      * decode up to and including last_slice.
+      */
+    boost::uint64_t EndOffset (int last_slice) const;
+
+    aim_storage_format_t        aim_type;
+    int                         number_of_slices;
+    int                         interval;
+    boost::uint64_t             compressed_size;
+    boost::uint64_t             source_size;
+    std::time_t                 source_modification_time;
+    std::vector<Checkpoint>     checkpoints;
+};
+
+}  // namespace
+
+#endif
@@ -0,0 +1,77 @@
+// Copyright (c) Eric Nodwell
+// See LICENSE for details.
+
+#ifndef __AimIO_ThreadPool_h
+#define __AimIO_ThreadPool_h
+
+#include <exception>
+#include <functional>
+#include <memory>
+
+#include "aimio_export.h"
+
+
+namespace AimIO
+{
+
+/** Interface to a pool of worker threads.
+  *
+  * Decompression, compression, data conversion, header scanning, the
+  * read-ahead of AimFile::ReadImageData and IsqSlabReader, and the
+  * operations of the *Async methods run on a single global pool. By
+  * default this is an internal pool with one thread per hardware thread,
+  * created on first use. Its size can be changed with SetNumThreads.
+  * Alternatively, an application can implement this interface to have
+  * AimIO share its own pool, and install it with SetThreadPool.
+  *
+  * The only other threads are those of the Prefetcher class: each
+  * Prefetcher owns one background thread, which waits on I/O and on the
+  * application, and is not counted by SetNumThreads.
+  *
+  * A synchronous AimIO call that waits for tasks it has submitted first
+  * does any of their work that no worker has started, so it completes even
+  * when called from a task of the pool with no other worker free. This
+  * does not apply to the futures returned by the *Async methods: waiting
+  * on one of those from a task of the pool requires a free worker.
+  */
+class AIMIO_EXPORT ThreadPool
+{
+  public:
+
+    virtual ~ThreadPool ();
+
+    /// Number of worker threads.
+    virtual int NumberOfThreads () const = 0;
+
+    /// Queues a task for execution by a worker thread, and returns
+    /// without waiting for it. Tasks do not throw.
+    virtual void Submit (const std::function<void()>& task) = 0;
+};
+
+/** Set the number of threads used by AimIO, including the calling thread.
+  *
+  * A value of 1 disables worker threads, so that all work is done by the
+  * calling thread. A value of 0 (the default) selects the number of
+  * hardware threads. Replaces any pool set with SetThreadPool.
+  */
+AIMIO_EXPORT void SetNumThreads (int number_of_threads);
+
+/// Number of threads used by AimIO, including the calling thread.
+AIMIO_EXPORT int GetNumThreads ();
+
+/** Use pool, which may be shared with the application, for all work.
+  *
+  * Passing a null pointer restores the internal pool.
+  */
+AIMIO_EXPORT void SetThreadPool (const std::shared_ptr<ThreadPool>& pool);
+
+/// The pool in use. Null if AimIO is single-threaded.
+AIMIO_EXPORT std::shared_ptr<ThreadPool> GetThreadPool ();
+
+/// Called on completion of an asynchronous operation, with the exception
+/// it threw, or null on success.
+typedef std::function<void(std::exception_ptr error)> completion_callback_t;
+
+}  // namespace
+
+#endif
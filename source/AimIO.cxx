@@ -3,11 +3,15 @@
 
 #include "AimIO/AimIO.h"
 #include "Compression.h"
+#include "FileIO.h"
+#include "Parallel.h"
 #include "PlatformFloat.h"
+#include "AimIO/ThreadPool.h"
 #include <boost/endian/conversion.hpp>
 #include <boost/endian/arithmetic.hpp>
 #include <iostream>
-#include <sstream>
+#include <algorithm>
+#include <cstring>
 
 
 using namespace boost::endian;
@@ -134,7 +138,9 @@ AimFile::AimFile ()
   assoc_nr (0),
   assoc_size (0),
   assoc_type (1),
-  byte_offset (0)
+  byte_offset (0),
+  read_chunk_size (4*1024*1024),
+  io_policy (IO_POLICY_BUFFERED)
   {}
 
 
@@ -159,12 +165,14 @@ AimFile::AimFile (const char* fn)
   assoc_nr (0),
   assoc_size (0),
   assoc_type (1),
-  byte_offset (0)
+  byte_offset (0),
+  read_chunk_size (4*1024*1024),
+  io_policy (IO_POLICY_BUFFERED)
   {}
 
 
 // ---------------------------------------------------------------------------
-void AimFile::ReadBlockList (std::ifstream& f)
+void AimFile::ReadBlockList (std::istream& f)
 {
 
   // Read in pre-header
@@ -245,7 +253,7 @@ AimFile::buffer_format_t AimFile::GetTransferBufferType
 
 
 // ---------------------------------------------------------------------------
-void AimFile::ReadHeader (std::ifstream& f)
+void AimFile::ReadHeader (std::istream& f)
 {
   aimio_assert (this->block_list.size());
 
@@ -354,7 +362,7 @@ void AimFile::ReadHeader (std::ifstream& f)
 
 
 // ---------------------------------------------------------------------------
-void AimFile::ReadProcessingLog (std::ifstream& f)
+void AimFile::ReadProcessingLog (std::istream& f)
 {
   aimio_assert (this->block_list.size() > 1);
 
@@ -373,18 +381,73 @@ void AimFile::ReadProcessingLog (std::ifstream& f)
 // ---------------------------------------------------------------------------
 void AimFile::ReadImageInfo ()
 {
+  if (this->source)
+  {
+    std::shared_ptr<const DataSource> opened = this->source;
+    PositionalStreamBuf buffer (*opened, 64*1024);
+    std::istream f (&buffer);
+    this->ReadImageInfo (f);
+    return;
+  }
+
   // Open file.
   std::ifstream f (this->filename.c_str(), std::ios_base::in | std::ios_base::binary);
   if (!f) {
     throw_aimio_exception (std::string("Unable to open file ") + filename); }
   f.exceptions ( std::ifstream::failbit | std::ifstream::badbit );
 
+  this->ReadImageInfo (f);
+}
+
+
+// ---------------------------------------------------------------------------
+void AimFile::ReadImageInfoFromMemory (const void* data, size_t size)
+{
+  this->SetSource (std::make_shared<MemorySource> (data, size));
+  this->ReadImageInfo();
+}
+
+
+// ---------------------------------------------------------------------------
+void AimFile::ReadImageInfo (std::istream& f)
+{
+  f.exceptions ( std::istream::failbit | std::istream::badbit );
+  f.seekg (0);
+  this->seek_index.reset();
+
   this->ReadBlockList (f);
   this->ReadHeader (f);
   this->ReadProcessingLog(f);
 }
 
 
+// Minimum number of values converted by one thread.
+static const size_t conversion_grain = 1<<16;
+
+// Byte order conversion of uncompressed data, in place, on the pool.
+static void ToNative (char*, size_t) {}
+
+static void ToNative (short* data, size_t n)
+{
+  if (order::native != order::little)
+  {
+    ParallelForRange (n, conversion_grain, [&] (size_t begin, size_t end)
+      {
+      for (size_t i=begin; i<end; ++i)
+        { little_to_native_inplace (data[i]); }
+      });
+  }
+}
+
+static void ToNative (float* data, size_t n)
+{
+  ParallelForRange (n, conversion_grain, [&] (size_t begin, size_t end)
+    {
+    for (size_t i=begin; i<end; ++i)
+      { vms_to_native_inplace (data[i]); }
+    });
+}
+
 // ---------------------------------------------------------------------------
 void AimFile::ReadAnyData
   (
@@ -393,25 +456,118 @@ void AimFile::ReadAnyData
   aim_storage_format_t type
   )
 {
-  // Open file.
-  std::ifstream f (this->filename.c_str(), std::ios_base::in | std::ios_base::binary);
-  if (!f) {
-    throw_aimio_exception (std::string("Unable to open file ") + filename); }
-  f.exceptions ( std::ifstream::failbit | std::ifstream::badbit );
+  std::shared_ptr<const DataSource> opened = this->OpenSource();
+  const DataSource& file = *opened;
+  this->ReadAnyDataFrom (file, data, buffer_number, type);
+}
 
-  std::vector<char> buffer (this->block_list[buffer_number].size);
-  f.seekg (this->block_list[buffer_number].offset);
-  f.read (&(buffer[0]), this->block_list[buffer_number].size);
+// ---------------------------------------------------------------------------
+void AimFile::ReadAnyDataFrom
+  (
+  const DataSource& file,
+  void* data,
+  int buffer_number,
+  aim_storage_format_t type
+  ) const
+{
+  const MemoryBlock& block = this->block_list[buffer_number];
+  if (this->read_chunk_size > 0 &&
+      block.size > 2*this->read_chunk_size &&
+      !file.Data() &&
+      GetThreadPool())
+  {
+    this->ReadAnyDataPipelined (file, data, buffer_number, type);
+    return;
+  }
+
+  // Data in memory are decoded in place.
+  std::vector<char> buffer;
+  const char* bytes = BytesAt (file, block.offset, block.size, buffer);
 
   AimIO::Decompress (data,
-                     &(buffer[0]),
-                     buffer.size(),
+                     bytes,
+                     block.size,
                      type,
                      this->dimensions,
                      this->offset,
                      (this->version == AIMFILE_VERSION_30));
 }
 
+// ---------------------------------------------------------------------------
+void AimFile::ReadAnyDataPipelined
+  (
+  const DataSource& file,
+  void* data,
+  int buffer_number,
+  aim_storage_format_t type
+  ) const
+{
+  const MemoryBlock& block = this->block_list[buffer_number];
+  // Whole chunks of any element type, and large enough for any RLE header.
+  const size_t chunk_size = std::max<size_t> (this->read_chunk_size & ~size_t(7), 64);
+
+  std::shared_ptr<ThreadPool> pool = GetThreadPool();
+  const bool single_worker = !pool || pool->NumberOfThreads() <= 1;
+
+  if ((type == AIMFILE_TYPE_D1TcharCmp || type == AIMFILE_TYPE_D1TbinCmp) &&
+      single_worker)
+  {
+    // With a single worker, which is reading, the runs could not be
+    // decoded in parallel anyway. Decode each chunk of the compressed
+    // data while the next is read.
+    std::vector<char> buffer (block.size);
+    ReadAhead ahead (file, &(buffer[0]), block.size, block.offset, chunk_size);
+    size_t available = ahead.WaitFor (chunk_size);
+    SliceDecompressor decompressor (&(buffer[0]),
+                                    block.size,
+                                    type,
+                                    this->dimensions,
+                                    this->offset,
+                                    (this->version == AIMFILE_VERSION_30));
+    decompressor.SetRefill (available, [&] (size_t count) { return ahead.WaitFor (count); });
+    decompressor.Next (reinterpret_cast<char*>(data), this->dimensions[2]);
+  }
+  else if (type == AIMFILE_TYPE_D1Tchar ||
+           type == AIMFILE_TYPE_D1Tshort ||
+           type == AIMFILE_TYPE_D1Tfloat)
+  {
+    // Read straight into the output, converting each chunk to native
+    // byte order, in parallel, while the next is read.
+    const size_t element_size = type & 0xffff;
+    const size_t size = long_product(this->dimensions) * element_size;
+    aimio_verbose_assert (block.size >= size, "Image data truncated.");
+    ReadAhead ahead (file, reinterpret_cast<char*>(data), size, block.offset, chunk_size);
+    size_t done = 0;
+    while (done < size)
+    {
+      size_t available = ahead.WaitFor (done + chunk_size);
+      if (type == AIMFILE_TYPE_D1Tshort)
+        { ToNative (reinterpret_cast<short*>(data) + done/element_size, (available - done)/element_size); }
+      else if (type == AIMFILE_TYPE_D1Tfloat)
+        { ToNative (reinterpret_cast<float*>(data) + done/element_size, (available - done)/element_size); }
+      done = available;
+    }
+  }
+  else
+  {
+    // D3Tbit8 data require the last byte before decoding can start, and
+    // the parallel decoding of D1TcharCmp and D1TbinCmp data requires all
+    // the runs. Read the chunks on the pool, then decode in parallel.
+    std::vector<char> buffer (block.size);
+    {
+      ReadAhead ahead (file, &(buffer[0]), block.size, block.offset, chunk_size);
+      ahead.WaitFor (block.size);
+    }
+    AimIO::Decompress (data,
+                       &(buffer[0]),
+                       block.size,
+                       type,
+                       this->dimensions,
+                       this->offset,
+                       (this->version == AIMFILE_VERSION_30));
+  }
+}
+
 // ---------------------------------------------------------------------------
 void AimFile::ReadImageData (char* data, size_t size)
 {
@@ -439,6 +595,445 @@ void AimFile::ReadImageData (float* data, size_t size)
   this->ReadAnyData (data, 2, this->aim_type);
 }
 
+// ---------------------------------------------------------------------------
+template <typename T>
+void AimFile::ForEachSlab
+  (
+  int slab_thickness,
+  const std::function<void(T* slab, int first_slice, int number_of_slices)>& consume
+  )
+{
+  aimio_assert (this->block_list.size() >= 3);
+  aimio_assert (slab_thickness > 0);
+  const size_t slice_size = size_t(this->dimensions[0]) * this->dimensions[1];
+  std::vector<T> slab (slice_size * std::min (slab_thickness, std::max (this->dimensions[2], 1)));
+  if (slab.empty())
+    { return; }
+
+  std::shared_ptr<const DataSource> opened = this->OpenSource();
+  const DataSource& file = *opened;
+  const MemoryBlock& block = this->block_list[2];
+
+  if (this->aim_type == AIMFILE_TYPE_D1TcharCmp ||
+      this->aim_type == AIMFILE_TYPE_D1TbinCmp ||
+      this->aim_type == AIMFILE_TYPE_D3Tbit8)
+  {
+    // Compressed data are small; decompress only a slab at a time.
+    aimio_assert (sizeof(T) == 1);
+    std::vector<char> buffer;
+    const char* compressed = BytesAt (file, block.offset, block.size, buffer);
+    SliceDecompressor decompressor (compressed,
+                                    block.size,
+                                    this->aim_type,
+                                    this->dimensions,
+                                    this->offset,
+                                    (this->version == AIMFILE_VERSION_30));
+    for (int z=0; z<this->dimensions[2]; z+=slab_thickness)
+    {
+      int n = std::min (slab_thickness, this->dimensions[2] - z);
+      decompressor.Next (reinterpret_cast<char*>(&(slab[0])), n);
+      consume (&(slab[0]), z, n);
+    }
+  }
+  else
+  {
+    // Uncompressed: read a slab at a time directly from the file.
+    aimio_assert (this->aim_type == AIMFILE_TYPE_D1Tchar ||
+                  this->aim_type == AIMFILE_TYPE_D1Tshort ||
+                  this->aim_type == AIMFILE_TYPE_D1Tfloat);
+    aimio_assert ((this->aim_type & 0xffff) == sizeof(T));
+    aimio_assert (block.size >= long_product(this->dimensions) * sizeof(T));
+    for (int z=0; z<this->dimensions[2]; z+=slab_thickness)
+    {
+      int n = std::min (slab_thickness, this->dimensions[2] - z);
+      file.ReadExactlyAt (&(slab[0]), slice_size * n * sizeof(T),
+                          block.offset + boost::uint64_t(z) * slice_size * sizeof(T));
+      ToNative (&(slab[0]), slice_size * n);
+      consume (&(slab[0]), z, n);
+    }
+  }
+}
+
+template void AimFile::ForEachSlab<char> (int, const std::function<void(char*, int, int)>&);
+template void AimFile::ForEachSlab<short> (int, const std::function<void(short*, int, int)>&);
+template void AimFile::ForEachSlab<float> (int, const std::function<void(float*, int, int)>&);
+
+// ---------------------------------------------------------------------------
+const AimSeekIndex& AimFile::GetSeekIndex ()
+{
+  if (!this->seek_index)
+  {
+    std::shared_ptr<AimSeekIndex> index (new AimSeekIndex);
+    index->Build (*this);
+    this->seek_index = index;
+  }
+  return *this->seek_index;
+}
+
+// ---------------------------------------------------------------------------
+void AimFile::SetSeekIndex (const AimSeekIndex& index)
+{
+  aimio_verbose_assert (index.aim_type == this->aim_type &&
+                        index.number_of_slices == this->dimensions[2] &&
+                        this->block_list.size() >= 3 &&
+                        index.compressed_size == this->block_list[2].size,
+    "Seek index does not match AIM file.");
+  this->seek_index.reset (new AimSeekIndex (index));
+}
+
+// ---------------------------------------------------------------------------
+void AimFile::SetSource (const std::shared_ptr<const DataSource>& s)
+{
+  this->source = s;
+  this->seek_index.reset();
+}
+
+// ---------------------------------------------------------------------------
+void AimFile::SetSink (const std::shared_ptr<DataSink>& s)
+{
+  this->sink = s;
+}
+
+// ---------------------------------------------------------------------------
+std::shared_ptr<const DataSource> AimFile::OpenSource () const
+{
+  if (this->source)
+    { return this->source; }
+  return std::make_shared<PositionalFile> (this->filename, this->io_policy);
+}
+
+// ---------------------------------------------------------------------------
+template <typename T>
+void AimFile::ReadAnySlices
+  (
+  int first_slice,
+  int number_of_slices,
+  T* data,
+  size_t size
+  )
+{
+  aimio_assert (this->block_list.size() >= 3);
+  aimio_verbose_assert (first_slice >= 0 && number_of_slices >= 0 &&
+                        first_slice + number_of_slices <= this->dimensions[2],
+    "Slices out of range.");
+  aimio_assert (size == size_t(this->dimensions[0]) * this->dimensions[1] * number_of_slices);
+  if (size == 0)
+    { return; }
+  const AimSeekIndex* index = 0;
+  if (this->aim_type == AIMFILE_TYPE_D1TcharCmp ||
+      this->aim_type == AIMFILE_TYPE_D1TbinCmp)
+    { index = &(this->GetSeekIndex()); }
+  std::shared_ptr<const DataSource> opened = this->OpenSource();
+  const DataSource& file = *opened;
+  this->ReadSlicesFrom (file, index, first_slice, number_of_slices, data);
+}
+
+// ---------------------------------------------------------------------------
+template <typename T>
+void AimFile::ReadSlicesFrom
+  (
+  const DataSource& file,
+  const AimSeekIndex* index,
+  int first_slice,
+  int number_of_slices,
+  T* data
+  ) const
+{
+  const size_t slice_size = size_t(this->dimensions[0]) * this->dimensions[1];
+  const MemoryBlock& block = this->block_list[2];
+
+  if (this->aim_type == AIMFILE_TYPE_D1TcharCmp ||
+      this->aim_type == AIMFILE_TYPE_D1TbinCmp)
+  {
+    // Read the compressed data from the preceding checkpoint up to the
+    // following one, and skip the slices before first_slice.
+    aimio_assert (sizeof(T) == 1);
+    aimio_assert (index);
+    int checkpoint_slice = 0;
+    const AimSeekIndex::Checkpoint& state = index->Find (first_slice, checkpoint_slice);
+    boost::uint64_t end = index->EndOffset (first_slice + number_of_slices - 1);
+    aimio_verbose_assert (state.offset <= end && end <= block.size, "Corrupt seek index.");
+    std::vector<char> buffer;
+    const char* window = BytesAt (file, block.offset + state.offset, end - state.offset, buffer);
+    SliceDecompressor decompressor (window,
+                                    end - state.offset,
+                                    this->aim_type,
+                                    this->dimensions,
+                                    this->offset,
+                                    checkpoint_slice,
+                                    state);
+    decompressor.Next (0, first_slice - checkpoint_slice);
+    decompressor.Next (reinterpret_cast<char*>(data), number_of_slices);
+  }
+  else if (this->aim_type == AIMFILE_TYPE_D3Tbit8)
+  {
+    // Each pair of slices is one layer of the compressed data; read only
+    // the layers required, and the value that follows the last layer.
+    aimio_assert (sizeof(T) == 1);
+    const tuplet<3,int> c_dim = (this->dimensions + 1)/2;
+    const size_t layer_size = size_t(c_dim[0]) * c_dim[1];
+    aimio_verbose_assert (block.size == long_product(c_dim) + 1, "Corrupt D3Tbit8 data.");
+    const int first_layer = first_slice/2;
+    const int number_of_layers = (first_slice + number_of_slices - 1)/2 - first_layer + 1;
+    std::vector<char> buffer;
+    const unsigned char* layers = reinterpret_cast<const unsigned char*>(
+      BytesAt (file, block.offset + first_layer*layer_size, layer_size * number_of_layers, buffer));
+    char value = 0;
+    file.ReadExactlyAt (&value, 1, block.offset + block.size - 1);
+    const size_t dx = this->dimensions[0];
+    char* raw = reinterpret_cast<char*>(data);
+    for (int k_r=first_slice; k_r<first_slice+number_of_slices; ++k_r)
+    {
+      const unsigned char* layer = layers + (k_r/2 - first_layer)*layer_size;
+      for (size_t j_r=0; j_r<size_t(this->dimensions[1]); ++j_r)
+      {
+        const unsigned char* row = layer + c_dim[0]*(j_r/2);
+        int bit_base = (k_r%2)*4 + (j_r%2)*2;
+        for (size_t i_r=0; i_r<dx; ++i_r)
+          { *raw++ = (row[i_r/2] & (1 << (bit_base + (i_r%2)))) != 0 ? value : 0; }
+      }
+    }
+  }
+  else
+  {
+    aimio_assert ((this->aim_type & 0xffff) == sizeof(T));
+    aimio_assert (block.size >= long_product(this->dimensions) * sizeof(T));
+    size_t size = slice_size * number_of_slices;
+    file.ReadExactlyAt (data, size * sizeof(T),
+                        block.offset + boost::uint64_t(first_slice) * slice_size * sizeof(T));
+    ToNative (data, size);
+  }
+}
+
+template void AimFile::ReadSlicesFrom<char> (const DataSource&, const AimSeekIndex*, int, int, char*) const;
+template void AimFile::ReadSlicesFrom<short> (const DataSource&, const AimSeekIndex*, int, int, short*) const;
+template void AimFile::ReadSlicesFrom<float> (const DataSource&, const AimSeekIndex*, int, int, float*) const;
+
+// ---------------------------------------------------------------------------
+template <typename T>
+void AimFile::ReadRegionFrom
+  (
+  const DataSource& file,
+  const AimSeekIndex* index,
+  const tuplet<3,int>& start,
+  const tuplet<3,int>& extent,
+  T* data
+  ) const
+{
+  const size_t row_size = extent[0];
+  const size_t region_slice_size = row_size * extent[1];
+
+  if ((this->aim_type & 0xffff) == sizeof(T) &&
+      this->aim_type != AIMFILE_TYPE_D1TcharCmp &&
+      this->aim_type != AIMFILE_TYPE_D1TbinCmp &&
+      this->aim_type != AIMFILE_TYPE_D3Tbit8)
+  {
+    // Uncompressed: each row of the region is a contiguous span of the file.
+    const boost::uint64_t dimx = this->dimensions[0];
+    const boost::uint64_t dimy = this->dimensions[1];
+    const size_t number_of_rows = size_t(extent[1]) * extent[2];
+    std::vector<boost::uint64_t> span_offset (number_of_rows);
+    for (int k=0; k<extent[2]; ++k)
+      for (int j=0; j<extent[1]; ++j)
+      {
+        boost::uint64_t voxel = (boost::uint64_t(start[2] + k)*dimy + start[1] + j)*dimx + start[0];
+        span_offset[size_t(k)*extent[1] + j] = this->block_list[2].offset + voxel*sizeof(T);
+      }
+    ReadSpans (file, span_offset, row_size*sizeof(T),
+      [&] (size_t r, const char* src)
+        { memcpy (data + r*row_size, src, row_size*sizeof(T)); });
+    ToNative (data, region_slice_size * extent[2]);
+    return;
+  }
+
+  // Compressed: decode whole slices a batch at a time and crop them.
+  const int batch = 16;
+  const size_t slice_size = size_t(this->dimensions[0]) * this->dimensions[1];
+  std::vector<T> slices (slice_size * std::min (batch, extent[2]));
+  for (int k=0; k<extent[2]; k+=batch)
+  {
+    int n = std::min (batch, extent[2] - k);
+    this->ReadSlicesFrom (file, index, start[2] + k, n, &(slices[0]));
+    for (int kk=0; kk<n; ++kk)
+      for (int j=0; j<extent[1]; ++j)
+      {
+        const T* src = &(slices[0]) + kk*slice_size + size_t(start[1] + j)*this->dimensions[0] + start[0];
+        std::copy (src, src + row_size, data + (k + kk)*region_slice_size + j*row_size);
+      }
+  }
+}
+
+template void AimFile::ReadRegionFrom<char> (const DataSource&, const AimSeekIndex*, const tuplet<3,int>&, const tuplet<3,int>&, char*) const;
+template void AimFile::ReadRegionFrom<short> (const DataSource&, const AimSeekIndex*, const tuplet<3,int>&, const tuplet<3,int>&, short*) const;
+template void AimFile::ReadRegionFrom<float> (const DataSource&, const AimSeekIndex*, const tuplet<3,int>&, const tuplet<3,int>&, float*) const;
+
+// ---------------------------------------------------------------------------
+void AimFile::ReadSlices (int first_slice, int number_of_slices, char* data, size_t size)
+{
+  aimio_assert (this->buffer_type == AIMFILE_TYPE_CHAR);
+  this->ReadAnySlices (first_slice, number_of_slices, data, size);
+}
+
+// ---------------------------------------------------------------------------
+void AimFile::ReadSlices (int first_slice, int number_of_slices, short* data, size_t size)
+{
+  aimio_assert (this->buffer_type == AIMFILE_TYPE_SHORT);
+  this->ReadAnySlices (first_slice, number_of_slices, data, size);
+}
+
+// ---------------------------------------------------------------------------
+void AimFile::ReadSlices (int first_slice, int number_of_slices, float* data, size_t size)
+{
+  aimio_assert (this->buffer_type == AIMFILE_TYPE_FLOAT);
+  this->ReadAnySlices (first_slice, number_of_slices, data, size);
+}
+
+// ---------------------------------------------------------------------------
+template <typename T>
+void AimFile::ReadBinnedAnyData
+  (
+  T* data,
+  size_t size,
+  int bin,
+  bin_method_t method
+  )
+{
+  tuplet<3,int> out_dims = BinnedDimensions (this->dimensions, bin);
+  aimio_assert (size == long_product(out_dims));
+  if (size == 0)
+    { return; }
+
+  // Decode bin slices at a time; trailing slices that do not make up a
+  // full block are ignored.
+  const size_t out_slice_size = size_t(out_dims[0]) * out_dims[1];
+  const tuplet<3,int> out_slab_dims (out_dims[0], out_dims[1], 1);
+  this->ForEachSlab<T> (bin,
+    [&] (T* slab, int first_slice, int number_of_slices)
+    {
+      int k = first_slice / bin;
+      if (k < out_dims[2])
+      {
+        tuplet<3,int> slab_dims (this->dimensions[0], this->dimensions[1], number_of_slices);
+        BinImageData (slab, slab_dims, tuplet<3,int>(0,0,0), out_slab_dims,
+                      bin, method, data + k*out_slice_size);
+      }
+    });
+}
+
+// ---------------------------------------------------------------------------
+void AimFile::ReadBinnedImageData (char* data, size_t size, int bin, bin_method_t method)
+{
+  aimio_assert (this->buffer_type == AIMFILE_TYPE_CHAR);
+  this->ReadBinnedAnyData (data, size, bin, method);
+}
+
+// ---------------------------------------------------------------------------
+void AimFile::ReadBinnedImageData (short* data, size_t size, int bin, bin_method_t method)
+{
+  aimio_assert (this->buffer_type == AIMFILE_TYPE_SHORT);
+  this->ReadBinnedAnyData (data, size, bin, method);
+}
+
+// ---------------------------------------------------------------------------
+void AimFile::ReadBinnedImageData (float* data, size_t size, int bin, bin_method_t method)
+{
+  aimio_assert (this->buffer_type == AIMFILE_TYPE_FLOAT);
+  this->ReadBinnedAnyData (data, size, bin, method);
+}
+
+// Number of bits set in each possible byte.
+struct BitCountTable
+{
+  char count[256];
+  BitCountTable ()
+  {
+    for (int b=0; b<256; ++b)
+    {
+      count[b] = 0;
+      for (int bit=0; bit<8; ++bit)
+        { count[b] += (b >> bit) & 1; }
+    }
+  }
+};
+
+// ---------------------------------------------------------------------------
+void AimFile::ReadBit8Preview
+  (
+  char* data,
+  size_t size,
+  bit8_preview_t mode
+  )
+{
+  aimio_assert (this->block_list.size() >= 3);
+  aimio_verbose_assert (this->aim_type == AIMFILE_TYPE_D3Tbit8,
+    "Preview requires D3Tbit8 data.");
+  aimio_assert (size == long_product((this->dimensions + 1)/2));
+  const MemoryBlock& block = this->block_list[2];
+  aimio_assert (block.size == size + 1);
+
+  // The object value is stored after the cubes.
+  std::shared_ptr<const DataSource> opened = this->OpenSource();
+  const DataSource& file = *opened;
+  file.ReadExactlyAt (data, size, block.offset);
+  char value = 0;
+  file.ReadExactlyAt (&value, 1, block.offset + size);
+
+  if (mode == BIT8_PREVIEW_OCCUPANCY)
+  {
+    for (size_t i=0; i<size; ++i)
+      { data[i] = data[i] != 0 ? value : 0; }
+  }
+  else if (mode == BIT8_PREVIEW_COUNT)
+  {
+    static const BitCountTable bit_count;
+    for (size_t i=0; i<size; ++i)
+      { data[i] = bit_count.count[(unsigned char)(data[i])]; }
+  }
+  else
+  {
+    throw_aimio_exception ("Unrecognized preview type.");
+  }
+}
+
+// ---------------------------------------------------------------------------
+Calibration AimFile::GetCalibration () const
+{
+  return Calibration::FromProcessingLog (this->processing_log);
+}
+
+// ---------------------------------------------------------------------------
+void AimFile::ReadCalibratedImageData
+  (
+  float* data,
+  size_t size,
+  calibration_unit_t unit
+  )
+{
+  this->ReadCalibratedImageData (data, size, unit, this->GetCalibration());
+}
+
+// ---------------------------------------------------------------------------
+void AimFile::ReadCalibratedImageData
+  (
+  float* data,
+  size_t size,
+  calibration_unit_t unit,
+  const Calibration& calibration
+  )
+{
+  aimio_assert (this->block_list.size() >= 3);
+  aimio_verbose_assert (this->aim_type == AIMFILE_TYPE_D1Tshort,
+    "Calibrated read requires short data.");
+  aimio_assert (size == long_product(this->dimensions));
+  aimio_assert (this->block_list[2].size == size * sizeof(short));
+
+  std::shared_ptr<const DataSource> opened = this->OpenSource();
+  const DataSource& file = *opened;
+  ReadShortChunks (file, this->block_list[2].offset, size,
+    [&] (const short* chunk, size_t index, size_t count)
+      { CalibrateData (chunk, data + index, count, calibration, unit); });
+}
+
 // ---------------------------------------------------------------------------
 void AimFile::FillHeader (std::vector<char>& header)
 {
@@ -558,31 +1153,91 @@ void AimFile::WriteAnyData
   (
   const void* data
   )
+{
+  // Have to compress the data before writing to see how large it will be.
+  Encoder encoded (data, this->aim_type, this->dimensions, (this->version == AIMFILE_VERSION_30));
+
+  if (this->sink)
+  {
+    this->WriteEncoded (*this->sink, encoded);
+    return;
+  }
+
+  if (this->io_policy != IO_POLICY_BUFFERED)
+  {
+    FileSink file (this->filename, this->io_policy);
+    this->WriteEncoded (file, encoded);
+    file.Close();
+    return;
+  }
+
+  std::ofstream f (this->filename.c_str(), std::ios_base::out | std::ios_base::binary);
+  if (!f) {
+    throw_aimio_exception (std::string("Unable to open file ") + filename);
+  }
+  f.exceptions ( std::ifstream::failbit | std::ifstream::badbit );
+
+  this->WritePreamble (f, encoded.Size());
+  encoded.Write (f);
+}
+
+// ---------------------------------------------------------------------------
+void AimFile::WriteEncoded
+  (
+  DataSink& sink,
+  const Encoder& encoded
+  )
+{
+  std::vector<char> preamble;
+  {
+    MemorySink header;
+    SinkStreamBuf buffer (header);
+    std::ostream f (&buffer);
+    f.exceptions ( std::ostream::failbit | std::ostream::badbit );
+    this->WritePreamble (f, encoded.Size());
+    f.flush();
+    preamble.swap (header.Buffer());
+  }
+  sink.Reserve (preamble.size() + encoded.Size());
+  sink.Write (preamble.data(), preamble.size());
+  SinkStreamBuf buffer (sink);
+  std::ostream f (&buffer);
+  f.exceptions ( std::ostream::failbit | std::ostream::badbit );
+  encoded.Write (f);
+  f.flush();
+}
+
+// ---------------------------------------------------------------------------
+void AimFile::WritePreamble
+  (
+  std::ostream& f,
+  size_t data_size,
+  size_t data_alignment
+  )
 {
   std::vector<char> header;
   this->FillHeader (header);
 
-  // Have to compress the data before writing to see how large it will be.
-  std::ostringstream os;
-  Compress (os, data, this->aim_type, this->dimensions, (this->version == AIMFILE_VERSION_30));
-  std::string compressed_data = os.str();
-
   // Construct block table
   this->block_list.clear();
   this->block_list.resize (4);  // zeroed on construction
   this->block_list[0].size = header.size();
   this->block_list[1].size = this->processing_log.size() + 1;
-  this->block_list[2].size = compressed_data.size();
+  if (data_alignment > 1)
+  {
+    // Readers stop at the first null of the processing log, so trailing
+    // nulls can be used as padding.
+    boost::uint64_t data_offset = (this->version == AIMFILE_VERSION_30)
+        ? 16 + 5*sizeof(boost::int64_t) : 5*sizeof(boost::int32_t);
+    data_offset += this->block_list[0].size + this->block_list[1].size;
+    this->block_list[1].size += (data_alignment - data_offset % data_alignment) % data_alignment;
+  }
+  this->block_list[2].size = data_size;
   if (this->version == AIMFILE_VERSION_30)
     { this->block_list[0].offset = 16; }
   for (int i=0; i<3; ++i)
     { this->block_list[i+1].offset = this->block_list[i].offset
                                    + this->block_list[i].size; }
-  std::ofstream f (this->filename.c_str(), std::ios_base::out | std::ios_base::binary);
-  if (!f) {
-    throw_aimio_exception (std::string("Unable to open file ") + filename);
-  }
-  f.exceptions ( std::ifstream::failbit | std::ifstream::badbit );
 
   // File identifier
   if (this->version == AIMFILE_VERSION_30) {
@@ -611,8 +1266,9 @@ void AimFile::WriteAnyData
   }
 
   f.write (&(header[0]), this->block_list[0].size);
-  f.write (this->processing_log.c_str(), this->block_list[1].size);
-  f.write (compressed_data.data(), this->block_list[2].size);
+  f.write (this->processing_log.c_str(), this->processing_log.size() + 1);
+  for (size_t i=this->processing_log.size()+1; i<this->block_list[1].size; ++i)
+    { f.put (0); }
 }
 
 
@@ -714,4 +1370,76 @@ void AimFile::WriteImageData (const float* data)
   this->WriteAnyData (data);
 }
 
+// ---------------------------------------------------------------------------
+std::future<void> AimFile::ReadImageDataAsync (char* data, size_t size)
+{
+  return RunAsync<void> ([this, data, size] () { this->ReadImageData (data, size); });
+}
+
+// ---------------------------------------------------------------------------
+std::future<void> AimFile::ReadImageDataAsync (short* data, size_t size)
+{
+  return RunAsync<void> ([this, data, size] () { this->ReadImageData (data, size); });
+}
+
+// ---------------------------------------------------------------------------
+std::future<void> AimFile::ReadImageDataAsync (float* data, size_t size)
+{
+  return RunAsync<void> ([this, data, size] () { this->ReadImageData (data, size); });
+}
+
+// ---------------------------------------------------------------------------
+void AimFile::ReadImageDataAsync (char* data, size_t size, const completion_callback_t& done)
+{
+  RunWithCallback ([this, data, size] () { this->ReadImageData (data, size); }, done);
+}
+
+// ---------------------------------------------------------------------------
+void AimFile::ReadImageDataAsync (short* data, size_t size, const completion_callback_t& done)
+{
+  RunWithCallback ([this, data, size] () { this->ReadImageData (data, size); }, done);
+}
+
+// ---------------------------------------------------------------------------
+void AimFile::ReadImageDataAsync (float* data, size_t size, const completion_callback_t& done)
+{
+  RunWithCallback ([this, data, size] () { this->ReadImageData (data, size); }, done);
+}
+
+// ---------------------------------------------------------------------------
+std::future<void> AimFile::WriteImageDataAsync (const char* data)
+{
+  return RunAsync<void> ([this, data] () { this->WriteImageData (data); });
+}
+
+// ---------------------------------------------------------------------------
+std::future<void> AimFile::WriteImageDataAsync (const short* data)
+{
+  return RunAsync<void> ([this, data] () { this->WriteImageData (data); });
+}
+
+// ---------------------------------------------------------------------------
+std::future<void> AimFile::WriteImageDataAsync (const float* data)
+{
+  return RunAsync<void> ([this, data] () { this->WriteImageData (data); });
+}
+
+// ---------------------------------------------------------------------------
+void AimFile::WriteImageDataAsync (const char* data, const completion_callback_t& done)
+{
+  RunWithCallback ([this, data] () { this->WriteImageData (data); }, done);
+}
+
+// ---------------------------------------------------------------------------
+void AimFile::WriteImageDataAsync (const short* data, const completion_callback_t& done)
+{
+  RunWithCallback ([this, data] () { this->WriteImageData (data); }, done);
+}
+
+// ---------------------------------------------------------------------------
+void AimFile::WriteImageDataAsync (const float* data, const completion_callback_t& done)
+{
+  RunWithCallback ([this, data] () { this->WriteImageData (data); }, done);
+}
+
 }  // namespace
@@ -0,0 +1,186 @@
+// Copyright (c) Eric Nodwell
+// See LICENSE for details.
+
+#include "AimIO/AimMappedWriter.h"
+#include "Parallel.h"
+#include "PlatformFloat.h"
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/filesystem/operations.hpp>
+#include <boost/endian/conversion.hpp>
+#include <fstream>
+#include <limits>
+#include <cerrno>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+
+using namespace boost::endian;
+
+namespace AimIO
+{
+
+// The data block starts on a page boundary, which aligns it for any type,
+// and keeps the data in pages separate from the header.
+static const size_t data_alignment = 4096;
+// Minimum number of values converted by one thread on Close.
+static const size_t conversion_grain = 1<<16;
+
+struct AimMappedWriter::Mapping
+{
+  boost::interprocess::file_mapping   file;
+  boost::interprocess::mapped_region  region;
+};
+
+// Sets the size of the file, allocating the blocks where the file system
+// supports it, so that running out of space is reported now rather than
+// as a fault when the mapping is written.
+static void AllocateFile (const std::string& filename, boost::uint64_t size)
+{
+#if defined(FALLOC_FL_KEEP_SIZE)
+  int fd = open (filename.c_str(), O_RDWR);
+  if (fd < 0) {
+    throw_aimio_exception (std::string("Unable to open file ") + filename); }
+  int result = fallocate (fd, 0, 0, off_t(size));
+  if (result != 0 && (errno == EOPNOTSUPP || errno == ENOSYS))
+    { result = ftruncate (fd, off_t(size)); }
+  close (fd);
+  if (result != 0) {
+    throw_aimio_exception (std::string("Unable to allocate file ") + filename); }
+#else
+  boost::system::error_code ec;
+  boost::filesystem::resize_file (filename, size, ec);
+  if (ec) {
+    throw_aimio_exception (std::string("Unable to allocate file ") + filename); }
+#endif
+}
+
+// ---------------------------------------------------------------------------
+AimMappedWriter::AimMappedWriter (AimFile& header)
+  :
+  filename (header.filename),
+  type (header.aim_type),
+  number_of_values (long_product(header.dimensions)),
+  mapping (new Mapping),
+  data (0)
+{
+  if (this->type == AIMFILE_TYPE_D1Tundef)
+  {
+    switch (header.buffer_type)
+    {
+      case AimFile::AIMFILE_TYPE_CHAR:  this->type = AIMFILE_TYPE_D1Tchar;  break;
+      case AimFile::AIMFILE_TYPE_SHORT: this->type = AIMFILE_TYPE_D1Tshort; break;
+      case AimFile::AIMFILE_TYPE_FLOAT: this->type = AIMFILE_TYPE_D1Tfloat; break;
+      default: break;
+    }
+  }
+  aimio_verbose_assert (this->type == AIMFILE_TYPE_D1Tchar ||
+                        this->type == AIMFILE_TYPE_D1Tshort ||
+                        this->type == AIMFILE_TYPE_D1Tfloat,
+    "Mapped writing requires AIMFILE_TYPE_D1Tchar, AIMFILE_TYPE_D1Tshort or AIMFILE_TYPE_D1Tfloat.");
+  header.aim_type = this->type;
+  header.buffer_type = header.GetTransferBufferType (this->type);
+
+  boost::uint64_t data_size = boost::uint64_t(this->number_of_values) * (this->type & 0xFFFF);
+  if (header.version != AIMFILE_VERSION_30)
+  {
+    aimio_verbose_assert (data_size <= boost::uint64_t(std::numeric_limits<boost::int32_t>::max()),
+      "Image too large for AIM version 2 or earlier.");
+  }
+
+  boost::uint64_t data_offset = 0;
+  {
+    std::ofstream f (this->filename.c_str(), std::ios_base::out | std::ios_base::binary);
+    if (!f) {
+      throw_aimio_exception (std::string("Unable to open file ") + this->filename);
+    }
+    f.exceptions ( std::ifstream::failbit | std::ifstream::badbit );
+    header.WritePreamble (f, size_t(data_size), data_alignment);
+    data_offset = f.tellp();
+    f.close();
+  }
+  if (data_size == 0)
+    { return; }   // An empty region cannot be mapped.
+  AllocateFile (this->filename, data_offset + data_size);
+
+  using namespace boost::interprocess;
+  try
+  {
+    // The mapping must start on a page boundary, which may be larger than
+    // data_alignment.
+    boost::uint64_t page_offset = data_offset - data_offset % mapped_region::get_page_size();
+    file_mapping m (this->filename.c_str(), read_write);
+    mapped_region r (m, read_write, offset_t(page_offset), size_t(data_offset + data_size - page_offset));
+    this->mapping->file.swap (m);
+    this->mapping->region.swap (r);
+    this->data = reinterpret_cast<char*>(this->mapping->region.get_address()) + (data_offset - page_offset);
+  }
+  catch (interprocess_exception& e)
+  {
+    throw_aimio_exception (std::string("Unable to map file ") + this->filename + " : " + e.what());
+  }
+}
+
+// ---------------------------------------------------------------------------
+AimMappedWriter::~AimMappedWriter ()
+{}
+
+// ---------------------------------------------------------------------------
+char* AimMappedWriter::CharData ()
+{
+  aimio_verbose_assert (this->type == AIMFILE_TYPE_D1Tchar,
+    "Incompatible storage type for char.");
+  return this->data;
+}
+
+// ---------------------------------------------------------------------------
+short* AimMappedWriter::ShortData ()
+{
+  aimio_verbose_assert (this->type == AIMFILE_TYPE_D1Tshort,
+    "Incompatible storage type for short.");
+  return reinterpret_cast<short*>(this->data);
+}
+
+// ---------------------------------------------------------------------------
+float* AimMappedWriter::FloatData ()
+{
+  aimio_verbose_assert (this->type == AIMFILE_TYPE_D1Tfloat,
+    "Incompatible storage type for float.");
+  return reinterpret_cast<float*>(this->data);
+}
+
+// ---------------------------------------------------------------------------
+void AimMappedWriter::Close ()
+{
+  aimio_assert (this->mapping);
+  if (this->data)
+  {
+    if (this->type == AIMFILE_TYPE_D1Tfloat)
+    {
+      float* values = reinterpret_cast<float*>(this->data);
+      ParallelForRange (this->number_of_values, conversion_grain, [&] (size_t begin, size_t end)
+        {
+        for (size_t i=begin; i<end; ++i)
+          { native_to_vms_inplace (values[i]); }
+        });
+    }
+    else if (this->type == AIMFILE_TYPE_D1Tshort && order::native != order::little)
+    {
+      short* values = reinterpret_cast<short*>(this->data);
+      ParallelForRange (this->number_of_values, conversion_grain, [&] (size_t begin, size_t end)
+        {
+        for (size_t i=begin; i<end; ++i)
+          { native_to_little_inplace (values[i]); }
+        });
+    }
+    this->data = 0;
+    if (!this->mapping->region.flush (0, 0, false)) {
+      throw_aimio_exception (std::string("Error writing file ") + this->filename); }
+  }
+  this->mapping.reset();
+}
+
+}  // namespace
@@ -0,0 +1,187 @@
+// Copyright (c) Eric Nodwell
+// See LICENSE for details.
+
+#include "AimIO/AimReader.h"
+#include "FileIO.h"
+
+
+using n88::tuplet;
+
+namespace AimIO
+{
+
+static AimFile::buffer_format_t BufferType (char*)  { return AimFile::AIMFILE_TYPE_CHAR; }
+static AimFile::buffer_format_t BufferType (short*) { return AimFile::AIMFILE_TYPE_SHORT; }
+static AimFile::buffer_format_t BufferType (float*) { return AimFile::AIMFILE_TYPE_FLOAT; }
+
+// ---------------------------------------------------------------------------
+AimReader::AimReader (const AimFile& header)
+  :
+  header (header),
+  index (header.seek_index)
+{
+  this->Open();
+}
+
+// ---------------------------------------------------------------------------
+AimReader::AimReader (const std::string& filename)
+  :
+  header (filename.c_str())
+{
+  this->header.ReadImageInfo();
+  this->Open();
+}
+
+// ---------------------------------------------------------------------------
+AimReader::~AimReader ()
+{}
+
+// ---------------------------------------------------------------------------
+void AimReader::Open ()
+{
+  aimio_verbose_assert (this->header.block_list.size() >= 3,
+    "ReadImageInfo must be called before creating an AimReader.");
+  this->file = this->header.OpenSource();
+}
+
+// ---------------------------------------------------------------------------
+const AimSeekIndex* AimReader::Index () const
+{
+  if (this->header.aim_type != AIMFILE_TYPE_D1TcharCmp &&
+      this->header.aim_type != AIMFILE_TYPE_D1TbinCmp)
+    { return 0; }
+  std::call_once (this->index_built, [this] ()
+    {
+    if (!this->index)
+    {
+      std::shared_ptr<AimSeekIndex> built (new AimSeekIndex);
+      built->Build (this->header);
+      this->index = built;
+    }
+    });
+  return this->index.get();
+}
+
+// ---------------------------------------------------------------------------
+void AimReader::ReadImageData (char* data, size_t size) const
+{
+  aimio_assert (this->header.buffer_type == AimFile::AIMFILE_TYPE_CHAR);
+  aimio_assert (size == long_product(this->header.dimensions));
+  this->header.ReadAnyDataFrom (*this->file, data, 2, this->header.aim_type);
+}
+
+// ---------------------------------------------------------------------------
+void AimReader::ReadImageData (short* data, size_t size) const
+{
+  aimio_assert (this->header.buffer_type == AimFile::AIMFILE_TYPE_SHORT);
+  aimio_assert (size == long_product(this->header.dimensions));
+  this->header.ReadAnyDataFrom (*this->file, data, 2, this->header.aim_type);
+}
+
+// ---------------------------------------------------------------------------
+void AimReader::ReadImageData (float* data, size_t size) const
+{
+  aimio_assert (this->header.buffer_type == AimFile::AIMFILE_TYPE_FLOAT);
+  aimio_assert (size == long_product(this->header.dimensions));
+  this->header.ReadAnyDataFrom (*this->file, data, 2, this->header.aim_type);
+}
+
+// ---------------------------------------------------------------------------
+template <typename T>
+void AimReader::ReadAnySlices
+  (
+  int first_slice,
+  int number_of_slices,
+  T* data,
+  size_t size
+  ) const
+{
+  const tuplet<3,int>& dims = this->header.dimensions;
+  aimio_assert (this->header.buffer_type == BufferType (data));
+  aimio_verbose_assert (first_slice >= 0 && number_of_slices >= 0 &&
+                        first_slice + number_of_slices <= dims[2],
+    "Slices out of range.");
+  aimio_assert (size == size_t(dims[0]) * dims[1] * number_of_slices);
+  if (size == 0)
+    { return; }
+  this->header.ReadSlicesFrom (*this->file, this->Index(), first_slice, number_of_slices, data);
+}
+
+// ---------------------------------------------------------------------------
+void AimReader::ReadSlices (int first_slice, int number_of_slices, char* data, size_t size) const
+{
+  this->ReadAnySlices (first_slice, number_of_slices, data, size);
+}
+
+// ---------------------------------------------------------------------------
+void AimReader::ReadSlices (int first_slice, int number_of_slices, short* data, size_t size) const
+{
+  this->ReadAnySlices (first_slice, number_of_slices, data, size);
+}
+
+// ---------------------------------------------------------------------------
+void AimReader::ReadSlices (int first_slice, int number_of_slices, float* data, size_t size) const
+{
+  this->ReadAnySlices (first_slice, number_of_slices, data, size);
+}
+
+// ---------------------------------------------------------------------------
+template <typename T>
+void AimReader::ReadAnyRegion
+  (
+  const tuplet<3,int>& start,
+  const tuplet<3,int>& extent,
+  T* data,
+  size_t size
+  ) const
+{
+  aimio_assert (this->header.buffer_type == BufferType (data));
+  for (int i=0; i<3; ++i)
+  {
+    aimio_verbose_assert (start[i] >= 0 && extent[i] >= 0 &&
+                          start[i] + extent[i] <= this->header.dimensions[i],
+      "Region outside image.");
+  }
+  aimio_assert (size == long_product(extent));
+  if (size == 0)
+    { return; }
+  this->header.ReadRegionFrom (*this->file, this->Index(), start, extent, data);
+}
+
+// ---------------------------------------------------------------------------
+void AimReader::ReadRegion
+  (
+  const tuplet<3,int>& start,
+  const tuplet<3,int>& extent,
+  char* data,
+  size_t size
+  ) const
+{
+  this->ReadAnyRegion (start, extent, data, size);
+}
+
+// ---------------------------------------------------------------------------
+void AimReader::ReadRegion
+  (
+  const tuplet<3,int>& start,
+  const tuplet<3,int>& extent,
+  short* data,
+  size_t size
+  ) const
+{
+  this->ReadAnyRegion (start, extent, data, size);
+}
+
+// ---------------------------------------------------------------------------
+void AimReader::ReadRegion
+  (
+  const tuplet<3,int>& start,
+  const tuplet<3,int>& extent,
+  float* data,
+  size_t size
+  ) const
+{
+  this->ReadAnyRegion (start, extent, data, size);
+}
+
+}  // namespace
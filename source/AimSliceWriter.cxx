@@ -0,0 +1,89 @@
+// Copyright (c) Eric Nodwell
+// See LICENSE for details.
+
+#include "AimIO/AimSliceWriter.h"
+#include <boost/endian/conversion.hpp>
+#include <algorithm>
+#include <limits>
+
+
+using namespace boost::endian;
+
+namespace AimIO
+{
+
+// ---------------------------------------------------------------------------
+AimSliceWriter::AimSliceWriter (AimFile& header)
+  :
+  dimensions (header.dimensions),
+  slices_written (0)
+{
+  if (header.aim_type == AIMFILE_TYPE_D1Tundef)
+    { header.aim_type = AIMFILE_TYPE_D1Tshort; }
+  aimio_verbose_assert (header.aim_type == AIMFILE_TYPE_D1Tshort,
+    "Incompatible storage type for short.");
+  header.buffer_type = AimFile::AIMFILE_TYPE_SHORT;
+
+  boost::uint64_t data_size = boost::uint64_t(long_product(this->dimensions)) * sizeof(short);
+  if (header.version != AIMFILE_VERSION_30)
+  {
+    aimio_verbose_assert (data_size <= boost::uint64_t(std::numeric_limits<boost::int32_t>::max()),
+      "Image too large for AIM version 2 or earlier.");
+  }
+
+  this->f.open (header.filename.c_str(), std::ios_base::out | std::ios_base::binary);
+  if (!this->f) {
+    throw_aimio_exception (std::string("Unable to open file ") + header.filename);
+  }
+  this->f.exceptions ( std::ifstream::failbit | std::ifstream::badbit );
+  header.WritePreamble (this->f, size_t(data_size));
+}
+
+// ---------------------------------------------------------------------------
+AimSliceWriter::~AimSliceWriter ()
+{
+  try
+  {
+    if (this->f.is_open())
+      { this->f.close(); }
+  }
+  catch (...) {}
+}
+
+// ---------------------------------------------------------------------------
+void AimSliceWriter::WriteSlices (const short* data, int number_of_slices)
+{
+  aimio_assert (this->f.is_open());
+  aimio_verbose_assert (number_of_slices >= 0 &&
+                        this->slices_written + number_of_slices <= this->dimensions[2],
+    "Too many slices written.");
+  size_t count = size_t(this->dimensions[0]) * this->dimensions[1] * number_of_slices;
+  if (order::native == order::little)
+  {
+    this->f.write (reinterpret_cast<const char*>(data), count * sizeof(short));
+  }
+  else
+  {
+    const size_t chunk_size = 64*1024;
+    this->buffer.resize (std::min (count, chunk_size));
+    for (size_t index=0; index<count; index+=chunk_size)
+    {
+      size_t n = std::min (chunk_size, count - index);
+      for (size_t i=0; i<n; ++i)
+        { this->buffer[i] = native_to_little (data[index + i]); }
+      this->f.write (reinterpret_cast<const char*>(&(this->buffer[0])), n * sizeof(short));
+    }
+  }
+  this->slices_written += number_of_slices;
+}
+
+// ---------------------------------------------------------------------------
+void AimSliceWriter::Close ()
+{
+  aimio_assert (this->f.is_open());
+  aimio_verbose_assert (this->slices_written == this->dimensions[2],
+    "Not all slices were written.");
+  this->f.close();
+}
+
+}  // namespace
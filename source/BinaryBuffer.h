@@ -0,0 +1,112 @@
+// Copyright (c) Eric Nodwell
+// See LICENSE for details.
+
+#ifndef __AimIO_BinaryBuffer_h
+#define __AimIO_BinaryBuffer_h
+
+#include "AimIO/Exception.h"
+#include <n88util/tuplet.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/endian/conversion.hpp>
+#include <string>
+#include <vector>
+#include <cstring>
+
+
+namespace AimIO
+{
+
+/// Serializes values into a byte buffer, in little-endian order, for the
+/// binary files written by AimIO (catalogs, sidecar files).
+///
+/// For internal use.
+class BufferWriter
+{
+  public:
+    std::vector<char> buffer;
+
+    template <typename T> void Integer (T x)
+    {
+      boost::endian::native_to_little_inplace (x);
+      const char* p = reinterpret_cast<const char*>(&x);
+      this->buffer.insert (this->buffer.end(), p, p + sizeof(T));
+    }
+    void Float (float x)
+    {
+      boost::uint32_t i;
+      memcpy (&i, &x, sizeof(i));
+      this->Integer (i);
+    }
+    void Bytes (const void* data, size_t n)
+    {
+      const char* p = reinterpret_cast<const char*>(data);
+      this->buffer.insert (this->buffer.end(), p, p + n);
+    }
+    void String (const std::string& s)
+    {
+      this->Integer (boost::uint32_t(s.size()));
+      this->buffer.insert (this->buffer.end(), s.begin(), s.end());
+    }
+    void Tuplet (const n88::tuplet<3,int>& t)
+    {
+      for (int i=0; i<3; ++i)
+        { this->Integer (boost::int32_t(t[i])); }
+    }
+};
+
+/// Reads values written by BufferWriter. Throws AimIOException if the
+/// buffer is too short.
+///
+/// For internal use.
+class BufferReader
+{
+  public:
+    /// what is used in the error message, e.g. "Catalog file".
+    BufferReader (const std::vector<char>& b, const char* what_)
+      : buffer(b), position(0), what(what_) {}
+
+    void Bytes (void* out, size_t n)
+    {
+      if (this->buffer.size() - this->position < n) {
+        throw_aimio_exception (std::string(this->what) + " is truncated."); }
+      memcpy (out, &(this->buffer[0]) + this->position, n);
+      this->position += n;
+    }
+    template <typename T> T Integer ()
+    {
+      T x;
+      this->Bytes (&x, sizeof(T));
+      return boost::endian::little_to_native (x);
+    }
+    float Float ()
+    {
+      boost::uint32_t i = this->Integer<boost::uint32_t>();
+      float x;
+      memcpy (&x, &i, sizeof(x));
+      return x;
+    }
+    std::string String ()
+    {
+      boost::uint32_t n = this->Integer<boost::uint32_t>();
+      if (this->buffer.size() - this->position < n) {
+        throw_aimio_exception (std::string(this->what) + " is truncated."); }
+      std::string s (&(this->buffer[0]) + this->position, n);
+      this->position += n;
+      return s;
+    }
+    n88::tuplet<3,int> Tuplet ()
+    {
+      n88::tuplet<3,int> t;
+      for (int i=0; i<3; ++i)
+        { t[i] = this->Integer<boost::int32_t>(); }
+      return t;
+    }
+
+    const std::vector<char>& buffer;
+    size_t position;
+    const char* what;
+};
+
+}  // namespace
+
+#endif
@@ -0,0 +1,177 @@
+// Copyright (c) Eric Nodwell
+// See LICENSE for details.
+
+#include "AimIO/Binning.h"
+#include "AimIO/Exception.h"
+#include <vector>
+
+using n88::tuplet;
+
+
+namespace AimIO
+{
+
+// ---------------------------------------------------------------------------
+tuplet<3,int> BinnedDimensions (const tuplet<3,int>& dims, int bin)
+{
+  aimio_verbose_assert (bin > 0, "Bin size must be positive.");
+  return dims / bin;
+}
+
+// Averaging is rounded to nearest for integer types.
+template <typename T, typename S>
+inline T RoundedMean (S sum, S count)
+{
+  return T((sum >= 0 ? sum + count/2 : sum - count/2) / count);
+}
+
+template <>
+inline float RoundedMean<float,double> (double sum, double count)
+{
+  return float(sum / count);
+}
+
+// Accumulator types for averaging.
+template <typename T> struct BinSum {typedef long long type;};
+template <> struct BinSum<float> {typedef double type;};
+
+// ---------------------------------------------------------------------------
+template <typename T>
+static void BinAnyData
+  (
+  const T* in,
+  const tuplet<3,int>& in_dims,
+  const tuplet<3,int>& start,
+  const tuplet<3,int>& out_dims,
+  int bin,
+  bin_method_t method,
+  T* out
+  )
+{
+  aimio_verbose_assert (bin > 0, "Bin size must be positive.");
+  for (int d=0; d<3; ++d)
+  {
+    aimio_verbose_assert (start[d] >= 0 && start[d] + out_dims[d]*bin <= in_dims[d],
+      "Binned region outside input.");
+  }
+  aimio_verbose_assert (method != BIN_MAJORITY || sizeof(T) == 1,
+    "Majority binning only available for char data.");
+
+  typedef typename BinSum<T>::type S;
+  const S count = S(bin) * bin * bin;
+  const size_t dx = in_dims[0];
+  const size_t dxy = dx * in_dims[1];
+  // For majority: counts of each char value, reset after each block.
+  std::vector<int> counts (method == BIN_MAJORITY ? 256 : 0, 0);
+
+  size_t n = 0;
+  for (int k=0; k<out_dims[2]; ++k)
+    for (int j=0; j<out_dims[1]; ++j)
+    {
+      const T* block_row = in + (size_t(start[2]) + size_t(k)*bin)*dxy
+                              + (size_t(start[1]) + size_t(j)*bin)*dx
+                              + start[0];
+      for (int i=0; i<out_dims[0]; ++i, ++n)
+      {
+        const T* block = block_row + size_t(i)*bin;
+        if (method == BIN_AVERAGE)
+        {
+          S sum = 0;
+          for (int kk=0; kk<bin; ++kk)
+            for (int jj=0; jj<bin; ++jj)
+            {
+              const T* p = block + kk*dxy + jj*dx;
+              for (int ii=0; ii<bin; ++ii)
+                { sum += p[ii]; }
+            }
+          out[n] = RoundedMean<T,S> (sum, count);
+        }
+        else if (method == BIN_MAXIMUM)
+        {
+          T value = *block;
+          for (int kk=0; kk<bin; ++kk)
+            for (int jj=0; jj<bin; ++jj)
+            {
+              const T* p = block + kk*dxy + jj*dx;
+              for (int ii=0; ii<bin; ++ii)
+                { if (p[ii] > value) value = p[ii]; }
+            }
+          out[n] = value;
+        }
+        else
+        {
+          T value = *block;
+          int best = 0;
+          for (int kk=0; kk<bin; ++kk)
+            for (int jj=0; jj<bin; ++jj)
+            {
+              const T* p = block + kk*dxy + jj*dx;
+              for (int ii=0; ii<bin; ++ii)
+              {
+                int c = ++counts[(unsigned char)(p[ii])];
+                if (c > best || (c == best && p[ii] > value))
+                {
+                  best = c;
+                  value = p[ii];
+                }
+              }
+            }
+          for (int kk=0; kk<bin; ++kk)
+            for (int jj=0; jj<bin; ++jj)
+            {
+              const T* p = block + kk*dxy + jj*dx;
+              for (int ii=0; ii<bin; ++ii)
+                { counts[(unsigned char)(p[ii])] = 0; }
+            }
+          out[n] = value;
+        }
+      }
+    }
+}
+
+// ---------------------------------------------------------------------------
+void BinImageData
+  (
+  const char* in,
+  const tuplet<3,int>& in_dims,
+  const tuplet<3,int>& start,
+  const tuplet<3,int>& out_dims,
+  int bin,
+  bin_method_t method,
+  char* out
+  )
+{
+  BinAnyData (in, in_dims, start, out_dims, bin, method, out);
+}
+
+// ---------------------------------------------------------------------------
+void BinImageData
+  (
+  const short* in,
+  const tuplet<3,int>& in_dims,
+  const tuplet<3,int>& start,
+  const tuplet<3,int>& out_dims,
+  int bin,
+  bin_method_t method,
+  short* out
+  )
+{
+  BinAnyData (in, in_dims, start, out_dims, bin, method, out);
+}
+
+// ---------------------------------------------------------------------------
+void BinImageData
+  (
+  const float* in,
+  const tuplet<3,int>& in_dims,
+  const tuplet<3,int>& start,
+  const tuplet<3,int>& out_dims,
+  int bin,
+  bin_method_t method,
+  float* out
+  )
+{
+  BinAnyData (in, in_dims, start, out_dims, bin, method, out);
+}
+
+}  // namespace
@@ -0,0 +1,636 @@
+// Copyright (c) Eric Nodwell
+// See LICENSE for details.
+
+#include "AimIO/BrickFile.h"
+#include "FileIO.h"
+#include "BinaryBuffer.h"
+#include "Parallel.h"
+#include <boost/filesystem.hpp>
+#include <boost/endian/conversion.hpp>
+#include <algorithm>
+#include <fstream>
+#include <limits>
+#include <cstring>
+
+
+using namespace boost::endian;
+using n88::tuplet;
+
+namespace AimIO
+{
+
+// Brick file layout (all values little endian):
+//
+//   char[8]   "AIMIOBRK"
+//   uint32    format version
+//   uint32    buffer type (AimFile::buffer_format_t)
+//   int32     brick size
+//   int32[3]  dimensions
+//   int32[3]  position
+//   int32[3]  offset
+//   float[3]  element size in mm
+//   uint64    size of the AIM file
+//   int64     modification time of the AIM file
+//   string    processing log (uint32 length, then characters)
+//   uint64    number of bricks
+//   then per brick, x fastest:
+//     uint64    offset of data
+//     uint32    size of data
+//     uint8     codec
+//
+// followed by the brick data. Bricks at the upper edges are clipped to the
+// image. Within a brick, voxels are in x-fastest order.
+
+static const char* brick_magic = "AIMIOBRK";
+static const boost::uint32_t brick_format_version = 1;
+static const size_t brick_entry_size = 8 + 4 + 1;
+
+enum brick_codec_t {
+  BRICK_RAW       = 0,   // little endian; IEEE for float
+  BRICK_RLE       = 1,   // char: (value, run length) byte pairs
+  BRICK_DELTA     = 2};  // short: zig-zag LEB128 of difference from previous value in row
+
+// ---------------------------------------------------------------------------
+// Codecs
+
+static void EncodeRaw (const char* in, size_t n, std::vector<char>& out)
+{
+  out.assign (in, in + n);
+}
+
+static void EncodeRaw (const short* in, size_t n, std::vector<char>& out)
+{
+  out.resize (n * sizeof(short));
+  for (size_t i=0; i<n; ++i)
+  {
+    short x = native_to_little (in[i]);
+    memcpy (&(out[i*sizeof(short)]), &x, sizeof(short));
+  }
+}
+
+static void EncodeRaw (const float* in, size_t n, std::vector<char>& out)
+{
+  out.resize (n * sizeof(float));
+  for (size_t i=0; i<n; ++i)
+  {
+    boost::uint32_t x;
+    memcpy (&x, in + i, sizeof(x));
+    native_to_little_inplace (x);
+    memcpy (&(out[i*sizeof(float)]), &x, sizeof(x));
+  }
+}
+
+static void DecodeRaw (const char* in, size_t size, char* out, size_t n)
+{
+  aimio_verbose_assert (size == n, "Corrupt brick.");
+  memcpy (out, in, n);
+}
+
+static void DecodeRaw (const char* in, size_t size, short* out, size_t n)
+{
+  aimio_verbose_assert (size == n*sizeof(short), "Corrupt brick.");
+  memcpy (out, in, size);
+  for (size_t i=0; i<n; ++i)
+    { little_to_native_inplace (out[i]); }
+}
+
+static void DecodeRaw (const char* in, size_t size, float* out, size_t n)
+{
+  aimio_verbose_assert (size == n*sizeof(float), "Corrupt brick.");
+  memcpy (out, in, size);
+  if (order::native != order::little)
+  {
+    for (size_t i=0; i<n; ++i)
+    {
+      boost::uint32_t x;
+      memcpy (&x, out + i, sizeof(x));
+      little_to_native_inplace (x);
+      memcpy (out + i, &x, sizeof(x));
+    }
+  }
+}
+
+static void EncodeRLE (const char* in, size_t n, std::vector<char>& out)
+{
+  out.clear();
+  size_t i = 0;
+  while (i < n)
+  {
+    char value = in[i];
+    size_t run = 1;
+    while (i + run < n && in[i + run] == value && run < 255)
+      { ++run; }
+    out.push_back (value);
+    out.push_back (char(run));
+    i += run;
+  }
+}
+
+static void DecodeRLE (const char* in, size_t size, char* out, size_t n)
+{
+  aimio_verbose_assert (size % 2 == 0, "Corrupt brick.");
+  size_t k = 0;
+  for (size_t i=0; i<size; i+=2)
+  {
+    size_t run = (unsigned char)(in[i+1]);
+    aimio_verbose_assert (k + run <= n, "Corrupt brick.");
+    memset (out + k, in[i], run);
+    k += run;
+  }
+  aimio_verbose_assert (k == n, "Corrupt brick.");
+}
+
+static void EncodeDelta (const short* in, size_t n, size_t row_length, std::vector<char>& out)
+{
+  out.clear();
+  for (size_t i=0; i<n; ++i)
+  {
+    boost::int32_t previous = (i % row_length) ? in[i-1] : 0;
+    boost::int32_t d = boost::int32_t(in[i]) - previous;
+    boost::uint32_t z = (boost::uint32_t(d) << 1) ^ boost::uint32_t(d >> 31);
+    while (z >= 0x80)
+    {
+      out.push_back (char((z & 0x7f) | 0x80));
+      z >>= 7;
+    }
+    out.push_back (char(z));
+  }
+}
+
+static void DecodeDelta (const char* in, size_t size, short* out, size_t n, size_t row_length)
+{
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(in);
+  const unsigned char* end = p + size;
+  for (size_t i=0; i<n; ++i)
+  {
+    boost::uint32_t z = 0;
+    int shift = 0;
+    do
+    {
+      aimio_verbose_assert (p < end && shift < 32, "Corrupt brick.");
+      z |= boost::uint32_t(*p & 0x7f) << shift;
+      shift += 7;
+    }
+    while (*p++ & 0x80);
+    boost::int32_t d = boost::int32_t(z >> 1) ^ -boost::int32_t(z & 1);
+    boost::int32_t previous = (i % row_length) ? out[i-1] : 0;
+    out[i] = short(previous + d);
+  }
+  aimio_verbose_assert (p == end, "Corrupt brick.");
+}
+
+// Encodes a brick with the best codec for the type.
+static boost::uint8_t EncodeBrick (const char* in, size_t n, size_t, std::vector<char>& out)
+{
+  EncodeRLE (in, n, out);
+  if (out.size() < n)
+    { return BRICK_RLE; }
+  EncodeRaw (in, n, out);
+  return BRICK_RAW;
+}
+
+static boost::uint8_t EncodeBrick (const short* in, size_t n, size_t row_length, std::vector<char>& out)
+{
+  EncodeDelta (in, n, row_length, out);
+  if (out.size() < n*sizeof(short))
+    { return BRICK_DELTA; }
+  EncodeRaw (in, n, out);
+  return BRICK_RAW;
+}
+
+static boost::uint8_t EncodeBrick (const float* in, size_t n, size_t, std::vector<char>& out)
+{
+  EncodeRaw (in, n, out);
+  return BRICK_RAW;
+}
+
+static void DecodeBrick (boost::uint8_t codec, const char* in, size_t size, char* out, size_t n, size_t)
+{
+  if (codec == BRICK_RLE)
+    { DecodeRLE (in, size, out, n); }
+  else if (codec == BRICK_RAW)
+    { DecodeRaw (in, size, out, n); }
+  else
+    { throw_aimio_exception ("Unrecognized brick codec."); }
+}
+
+static void DecodeBrick (boost::uint8_t codec, const char* in, size_t size, short* out, size_t n, size_t row_length)
+{
+  if (codec == BRICK_DELTA)
+    { DecodeDelta (in, size, out, n, row_length); }
+  else if (codec == BRICK_RAW)
+    { DecodeRaw (in, size, out, n); }
+  else
+    { throw_aimio_exception ("Unrecognized brick codec."); }
+}
+
+static void DecodeBrick (boost::uint8_t codec, const char* in, size_t size, float* out, size_t n, size_t)
+{
+  if (codec == BRICK_RAW)
+    { DecodeRaw (in, size, out, n); }
+  else
+    { throw_aimio_exception ("Unrecognized brick codec."); }
+}
+
+// Brick (bi,bj,bk): origin and clipped dimensions.
+static void BrickBounds
+  (
+  const tuplet<3,int>& dims,
+  int brick_size,
+  int bi, int bj, int bk,
+  tuplet<3,int>& origin,
+  tuplet<3,int>& brick_dims
+  )
+{
+  origin = tuplet<3,int> (bi, bj, bk) * brick_size;
+  for (int d=0; d<3; ++d)
+    { brick_dims[d] = std::min (brick_size, dims[d] - origin[d]); }
+}
+
+
+// ===========================================================================
+// AimBrickFile
+
+// ---------------------------------------------------------------------------
+AimBrickFile::AimBrickFile ()
+  :
+  buffer_type (AimFile::AIMFILE_TYPE_UNDEFINED),
+  dimensions (0,0,0),
+  position (0,0,0),
+  offset (0,0,0),
+  element_size (0,0,0),
+  brick_size (0),
+  source_size (0),
+  source_modification_time (0)
+{}
+
+// ---------------------------------------------------------------------------
+AimBrickFile::AimBrickFile (const char* filename_)
+  :
+  filename (filename_),
+  buffer_type (AimFile::AIMFILE_TYPE_UNDEFINED),
+  dimensions (0,0,0),
+  position (0,0,0),
+  offset (0,0,0),
+  element_size (0,0,0),
+  brick_size (0),
+  source_size (0),
+  source_modification_time (0)
+{}
+
+// ---------------------------------------------------------------------------
+std::string AimBrickFile::SidecarName (const std::string& aim_filename)
+{
+  return aim_filename + ".bricks";
+}
+
+// ---------------------------------------------------------------------------
+n88::tuplet<3,int> AimBrickFile::BrickGridDimensions () const
+{
+  aimio_assert (this->brick_size > 0);
+  return (this->dimensions + (this->brick_size - 1)) / this->brick_size;
+}
+
+// ---------------------------------------------------------------------------
+template <typename T>
+void AimBrickFile::CreateAny
+  (
+  AimFile& reader,
+  const std::string& filename,
+  int brick_size
+  )
+{
+  aimio_verbose_assert (brick_size > 0, "Brick size must be positive.");
+  // The brick table records sizes as uint32, and no encoding is larger
+  // than the raw brick.
+  aimio_verbose_assert (boost::uint64_t(brick_size) * brick_size * brick_size * sizeof(T)
+                          <= std::numeric_limits<boost::uint32_t>::max(),
+    "Brick size too large.");
+  const tuplet<3,int> dims = reader.dimensions;
+  const tuplet<3,int> grid = (dims + (brick_size - 1)) / brick_size;
+  const size_t number_of_bricks = long_product (grid);
+
+  BufferWriter w;
+  w.Bytes (brick_magic, 8);
+  w.Integer (brick_format_version);
+  w.Integer (boost::uint32_t(reader.buffer_type));
+  w.Integer (boost::int32_t(brick_size));
+  w.Tuplet (dims);
+  w.Tuplet (reader.position);
+  w.Tuplet (reader.offset);
+  for (int j=0; j<3; ++j)
+    { w.Float (reader.element_size[j]); }
+  // A source other than the file has no modification time; zero is
+  // recorded, so that IsCurrent is false.
+  boost::system::error_code ec;
+  std::time_t modification_time = boost::filesystem::last_write_time (reader.filename, ec);
+  if (ec || reader.source)
+    { modification_time = 0; }
+  w.Integer (reader.OpenSource()->Size());
+  w.Integer (boost::int64_t(modification_time));
+  w.String (reader.processing_log);
+  w.Integer (boost::uint64_t(number_of_bricks));
+  const boost::uint64_t table_offset = w.buffer.size();
+  const boost::uint64_t data_offset = table_offset + number_of_bricks * brick_entry_size;
+
+  std::vector<BrickEntry> table (number_of_bricks);
+  std::string temporary = filename + ".tmp";
+  try
+  {
+    {
+      std::ofstream f (temporary.c_str(), std::ios_base::out | std::ios_base::binary);
+      if (!f) {
+        throw_aimio_exception (std::string("Unable to open file ") + temporary); }
+      f.exceptions ( std::ofstream::failbit | std::ofstream::badbit );
+      f.write (&(w.buffer[0]), w.buffer.size());
+      // The table is written once all bricks are encoded.
+      f.seekp (std::streamoff(data_offset));
+
+      // Each slab is one layer of bricks.
+      boost::uint64_t position = data_offset;
+      std::vector<T> brick;
+      std::vector<char> encoded;
+      const size_t dx = dims[0];
+      const size_t dxy = dx * dims[1];
+      reader.ForEachSlab<T> (brick_size,
+        [&] (T* slab, int first_slice, int)
+        {
+          int bk = first_slice / brick_size;
+          for (int bj=0; bj<grid[1]; ++bj)
+            for (int bi=0; bi<grid[0]; ++bi)
+            {
+              tuplet<3,int> origin, bdims;
+              BrickBounds (dims, brick_size, bi, bj, bk, origin, bdims);
+              brick.resize (long_product (bdims));
+              T* b = &(brick[0]);
+              for (int k=0; k<bdims[2]; ++k)
+                for (int j=0; j<bdims[1]; ++j)
+                {
+                  const T* row = slab + k*dxy + (origin[1] + j)*dx + origin[0];
+                  b = std::copy (row, row + bdims[0], b);
+                }
+              BrickEntry& e = table[(size_t(bk)*grid[1] + bj)*grid[0] + bi];
+              e.codec = EncodeBrick (&(brick[0]), brick.size(), bdims[0], encoded);
+              e.offset = position;
+              e.size = boost::uint32_t (encoded.size());
+              f.write (&(encoded[0]), encoded.size());
+              position += encoded.size();
+            }
+        });
+
+      BufferWriter t;
+      for (size_t i=0; i<table.size(); ++i)
+      {
+        t.Integer (table[i].offset);
+        t.Integer (table[i].size);
+        t.Integer (table[i].codec);
+      }
+      f.seekp (std::streamoff(table_offset));
+      f.write (&(t.buffer[0]), t.buffer.size());
+    }
+    boost::filesystem::rename (temporary, filename);
+  }
+  catch (...)
+  {
+    boost::filesystem::remove (temporary, ec);
+    throw;
+  }
+}
+
+// ---------------------------------------------------------------------------
+void AimBrickFile::Create
+  (
+  AimFile& reader,
+  const std::string& filename,
+  int brick_size
+  )
+{
+  switch (reader.buffer_type)
+  {
+    case AimFile::AIMFILE_TYPE_CHAR:
+      CreateAny<char> (reader, filename, brick_size);
+      break;
+    case AimFile::AIMFILE_TYPE_SHORT:
+      CreateAny<short> (reader, filename, brick_size);
+      break;
+    case AimFile::AIMFILE_TYPE_FLOAT:
+      CreateAny<float> (reader, filename, brick_size);
+      break;
+    default:
+      throw_aimio_exception ("Unrecognized AIM data type.");
+  }
+}
+
+// ---------------------------------------------------------------------------
+void AimBrickFile::ReadImageInfo ()
+{
+  std::ifstream f (this->filename.c_str(), std::ios_base::in | std::ios_base::binary);
+  if (!f) {
+    throw_aimio_exception (std::string("Unable to open file ") + filename); }
+  f.exceptions ( std::ifstream::failbit | std::ifstream::badbit );
+
+  // Fixed part, up to the processing log length.
+  std::vector<char> buffer (8 + 3*4 + 3*3*4 + 3*4 + 8 + 8 + 4);
+  f.read (&(buffer[0]), buffer.size());
+  BufferReader r (buffer, "Brick file");
+  char magic[8];
+  r.Bytes (magic, 8);
+  if (strncmp (magic, brick_magic, 8) != 0) {
+    throw_aimio_exception (std::string("Not an AimIO brick file: ") + filename); }
+  if (r.Integer<boost::uint32_t>() != brick_format_version) {
+    throw_aimio_exception (std::string("Unsupported brick file version: ") + filename); }
+  this->buffer_type = AimFile::buffer_format_t (r.Integer<boost::uint32_t>());
+  this->brick_size = r.Integer<boost::int32_t>();
+  this->dimensions = r.Tuplet();
+  this->position = r.Tuplet();
+  this->offset = r.Tuplet();
+  for (int j=0; j<3; ++j)
+    { this->element_size[j] = r.Float(); }
+  this->source_size = r.Integer<boost::uint64_t>();
+  this->source_modification_time = std::time_t (r.Integer<boost::int64_t>());
+  aimio_verbose_assert (this->brick_size > 0, "Corrupt brick file.");
+
+  // Processing log and brick table.
+  boost::uint32_t log_length = r.Integer<boost::uint32_t>();
+  buffer.resize (log_length + 8);
+  f.read (&(buffer[0]), buffer.size());
+  this->processing_log.assign (&(buffer[0]), log_length);
+  BufferReader n_reader (buffer, "Brick file");
+  n_reader.position = log_length;
+  boost::uint64_t n = n_reader.Integer<boost::uint64_t>();
+  aimio_verbose_assert (n == boost::uint64_t(long_product (this->BrickGridDimensions())),
+    "Corrupt brick file.");
+
+  buffer.resize (n * brick_entry_size);
+  if (n)
+    { f.read (&(buffer[0]), buffer.size()); }
+  BufferReader t (buffer, "Brick file");
+  this->bricks.resize (n);
+  for (size_t i=0; i<n; ++i)
+  {
+    this->bricks[i].offset = t.Integer<boost::uint64_t>();
+    this->bricks[i].size = t.Integer<boost::uint32_t>();
+    this->bricks[i].codec = t.Integer<boost::uint8_t>();
+  }
+}
+
+// ---------------------------------------------------------------------------
+bool AimBrickFile::IsCurrent (const std::string& aim_filename) const
+{
+  boost::system::error_code ec;
+  boost::uintmax_t size = boost::filesystem::file_size (aim_filename, ec);
+  if (ec)
+    { return false; }
+  std::time_t mtime = boost::filesystem::last_write_time (aim_filename, ec);
+  if (ec)
+    { return false; }
+  return size == this->source_size && mtime == this->source_modification_time;
+}
+
+// ---------------------------------------------------------------------------
+template <typename T>
+void AimBrickFile::ReadAnyRegion
+  (
+  const tuplet<3,int>& start,
+  const tuplet<3,int>& extent,
+  T* data,
+  size_t size
+  )
+{
+  aimio_verbose_assert (!this->bricks.empty() || long_product (this->dimensions) == 0,
+    "ReadImageInfo must be called first.");
+  for (int d=0; d<3; ++d)
+  {
+    aimio_verbose_assert (start[d] >= 0 && extent[d] >= 0 &&
+                          start[d] + extent[d] <= this->dimensions[d],
+      "Region outside image.");
+  }
+  aimio_assert (size == long_product (extent));
+  if (size == 0)
+    { return; }
+
+  const tuplet<3,int> grid = this->BrickGridDimensions();
+  const tuplet<3,int> first = start / this->brick_size;
+  const tuplet<3,int> last = (start + extent - 1) / this->brick_size;
+
+  PositionalFile file (this->filename);
+  const size_t bricks_per_layer = size_t(last[0] - first[0] + 1) * (last[1] - first[1] + 1);
+  std::vector<size_t> brick_index (bricks_per_layer);
+  std::vector<size_t> encoded_offset (bricks_per_layer);
+  std::vector<ReadRequest> requests;
+  std::vector<char> encoded;
+  // A layer of bricks at a time, so that the encoded data of the entire
+  // region are not held at once.
+  for (int bk=first[2]; bk<=last[2]; ++bk)
+  {
+    // Read the encoded bricks of the layer in one batch. Bricks that are
+    // adjacent in the file are fetched with a single read.
+    size_t total = 0;
+    size_t n = 0;
+    for (int bj=first[1]; bj<=last[1]; ++bj)
+      for (int bi=first[0]; bi<=last[0]; ++bi)
+      {
+        brick_index[n] = (size_t(bk)*grid[1] + bj)*grid[0] + bi;
+        encoded_offset[n] = total;
+        total += this->bricks[brick_index[n]].size;
+        ++n;
+      }
+    encoded.resize (std::max<size_t> (total, 1));
+    requests.clear();
+    for (size_t b=0; b<n; ++b)
+    {
+      const BrickEntry& e = this->bricks[brick_index[b]];
+      if (!requests.empty() &&
+          requests.back().offset + requests.back().size == e.offset)
+        { requests.back().size += e.size; }
+      else
+      {
+        ReadRequest request;
+        request.file = &file;
+        request.buffer = &(encoded[0]) + encoded_offset[b];
+        request.size = e.size;
+        request.offset = e.offset;
+        requests.push_back (request);
+      }
+    }
+    GetBatchReader().Read (requests);
+    for (size_t r=0; r<requests.size(); ++r)
+    {
+      if (requests[r].failed) {
+        throw_aimio_exception (std::string("Error reading file ") + this->filename); }
+      if (requests[r].result != requests[r].size) {
+        throw_aimio_exception (std::string("Unexpected end of file ") + this->filename); }
+    }
+
+    // Decode the bricks in parallel. Each writes a separate part of data.
+    ParallelFor (n, [&] (size_t b)
+      {
+      size_t index = brick_index[b];
+      const BrickEntry& e = this->bricks[index];
+      int bi = int(index % grid[0]);
+      int bj = int((index / grid[0]) % grid[1]);
+      tuplet<3,int> origin, bdims;
+      BrickBounds (this->dimensions, this->brick_size, bi, bj, bk, origin, bdims);
+      std::vector<T> brick (long_product (bdims));
+      DecodeBrick (e.codec, &(encoded[0]) + encoded_offset[b], e.size, &(brick[0]), brick.size(), bdims[0]);
+
+      // Copy the overlap of brick and region.
+      tuplet<3,int> lo, hi;
+      for (int d=0; d<3; ++d)
+      {
+        lo[d] = std::max (start[d], origin[d]);
+        hi[d] = std::min (start[d] + extent[d], origin[d] + bdims[d]);
+      }
+      for (int z=lo[2]; z<hi[2]; ++z)
+        for (int y=lo[1]; y<hi[1]; ++y)
+        {
+          const T* src = &(brick[0]) + ((size_t(z - origin[2])*bdims[1] + (y - origin[1]))*bdims[0]
+                                        + (lo[0] - origin[0]));
+          T* dest = data + ((size_t(z - start[2])*extent[1] + (y - start[1]))*extent[0]
+                            + (lo[0] - start[0]));
+          std::copy (src, src + (hi[0] - lo[0]), dest);
+        }
+      });
+  }
+}
+
+// ---------------------------------------------------------------------------
+void AimBrickFile::ReadRegion (const tuplet<3,int>& start, const tuplet<3,int>& extent, char* data, size_t size)
+{
+  aimio_assert (this->buffer_type == AimFile::AIMFILE_TYPE_CHAR);
+  this->ReadAnyRegion (start, extent, data, size);
+}
+
+// ---------------------------------------------------------------------------
+void AimBrickFile::ReadRegion (const tuplet<3,int>& start, const tuplet<3,int>& extent, short* data, size_t size)
+{
+  aimio_assert (this->buffer_type == AimFile::AIMFILE_TYPE_SHORT);
+  this->ReadAnyRegion (start, extent, data, size);
+}
+
+// ---------------------------------------------------------------------------
+void AimBrickFile::ReadRegion (const tuplet<3,int>& start, const tuplet<3,int>& extent, float* data, size_t size)
+{
+  aimio_assert (this->buffer_type == AimFile::AIMFILE_TYPE_FLOAT);
+  this->ReadAnyRegion (start, extent, data, size);
+}
+
+// ---------------------------------------------------------------------------
+void AimBrickFile::ReadImageData (char* data, size_t size)
+{
+  this->ReadRegion (tuplet<3,int>(0,0,0), this->dimensions, data, size);
+}
+
+// ---------------------------------------------------------------------------
+void AimBrickFile::ReadImageData (short* data, size_t size)
+{
+  this->ReadRegion (tuplet<3,int>(0,0,0), this->dimensions, data, size);
+}
+
+// ---------------------------------------------------------------------------
+void AimBrickFile::ReadImageData (float* data, size_t size)
+{
+  this->ReadRegion (tuplet<3,int>(0,0,0), this->dimensions, data, size);
+}
+
+}  // namespace
@@ -0,0 +1,92 @@
+// Copyright (c) Eric Nodwell
+// See LICENSE for details.
+
+#include "AimIO/Calibration.h"
+#include "AimIO/ProcessingLog.h"
+#include "AimIO/Exception.h"
+#include <cstdlib>
+
+
+namespace AimIO
+{
+
+// ---------------------------------------------------------------------------
+Calibration::Calibration ()
+  :
+  mu_scaling (0),
+  mu_water (0),
+  density_slope (0),
+  density_intercept (0)
+{}
+
+// ---------------------------------------------------------------------------
+Calibration Calibration::FromProcessingLog (const std::string& log)
+{
+  LogFields fields = ParseProcessingLog (log);
+  Calibration calibration;
+  calibration.mu_scaling        = std::atof (fields["Mu_Scaling"].c_str());
+  calibration.mu_water          = std::atof (fields["HU: mu water"].c_str());
+  calibration.density_slope     = std::atof (fields["Density: slope"].c_str());
+  calibration.density_intercept = std::atof (fields["Density: intercept"].c_str());
+  calibration.density_unit      = fields["Density: unit"];
+  return calibration;
+}
+
+// ---------------------------------------------------------------------------
+void Calibration::GetLinearTransform
+  (
+  calibration_unit_t unit,
+  double& scale,
+  double& shift
+  ) const
+{
+  if (unit == CALIBRATION_NATIVE)
+  {
+    scale = 1;
+    shift = 0;
+    return;
+  }
+  aimio_verbose_assert (this->mu_scaling > 0, "Mu_Scaling unknown.");
+  double mu_scale = 1.0 / this->mu_scaling;
+  switch (unit)
+  {
+    case CALIBRATION_LINEAR_ATTENUATION:
+      scale = mu_scale;
+      shift = 0;
+      break;
+    case CALIBRATION_HU:
+      aimio_verbose_assert (this->mu_water > 0, "HU: mu water unknown.");
+      scale = 1000 * mu_scale / this->mu_water;
+      shift = -1000;
+      break;
+    case CALIBRATION_DENSITY:
+      aimio_verbose_assert (this->density_slope != 0, "Density calibration unknown.");
+      scale = this->density_slope * mu_scale;
+      shift = this->density_intercept;
+      break;
+    default:
+      throw_aimio_exception ("Unrecognized calibration unit.");
+  }
+}
+
+// ---------------------------------------------------------------------------
+void CalibrateData
+  (
+  const short* in,
+  float* out,
+  size_t n,
+  const Calibration& calibration,
+  calibration_unit_t unit
+  )
+{
+  double scale, shift;
+  calibration.GetLinearTransform (unit, scale, shift);
+  // Single precision with no aliasing between in and out, so that the
+  // compiler can vectorize this loop.
+  const float s = float(scale);
+  const float t = float(shift);
+  for (size_t i=0; i<n; ++i)
+    { out[i] = s * float(in[i]) + t; }
+}
+
+}  // namespace
@@ -0,0 +1,351 @@
+// Copyright (c) Eric Nodwell
+// See LICENSE for details.
+
+#include "AimIO/Catalog.h"
+#include "Parallel.h"
+#include "BinaryBuffer.h"
+#include <boost/filesystem.hpp>
+#include <boost/endian/conversion.hpp>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+
+using namespace boost::endian;
+
+namespace AimIO
+{
+
+// ===========================================================================
+// Catalog file format (all integers little endian):
+//
+//   char[8]   "AIMIOCAT"
+//   uint32    format version (currently 1)
+//   uint64    number of entries
+//   entries:
+//     string  path                 (uint32 length followed by bytes)
+//     uint8   format
+//     uint64  file_size
+//     int64   modification_time
+//     int32   version
+//     int32   aim_type
+//     int32   dimensions[3], position[3], offset[3]
+//     float32 element_size[3]      (IEEE, little endian)
+//     int64   byte_offset
+//     uint32  number of fields
+//     fields: string name, string value
+
+static const char* catalog_magic = "AIMIOCAT";
+static const boost::uint32_t catalog_format_version = 1;
+
+namespace
+{
+
+bool EntryPathLess (const CatalogEntry& a, const CatalogEntry& b)
+{
+  return a.path < b.path;
+}
+
+}  // anonymous namespace
+
+
+// ===========================================================================
+// CatalogEntry
+
+// ---------------------------------------------------------------------------
+CatalogEntry::CatalogEntry ()
+  :
+  format (HeaderRecord::FORMAT_UNKNOWN),
+  file_size (0),
+  modification_time (0),
+  version (AIMFILE_VERSION_30),
+  aim_type (AIMFILE_TYPE_D1Tundef),
+  dimensions (0,0,0),
+  position (0,0,0),
+  offset (0,0,0),
+  element_size (0,0,0),
+  byte_offset (0)
+  {}
+
+
+// ---------------------------------------------------------------------------
+std::string CatalogEntry::Field (const std::string& name) const
+{
+  LogFields::const_iterator it = this->fields.find (name);
+  if (it == this->fields.end())
+    { return std::string(); }
+  return it->second;
+}
+
+
+// ---------------------------------------------------------------------------
+double CatalogEntry::NumericField (const std::string& name, double default_value) const
+{
+  LogFields::const_iterator it = this->fields.find (name);
+  if (it == this->fields.end() || it->second.empty())
+    { return default_value; }
+  const char* begin = it->second.c_str();
+  char* end = 0;
+  double x = strtod (begin, &end);
+  if (end == begin)
+    { return default_value; }
+  return x;
+}
+
+
+// ---------------------------------------------------------------------------
+void MakeCatalogEntry (const HeaderRecord& record, CatalogEntry& entry)
+{
+  entry.path              = record.path;
+  entry.format            = record.format;
+  entry.file_size         = record.file_size;
+  entry.modification_time = record.modification_time;
+  entry.version           = record.version;
+  entry.aim_type          = record.aim_type;
+  entry.dimensions        = record.dimensions;
+  entry.position          = record.position;
+  entry.offset            = record.offset;
+  entry.element_size      = record.element_size;
+  entry.byte_offset       = record.byte_offset;
+  entry.fields.clear();
+  if (record.format == HeaderRecord::FORMAT_AIM)
+  {
+    entry.fields = ParseProcessingLog (record.processing_log);
+  }
+  else if (record.format == HeaderRecord::FORMAT_ISQ)
+  {
+    // Use the same names as ISQ_TO_AIM would write to the processing log.
+    std::ostringstream dim_p;
+    dim_p << record.dimensions[0] << " " << record.dimensions[1] << " " << record.dimensions[2];
+    entry.fields["Patient Name"]           = record.name;
+    entry.fields["Index Patient"]          = std::to_string (record.patient_index);
+    entry.fields["Index Measurement"]      = std::to_string (record.index_measurement);
+    entry.fields["Site"]                   = std::to_string (record.site);
+    entry.fields["Scanner ID"]             = std::to_string (record.scanner_id);
+    entry.fields["Scanner type"]           = std::to_string (record.scanner_type);
+    entry.fields["Mu_Scaling"]             = std::to_string (record.mu_scaling);
+    entry.fields["Original Creation-Date"] = record.creation_date_string;
+    entry.fields["Orig-ISQ-Dim-p"]         = dim_p.str();
+  }
+}
+
+
+// ===========================================================================
+// Catalog
+
+// ---------------------------------------------------------------------------
+Catalog::Catalog ()
+  {}
+
+
+// ---------------------------------------------------------------------------
+Catalog::Catalog (const char* fn)
+  :
+  filename (fn)
+  {}
+
+
+// ---------------------------------------------------------------------------
+void Catalog::Load ()
+{
+  std::ifstream f (this->filename.c_str(), std::ios_base::in | std::ios_base::binary);
+  if (!f) {
+    throw_aimio_exception (std::string("Unable to open file ") + filename); }
+  std::vector<char> buffer ((std::istreambuf_iterator<char>(f)),
+                            std::istreambuf_iterator<char>());
+
+  BufferReader r (buffer, "Catalog file");
+  char magic[8];
+  r.Bytes (magic, 8);
+  if (strncmp (magic, catalog_magic, 8) != 0) {
+    throw_aimio_exception (std::string("Not an AimIO catalog: ") + filename); }
+  if (r.Integer<boost::uint32_t>() != catalog_format_version) {
+    throw_aimio_exception (std::string("Unsupported catalog version: ") + filename); }
+
+  boost::uint64_t n = r.Integer<boost::uint64_t>();
+  std::vector<CatalogEntry> loaded;
+  loaded.reserve (std::min<boost::uint64_t> (n, buffer.size()));
+  for (boost::uint64_t i=0; i<n; ++i)
+  {
+    CatalogEntry e;
+    e.path              = r.String();
+    e.format            = HeaderRecord::file_format_t (r.Integer<boost::uint8_t>());
+    e.file_size         = r.Integer<boost::uint64_t>();
+    e.modification_time = std::time_t (r.Integer<boost::int64_t>());
+    e.version           = aim_version_t (r.Integer<boost::int32_t>());
+    e.aim_type          = aim_storage_format_t (r.Integer<boost::int32_t>());
+    e.dimensions        = r.Tuplet();
+    e.position          = r.Tuplet();
+    e.offset            = r.Tuplet();
+    for (int j=0; j<3; ++j)
+      { e.element_size[j] = r.Float(); }
+    e.byte_offset       = r.Integer<boost::int64_t>();
+    boost::uint32_t nfields = r.Integer<boost::uint32_t>();
+    for (boost::uint32_t j=0; j<nfields; ++j)
+    {
+      std::string name = r.String();
+      e.fields[name] = r.String();
+    }
+    loaded.push_back (e);
+  }
+  std::sort (loaded.begin(), loaded.end(), EntryPathLess);
+  this->entries.swap (loaded);
+}
+
+
+// ---------------------------------------------------------------------------
+void Catalog::Save () const
+{
+  BufferWriter w;
+  w.buffer.insert (w.buffer.end(), catalog_magic, catalog_magic + 8);
+  w.Integer (catalog_format_version);
+  w.Integer (boost::uint64_t(this->entries.size()));
+  for (size_t i=0; i<this->entries.size(); ++i)
+  {
+    const CatalogEntry& e = this->entries[i];
+    w.String (e.path);
+    w.Integer (boost::uint8_t(e.format));
+    w.Integer (boost::uint64_t(e.file_size));
+    w.Integer (boost::int64_t(e.modification_time));
+    w.Integer (boost::int32_t(e.version));
+    w.Integer (boost::int32_t(e.aim_type));
+    w.Tuplet (e.dimensions);
+    w.Tuplet (e.position);
+    w.Tuplet (e.offset);
+    for (int j=0; j<3; ++j)
+      { w.Float (e.element_size[j]); }
+    w.Integer (boost::int64_t(e.byte_offset));
+    w.Integer (boost::uint32_t(e.fields.size()));
+    for (LogFields::const_iterator it = e.fields.begin(); it != e.fields.end(); ++it)
+    {
+      w.String (it->first);
+      w.String (it->second);
+    }
+  }
+
+  std::string temporary = this->filename + ".tmp";
+  {
+    std::ofstream f (temporary.c_str(), std::ios_base::out | std::ios_base::binary);
+    if (!f) {
+      throw_aimio_exception (std::string("Unable to open file ") + temporary); }
+    f.exceptions ( std::ofstream::failbit | std::ofstream::badbit );
+    f.write (&(w.buffer[0]), w.buffer.size());
+  }
+  boost::filesystem::rename (temporary, this->filename);
+}
+
+
+// ---------------------------------------------------------------------------
+Catalog::RefreshStatistics Catalog::Refresh
+  (
+  const std::vector<std::string>& paths,
+  const ScanOptions& options
+  )
+{
+  RefreshStatistics stats;
+
+  // Sorted, unique list of paths.
+  std::vector<std::string> wanted (paths);
+  std::sort (wanted.begin(), wanted.end());
+  wanted.erase (std::unique (wanted.begin(), wanted.end()), wanted.end());
+
+  // Stat every file (concurrently, since on network file systems this is
+  // the dominant cost) and compare against the catalog.
+  std::vector<const CatalogEntry*> existing (wanted.size());
+  std::vector<char> changed (wanted.size(), 1);
+  std::function<void(size_t)> check = [&] (size_t i)
+    {
+    existing[i] = this->Find (wanted[i]);
+    if (!existing[i])
+      { return; }
+    boost::system::error_code ec;
+    boost::uintmax_t size = boost::filesystem::file_size (wanted[i], ec);
+    if (ec)
+      { return; }
+    std::time_t mtime = boost::filesystem::last_write_time (wanted[i], ec);
+    if (ec)
+      { return; }
+    changed[i] = (size != existing[i]->file_size ||
+                  mtime != existing[i]->modification_time);
+    };
+  ParallelFor (wanted.size(), check, options.number_of_threads);
+
+  std::vector<std::string> to_scan;
+  for (size_t i=0; i<wanted.size(); ++i)
+    if (changed[i])
+      { to_scan.push_back (wanted[i]); }
+  ScanOptions scan_options (options);
+  scan_options.read_processing_log = true;
+  std::vector<HeaderRecord> records = ScanHeaders (to_scan, scan_options);
+
+  // Merge: both wanted and records are in path order.
+  std::vector<CatalogEntry> refreshed;
+  refreshed.reserve (wanted.size());
+  size_t r = 0;
+  for (size_t i=0; i<wanted.size(); ++i)
+  {
+    if (!changed[i])
+    {
+      refreshed.push_back (*existing[i]);
+      ++stats.unchanged;
+      continue;
+    }
+    const HeaderRecord& record = records[r++];
+    if (!record.error.empty())
+    {
+      ++stats.failed;
+      continue;
+    }
+    refreshed.push_back (CatalogEntry());
+    MakeCatalogEntry (record, refreshed.back());
+    if (existing[i])
+      { ++stats.updated; }
+    else
+      { ++stats.added; }
+  }
+  stats.removed = this->entries.size() - stats.unchanged - stats.updated;
+  this->entries.swap (refreshed);
+  return stats;
+}
+
+
+// ---------------------------------------------------------------------------
+Catalog::RefreshStatistics Catalog::RefreshDirectory
+  (
+  const std::string& directory,
+  const ScanOptions& options
+  )
+{
+  return this->Refresh (ListImageFiles (directory, options.recursive), options);
+}
+
+
+// ---------------------------------------------------------------------------
+std::vector<CatalogEntry> Catalog::Query
+  (
+  const std::function<bool(const CatalogEntry&)>& predicate
+  ) const
+{
+  std::vector<CatalogEntry> result;
+  for (size_t i=0; i<this->entries.size(); ++i)
+    if (predicate (this->entries[i]))
+      { result.push_back (this->entries[i]); }
+  return result;
+}
+
+
+// ---------------------------------------------------------------------------
+const CatalogEntry* Catalog::Find (const std::string& path) const
+{
+  CatalogEntry key;
+  key.path = path;
+  std::vector<CatalogEntry>::const_iterator it =
+    std::lower_bound (this->entries.begin(), this->entries.end(), key, EntryPathLess);
+  if (it == this->entries.end() || it->path != path)
+    { return 0; }
+  return &(*it);
+}
+
+}  // namespace
@@ -3,9 +3,13 @@
 
 #include "Compression.h"
 #include "PlatformFloat.h"
+#include "Parallel.h"
 #include <boost/cstdint.hpp>
 #include <boost/endian/conversion.hpp>
 #include <cstring>
+#include <algorithm>
+#include <functional>
+#include <vector>
 
 using namespace boost::endian;
 
@@ -22,6 +26,214 @@ struct D1charCmp_t {
 };
 
 
+// Work is divided into parts of at least this many values for the thread pool.
+static const size_t parallel_grain = 1<<16;
+
+// Number of z slices in parallel_grain values.
+static size_t SliceGrain (tuplet<3,int> dim)
+{
+  return std::max (parallel_grain / std::max (size_t(dim[0])*dim[1], size_t(1)), size_t(1));
+}
+
+// D1TcharCmp and D1TbinCmp decompression, in two passes over the runs.
+// The first finds where each part of the runs starts in the output, and
+// the second fills in the values. Run lengths must be non-zero, and the
+// last run must be required to fill the output, as for sequential decoding.
+//
+// length(i) is the length of run i, and changes(i) whether the value
+// changes after run i (for D1TbinCmp). fill(i, pos, n, c) writes n values
+// of run i at pos, where c is the number of changes before run i.
+static void DecodeRuns
+  (
+  size_t number_of_runs,
+  size_t N,
+  const std::function<size_t(size_t)>& length,
+  const std::function<bool(size_t)>& changes,
+  const std::function<void(size_t, size_t, size_t, size_t)>& fill
+  )
+{
+  size_t parts = std::max (NumberOfParts (number_of_runs, parallel_grain/4), size_t(1));
+  std::vector<size_t> part_start (parts + 1, 0);
+  std::vector<size_t> part_changes (parts + 1, 0);
+  ParallelFor (parts, [&] (size_t p)
+    {
+    size_t begin, end;
+    PartRange (p, parts, number_of_runs, begin, end);
+    size_t total = 0;
+    size_t count = 0;
+    for (size_t i=begin; i<end; ++i)
+    {
+      size_t l = length (i);
+      aimio_verbose_assert (l != 0, "Corrupt compressed data: zero run length.");
+      total += l;
+      count += changes (i);
+    }
+    part_start[p+1] = total;
+    part_changes[p+1] = count;
+    });
+  for (size_t p=0; p<parts; ++p)
+  {
+    part_start[p+1] += part_start[p];
+    part_changes[p+1] += part_changes[p];
+  }
+  aimio_verbose_assert (part_start[parts] >= N &&
+                        (number_of_runs == 0 || part_start[parts] - length (number_of_runs-1) < N),
+    "Compressed data does not match image size.");
+
+  ParallelFor (parts, [&] (size_t p)
+    {
+    size_t begin, end;
+    PartRange (p, parts, number_of_runs, begin, end);
+    size_t pos = part_start[p];
+    size_t count = part_changes[p];
+    for (size_t i=begin; i<end && pos<N; ++i)
+    {
+      size_t l = length (i);
+      fill (i, pos, std::min (l, N - pos), count);
+      pos += l;
+      count += changes (i);
+    }
+    });
+}
+
+// Divides [0,N) of raw into parts, each starting where the value changes,
+// so that each part can be run-length encoded independently with the same
+// result as encoding the whole.
+static std::vector<size_t> RunAlignedParts (const char* raw, size_t N)
+{
+  size_t parts = std::max (NumberOfParts (N, parallel_grain), size_t(1));
+  std::vector<size_t> boundary (parts + 1, N);
+  boundary[0] = 0;
+  for (size_t p=1; p<parts; ++p)
+  {
+    size_t b = std::max (p*N/parts, boundary[p-1]);
+    while (b > 0 && b < N && raw[b] == raw[b-1])
+      { ++b; }
+    boundary[p] = b;
+  }
+  return boundary;
+}
+
+// D1TcharCmp encoding of raw[begin,end). If first, this is the start of the
+// image, which starts with the field (0,0).
+static void EncodeCharCmpPart (const char* raw, const char* raw_end, bool first, std::vector<char>& out)
+{
+  if (!first && raw == raw_end)
+    { return; }
+  D1charCmp_t current_field (first ? 0 : *raw, 0);
+  while (raw != raw_end)
+  {
+    if (*raw == current_field.value)
+    {
+      if (current_field.length == 255)
+      {
+        out.push_back (current_field.value);
+        out.push_back (char(current_field.length));
+        current_field.length = 1;
+      }
+      else
+      {
+        ++(current_field.length);
+      }
+    }
+    else
+    {
+      out.push_back (current_field.value);
+      out.push_back (char(current_field.length));
+      current_field.value = *raw;
+      current_field.length = 1;
+    }
+    ++raw;
+  }
+  out.push_back (current_field.value);
+  out.push_back (char(current_field.length));
+}
+
+// D1TbinCmp encoding of raw[begin,end), as for EncodeCharCmpPart.
+static void EncodeBinCmpPart (const char* raw, const char* raw_end, bool first, char value_1, std::vector<char>& out)
+{
+  if (!first && raw == raw_end)
+    { return; }
+  char current_value = first ? value_1 : *raw;
+  unsigned char current_length = 0;
+  while (raw != raw_end)
+  {
+    if (*raw == current_value)
+    {
+      if (current_length == 254)
+      {
+        out.push_back (char(255));   /* 255 means 254 and don't change value */
+        current_length = 1;
+      }
+      else
+      {
+        ++current_length;
+      }
+    }
+    else
+    {
+      out.push_back (char(current_length));
+      current_value = *raw;
+      current_length = 1;
+    }
+    ++raw;
+  }
+  out.push_back (char(current_length));
+}
+
+// Encodes the parts in parallel, and returns the total size.
+static size_t EncodeParts
+  (
+  const char* raw,
+  size_t N,
+  const std::function<void(const char*, const char*, bool, std::vector<char>&)>& encode,
+  std::vector<std::vector<char> >& encoded
+  )
+{
+  std::vector<size_t> boundary = RunAlignedParts (raw, N);
+  size_t parts = boundary.size() - 1;
+  encoded.assign (parts, std::vector<char>());
+  ParallelFor (parts, [&] (size_t p)
+    { encode (raw + boundary[p], raw + boundary[p+1], p == 0, encoded[p]); });
+  size_t total = 0;
+  for (size_t p=0; p<parts; ++p)
+    { total += encoded[p].size(); }
+  return total;
+}
+
+static void AppendBytes (std::vector<char>& out, const void* data, size_t size)
+{
+  const char* d = reinterpret_cast<const char*>(data);
+  out.insert (out.end(), d, d + size);
+}
+
+static void WriteParts (std::ostream& out, const std::vector<std::vector<char> >& encoded)
+{
+  for (size_t p=0; p<encoded.size(); ++p)
+    if (!encoded[p].empty())
+      { out.write (&(encoded[p][0]), encoded[p].size()); }
+}
+
+// Converts N values in blocks and writes them, so that no copy of the
+// entire data is required.
+template <typename T>
+static void ConvertAndWrite (std::ostream& out, const T* in, size_t N, T (*convert)(T))
+{
+  const size_t block = 1<<20;
+  std::vector<T> buffer (std::min (N, block));
+  for (size_t b=0; b<N; b+=block)
+  {
+    size_t n = std::min (block, N - b);
+    ParallelForRange (n, parallel_grain, [&] (size_t begin, size_t end)
+      {
+      for (size_t i=begin; i<end; ++i)
+        { buffer[i] = convert (in[b+i]); }
+      });
+    out.write (reinterpret_cast<const char*>(&(buffer[0])), n*sizeof(T));
+  }
+}
+
+
 void Decompress
   (
   void* void_out,
@@ -78,149 +290,314 @@ void DecompressNoOffset
   if (type == AIMFILE_TYPE_D3Tbit8)
   {
     const unsigned char* compressed = reinterpret_cast<const unsigned char*>(void_in);
-    const unsigned char* compressed_end = compressed + compressed_size;
-    char* raw = reinterpret_cast<char*>(void_out);
 
     tuplet<3,int> c_dim = (dim + 1)/2;
     n88_assert (compressed_size == long_product(c_dim)+1);
 
     char value = compressed[long_product(c_dim)];
 
-    for (size_t k_r=0; k_r<dim[2]; ++k_r)
-    {
-      size_t k_c = k_r/2;
-      for (size_t j_r=0; j_r<dim[1]; ++j_r)
-          {
-        size_t j_c = j_r/2;
-        for (size_t i_r=0; i_r<dim[0]; ++i_r)
+    // Slices are independent.
+    ParallelForRange (dim[2], SliceGrain (dim), [&] (size_t k_begin, size_t k_end)
+      {
+      char* raw = reinterpret_cast<char*>(void_out) + k_begin*dim[0]*dim[1];
+      for (size_t k_r=k_begin; k_r<k_end; ++k_r)
+      {
+        size_t k_c = k_r/2;
+        for (size_t j_r=0; j_r<dim[1]; ++j_r)
         {
-          size_t i_c = i_r/2;
-          const unsigned char* c = compressed + i_c + c_dim[0]*(j_c + c_dim[1]*k_c);
-          int bit_pos = (k_r%2)*4 + (j_r%2)*2 + (i_r%2);
-          *raw = (*c & (1<<bit_pos)) != 0 ? value : 0 ;
-          ++raw;
+          size_t j_c = j_r/2;
+          for (size_t i_r=0; i_r<dim[0]; ++i_r)
+          {
+            size_t i_c = i_r/2;
+            const unsigned char* c = compressed + i_c + c_dim[0]*(j_c + c_dim[1]*k_c);
+            int bit_pos = (k_r%2)*4 + (j_r%2)*2 + (i_r%2);
+            *raw = (*c & (1<<bit_pos)) != 0 ? value : 0 ;
+            ++raw;
+          }
         }
       }
-    }
+      });
   }
 
   else if (type == AIMFILE_TYPE_D1TcharCmp)
   {
-    const D1charCmp_t* compressed = reinterpret_cast<const D1charCmp_t*>(void_in);
-    const D1charCmp_t* compressed_end = reinterpret_cast<const D1charCmp_t*>(
-      reinterpret_cast<const char*>(compressed) + compressed_size);
-    compressed += encode_64bit ? 4 : 2;
+    size_t header_size = (encode_64bit ? 4 : 2) * sizeof(D1charCmp_t);
+    n88_assert (compressed_size >= header_size && (compressed_size - header_size) % sizeof(D1charCmp_t) == 0);
+    const D1charCmp_t* compressed = reinterpret_cast<const D1charCmp_t*>(
+      reinterpret_cast<const char*>(void_in) + header_size);
+    size_t number_of_runs = (compressed_size - header_size) / sizeof(D1charCmp_t);
 
-    unsigned char current_length = 0;
-    char current_value = 0;
+    char* raw = reinterpret_cast<char*>(void_out);
+    DecodeRuns (number_of_runs,
+                long_product (dim),
+                [&] (size_t i) { return size_t(compressed[i].length); },
+                [] (size_t) { return false; },
+                [&] (size_t i, size_t pos, size_t n, size_t)
+                  { memset (raw + pos, compressed[i].value, n); });
+  }
 
+  else if (type == AIMFILE_TYPE_D1TbinCmp)
+  {
+    size_t header_size = encode_64bit ? 8 : 4;
+    n88_assert (compressed_size >= header_size + 2);
+    char value_1 = reinterpret_cast<const char*>(void_in)[header_size];
+    char value_2 = reinterpret_cast<const char*>(void_in)[header_size + 1];
+    const unsigned char* compressed = reinterpret_cast<const unsigned char*>(void_in) + header_size + 2;
+    size_t number_of_runs = compressed_size - header_size - 2;
+
+    // A length of 255 means 254 without a change of value afterwards.
     char* raw = reinterpret_cast<char*>(void_out);
-    char* raw_end = raw + long_product (dim);
-    while (raw != raw_end)
-    {
-      if (current_length == 0)
+    DecodeRuns (number_of_runs,
+                long_product (dim),
+                [&] (size_t i) { return size_t(compressed[i] == 255 ? 254 : compressed[i]); },
+                [&] (size_t i) { return compressed[i] != 255; },
+                [&] (size_t, size_t pos, size_t n, size_t c)
+                  { memset (raw + pos, (c % 2) ? value_2 : value_1, n); });
+  }
+
+  else if (type == AIMFILE_TYPE_D1Tchar)
+  {
+    memcpy (void_out, void_in, long_product(dim) * sizeof(char));
+  }
+
+  else if (type == AIMFILE_TYPE_D1Tshort)
+  {
+    const short* in = reinterpret_cast<const short*>(void_in);
+    short* out = reinterpret_cast<short*>(void_out);
+    ParallelForRange (long_product(dim), parallel_grain, [&] (size_t begin, size_t end)
       {
-        n88_assert (compressed < compressed_end);
-        current_length = compressed->length;
-        current_value = compressed->value;
-        ++compressed;
-      }
-      n88_assert (current_length);
-      *raw = current_value;
-      --current_length;
-      ++raw;
-    }
-    n88_assert (compressed == compressed_end);
+      for (size_t i=begin; i<end; ++i)
+        { out[i] = little_to_native (in[i]); }
+      });
+  }
+
+  else if (type == AIMFILE_TYPE_D1Tfloat)
+  {
+    const float* in = reinterpret_cast<const float*>(void_in);
+    float* out = reinterpret_cast<float*>(void_out);
+    ParallelForRange (long_product(dim), parallel_grain, [&] (size_t begin, size_t end)
+      {
+      for (size_t i=begin; i<end; ++i)
+        { out[i] = vms_to_native (in[i]); }
+      });
   }
 
+  else
+  {
+    throw_aimio_exception ("Unrecognized AIM data type.");
+  }
+}
+
+
+SliceDecompressor::SliceDecompressor
+  (
+  const void* in,
+  size_t compressed_size,
+  aim_storage_format_t type_,
+  tuplet<3,int> dim_,
+  tuplet<3,int> off_,
+  bool encode_64bit
+  )
+  :
+  compressed (reinterpret_cast<const unsigned char*>(in)),
+  compressed_begin (reinterpret_cast<const unsigned char*>(in)),
+  compressed_end (reinterpret_cast<const unsigned char*>(in) + compressed_size),
+  window_offset (0),
+  type (type_),
+  dim (dim_),
+  off (off_),
+  next_slice (0),
+  current_length (0),
+  current_value (0),
+  value_1 (0),
+  value_2 (0),
+  is_value_1 (true),
+  change_value (false)
+{
+  if (type == AIMFILE_TYPE_D3Tbit8)
+  {
+    // As for Decompress, the offset is not used for this type.
+    this->off = tuplet<3,int>(0,0,0);
+    n88_assert (compressed_size == long_product((dim + 1)/2)+1);
+  }
+  else if (type == AIMFILE_TYPE_D1TcharCmp)
+  {
+    this->compressed += (encode_64bit ? 4 : 2) * sizeof(D1charCmp_t);
+  }
   else if (type == AIMFILE_TYPE_D1TbinCmp)
   {
-    const unsigned char* compressed = reinterpret_cast<const unsigned char*>(void_in);
-    const unsigned char* compressed_end = compressed + compressed_size;
+    int header_size = encode_64bit ? 8 : 4;
+    n88_assert (compressed_size >= header_size + 2);
+    this->value_1 = this->compressed[header_size];
+    this->value_2 = this->compressed[header_size + 1];
+    this->current_value = this->value_1;
+    this->compressed += header_size + 2;
+  }
+  else
+  {
+    throw_aimio_exception ("Unsupported type for slice decompression.");
+  }
+}
 
-    char value_1;
-    char value_2;
-    if (encode_64bit)
-    {
-      value_1 = reinterpret_cast<const char*>(void_in)[8];
-      value_2 = reinterpret_cast<const char*>(void_in)[9];
-      compressed += 10;
-    }
-    else
-    {
-      value_1 = reinterpret_cast<const char*>(void_in)[4];
-      value_2 = reinterpret_cast<const char*>(void_in)[5];
-      compressed += 6;
-    }
 
-    unsigned char current_length = 0;
-    bool change_value = false;
+SliceDecompressor::SliceDecompressor
+  (
+  const void* window,
+  size_t window_size,
+  aim_storage_format_t type_,
+  tuplet<3,int> dim_,
+  tuplet<3,int> off_,
+  int first_slice,
+  const AimSeekIndex::Checkpoint& state
+  )
+  :
+  compressed (reinterpret_cast<const unsigned char*>(window)),
+  compressed_begin (reinterpret_cast<const unsigned char*>(window)),
+  compressed_end (reinterpret_cast<const unsigned char*>(window) + window_size),
+  window_offset (state.offset),
+  type (type_),
+  dim (dim_),
+  off (off_),
+  next_slice (first_slice),
+  current_length (state.length),
+  current_value (state.value),
+  value_1 (state.value_1),
+  value_2 (state.value_2),
+  is_value_1 (state.is_value_1),
+  change_value (state.change_value)
+{
+  if (type != AIMFILE_TYPE_D1TcharCmp && type != AIMFILE_TYPE_D1TbinCmp)
+  {
+    throw_aimio_exception ("Unsupported type for resumed slice decompression.");
+  }
+}
+
 
-    char current_value = value_1;
-    bool is_value_1 = true;
+AimSeekIndex::Checkpoint SliceDecompressor::GetState () const
+{
+  AimSeekIndex::Checkpoint state;
+  state.offset = this->window_offset + (this->compressed - this->compressed_begin);
+  state.length = this->current_length;
+  state.value = this->current_value;
+  state.value_1 = this->value_1;
+  state.value_2 = this->value_2;
+  state.is_value_1 = this->is_value_1;
+  state.change_value = this->change_value;
+  return state;
+}
 
-    char* raw = reinterpret_cast<char*>(void_out);
-    char* raw_end = raw + long_product (dim);
-    while (raw != raw_end)
+
+void SliceDecompressor::SetRefill
+  (
+  size_t available,
+  const std::function<size_t(size_t)>& refill_
+  )
+{
+  n88_assert (this->type != AIMFILE_TYPE_D3Tbit8);
+  n88_assert (this->compressed_begin + available >= this->compressed);
+  this->compressed_end = std::min (this->compressed_end, this->compressed_begin + available);
+  this->refill = refill_;
+}
+
+
+void SliceDecompressor::DecodeRun (char* raw, size_t n)
+{
+  const size_t record_size = (this->type == AIMFILE_TYPE_D1TcharCmp) ? sizeof(D1charCmp_t) : 1;
+  while (n)
+  {
+    if (this->current_length == 0)
     {
-      if (current_length == 0)
+      if (this->refill && this->compressed + record_size > this->compressed_end)
       {
-        if (change_value)
+        size_t needed = (this->compressed - this->compressed_begin) + record_size;
+        this->compressed_end = this->compressed_begin + this->refill (needed);
+      }
+      aimio_verbose_assert (this->compressed + record_size <= this->compressed_end, "Compressed data truncated.");
+      if (this->type == AIMFILE_TYPE_D1TcharCmp)
+      {
+        const D1charCmp_t* c = reinterpret_cast<const D1charCmp_t*>(this->compressed);
+        this->current_length = c->length;
+        this->current_value = c->value;
+        this->compressed += sizeof(D1charCmp_t);
+      }
+      else
+      {
+        if (this->change_value)
         {
-          is_value_1 = !is_value_1;
-          current_value = is_value_1 ? value_1 : value_2;
+          this->is_value_1 = !this->is_value_1;
+          this->current_value = this->is_value_1 ? this->value_1 : this->value_2;
         }
-        n88_assert (compressed < compressed_end);
-        current_length = *compressed;
-        if (current_length == 255)
+        this->current_length = *this->compressed;
+        if (this->current_length == 255)
         {
-          current_length = 254;
-          change_value = false;
+          this->current_length = 254;
+          this->change_value = false;
         }
         else
         {
-          change_value = true;
+          this->change_value = true;
         }
-        ++compressed;
+        ++this->compressed;
       }
-      n88_assert (current_length);
-      *raw = current_value;
-      --current_length;
-      ++raw;
     }
-    n88_assert (compressed == compressed_end);
+    n88_assert (this->current_length);
+    size_t count = std::min (size_t(this->current_length), n);
+    if (raw)
+    {
+      memset (raw, this->current_value, count);
+      raw += count;
+    }
+    n -= count;
+    this->current_length -= count;
   }
+}
 
-  else if (type == AIMFILE_TYPE_D1Tchar)
-  {
-    memcpy (void_out, void_in, long_product(dim) * sizeof(char));
-  }
 
-  else if (type == AIMFILE_TYPE_D1Tshort)
+void SliceDecompressor::Next (char* out, int number_of_slices)
+{
+  n88_assert (this->next_slice + number_of_slices <= this->dim[2]);
+  const size_t dx = this->dim[0];
+  const size_t dxy = dx * this->dim[1];
+  for (int s=0; s<number_of_slices; ++s, ++this->next_slice)
   {
-    const short* in = reinterpret_cast<const short*>(void_in);
-    short* out = reinterpret_cast<short*>(void_out);
-    size_t N = long_product(dim);
-    for (size_t i=0; i<N; ++i)
+    char* slice = out ? out + s*dxy : 0;
+    size_t k_r = this->next_slice;
+
+    if (this->type == AIMFILE_TYPE_D3Tbit8)
     {
-      out[i] = little_to_native (in[i]);
+      if (!slice)
+        { continue; }
+      tuplet<3,int> c_dim = (this->dim + 1)/2;
+      const unsigned char* layer = this->compressed_begin + size_t(c_dim[0])*c_dim[1]*(k_r/2);
+      char value = this->compressed_begin[long_product(c_dim)];
+      for (size_t j_r=0; j_r<this->dim[1]; ++j_r)
+      {
+        const unsigned char* row = layer + c_dim[0]*(j_r/2);
+        int bit_base = (k_r%2)*4 + (j_r%2)*2;
+        for (size_t i_r=0; i_r<dx; ++i_r)
+        {
+          int bit_pos = bit_base + (i_r%2);
+          slice[j_r*dx + i_r] = (row[i_r/2] & (1<<bit_pos)) != 0 ? value : 0;
+        }
+      }
     }
-  }
 
-  else if (type == AIMFILE_TYPE_D1Tfloat)
-  {
-    const float* in = reinterpret_cast<const float*>(void_in);
-    float* out = reinterpret_cast<float*>(void_out);
-    size_t N = long_product(dim);
-    for (size_t i=0; i<N; ++i)
+    else if (this->off == tuplet<3,int>(0,0,0))
     {
-      out[i] = vms_to_native (in[i]);
+      this->DecodeRun (slice, dxy);
     }
-  }
 
-  else
-  {
-    throw_aimio_exception ("Unrecognized AIM data type.");
+    else
+    {
+      // The compressed stream excludes the offset region.
+      if (slice)
+        { memset (slice, 0, dxy); }
+      if (k_r >= this->off[2] && k_r < this->dim[2] - this->off[2])
+      {
+        for (size_t j=this->off[1]; j<this->dim[1]-this->off[1]; ++j)
+          { this->DecodeRun (slice ? slice + j*dx + this->off[0] : 0, dx - 2*this->off[0]); }
+      }
+    }
   }
 }
 
@@ -233,97 +610,106 @@ void RestoreOffset
   tuplet<3,int> off
   )
 {
-  // Zero output
-  size_t N = long_product (dim);
-  for (size_t i=0; i<N; ++i)
-    { out[i] = 0; }
-
-  for (size_t k=off[2]; k<dim[2]-off[2]; ++k)
-    for (size_t j=off[1]; j<dim[1]-off[1]; ++j)
-      for (size_t i=off[0]; i<dim[0]-off[0]; ++i)
+  // Slices are independent.
+  const size_t dx = dim[0];
+  const size_t dxy = dx * dim[1];
+  if (dim[0] <= 2*off[0] || dim[1] <= 2*off[1] || dim[2] <= 2*off[2])
+  {
+    memset (out, 0, long_product (dim));
+    return;
+  }
+  const size_t in_row = dim[0] - 2*off[0];
+  const size_t in_slice = in_row * (dim[1] - 2*off[1]);
+  ParallelForRange (dim[2], SliceGrain (dim), [&] (size_t k_begin, size_t k_end)
+    {
+    for (size_t k=k_begin; k<k_end; ++k)
+    {
+      char* slice = out + k*dxy;
+      memset (slice, 0, dxy);
+      if (k < size_t(off[2]) || k >= size_t(dim[2]-off[2]))
+        { continue; }
+      const char* in_k = in + (k - off[2])*in_slice;
+      for (size_t j=off[1]; j<dim[1]-off[1]; ++j)
       {
-        out[(k*dim[1]+j)*dim[0]+i] = *in;
-        ++in;
+        memcpy (slice + j*dx + off[0], in_k, in_row);
+        in_k += in_row;
       }
+    }
+    });
 }
 
 
-void Compress
+// ---------------------------------------------------------------------------
+Encoder::Encoder
   (
-  std::ostream& out,
   const void* void_in,
-  aim_storage_format_t type,
-  tuplet<3,int> dim,
+  aim_storage_format_t type_,
+  tuplet<3,int> dim_,
   bool encode_64bit
   )
+  :
+  in (void_in),
+  type (type_),
+  dim (dim_),
+  size (0)
 {
 
   if (type == AIMFILE_TYPE_D3Tbit8)
   {
     tuplet<3,int> c_dim = (dim + 1)/2;
 
-    const char* raw  = reinterpret_cast<const char*>(void_in);
-    std::vector<unsigned char> buffer (long_product(c_dim)+1);
-    for (size_t i=0; i<buffer.size(); ++i)
-      { buffer[i] = 0; }
-    unsigned char* compressed = &(buffer[0]);
+    const char* raw_begin = reinterpret_cast<const char*>(void_in);
+    this->encoded.assign (1, std::vector<char> (long_product(c_dim)+1, 0));
+    unsigned char* compressed = reinterpret_cast<unsigned char*>(&(this->encoded[0][0]));
 
-    char value = 0;
-    for (size_t k_r=0; k_r<dim[2]; ++k_r)
-    {
-      size_t k_c = k_r/2;
-      for (size_t j_r=0; j_r<dim[1]; ++j_r)
+    // Each compressed layer is made from two slices, and can be done
+    // independently. The value is the last non-zero value of the image,
+    // so the last non-zero value of each layer is recorded.
+    std::vector<char> layer_value (c_dim[2], 0);
+    std::vector<char> layer_has_value (c_dim[2], 0);
+    ParallelForRange (c_dim[2], std::max (SliceGrain (dim)/2, size_t(1)), [&] (size_t kc_begin, size_t kc_end)
       {
-        size_t j_c = j_r/2;
-        for (size_t i_r=0; i_r<dim[0]; ++i_r)
+      for (size_t k_c=kc_begin; k_c<kc_end; ++k_c)
+      {
+        size_t k_r_end = std::min (2*k_c + 2, size_t(dim[2]));
+        const char* raw = raw_begin + 2*k_c*dim[0]*dim[1];
+        for (size_t k_r=2*k_c; k_r<k_r_end; ++k_r)
         {
-          size_t i_c = i_r/2;
-          if (*raw)
+          for (size_t j_r=0; j_r<dim[1]; ++j_r)
           {
-            unsigned char* c = compressed + i_c + c_dim[0]*(j_c + c_dim[1]*k_c);
-            int bit_pos = (k_r%2)*4 + (j_r%2)*2 + (i_r%2);
-            *c += 1<<bit_pos;
-            value = *raw;
+            size_t j_c = j_r/2;
+            for (size_t i_r=0; i_r<dim[0]; ++i_r)
+            {
+              size_t i_c = i_r/2;
+              if (*raw)
+              {
+                unsigned char* c = compressed + i_c + c_dim[0]*(j_c + c_dim[1]*k_c);
+                int bit_pos = (k_r%2)*4 + (j_r%2)*2 + (i_r%2);
+                *c += 1<<bit_pos;
+                layer_value[k_c] = *raw;
+                layer_has_value[k_c] = 1;
+              }
+              ++raw;
+            }
           }
-          ++raw;
         }
       }
-    }
+      });
+    char value = 0;
+    for (size_t k_c=0; k_c<layer_value.size(); ++k_c)
+      if (layer_has_value[k_c])
+        { value = layer_value[k_c]; }
     compressed[long_product(c_dim)] = value;
-    out.write (reinterpret_cast<char*>(&(buffer[0])), buffer.size());
+    this->size = this->encoded[0].size();
   }
 
   else if (type == AIMFILE_TYPE_D1TcharCmp)
   {
-
-    char current_value = 0;
-    unsigned char current_length = 0;
-    size_t count = 1;
-
+    // Encode parts of the image in parallel; they are concatenated,
+    // following a header part.
     const char* raw = reinterpret_cast<const char*>(void_in);
-    const char* raw_end = raw + long_product (dim);
-    while (raw != raw_end)
-    {
-      if (*raw == current_value)
-      {
-        if (current_length == 255)
-        {
-          ++count;
-          current_length = 1;
-        }
-        else
-        {
-          ++current_length;
-        }
-      }
-      else
-      {
-        current_value = *raw;
-        current_length = 1;
-        ++count;
-      }
-      ++raw;
-    }
+    std::vector<std::vector<char> > parts;
+    size_t count = EncodeParts (raw, long_product (dim), EncodeCharCmpPart, parts) / sizeof(D1charCmp_t);
 
     size_t mem_size = 0;
     if (encode_64bit)
@@ -339,101 +725,61 @@ void Compress
       }
     }
 
+    std::vector<char> header;
     if (encode_64bit)
     {
       size_t ms = mem_size;
       native_to_little_inplace(ms);
-      out.write (reinterpret_cast<char*>(&ms), sizeof(size_t));
+      AppendBytes (header, &ms, sizeof(size_t));
     }
     else
     {
 	    boost::int32_t ms = mem_size;
       native_to_little_inplace(ms);
-      out.write (reinterpret_cast<char*>(&ms), sizeof(boost::int32_t));
+      AppendBytes (header, &ms, sizeof(boost::int32_t));
     }
 
-    D1charCmp_t current_field (0,0);
-    raw = reinterpret_cast<const char*>(void_in);
-    while (raw != raw_end)
-    {
-      if (*raw == current_field.value)
-      {
-        if (current_field.length == 255)
-        {
-          out.write (reinterpret_cast<char*>(&current_field), sizeof(D1charCmp_t));
-          current_field.length = 1;
-        }
-        else
-        {
-          ++(current_field.length);
-        }
-      }
-      else
-      {
-        out.write (reinterpret_cast<char*>(&current_field), sizeof(D1charCmp_t));
-        current_field.value = *raw;
-        current_field.length = 1;
-      }
-      ++raw;
-    }
-
-    out.write (reinterpret_cast<char*>(&current_field), sizeof(D1charCmp_t));
+    this->SetParts (header, parts);
   }
 
   else if (type == AIMFILE_TYPE_D1TbinCmp)
   {
-    // Determine the two values.
+    // Determine the two values: value_2 is the first value different from
+    // value_1, and no other values may occur.
     const char* raw  = reinterpret_cast<const char*>(void_in);
+    const size_t N = long_product (dim);
     char value_1 = raw[0];
-    bool value_2_found = false;
-    char value_2 = 0;
-
-    const char* raw_end = raw + long_product (dim);
-    while (raw != raw_end)
-    {
-      if (*raw != value_1)
+    size_t parts = std::max (NumberOfParts (N, parallel_grain), size_t(1));
+    std::vector<size_t> first_other (parts, N);
+    ParallelFor (parts, [&] (size_t p)
       {
-        if (!value_2_found)
+      size_t begin, end;
+      PartRange (p, parts, N, begin, end);
+      for (size_t i=begin; i<end; ++i)
+        if (raw[i] != value_1)
         {
-          value_2 = *raw;
-          value_2_found = true;
+          first_other[p] = i;
+          break;
         }
-        else if (*raw != value_2)
+      });
+    size_t value_2_index = *std::min_element (first_other.begin(), first_other.end());
+    char value_2 = value_2_index < N ? raw[value_2_index] : 0;
+    ParallelForRange (N, parallel_grain, [&] (size_t begin, size_t end)
+      {
+      for (size_t i=begin; i<end; ++i)
+        if (raw[i] != value_1 && raw[i] != value_2)
         {
           throw_aimio_exception ("D1TbinCmp compression only supports 2 values. 3 or more values in image.");
         }
-      }
-      ++raw;
-    }
+      });
 
-    //  Count fields
-
-    char current_value = value_1;
-    unsigned char current_length = 0;
-    size_t count = 1;
-    raw = reinterpret_cast<const char*>(void_in);
-    while (raw != raw_end)
-    {
-      if (*raw == current_value)
-      {
-        if (current_length == 254)
-        {
-          ++count;
-          current_length = 1; 
-        }
-        else
-        {
-          ++current_length;
-        }
-      }
-      else
-      {
-        current_value = *raw;
-        current_length = 1;
-        ++count;
-      }
-      ++raw;
-    }
+    // Encode parts of the image in parallel; they are concatenated,
+    // following a header part.
+    std::vector<std::vector<char> > encoded_parts;
+    size_t count = EncodeParts (raw, N,
+      [value_1] (const char* begin, const char* end, bool first, std::vector<char>& part)
+        { EncodeBinCmpPart (begin, end, first, value_1, part); },
+      encoded_parts);
 
     size_t mem_size = 0;
     if (encode_64bit)
@@ -449,79 +795,38 @@ void Compress
       }
     }
     
+    std::vector<char> header;
     if (encode_64bit)
     {
       boost::int64_t ms = mem_size;
       native_to_little_inplace(ms);
-      out.write (reinterpret_cast<char*>(&ms), sizeof(boost::int64_t));
-      out.write (&value_1, sizeof(char));
-      out.write (&value_2, sizeof(char));
+      AppendBytes (header, &ms, sizeof(boost::int64_t));
     }
     else
     {
       boost::int32_t ms = mem_size;
       native_to_little_inplace(ms);
-      out.write (reinterpret_cast<char*>(&ms), sizeof(boost::int32_t));
-      out.write (&value_1, sizeof(char));
-      out.write (&value_2, sizeof(char));
+      AppendBytes (header, &ms, sizeof(boost::int32_t));
     }
-    current_value = value_1;
-    current_length = 0;
+    header.push_back (value_1);
+    header.push_back (value_2);
 
-    raw = reinterpret_cast<const char*>(void_in);
-    while (raw != raw_end)
-    {
-      if (*raw == current_value)
-      {
-        if (current_length == 254)
-        {              
-          unsigned char x = 255; /* 255 means 254 and don't change value */
-          out.write (reinterpret_cast<char*>(&x), sizeof(unsigned char));
-          current_length = 1;
-        }
-        else
-        {
-          ++current_length;
-        }
-      }
-      else
-      {
-        out.write (reinterpret_cast<char*>(&current_length), sizeof(unsigned char));
-        current_value = *raw;
-        current_length = 1;
-      }
-      ++raw;
-    }
-
-    out.write (reinterpret_cast<char*>(&current_length), sizeof(unsigned char));
+    this->SetParts (header, encoded_parts);
   }
 
   else if (type == AIMFILE_TYPE_D1Tchar)
   {
-    out.write (reinterpret_cast<const char*>(void_in),
-               long_product(dim) * sizeof(char));
+    this->size = long_product(dim) * sizeof(char);
   }
 
   else if (type == AIMFILE_TYPE_D1Tshort)
   {
-    const short* in = reinterpret_cast<const short*>(void_in);
-    size_t N = long_product(dim);
-    for (size_t i=0; i<N; ++i)
-    {
-      short x = native_to_little(in[i]);
-      out.write (reinterpret_cast<char*>(&x), sizeof(short));
-    }
+    this->size = long_product(dim) * sizeof(short);
   }
 
   else if (type == AIMFILE_TYPE_D1Tfloat)
   {
-    const float* in = reinterpret_cast<const float*>(void_in);
-    size_t N = long_product(dim);
-    for (size_t i=0; i<N; ++i)
-    {
-      float x = native_to_vms(in[i]);
-      out.write (reinterpret_cast<char*>(&x), sizeof(float));
-    }
+    this->size = long_product(dim) * sizeof(float);
   }
 
   else
@@ -531,4 +836,49 @@ void Compress
 
 }
 
+// ---------------------------------------------------------------------------
+void Encoder::SetParts
+  (
+  std::vector<char>& header,
+  std::vector<std::vector<char> >& parts
+  )
+{
+  this->encoded.resize (parts.size() + 1);
+  this->encoded[0].swap (header);
+  this->size = this->encoded[0].size();
+  for (size_t p=0; p<parts.size(); ++p)
+  {
+    this->encoded[p+1].swap (parts[p]);
+    this->size += this->encoded[p+1].size();
+  }
+}
+
+// ---------------------------------------------------------------------------
+void Encoder::Write (std::ostream& out) const
+{
+  if (this->type == AIMFILE_TYPE_D1Tchar)
+  {
+    out.write (reinterpret_cast<const char*>(this->in), this->size);
+  }
+  else if (this->type == AIMFILE_TYPE_D1Tshort)
+  {
+    if (order::native == order::little)
+      { out.write (reinterpret_cast<const char*>(this->in), this->size); }
+    else
+    {
+      ConvertAndWrite<short> (out, reinterpret_cast<const short*>(this->in), long_product(this->dim),
+                              [] (short x) { return native_to_little (x); });
+    }
+  }
+  else if (this->type == AIMFILE_TYPE_D1Tfloat)
+  {
+    ConvertAndWrite<float> (out, reinterpret_cast<const float*>(this->in), long_product(this->dim),
+                            [] (float x) { return native_to_vms (x); });
+  }
+  else
+  {
+    WriteParts (out, this->encoded);
+  }
+}
+
 }  // namespace
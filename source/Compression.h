@@ -7,7 +7,10 @@
 #include "n88util/tuplet.hpp"
 #include "AimIO/Definitions.h"
 #include "AimIO/Exception.h"
+#include "AimIO/SeekIndex.h"
 #include <ostream>
+#include <functional>
+#include <vector>
 
 
 namespace AimIO
@@ -23,13 +26,41 @@ void Decompress (
     n88::tuplet<3,int> off,
     bool encode_64bit);
 
-/// As well as compressing, handles endianness of data if required.
-void Compress (
-    std::ostream& out,
-    const void* in,
-    aim_storage_format_t type,
-    n88::tuplet<3,int> dim,
-    bool encode_64bit);
+/// Compresses data for writing. As well as compressing, handles endianness
+/// of data if required.
+///
+/// Compressed data are encoded on construction, so that Size is known before
+/// anything is written. Uncompressed data are converted only as they are
+/// written, and on little-endian platforms D1Tchar and D1Tshort data are
+/// written directly from the input, without any intermediate copy.
+class Encoder
+{
+  public:
+
+    /// in must remain valid for the lifetime of this object.
+    Encoder (
+        const void* in,
+        aim_storage_format_t type,
+        n88::tuplet<3,int> dim,
+        bool encode_64bit);
+
+    /// Size in bytes of the encoded data.
+    size_t Size () const
+      { return this->size; }
+
+    void Write (std::ostream& out) const;
+
+  protected:
+
+    /// Takes the contents of the header and parts, to be written in order.
+    void SetParts (std::vector<char>& header, std::vector<std::vector<char> >& parts);
+
+    const void*                       in;
+    aim_storage_format_t              type;
+    n88::tuplet<3,int>                dim;
+    size_t                            size;
+    std::vector<std::vector<char> >   encoded;
+};
 
 /// Decompresses without taking offset into account.
 ///
@@ -51,6 +82,73 @@ void RestoreOffset (
     n88::tuplet<3,int> dim,
     n88::tuplet<3,int> off);
 
+/// Decompresses char data incrementally, a number of z slices at a time,
+/// so that the entire decompressed image need never be in memory.
+///
+/// Handles D1TcharCmp, D1TbinCmp and D3Tbit8 data, and the offset in the
+/// same way as Decompress.
+class SliceDecompressor
+{
+  public:
+
+    /// in must remain valid for the lifetime of this object.
+    SliceDecompressor (
+        const void* in,
+        size_t compressed_size,
+        aim_storage_format_t type,
+        n88::tuplet<3,int> dim,
+        n88::tuplet<3,int> off,
+        bool encode_64bit);
+
+    /// Resumes decompression of D1TcharCmp or D1TbinCmp data at
+    /// first_slice, from a checkpoint of an AimSeekIndex. window holds the
+    /// compressed data starting at state.offset .
+    SliceDecompressor (
+        const void* window,
+        size_t window_size,
+        aim_storage_format_t type,
+        n88::tuplet<3,int> dim,
+        n88::tuplet<3,int> off,
+        int first_slice,
+        const AimSeekIndex::Checkpoint& state);
+
+    /// Decompresses the next number_of_slices z slices into out. If out is
+    /// null, the slices are skipped.
+    void Next (char* out, int number_of_slices);
+
+    /// Decoder state at the start of the next slice.
+    AimSeekIndex::Checkpoint GetState () const;
+
+    /// For data that are still arriving (D1TcharCmp and D1TbinCmp only):
+    /// only the first available bytes may be used so far. When more are
+    /// needed, refill(count) is called; it must block until count bytes are
+    /// available, or there will be no more, and return the number available.
+    void SetRefill (size_t available, const std::function<size_t(size_t count)>& refill);
+
+  protected:
+
+    /// Decompresses the next n values of a run-length encoded stream. If
+    /// out is null, the values are skipped.
+    void DecodeRun (char* out, size_t n);
+
+    const unsigned char*  compressed;
+    const unsigned char*  compressed_begin;
+    const unsigned char*  compressed_end;
+    size_t                window_offset;   // of compressed_begin in the data block
+    std::function<size_t(size_t)> refill;
+    aim_storage_format_t  type;
+    n88::tuplet<3,int>    dim;
+    n88::tuplet<3,int>    off;
+    int                   next_slice;
+    // Run state
+    unsigned char         current_length;
+    char                  current_value;
+    char                  value_1;
+    char                  value_2;
+    bool                  is_value_1;
+    bool                  change_value;
+};
+
 }  // namespace
 
 #endif
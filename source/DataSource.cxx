@@ -0,0 +1,418 @@
+// Copyright (c) Eric Nodwell
+// See LICENSE for details.
+
+#include "AimIO/DataSource.h"
+#include "AimIO/Exception.h"
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/filesystem/operations.hpp>
+#include <boost/lexical_cast.hpp>
+#include <algorithm>
+#include <mutex>
+#include <cerrno>
+#include <cstring>
+
+#ifdef _WIN32
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#endif
+
+
+namespace AimIO
+{
+
+// ===========================================================================
+// DataSource
+
+// ---------------------------------------------------------------------------
+DataSource::~DataSource ()
+{}
+
+// ---------------------------------------------------------------------------
+void DataSource::ReadExactlyAt
+  (
+  void* buffer,
+  size_t size,
+  boost::uint64_t offset
+  ) const
+{
+  if (this->ReadAt (buffer, size, offset) != size) {
+    throw_aimio_exception (std::string("Unexpected end of file ") + this->Name()); }
+}
+
+// ---------------------------------------------------------------------------
+std::string DataSource::Name () const
+{
+  return "(data source)";
+}
+
+// ---------------------------------------------------------------------------
+const char* DataSource::Data () const
+{
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+int DataSource::Descriptor () const
+{
+  return -1;
+}
+
+
+// ===========================================================================
+// MemorySource
+
+// ---------------------------------------------------------------------------
+MemorySource::MemorySource (const void* d, size_t s)
+  :
+  data (reinterpret_cast<const char*>(d)),
+  size (s)
+{
+  aimio_assert (this->data || this->size == 0);
+}
+
+// ---------------------------------------------------------------------------
+boost::uint64_t MemorySource::Size () const
+{
+  return this->size;
+}
+
+// ---------------------------------------------------------------------------
+size_t MemorySource::ReadAt
+  (
+  void* buffer,
+  size_t count,
+  boost::uint64_t offset
+  ) const
+{
+  if (offset >= this->size)
+    { return 0; }
+  count = std::min<size_t> (count, size_t(this->size - offset));
+  memcpy (buffer, this->data + offset, count);
+  return count;
+}
+
+// ---------------------------------------------------------------------------
+std::string MemorySource::Name () const
+{
+  return "(memory)";
+}
+
+// ---------------------------------------------------------------------------
+const char* MemorySource::Data () const
+{
+  return this->data;
+}
+
+
+// ===========================================================================
+// DescriptorSource
+
+#ifdef _WIN32
+// There are no positional reads on CRT descriptors, so reads seek, and are
+// serialized.
+static std::mutex descriptor_mutex;
+#endif
+
+// ---------------------------------------------------------------------------
+DescriptorSource::DescriptorSource (int f)
+  :
+  fd (f)
+{
+  aimio_verbose_assert (f >= 0, "Invalid file descriptor.");
+}
+
+// ---------------------------------------------------------------------------
+boost::uint64_t DescriptorSource::Size () const
+{
+#ifdef _WIN32
+  struct _stati64 st;
+  if (_fstati64 (this->fd, &st) != 0) {
+#else
+  struct stat st;
+  if (fstat (this->fd, &st) != 0) {
+#endif
+    throw_aimio_exception (std::string("Unable to stat ") + this->Name()); }
+  return st.st_size;
+}
+
+// ---------------------------------------------------------------------------
+size_t DescriptorSource::ReadAt
+  (
+  void* buffer,
+  size_t size,
+  boost::uint64_t offset
+  ) const
+{
+  size_t total = 0;
+#ifdef _WIN32
+  std::lock_guard<std::mutex> lock (descriptor_mutex);
+  if (_lseeki64 (this->fd, offset, SEEK_SET) < 0) {
+    throw_aimio_exception (std::string("Error reading ") + this->Name()); }
+  while (total < size)
+  {
+    int n = _read (this->fd,
+                   reinterpret_cast<char*>(buffer) + total,
+                   unsigned(std::min<size_t> (size - total, 1<<30)));
+    if (n < 0) {
+      throw_aimio_exception (std::string("Error reading ") + this->Name()); }
+    if (n == 0)
+      { break; }
+    total += n;
+  }
+#else
+  while (total < size)
+  {
+    ssize_t n = pread (this->fd,
+                       reinterpret_cast<char*>(buffer) + total,
+                       size - total,
+                       off_t(offset + total));
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        { continue; }
+      throw_aimio_exception (std::string("Error reading ") + this->Name());
+    }
+    if (n == 0)
+      { break; }
+    total += n;
+  }
+#endif
+  return total;
+}
+
+// ---------------------------------------------------------------------------
+std::string DescriptorSource::Name () const
+{
+  return std::string("file descriptor ") + boost::lexical_cast<std::string> (this->fd);
+}
+
+// ---------------------------------------------------------------------------
+int DescriptorSource::Descriptor () const
+{
+#ifdef _WIN32
+  return -1;
+#else
+  return this->fd;
+#endif
+}
+
+
+// ===========================================================================
+// MappedSource
+
+struct MappedSource::Mapping
+{
+  boost::interprocess::file_mapping   file;
+  boost::interprocess::mapped_region  region;
+};
+
+// ---------------------------------------------------------------------------
+MappedSource::MappedSource (const std::string& fn)
+  :
+  filename (fn),
+  mapping (new Mapping)
+{
+  using namespace boost::interprocess;
+  boost::system::error_code ec;
+  boost::uintmax_t size = boost::filesystem::file_size (fn, ec);
+  if (ec) {
+    throw_aimio_exception (std::string("Unable to open file ") + fn); }
+  if (size == 0)
+    { return; }   // An empty file cannot be mapped.
+  try
+  {
+    file_mapping m (fn.c_str(), read_only);
+    mapped_region r (m, read_only);
+    this->mapping->file.swap (m);
+    this->mapping->region.swap (r);
+  }
+  catch (interprocess_exception& e)
+  {
+    throw_aimio_exception (std::string("Unable to map file ") + fn + " : " + e.what());
+  }
+}
+
+// ---------------------------------------------------------------------------
+MappedSource::~MappedSource ()
+{}
+
+// ---------------------------------------------------------------------------
+boost::uint64_t MappedSource::Size () const
+{
+  return this->mapping->region.get_size();
+}
+
+// ---------------------------------------------------------------------------
+size_t MappedSource::ReadAt
+  (
+  void* buffer,
+  size_t count,
+  boost::uint64_t offset
+  ) const
+{
+  const boost::uint64_t size = this->Size();
+  if (offset >= size)
+    { return 0; }
+  count = std::min<size_t> (count, size_t(size - offset));
+  memcpy (buffer, this->Data() + offset, count);
+  return count;
+}
+
+// ---------------------------------------------------------------------------
+std::string MappedSource::Name () const
+{
+  return this->filename;
+}
+
+// ---------------------------------------------------------------------------
+const char* MappedSource::Data () const
+{
+  return reinterpret_cast<const char*>(this->mapping->region.get_address());
+}
+
+
+// ===========================================================================
+// CallbackSource
+
+// ---------------------------------------------------------------------------
+CallbackSource::CallbackSource
+  (
+  boost::uint64_t s,
+  const read_function_t& r
+  )
+  :
+  size (s),
+  read (r)
+{
+  aimio_assert (this->read);
+}
+
+// ---------------------------------------------------------------------------
+boost::uint64_t CallbackSource::Size () const
+{
+  return this->size;
+}
+
+// ---------------------------------------------------------------------------
+size_t CallbackSource::ReadAt
+  (
+  void* buffer,
+  size_t count,
+  boost::uint64_t offset
+  ) const
+{
+  if (offset >= this->size)
+    { return 0; }
+  count = std::min<size_t> (count, size_t(this->size - offset));
+  // The function may return fewer bytes than requested, as a stream does.
+  size_t total = 0;
+  while (total < count)
+  {
+    size_t n = this->read (reinterpret_cast<char*>(buffer) + total, count - total, offset + total);
+    if (n == 0)
+      { break; }
+    total += n;
+  }
+  return total;
+}
+
+
+// ===========================================================================
+// DataSink
+
+// ---------------------------------------------------------------------------
+DataSink::~DataSink ()
+{}
+
+// ---------------------------------------------------------------------------
+void DataSink::Reserve (size_t)
+{}
+
+// ---------------------------------------------------------------------------
+void MemorySink::Write (const void* data, size_t size)
+{
+  const char* d = reinterpret_cast<const char*>(data);
+  this->buffer.insert (this->buffer.end(), d, d + size);
+}
+
+// ---------------------------------------------------------------------------
+void MemorySink::Reserve (size_t size)
+{
+  this->buffer.reserve (this->buffer.size() + size);
+}
+
+// ---------------------------------------------------------------------------
+BufferSink::BufferSink (void* d, size_t c)
+  :
+  data (reinterpret_cast<char*>(d)),
+  capacity (c),
+  size (0)
+{
+  aimio_assert (this->data || this->capacity == 0);
+}
+
+// ---------------------------------------------------------------------------
+void BufferSink::Write (const void* d, size_t count)
+{
+  if (count > this->capacity - this->size) {
+    throw_aimio_exception ("Buffer too small."); }
+  memcpy (this->data + this->size, d, count);
+  this->size += count;
+}
+
+// ---------------------------------------------------------------------------
+void BufferSink::Reserve (size_t count)
+{
+  // Fail before anything is written.
+  if (count > this->capacity - this->size) {
+    throw_aimio_exception ("Buffer too small."); }
+}
+
+// ---------------------------------------------------------------------------
+DescriptorSink::DescriptorSink (int f)
+  :
+  fd (f)
+{
+  aimio_verbose_assert (f >= 0, "Invalid file descriptor.");
+}
+
+// ---------------------------------------------------------------------------
+void DescriptorSink::Write (const void* data, size_t size)
+{
+  const char* d = reinterpret_cast<const char*>(data);
+  size_t total = 0;
+  while (total < size)
+  {
+#ifdef _WIN32
+    int n = _write (this->fd, d + total, unsigned(std::min<size_t> (size - total, 1<<30)));
+#else
+    ssize_t n = ::write (this->fd, d + total, size - total);
+    if (n < 0 && errno == EINTR)
+      { continue; }
+#endif
+    if (n <= 0) {
+      throw_aimio_exception ("Error writing to file descriptor."); }
+    total += n;
+  }
+}
+
+// ---------------------------------------------------------------------------
+CallbackSink::CallbackSink (const write_function_t& w)
+  :
+  write (w)
+{
+  aimio_assert (this->write);
+}
+
+// ---------------------------------------------------------------------------
+void CallbackSink::Write (const void* data, size_t size)
+{
+  this->write (data, size);
+}
+
+}  // namespace
@@ -0,0 +1,1058 @@
+// Copyright (c) Eric Nodwell
+// See LICENSE for details.
+
+#include "FileIO.h"
+#include "Parallel.h"
+#include "AimIO/Exception.h"
+#include <boost/filesystem/operations.hpp>
+#include <boost/endian/conversion.hpp>
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#endif
+
+
+using namespace boost::endian;
+
+namespace AimIO
+{
+
+// Alignment of O_DIRECT transfers, sufficient for any logical block size.
+static const size_t direct_alignment = 4096;
+// Largest O_DIRECT read through a bounce buffer.
+static const size_t direct_read_chunk = 1<<20;
+// Size of the staging buffer of O_DIRECT writes.
+static const size_t direct_write_chunk = 4*1024*1024;
+// With IO_POLICY_STREAMING, written data are flushed and dropped from the
+// cache in ranges of this size.
+static const boost::uint64_t streaming_window = 8*1024*1024;
+
+static size_t RoundUp (size_t n, size_t alignment)
+{
+  return (n + alignment - 1) / alignment * alignment;
+}
+
+// ===========================================================================
+// PositionalFile
+
+#ifdef _WIN32
+
+// ---------------------------------------------------------------------------
+PositionalFile::PositionalFile (const std::string& fn, io_policy_t p)
+  :
+  filename (fn),
+  // Only a hint is available; unbuffered handles require aligned transfers.
+  policy (p == IO_POLICY_BUFFERED ? p : IO_POLICY_STREAMING),
+  aligned (false)
+{
+  this->handle = CreateFileA (fn.c_str(),
+                              GENERIC_READ,
+                              FILE_SHARE_READ | FILE_SHARE_WRITE,
+                              NULL,
+                              OPEN_EXISTING,
+                              this->policy == IO_POLICY_BUFFERED ? FILE_ATTRIBUTE_NORMAL
+                                                                 : FILE_FLAG_SEQUENTIAL_SCAN,
+                              NULL);
+  if (this->handle == INVALID_HANDLE_VALUE) {
+    throw_aimio_exception (std::string("Unable to open file ") + fn); }
+}
+
+// ---------------------------------------------------------------------------
+PositionalFile::~PositionalFile ()
+{
+  CloseHandle (this->handle);
+}
+
+// ---------------------------------------------------------------------------
+void PositionalFile::Stat
+  (
+  boost::uint64_t& size,
+  std::time_t& modification_time
+  ) const
+{
+  LARGE_INTEGER s;
+  FILETIME ft;
+  if (!GetFileSizeEx (this->handle, &s) ||
+      !GetFileTime (this->handle, NULL, NULL, &ft)) {
+    throw_aimio_exception (std::string("Unable to stat file ") + filename); }
+  size = s.QuadPart;
+  // FILETIME counts 100 ns intervals since 1601-01-01.
+  boost::uint64_t t = (boost::uint64_t(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+  modification_time = std::time_t((t - 116444736000000000ULL) / 10000000ULL);
+}
+
+// ---------------------------------------------------------------------------
+size_t PositionalFile::ReadAt
+  (
+  void* buffer,
+  size_t size,
+  boost::uint64_t offset
+  ) const
+{
+  size_t total = 0;
+  while (total < size)
+  {
+    DWORD request = DWORD(std::min<size_t>(size - total, 1<<30));
+    OVERLAPPED ov;
+    memset (&ov, 0, sizeof(ov));
+    ov.Offset = DWORD(offset + total);
+    ov.OffsetHigh = DWORD((offset + total) >> 32);
+    DWORD n = 0;
+    if (!ReadFile (this->handle, reinterpret_cast<char*>(buffer) + total, request, &n, &ov))
+    {
+      if (GetLastError() == ERROR_HANDLE_EOF)
+        { break; }
+      throw_aimio_exception (std::string("Error reading file ") + filename);
+    }
+    if (n == 0)
+      { break; }
+    total += n;
+  }
+  return total;
+}
+
+#else  // POSIX
+
+namespace
+{
+
+struct AlignedFree
+{
+  void operator() (char* p) const
+    { free (p); }
+};
+
+char* AllocateAligned (size_t size)
+{
+  void* p = 0;
+  if (posix_memalign (&p, direct_alignment, size) != 0) {
+    throw_aimio_exception ("Unable to allocate aligned buffer."); }
+  return reinterpret_cast<char*>(p);
+}
+
+// An O_DIRECT read; buffer, size and offset must be aligned. A read that
+// ends on an unaligned size has reached end of file.
+size_t ReadDirect
+  (
+  int fd,
+  char* buffer,
+  size_t size,
+  boost::uint64_t offset,
+  const std::string& filename
+  )
+{
+  size_t total = 0;
+  while (total < size)
+  {
+    ssize_t n = pread (fd, buffer + total, size - total, off_t(offset + total));
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        { continue; }
+      throw_aimio_exception (std::string("Error reading file ") + filename);
+    }
+    if (n == 0)
+      { break; }
+    total += n;
+    if (total % direct_alignment)
+      { break; }
+  }
+  return total;
+}
+
+}  // anonymous namespace
+
+// ---------------------------------------------------------------------------
+PositionalFile::PositionalFile (const std::string& fn, io_policy_t p)
+  :
+  filename (fn),
+  policy (p),
+  aligned (false)
+{
+  int flags = O_RDONLY;
+#ifdef O_CLOEXEC
+  flags |= O_CLOEXEC;
+#endif
+  this->fd = -1;
+#ifdef O_DIRECT
+  if (p == IO_POLICY_DIRECT)
+  {
+    // Not all file systems support O_DIRECT.
+    this->fd = open (fn.c_str(), flags | O_DIRECT);
+    this->aligned = (this->fd >= 0);
+  }
+#endif
+  if (this->fd < 0)
+    { this->fd = open (fn.c_str(), flags); }
+  if (this->fd < 0) {
+    throw_aimio_exception (std::string("Unable to open file ") + fn); }
+  if (p == IO_POLICY_DIRECT && !this->aligned)
+  {
+    this->policy = IO_POLICY_STREAMING;
+#ifdef F_NOCACHE
+    if (fcntl (this->fd, F_NOCACHE, 1) == 0)
+      { this->policy = IO_POLICY_DIRECT; }
+#endif
+  }
+#ifdef POSIX_FADV_SEQUENTIAL
+  if (this->policy == IO_POLICY_STREAMING)
+    { posix_fadvise (this->fd, 0, 0, POSIX_FADV_SEQUENTIAL); }
+#else
+  if (this->policy == IO_POLICY_STREAMING)
+    { this->policy = IO_POLICY_BUFFERED; }
+#endif
+}
+
+// ---------------------------------------------------------------------------
+PositionalFile::~PositionalFile ()
+{
+  close (this->fd);
+}
+
+// ---------------------------------------------------------------------------
+void PositionalFile::Stat
+  (
+  boost::uint64_t& size,
+  std::time_t& modification_time
+  ) const
+{
+  struct stat st;
+  if (fstat (this->fd, &st) != 0) {
+    throw_aimio_exception (std::string("Unable to stat file ") + filename); }
+  size = st.st_size;
+  modification_time = st.st_mtime;
+}
+
+// ---------------------------------------------------------------------------
+size_t PositionalFile::ReadAt
+  (
+  void* buffer,
+  size_t size,
+  boost::uint64_t offset
+  ) const
+{
+  if (this->aligned)
+    { return this->ReadAligned (buffer, size, offset); }
+  size_t total = 0;
+  while (total < size)
+  {
+    ssize_t n = pread (this->fd,
+                       reinterpret_cast<char*>(buffer) + total,
+                       size - total,
+                       off_t(offset + total));
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        { continue; }
+      throw_aimio_exception (std::string("Error reading file ") + filename);
+    }
+    if (n == 0)
+      { break; }
+    total += n;
+  }
+#ifdef POSIX_FADV_DONTNEED
+  if (this->policy == IO_POLICY_STREAMING && total)
+    { posix_fadvise (this->fd, off_t(offset), off_t(total), POSIX_FADV_DONTNEED); }
+#endif
+  return total;
+}
+
+// ---------------------------------------------------------------------------
+size_t PositionalFile::ReadAligned
+  (
+  void* buffer,
+  size_t size,
+  boost::uint64_t offset
+  ) const
+{
+  char* out = reinterpret_cast<char*>(buffer);
+  if (offset % direct_alignment == 0 &&
+      size % direct_alignment == 0 &&
+      reinterpret_cast<size_t>(out) % direct_alignment == 0)
+    { return ReadDirect (this->fd, out, size, offset, this->filename); }
+
+  // Otherwise read aligned blocks covering the request into a bounce
+  // buffer, a chunk at a time.
+  const size_t capacity = std::min (direct_read_chunk, RoundUp (size + direct_alignment, direct_alignment));
+  std::unique_ptr<char, AlignedFree> bounce (AllocateAligned (capacity));
+  size_t total = 0;
+  while (total < size)
+  {
+    boost::uint64_t position = offset + total;
+    boost::uint64_t start = position - position % direct_alignment;
+    size_t skip = size_t(position - start);
+    size_t request = std::min (capacity, RoundUp (skip + (size - total), direct_alignment));
+    size_t n = ReadDirect (this->fd, bounce.get(), request, start, this->filename);
+    if (n <= skip)
+      { break; }
+    size_t count = std::min (n - skip, size - total);
+    memcpy (out + total, bounce.get() + skip, count);
+    total += count;
+    if (n < request)
+      { break; }
+  }
+  return total;
+}
+
+#endif
+
+// ---------------------------------------------------------------------------
+boost::uint64_t PositionalFile::Size () const
+{
+  boost::uint64_t size;
+  std::time_t mtime;
+  this->Stat (size, mtime);
+  return size;
+}
+
+
+// ---------------------------------------------------------------------------
+const char* BytesAt
+  (
+  const DataSource& file,
+  boost::uint64_t offset,
+  size_t size,
+  std::vector<char>& buffer
+  )
+{
+  if (const char* data = file.Data())
+  {
+    if (offset > file.Size() || size > file.Size() - offset) {
+      throw_aimio_exception (std::string("Unexpected end of file ") + file.Name()); }
+    return data + offset;
+  }
+  buffer.resize (std::max<size_t> (size, 1));
+  file.ReadExactlyAt (&(buffer[0]), size, offset);
+  return &(buffer[0]);
+}
+
+
+// Spans separated by a gap of at most this many bytes are fetched with a
+// single read.
+static const boost::uint64_t max_coalesce_gap = 64*1024;
+// Upper limit on the size of a single coalesced read, and on the total size
+// of a batch of reads (and hence on the size of the staging buffer).
+static const boost::uint64_t max_coalesced_read = 8*1024*1024;
+// Upper limit on the number of reads submitted together.
+static const size_t max_batched_reads = 64;
+
+// ---------------------------------------------------------------------------
+void ReadSpans
+  (
+  const DataSource& file,
+  const std::vector<boost::uint64_t>& span_offset,
+  boost::uint64_t span_length,
+  const std::function<void(size_t, const char*)>& consume
+  )
+{
+  const size_t number_of_spans = span_offset.size();
+  std::vector<char> buffer;
+  std::vector<ReadRequest> requests;
+  std::vector<size_t> first_span;      // of each request, plus one past the end
+  std::vector<size_t> buffer_offset;   // of each request
+  size_t row = 0;
+  while (row < number_of_spans)
+  {
+    // Form a batch of reads, each of which coalesces following spans while
+    // the gap and total read size are small.
+    requests.clear();
+    first_span.clear();
+    buffer_offset.clear();
+    size_t total = 0;
+    size_t next = row;
+    while (next < number_of_spans && requests.size() < max_batched_reads)
+    {
+      size_t last = next;
+      while (last + 1 < number_of_spans &&
+             span_offset[last+1] - (span_offset[last] + span_length) <= max_coalesce_gap &&
+             span_offset[last+1] + span_length - span_offset[next] <= max_coalesced_read)
+        { ++last; }
+      size_t read_size = size_t(span_offset[last] + span_length - span_offset[next]);
+      if (!requests.empty() && total + read_size > max_coalesced_read)
+        { break; }
+      ReadRequest request;
+      request.file = &file;
+      request.size = read_size;
+      request.offset = span_offset[next];
+      requests.push_back (request);
+      first_span.push_back (next);
+      buffer_offset.push_back (total);
+      total += read_size;
+      next = last + 1;
+    }
+    first_span.push_back (next);
+
+    if (buffer.size() < total)
+      { buffer.resize (total); }
+    for (size_t k=0; k<requests.size(); ++k)
+      { requests[k].buffer = total ? &(buffer[0]) + buffer_offset[k] : 0; }
+    GetBatchReader().Read (requests);
+
+    for (size_t k=0; k<requests.size(); ++k)
+    {
+      const ReadRequest& request = requests[k];
+      if (request.failed) {
+        throw_aimio_exception (std::string("Error reading file ") + file.Name()); }
+      if (request.result != request.size) {
+        throw_aimio_exception (std::string("Unexpected end of file ") + file.Name()); }
+      const char* data = reinterpret_cast<const char*>(request.buffer);
+      for (size_t r=first_span[k]; r<first_span[k+1]; ++r)
+        { consume (r, request.size ? data + (span_offset[r] - request.offset) : 0); }
+    }
+    row = next;
+  }
+}
+
+
+// ---------------------------------------------------------------------------
+void ReadShortChunks
+  (
+  const DataSource& file,
+  boost::uint64_t offset,
+  size_t count,
+  const std::function<void(const short*, size_t, size_t)>& consume
+  )
+{
+  const size_t chunk_size = 64*1024;
+  std::vector<short> chunk (std::min (count, chunk_size));
+  for (size_t index=0; index<count; index+=chunk_size)
+  {
+    size_t n = std::min (chunk_size, count - index);
+    file.ReadExactlyAt (&(chunk[0]), n*sizeof(short), offset + index*sizeof(short));
+    if (order::native != order::little)
+    {
+      for (size_t i=0; i<n; ++i)
+        { little_to_native_inplace (chunk[i]); }
+    }
+    consume (&(chunk[0]), index, n);
+  }
+}
+// ===========================================================================
+// ReadAhead
+
+// Number of chunks that the pool task submits to the batch reader at once,
+// so that several are in flight with the io_uring backend.
+static const size_t read_ahead_batch = 4;
+
+struct ReadAhead::State
+{
+  State (const DataSource& f, char* b, size_t s, boost::uint64_t o, size_t c)
+    :
+    file (f), buffer (b), size (s), offset (o), chunk_size (c),
+    finished ((s + c - 1) / c, false),
+    next (0), reading (0), available (0), cancelled (false)
+    {}
+
+  // Claims up to max_chunks following chunks and reads them as one batch,
+  // with lock held on entry and on return. Returns false if there is no
+  // chunk left to claim.
+  bool ReadNext (std::unique_lock<std::mutex>& lock, size_t max_chunks)
+  {
+    if (this->cancelled || this->error || this->next == this->finished.size())
+      { return false; }
+    const size_t first = this->next;
+    const size_t last = std::min (first + std::max<size_t> (max_chunks, 1), this->finished.size());
+    this->next = last;
+    ++this->reading;
+    lock.unlock();
+    std::vector<ReadRequest> requests (last - first);
+    for (size_t c=first; c<last; ++c)
+    {
+      ReadRequest& request = requests[c - first];
+      const size_t begin = c * this->chunk_size;
+      request.file = &(this->file);
+      request.buffer = this->buffer + begin;
+      request.size = std::min (this->chunk_size, this->size - begin);
+      request.offset = this->offset + begin;
+    }
+    std::exception_ptr failure;
+    try
+    {
+      GetBatchReader().Read (requests);
+      for (size_t r=0; r<requests.size(); ++r)
+      {
+        const ReadRequest& request = requests[r];
+        if (request.failed) {
+          throw_aimio_exception (std::string("Error reading file ") + this->file.Name()); }
+        // A short read need not be the end of the file; this throws if it is.
+        if (request.result < request.size)
+        {
+          this->file.ReadExactlyAt (reinterpret_cast<char*>(request.buffer) + request.result,
+                                    request.size - request.result,
+                                    request.offset + request.result);
+        }
+      }
+    }
+    catch (...)
+      { failure = std::current_exception(); }
+    lock.lock();
+    --this->reading;
+    if (failure)
+    {
+      if (!this->error)
+        { this->error = failure; }
+    }
+    else
+    {
+      // Chunks may complete out of order; available covers only the
+      // complete ones at the start.
+      for (size_t c=first; c<last; ++c)
+        { this->finished[c] = true; }
+      while (this->available < this->size && this->finished[this->available / this->chunk_size])
+        { this->available = std::min (this->available + this->chunk_size, this->size); }
+    }
+    this->changed.notify_all();
+    return true;
+  }
+
+  const DataSource&         file;
+  char*                     buffer;
+  const size_t              size;
+  const boost::uint64_t     offset;
+  const size_t              chunk_size;
+  std::vector<bool>         finished;
+  size_t                    next;        // first chunk not yet claimed
+  int                       reading;     // chunks being read
+  size_t                    available;
+  bool                      cancelled;
+  std::exception_ptr        error;
+  std::mutex                mutex;
+  std::condition_variable   changed;
+};
+
+// ---------------------------------------------------------------------------
+ReadAhead::ReadAhead
+  (
+  const DataSource& file,
+  char* buffer,
+  size_t size,
+  boost::uint64_t offset,
+  size_t chunk_size
+  )
+  :
+  state (new State (file, buffer, size, offset, std::max<size_t> (chunk_size, 1)))
+{
+  std::shared_ptr<ThreadPool> pool = GetThreadPool();
+  if (pool)
+  {
+    // The task keeps the state alive, but stops reading on cancellation,
+    // after which the file and buffer may no longer exist.
+    std::shared_ptr<State> s = this->state;
+    pool->Submit ([s] ()
+      {
+      std::unique_lock<std::mutex> lock (s->mutex);
+      while (s->ReadNext (lock, read_ahead_batch)) {}
+      });
+  }
+}
+
+// ---------------------------------------------------------------------------
+ReadAhead::~ReadAhead ()
+{
+  std::unique_lock<std::mutex> lock (this->state->mutex);
+  this->state->cancelled = true;
+  this->state->changed.wait (lock, [this] () { return this->state->reading == 0; });
+}
+
+// ---------------------------------------------------------------------------
+size_t ReadAhead::WaitFor (size_t count)
+{
+  State& s = *(this->state);
+  count = std::min (count, s.size);
+  std::unique_lock<std::mutex> lock (s.mutex);
+  while (s.available < count && !s.error)
+  {
+    // Read the required chunks here unless a worker has claimed them.
+    if (s.next * s.chunk_size < count &&
+        s.ReadNext (lock, (count - 1) / s.chunk_size + 1 - s.next))
+      { continue; }
+    s.changed.wait (lock);
+  }
+  if (s.available < count)
+    { std::rethrow_exception (s.error); }
+  return s.available;
+}
+
+// ===========================================================================
+// PositionalStreamBuf
+
+// ---------------------------------------------------------------------------
+PositionalStreamBuf::PositionalStreamBuf
+  (
+  const DataSource& f,
+  size_t window_size
+  )
+  :
+  file (f),
+  window (std::max<size_t> (window_size, 1)),
+  window_offset (0)
+{
+  if (const char* data = f.Data())
+  {
+    // The whole source is the window.
+    char* begin = const_cast<char*>(data);
+    this->setg (begin, begin, begin + f.Size());
+    return;
+  }
+  // Start with an empty window; the first underflow fills it.
+  this->setg (&(this->window[0]), &(this->window[0]), &(this->window[0]));
+}
+
+// ---------------------------------------------------------------------------
+ReadRequest PositionalStreamBuf::InitialRead ()
+{
+  ReadRequest request;
+  request.file = &(this->file);
+  request.buffer = &(this->window[0]);
+  request.size = this->window.size();
+  request.offset = 0;
+  return request;
+}
+
+// ---------------------------------------------------------------------------
+void PositionalStreamBuf::Filled (const ReadRequest& request)
+{
+  // On failure, leave the window empty, so that it is read again on use.
+  if (request.failed || this->Position() != 0)
+    { return; }
+  this->window_offset = 0;
+  this->setg (&(this->window[0]), &(this->window[0]), &(this->window[0]) + request.result);
+}
+
+// ---------------------------------------------------------------------------
+PositionalStreamBuf::int_type PositionalStreamBuf::underflow ()
+{
+  if (this->gptr() < this->egptr())
+    { return traits_type::to_int_type (*this->gptr()); }
+  boost::uint64_t position = this->Position();
+  size_t n = this->file.ReadAt (&(this->window[0]), this->window.size(), position);
+  this->window_offset = position;
+  this->setg (&(this->window[0]), &(this->window[0]), &(this->window[0]) + n);
+  if (n == 0)
+    { return traits_type::eof(); }
+  return traits_type::to_int_type (*this->gptr());
+}
+
+// ---------------------------------------------------------------------------
+std::streamsize PositionalStreamBuf::xsgetn (char* s, std::streamsize n)
+{
+  std::streamsize total = 0;
+  // First whatever is already in the window.
+  std::streamsize available = this->egptr() - this->gptr();
+  if (available > 0)
+  {
+    std::streamsize count = std::min (available, n);
+    memcpy (s, this->gptr(), count);
+    this->gbump (int(count));
+    total += count;
+  }
+  if (total == n)
+    { return total; }
+  // Large remainders go straight to the destination.
+  if (size_t(n - total) >= this->window.size())
+  {
+    boost::uint64_t position = this->Position();
+    size_t count = this->file.ReadAt (s + total, n - total, position);
+    this->window_offset = position + count;
+    this->setg (&(this->window[0]), &(this->window[0]), &(this->window[0]));
+    return total + count;
+  }
+  // Otherwise refill the window.
+  while (total < n)
+  {
+    if (this->underflow() == traits_type::eof())
+      { break; }
+    std::streamsize count = std::min (std::streamsize(this->egptr() - this->gptr()), n - total);
+    memcpy (s + total, this->gptr(), count);
+    this->gbump (int(count));
+    total += count;
+  }
+  return total;
+}
+
+// ---------------------------------------------------------------------------
+PositionalStreamBuf::pos_type PositionalStreamBuf::seekoff
+  (
+  off_type off,
+  std::ios_base::seekdir dir,
+  std::ios_base::openmode which
+  )
+{
+  boost::int64_t target;
+  if (dir == std::ios_base::beg)
+    { target = off; }
+  else if (dir == std::ios_base::cur)
+    { target = boost::int64_t(this->Position()) + off; }
+  else
+    { target = boost::int64_t(this->file.Size()) + off; }
+  return this->seekpos (pos_type(off_type(target)), which);
+}
+
+// ---------------------------------------------------------------------------
+PositionalStreamBuf::pos_type PositionalStreamBuf::seekpos
+  (
+  pos_type pos,
+  std::ios_base::openmode which
+  )
+{
+  if (!(which & std::ios_base::in) || off_type(pos) < 0)
+    { return pos_type(off_type(-1)); }
+  boost::uint64_t target = off_type(pos);
+  const char* data = this->file.Data();
+  if (data && target <= this->file.Size())
+  {
+    char* begin = const_cast<char*>(data);
+    this->window_offset = 0;
+    this->setg (begin, begin + target, begin + this->file.Size());
+    return pos;
+  }
+  boost::uint64_t window_end = this->window_offset + (this->egptr() - this->eback());
+  if (target >= this->window_offset && target <= window_end)
+  {
+    // Within the current window: just move the get pointer.
+    this->setg (this->eback(),
+                this->eback() + (target - this->window_offset),
+                this->egptr());
+  }
+  else
+  {
+    this->window_offset = target;
+    this->setg (&(this->window[0]), &(this->window[0]), &(this->window[0]));
+  }
+  return pos;
+}
+
+
+// ===========================================================================
+// SinkStreamBuf
+
+// ---------------------------------------------------------------------------
+SinkStreamBuf::SinkStreamBuf
+  (
+  DataSink& s,
+  size_t buffer_size
+  )
+  :
+  sink (s),
+  buffer (std::max<size_t> (buffer_size, 1))
+{
+  this->setp (&(this->buffer[0]), &(this->buffer[0]) + this->buffer.size());
+}
+
+// ---------------------------------------------------------------------------
+SinkStreamBuf::~SinkStreamBuf ()
+{
+  try
+    { this->sync(); }
+  catch (...)
+    {}
+}
+
+// ---------------------------------------------------------------------------
+int SinkStreamBuf::sync ()
+{
+  size_t n = this->pptr() - this->pbase();
+  if (n)
+  {
+    // Reset first, so that nothing is written twice if the sink throws.
+    this->setp (&(this->buffer[0]), &(this->buffer[0]) + this->buffer.size());
+    this->sink.Write (&(this->buffer[0]), n);
+  }
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+SinkStreamBuf::int_type SinkStreamBuf::overflow (int_type c)
+{
+  this->sync();
+  if (!traits_type::eq_int_type (c, traits_type::eof()))
+  {
+    *this->pptr() = traits_type::to_char_type (c);
+    this->pbump (1);
+  }
+  return traits_type::not_eof (c);
+}
+
+// ---------------------------------------------------------------------------
+std::streamsize SinkStreamBuf::xsputn (const char* s, std::streamsize n)
+{
+  if (size_t(n) < size_t(this->epptr() - this->pptr()))
+  {
+    memcpy (this->pptr(), s, size_t(n));
+    this->pbump (int(n));
+    return n;
+  }
+  this->sync();
+  if (size_t(n) >= this->buffer.size())
+  {
+    this->sink.Write (s, size_t(n));
+    return n;
+  }
+  memcpy (this->pptr(), s, size_t(n));
+  this->pbump (int(n));
+  return n;
+}
+
+
+// ===========================================================================
+// FileSink
+
+// ---------------------------------------------------------------------------
+FileSink::FileSink
+  (
+  const std::string& fn,
+  io_policy_t p
+  )
+  :
+  filename (fn),
+  policy (p),
+  aligned (false),
+  fd (-1),
+  staging (0),
+  staged (0),
+  written (0),
+  flushed (0),
+  dropped (0)
+{
+#ifdef _WIN32
+  // Only a hint is available; unbuffered handles require aligned transfers.
+  if (this->policy != IO_POLICY_BUFFERED)
+    { this->policy = IO_POLICY_STREAMING; }
+  int flags = _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY;
+  if (this->policy == IO_POLICY_STREAMING)
+    { flags |= _O_SEQUENTIAL; }
+  this->fd = _open (fn.c_str(), flags, _S_IREAD | _S_IWRITE);
+  if (this->fd < 0) {
+    throw_aimio_exception (std::string("Unable to open file ") + fn); }
+#else
+  int flags = O_WRONLY | O_CREAT | O_TRUNC;
+#ifdef O_CLOEXEC
+  flags |= O_CLOEXEC;
+#endif
+#ifdef O_DIRECT
+  if (p == IO_POLICY_DIRECT)
+  {
+    // Not all file systems support O_DIRECT.
+    this->fd = open (fn.c_str(), flags | O_DIRECT, 0666);
+    this->aligned = (this->fd >= 0);
+  }
+#endif
+  if (this->fd < 0)
+    { this->fd = open (fn.c_str(), flags, 0666); }
+  if (this->fd < 0) {
+    throw_aimio_exception (std::string("Unable to open file ") + fn); }
+  if (this->aligned)
+  {
+    try
+      { this->staging = AllocateAligned (direct_write_chunk); }
+    catch (...)
+    {
+      close (this->fd);
+      throw;
+    }
+  }
+  if (p == IO_POLICY_DIRECT && !this->aligned)
+  {
+    this->policy = IO_POLICY_STREAMING;
+#ifdef F_NOCACHE
+    if (fcntl (this->fd, F_NOCACHE, 1) == 0)
+      { this->policy = IO_POLICY_DIRECT; }
+#endif
+  }
+#ifndef POSIX_FADV_DONTNEED
+  if (this->policy == IO_POLICY_STREAMING)
+    { this->policy = IO_POLICY_BUFFERED; }
+#endif
+#endif
+}
+
+// ---------------------------------------------------------------------------
+FileSink::~FileSink ()
+{
+  if (this->fd >= 0)
+  {
+#ifdef _WIN32
+    _close (this->fd);
+#else
+    close (this->fd);
+#endif
+  }
+  free (this->staging);
+}
+
+// ---------------------------------------------------------------------------
+void FileSink::WriteFully (const char* data, size_t size)
+{
+  size_t total = 0;
+  while (total < size)
+  {
+#ifdef _WIN32
+    int n = _write (this->fd, data + total, unsigned(std::min<size_t> (size - total, 1<<30)));
+#else
+    ssize_t n = ::write (this->fd, data + total, size - total);
+    if (n < 0 && errno == EINTR)
+      { continue; }
+#endif
+    if (n <= 0) {
+      throw_aimio_exception (std::string("Error writing file ") + this->filename); }
+    total += n;
+  }
+}
+
+// ---------------------------------------------------------------------------
+void FileSink::Write (const void* data, size_t size)
+{
+  const char* d = reinterpret_cast<const char*>(data);
+  if (!this->aligned)
+  {
+    this->WriteFully (d, size);
+    this->written += size;
+    if (this->policy == IO_POLICY_STREAMING)
+      { this->Evict (false); }
+    return;
+  }
+  while (size)
+  {
+    size_t n = std::min (size, direct_write_chunk - this->staged);
+    memcpy (this->staging + this->staged, d, n);
+    this->staged += n;
+    d += n;
+    size -= n;
+    if (this->staged == direct_write_chunk)
+    {
+      this->WriteFully (this->staging, this->staged);
+      this->written += this->staged;
+      this->staged = 0;
+    }
+  }
+}
+
+// ---------------------------------------------------------------------------
+void FileSink::Reserve (size_t size)
+{
+#if defined(FALLOC_FL_KEEP_SIZE)
+  // Allocate the blocks up front, without changing the file size. This is
+  // only a hint, and is not supported by all file systems.
+  if (size)
+    { fallocate (this->fd, FALLOC_FL_KEEP_SIZE, 0, off_t(size)); }
+#else
+  (void)size;
+#endif
+}
+
+// ---------------------------------------------------------------------------
+void FileSink::Evict (bool all)
+{
+#if !defined(_WIN32) && defined(POSIX_FADV_DONTNEED)
+  if (!all && this->written - this->flushed < streaming_window)
+    { return; }
+#ifdef SYNC_FILE_RANGE_WRITE
+  // Start writeback of the new data. Data of which writeback was started
+  // previously should be on disk by now; wait for it, and drop it from the
+  // cache.
+  if (this->flushed > this->dropped)
+  {
+    sync_file_range (this->fd, off_t(this->dropped), off_t(this->flushed - this->dropped),
+                     SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise (this->fd, off_t(this->dropped), off_t(this->flushed - this->dropped), POSIX_FADV_DONTNEED);
+    this->dropped = this->flushed;
+  }
+  sync_file_range (this->fd, off_t(this->flushed), off_t(this->written - this->flushed),
+                   all ? SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER
+                       : SYNC_FILE_RANGE_WRITE);
+  this->flushed = this->written;
+  if (all)
+  {
+    posix_fadvise (this->fd, off_t(this->dropped), off_t(this->written - this->dropped), POSIX_FADV_DONTNEED);
+    this->dropped = this->written;
+  }
+#else
+  fdatasync (this->fd);
+  posix_fadvise (this->fd, off_t(this->dropped), off_t(this->written - this->dropped), POSIX_FADV_DONTNEED);
+  this->dropped = this->flushed = this->written;
+#endif
+#else
+  (void)all;
+#endif
+}
+
+// ---------------------------------------------------------------------------
+void FileSink::Close ()
+{
+  if (this->fd < 0)
+    { return; }
+#ifndef _WIN32
+  if (this->aligned && this->staged)
+  {
+    // The final partial block is padded, and the file then truncated.
+    size_t padded = RoundUp (this->staged, direct_alignment);
+    memset (this->staging + this->staged, 0, padded - this->staged);
+    this->WriteFully (this->staging, padded);
+    this->written += this->staged;
+    this->staged = 0;
+    if (ftruncate (this->fd, off_t(this->written)) != 0) {
+      throw_aimio_exception (std::string("Error writing file ") + this->filename); }
+  }
+#endif
+  if (this->policy == IO_POLICY_STREAMING)
+    { this->Evict (true); }
+  int fd_ = this->fd;
+  this->fd = -1;
+#ifdef _WIN32
+  if (_close (fd_) != 0) {
+#else
+  if (close (fd_) != 0) {
+#endif
+    throw_aimio_exception (std::string("Error writing file ") + this->filename); }
+}
+
+
+// ===========================================================================
+// MappedFile
+
+// ---------------------------------------------------------------------------
+MappedFile::MappedFile
+  (
+  const std::string& filename,
+  boost::uint64_t offset,
+  size_t size
+  )
+{
+  using namespace boost::interprocess;
+  if (size == 0) {
+    throw_aimio_exception (std::string("Cannot map empty data region of ") + filename); }
+  boost::system::error_code ec;
+  boost::uintmax_t file_size = boost::filesystem::file_size (filename, ec);
+  if (ec || offset + size > file_size) {
+    throw_aimio_exception (std::string("File is shorter than expected ") + filename); }
+  try
+  {
+    file_mapping m (filename.c_str(), read_only);
+    mapped_region r (m, read_only, offset_t(offset), size);
+    this->mapping.swap (m);
+    this->region.swap (r);
+  }
+  catch (interprocess_exception& e)
+  {
+    throw_aimio_exception (std::string("Unable to map file ") + filename + " : " + e.what());
+  }
+}
+
+}  // namespace
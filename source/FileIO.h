@@ -0,0 +1,362 @@
+// Copyright (c) Eric Nodwell
+// See LICENSE for details.
+
+#ifndef __AimIO_FileIO_h
+#define __AimIO_FileIO_h
+
+#include "AimIO/DataSource.h"
+#include "AimIO/IOBackend.h"
+#include <boost/cstdint.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <functional>
+#include <memory>
+#include <streambuf>
+#include <string>
+#include <vector>
+#include <ctime>
+
+
+namespace AimIO
+{
+
+/// A read-only file handle supporting positional reads (pread on POSIX,
+/// overlapped ReadFile on Windows).
+///
+/// Positional reads do not modify any shared file position, so a single
+/// PositionalFile may be read concurrently from several threads.
+///
+/// For internal use.
+class PositionalFile : public DataSource
+{
+  public:
+
+    /// Opens the file for reading with the given page cache policy. Throws
+    /// AimIOException on failure.
+    explicit PositionalFile (const std::string& filename,
+                             io_policy_t policy = IO_POLICY_BUFFERED);
+    ~PositionalFile ();
+
+    const std::string& Filename () const
+      { return this->filename; }
+
+    /// Size of the file in bytes and time of last modification.
+    void Stat (boost::uint64_t& size, std::time_t& modification_time) const;
+
+    boost::uint64_t Size () const;
+
+    size_t ReadAt (void* buffer, size_t size, boost::uint64_t offset) const;
+
+    std::string Name () const
+      { return this->filename; }
+
+#ifndef _WIN32
+    /// Only for IO_POLICY_BUFFERED, so that the policy is not bypassed.
+    int Descriptor () const
+      { return this->policy == IO_POLICY_BUFFERED ? this->fd : -1; }
+#endif
+
+    /// The policy in effect, which may differ from that requested.
+    io_policy_t Policy () const
+      { return this->policy; }
+
+  protected:
+
+    /// For O_DIRECT: reads through an aligned buffer.
+    size_t ReadAligned (void* buffer, size_t size, boost::uint64_t offset) const;
+
+    std::string filename;
+    io_policy_t policy;
+    bool        aligned;    // transfers must be aligned (O_DIRECT)
+#ifdef _WIN32
+    void* handle;
+#else
+    int fd;
+#endif
+
+  private:
+
+    PositionalFile (const PositionalFile&);
+    PositionalFile& operator= (const PositionalFile&);
+};
+
+
+/// A positional read, for submission as part of a batch.
+///
+/// For internal use.
+struct ReadRequest
+{
+  const DataSource*   file;
+  void*               buffer;
+  size_t              size;
+  boost::uint64_t     offset;
+  size_t              result;   // bytes read; less than size only at end of file
+  bool                failed;   // if true, result is not valid
+
+  ReadRequest ()
+    : file (0), buffer (0), size (0), offset (0), result (0), failed (false) {}
+};
+
+
+/// Interface to a means of performing many positional reads at once.
+/// Implementations are selected with SetIOBackend (IOBackend.h).
+///
+/// For internal use.
+class BatchReader
+{
+  public:
+
+    virtual ~BatchReader ();
+
+    /// Performs the requests, in any order, and returns once all are
+    /// complete. Errors reading the files are reported in the failed member
+    /// of each request; an exception is thrown only if the backend itself
+    /// fails.
+    virtual void Read (ReadRequest* requests, size_t count) = 0;
+
+    void Read (std::vector<ReadRequest>& requests)
+      { if (!requests.empty()) { this->Read (&(requests[0]), requests.size()); } }
+};
+
+
+/// The batch reader of the selected I/O backend. The reader may only be
+/// used by the calling thread.
+///
+/// For internal use.
+BatchReader& GetBatchReader ();
+
+
+/// Reads count little-endian short values starting at offset in chunks of
+/// a size that stays in cache, and passes each chunk, converted to native
+/// byte order, to consume together with the index of its first value.
+///
+/// This allows data to be transformed while reading, without staging
+/// the entire data in memory.
+///
+/// For internal use.
+void ReadShortChunks
+  (
+  const DataSource& file,
+  boost::uint64_t offset,
+  size_t count,
+  const std::function<void(const short* chunk, size_t index, size_t chunk_count)>& consume
+  );
+
+
+/// Pointer to size bytes at offset in file. If the source is in memory (see
+/// DataSource::Data), this points directly into it; otherwise the bytes are
+/// read into buffer. Throws AimIOException if fewer than size bytes are
+/// available.
+///
+/// For internal use.
+const char* BytesAt
+  (
+  const DataSource& file,
+  boost::uint64_t offset,
+  size_t size,
+  std::vector<char>& buffer
+  );
+
+
+/// Reads spans of span_length bytes at the given file offsets, which must be
+/// in increasing order, and passes each to consume with its index. Spans
+/// separated by small gaps are fetched with a single read, as it is cheaper
+/// to read and discard a gap than to issue another system call.
+///
+/// For internal use.
+void ReadSpans
+  (
+  const DataSource& file,
+  const std::vector<boost::uint64_t>& span_offset,
+  boost::uint64_t span_length,
+  const std::function<void(size_t span, const char* data)>& consume
+  );
+
+
+/// Reads size bytes at offset into buffer, in chunks of chunk_size, on the
+/// global pool. The caller can meanwhile process the data that have
+/// already arrived, so that reading and decoding overlap. If a chunk that
+/// the caller needs has not been started by a worker, WaitFor reads it in
+/// the calling thread, so that no free worker is required. Chunks are read
+/// in batches through the batch reader of the selected I/O backend.
+///
+/// For internal use.
+class ReadAhead
+{
+  public:
+
+    /// Starts reading. buffer and file must remain valid for the lifetime
+    /// of this object.
+    ReadAhead (const DataSource& file,
+               char* buffer,
+               size_t size,
+               boost::uint64_t offset,
+               size_t chunk_size);
+
+    /// Stops reading, and waits for any chunk being read.
+    ~ReadAhead ();
+
+    /// Blocks until at least count bytes (or all, if count exceeds the
+    /// size) have been read, and returns the number read so far. Rethrows
+    /// any exception raised by reading.
+    size_t WaitFor (size_t count);
+
+  protected:
+
+    struct State;
+    std::shared_ptr<State>    state;
+
+  private:
+
+    ReadAhead (const ReadAhead&);
+    ReadAhead& operator= (const ReadAhead&);
+};
+
+
+/// A seekable input stream buffer that reads from a DataSource through
+/// a window of fixed size.
+///
+/// This allows the stream-based header parsers to be used while touching
+/// the file with as few positional reads as possible: with a sufficiently
+/// large window, a complete header is obtained with a single read. A source
+/// in memory is parsed directly, without copying it into the window.
+///
+/// For internal use.
+class PositionalStreamBuf : public std::streambuf
+{
+  public:
+
+    PositionalStreamBuf (const DataSource& file, size_t window_size);
+
+    /// A request to fill the window from the start of the file, so that
+    /// the reads of several files can be batched. Once it is complete,
+    /// pass it to Filled.
+    ReadRequest InitialRead ();
+    void Filled (const ReadRequest& request);
+
+  protected:
+
+    virtual int_type underflow ();
+    virtual std::streamsize xsgetn (char* s, std::streamsize n);
+    virtual pos_type seekoff (off_type off,
+                              std::ios_base::seekdir dir,
+                              std::ios_base::openmode which);
+    virtual pos_type seekpos (pos_type pos, std::ios_base::openmode which);
+
+    boost::uint64_t Position () const
+      { return this->window_offset + (this->gptr() - this->eback()); }
+
+    const DataSource&       file;
+    std::vector<char>       window;
+    boost::uint64_t         window_offset;  // file offset of window[0]
+};
+
+
+/// An output stream buffer that passes the data to a DataSink, in blocks of
+/// fixed size. Large writes are passed on directly.
+///
+/// For internal use.
+class SinkStreamBuf : public std::streambuf
+{
+  public:
+
+    SinkStreamBuf (DataSink& sink, size_t buffer_size = 64*1024);
+
+    /// Passes on any buffered data. Exceptions are not propagated; call
+    /// pubsync first to detect errors.
+    ~SinkStreamBuf ();
+
+  protected:
+
+    virtual int_type overflow (int_type c);
+    virtual std::streamsize xsputn (const char* s, std::streamsize n);
+    virtual int sync ();
+
+    DataSink&           sink;
+    std::vector<char>   buffer;
+};
+
+
+/// A file opened for writing, as a DataSink, with a page cache policy.
+///
+/// With IO_POLICY_DIRECT, data are staged in an aligned buffer, and the
+/// final partial block is padded and the file truncated to size. With
+/// IO_POLICY_STREAMING, each completed range is flushed to disk and dropped
+/// from the cache while later ranges are written.
+///
+/// For internal use.
+class FileSink : public DataSink
+{
+  public:
+
+    /// Creates (or truncates) the file. Throws AimIOException on failure.
+    FileSink (const std::string& filename, io_policy_t policy);
+
+    /// Closes the file if Close has not been called. Errors are ignored.
+    ~FileSink ();
+
+    void Write (const void* data, size_t size);
+
+    /// Preallocates the file where supported.
+    void Reserve (size_t size);
+
+    /// Writes any staged data and closes the file. Throws AimIOException
+    /// on error.
+    void Close ();
+
+  protected:
+
+    void WriteFully (const char* data, size_t size);
+    /// For IO_POLICY_STREAMING: starts writeback of new data, and drops
+    /// data already on disk from the cache. If all, waits for everything.
+    void Evict (bool all);
+
+    std::string         filename;
+    io_policy_t         policy;
+    bool                aligned;      // O_DIRECT in effect
+    int                 fd;
+    char*               staging;      // aligned buffer for O_DIRECT
+    size_t              staged;
+    boost::uint64_t     written;      // bytes passed to the file so far
+    boost::uint64_t     flushed;      // bytes whose writeback has been started
+    boost::uint64_t     dropped;      // bytes dropped from the cache
+
+  private:
+
+    FileSink (const FileSink&);
+    FileSink& operator= (const FileSink&);
+};
+
+
+/// A read-only memory mapping of a range of a file.
+///
+/// For internal use.
+class MappedFile
+{
+  public:
+
+    /// Maps size bytes of the file starting at offset (which need not be
+    /// page aligned). Throws AimIOException on failure.
+    MappedFile (const std::string& filename, boost::uint64_t offset, size_t size);
+
+    /// Pointer to the first mapped byte (the byte at offset in the file).
+    const char* Data () const
+      { return reinterpret_cast<const char*>(this->region.get_address()); }
+
+    size_t Size () const
+      { return this->region.get_size(); }
+
+  protected:
+
+    boost::interprocess::file_mapping   mapping;
+    boost::interprocess::mapped_region  region;
+
+  private:
+
+    MappedFile (const MappedFile&);
+    MappedFile& operator= (const MappedFile&);
+};
+
+}  // namespace
+
+#endif
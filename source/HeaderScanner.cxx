@@ -0,0 +1,308 @@
+// Copyright (c) Eric Nodwell
+// See LICENSE for details.
+
+#include "AimIO/HeaderScanner.h"
+#include "AimIO/AimIO.h"
+#include "AimIO/IsqIO.h"
+#include "FileIO.h"
+#include "Parallel.h"
+#include <boost/filesystem.hpp>
+#include <boost/algorithm/string/case_conv.hpp>
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <istream>
+#include <memory>
+
+
+namespace AimIO
+{
+
+// ---------------------------------------------------------------------------
+HeaderRecord::HeaderRecord ()
+  :
+  format (FORMAT_UNKNOWN),
+  file_size (0),
+  modification_time (0),
+  version (AIMFILE_VERSION_30),
+  aim_type (AIMFILE_TYPE_D1Tundef),
+  dimensions (0,0,0),
+  position (0,0,0),
+  offset (0,0,0),
+  element_size (0,0,0),
+  byte_offset (0),
+  patient_index (0),
+  index_measurement (0),
+  site (0),
+  scanner_id (0),
+  scanner_type (0),
+  mu_scaling (0)
+  {}
+
+
+// ---------------------------------------------------------------------------
+ScanOptions::ScanOptions ()
+  :
+  number_of_threads (0),
+  max_outstanding_reads (64),
+  initial_read_size (16384),
+  read_processing_log (true),
+  recursive (false)
+  {}
+
+
+// ---------------------------------------------------------------------------
+static void ReadHeaderRecord
+  (
+  const PositionalFile& file,
+  PositionalStreamBuf& buffer,
+  HeaderRecord& record,
+  const ScanOptions& options
+  )
+{
+  const std::string& path = file.Filename();
+  record = HeaderRecord();
+  record.path = path;
+
+  file.Stat (record.file_size, record.modification_time);
+  std::istream s (&buffer);
+
+  char magic[16];
+  s.read (magic, 16);
+  if (s.gcount() != 16) {
+    throw_aimio_exception (std::string("File too short to be an AIM or ISQ: ") + path); }
+
+  if (strncmp (magic, "CTDATA-HEADER_V1", 16) == 0)
+  {
+    IsqFile isq;
+    isq.ReadImageInfo (s);
+    record.format               = HeaderRecord::FORMAT_ISQ;
+    record.version              = isq.version;
+    record.aim_type             = AIMFILE_TYPE_D1Tshort;
+    record.dimensions           = isq.dimensions_p;
+    record.offset               = isq.offset;
+    record.element_size         = isq.spacing / 1000.0f;
+    record.byte_offset          = isq.data_offset;
+    record.name                 = isq.name;
+    record.patient_index        = isq.patient_index;
+    record.index_measurement    = isq.index_measurement;
+    record.site                 = isq.site;
+    record.scanner_id           = isq.scanner_id;
+    record.scanner_type         = isq.scanner_type;
+    record.mu_scaling           = isq.mu_scaling;
+    record.creation_date_string = isq.creation_date_string;
+  }
+  else
+  {
+    AimFile aim;
+    aim.ReadImageInfo (s);
+    record.format         = HeaderRecord::FORMAT_AIM;
+    record.version        = aim.version;
+    record.aim_type       = aim.aim_type;
+    record.dimensions     = aim.dimensions;
+    record.position       = aim.position;
+    record.offset         = aim.offset;
+    record.element_size   = aim.element_size;
+    record.byte_offset    = aim.byte_offset;
+    if (options.read_processing_log)
+      { record.processing_log.swap (aim.processing_log); }
+  }
+}
+
+
+// ---------------------------------------------------------------------------
+void ReadHeaderRecord
+  (
+  const std::string& path,
+  HeaderRecord& record,
+  const ScanOptions& options
+  )
+{
+  PositionalFile file (path);
+  PositionalStreamBuf buffer (file, std::max (options.initial_read_size, size_t(512)));
+  ReadHeaderRecord (file, buffer, record, options);
+}
+
+
+// ---------------------------------------------------------------------------
+// Largest number of files whose initial reads are submitted together (see
+// IOBackend.h).
+static const size_t scan_batch_size = 16;
+
+// Calls fn(i, file, buffer) for every index of paths, where buffer holds the
+// start of file. The files are opened, and their initial reads performed,
+// in batches. If opening a file or fn throws, fail(i, message) is called.
+static void ForEachFile
+  (
+  const std::vector<std::string>& paths,
+  const ScanOptions& options,
+  const std::function<void(size_t, const PositionalFile&, PositionalStreamBuf&)>& fn,
+  const std::function<void(size_t, const std::string&)>& fail
+  )
+{
+  // The batches are processed on the global pool, by as many threads as
+  // options allow. Each thread has at least one read in flight. With
+  // io_uring a whole batch is in flight at once, so batches are made
+  // smaller to respect max_outstanding_reads; pread reads a batch one file
+  // at a time.
+  const size_t n = paths.size();
+  size_t threads = options.number_of_threads > 0 ? options.number_of_threads : GetNumThreads();
+  size_t batch_size = scan_batch_size;
+  if (options.max_outstanding_reads > 0)
+  {
+    threads = std::min (threads, size_t(options.max_outstanding_reads));
+    if (GetIOBackend() == IO_BACKEND_IO_URING)
+      { batch_size = std::min (scan_batch_size, std::max (size_t(options.max_outstanding_reads) / threads, size_t(1))); }
+  }
+  const size_t number_of_batches = (n + batch_size - 1) / batch_size;
+  const size_t window_size = std::max (options.initial_read_size, size_t(512));
+  ParallelFor (number_of_batches, [&] (size_t b)
+    {
+    const size_t begin = b * batch_size;
+    const size_t end = std::min (begin + batch_size, n);
+    std::vector<std::unique_ptr<PositionalFile> > files (end - begin);
+    std::vector<std::unique_ptr<PositionalStreamBuf> > buffers (end - begin);
+    std::vector<ReadRequest> requests;
+    std::vector<size_t> request_index (end - begin, 0);
+    for (size_t i=begin; i<end; ++i)
+    {
+      try
+      {
+        files[i-begin].reset (new PositionalFile (paths[i]));
+        buffers[i-begin].reset (new PositionalStreamBuf (*files[i-begin], window_size));
+        request_index[i-begin] = requests.size();
+        requests.push_back (buffers[i-begin]->InitialRead());
+      }
+      catch (std::exception& e)
+      {
+        files[i-begin].reset();
+        fail (i, e.what());
+      }
+    }
+    GetBatchReader().Read (requests);
+    for (size_t i=begin; i<end; ++i)
+    {
+      if (!files[i-begin])
+        { continue; }
+      try
+      {
+        buffers[i-begin]->Filled (requests[request_index[i-begin]]);
+        fn (i, *files[i-begin], *buffers[i-begin]);
+      }
+      catch (std::exception& e)
+      {
+        fail (i, e.what());
+      }
+      // Close each file once done with it.
+      buffers[i-begin].reset();
+      files[i-begin].reset();
+    }
+    },
+    int(threads));
+}
+
+
+// ---------------------------------------------------------------------------
+std::vector<HeaderRecord> ScanHeaders
+  (
+  const std::vector<std::string>& paths,
+  const ScanOptions& options
+  )
+{
+  std::vector<HeaderRecord> records (paths.size());
+  ForEachFile (paths, options,
+    [&] (size_t i, const PositionalFile& file, PositionalStreamBuf& buffer)
+      { ReadHeaderRecord (file, buffer, records[i], options); },
+    [&] (size_t i, const std::string& message)
+      {
+      records[i] = HeaderRecord();
+      records[i].path = paths[i];
+      records[i].error = message;
+      });
+  return records;
+}
+
+
+// ---------------------------------------------------------------------------
+void ScanIsqHeaders
+  (
+  const std::vector<std::string>& paths,
+  std::vector<IsqFile>& headers,
+  std::vector<std::string>& errors,
+  const ScanOptions& options
+  )
+{
+  headers.assign (paths.size(), IsqFile());
+  errors.assign (paths.size(), std::string());
+  ForEachFile (paths, options,
+    [&] (size_t i, const PositionalFile&, PositionalStreamBuf& buffer)
+      {
+      std::istream s (&buffer);
+      headers[i].filename = paths[i];
+      headers[i].ReadImageInfo (s);
+      },
+    [&] (size_t i, const std::string& message)
+      {
+      errors[i] = message;
+      if (errors[i].empty())
+        { errors[i] = "Unable to read header."; }
+      });
+}
+
+
+// ---------------------------------------------------------------------------
+std::vector<HeaderRecord> ScanHeaderDirectory
+  (
+  const std::string& directory,
+  const ScanOptions& options
+  )
+{
+  return ScanHeaders (ListImageFiles (directory, options.recursive), options);
+}
+
+
+// ---------------------------------------------------------------------------
+static bool IsImageFileName (const boost::filesystem::path& p)
+{
+  std::string extension = boost::algorithm::to_lower_copy (p.extension().string());
+  // Strip VMS version number, e.g. ".isq;1"
+  size_t semicolon = extension.find (';');
+  if (semicolon != std::string::npos)
+    { extension.resize (semicolon); }
+  return (extension == ".aim" || extension == ".isq");
+}
+
+
+// ---------------------------------------------------------------------------
+std::vector<std::string> ListImageFiles
+  (
+  const std::string& directory,
+  bool recursive
+  )
+{
+  namespace fs = boost::filesystem;
+  if (!fs::is_directory (directory)) {
+    throw_aimio_exception (std::string("Not a directory: ") + directory); }
+
+  std::vector<std::string> paths;
+  if (recursive)
+  {
+    for (fs::recursive_directory_iterator it (directory), end; it != end; ++it)
+    {
+      if (fs::is_regular_file (it->status()) && IsImageFileName (it->path()))
+        { paths.push_back (it->path().string()); }
+    }
+  }
+  else
+  {
+    for (fs::directory_iterator it (directory), end; it != end; ++it)
+    {
+      if (fs::is_regular_file (it->status()) && IsImageFileName (it->path()))
+        { paths.push_back (it->path().string()); }
+    }
+  }
+  std::sort (paths.begin(), paths.end());
+  return paths;
+}
+
+}  // namespace
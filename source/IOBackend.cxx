@@ -0,0 +1,397 @@
+// Copyright (c) Eric Nodwell
+// See LICENSE for details.
+
+#include "AimIO/IOBackend.h"
+#include "AimIO/Exception.h"
+#include "FileIO.h"
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <cerrno>
+#include <cstring>
+
+#ifdef AIMIO_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+
+namespace AimIO
+{
+
+// ---------------------------------------------------------------------------
+BatchReader::~BatchReader ()
+{}
+
+
+// ===========================================================================
+// pread backend
+
+namespace
+{
+
+class PreadBatchReader : public BatchReader
+{
+  public:
+
+    void Read (ReadRequest* requests, size_t count)
+    {
+      for (size_t i=0; i<count; ++i)
+      {
+        try
+        {
+          requests[i].result = requests[i].file->ReadAt (requests[i].buffer,
+                                                         requests[i].size,
+                                                         requests[i].offset);
+          requests[i].failed = false;
+        }
+        catch (AimIOException&)
+        {
+          requests[i].failed = true;
+        }
+      }
+    }
+};
+
+}  // anonymous namespace
+
+
+// ===========================================================================
+// io_uring backend
+//
+// Uses the system calls directly, so that liburing is not required. Reads
+// are IORING_OP_READV, which is supported since Linux 5.1.
+
+#ifdef AIMIO_HAVE_IO_URING
+
+namespace
+{
+
+class UringBatchReader : public BatchReader
+{
+  public:
+
+    /// Throws AimIOException if a ring cannot be created.
+    explicit UringBatchReader (unsigned entries);
+    ~UringBatchReader ();
+
+    void Read (ReadRequest* requests, size_t count);
+
+  protected:
+
+    /// Unmaps the rings and closes the ring file descriptor.
+    void Release ();
+
+    /// Submits requests[0,count), count <= number of entries, and waits
+    /// for their completion.
+    void ReadSome (ReadRequest* requests, size_t count);
+
+    int                   ring_fd;
+    unsigned              entries;
+    void*                 sq_ring;
+    size_t                sq_ring_size;
+    void*                 cq_ring;
+    size_t                cq_ring_size;
+    io_uring_sqe*         sqes;
+    size_t                sqes_size;
+    unsigned*             sq_tail;
+    unsigned*             sq_mask;
+    unsigned*             sq_array;
+    unsigned*             cq_head;
+    unsigned*             cq_tail;
+    unsigned*             cq_mask;
+    io_uring_cqe*         cqes;
+    std::vector<iovec>    iovecs;
+
+  private:
+
+    UringBatchReader (const UringBatchReader&);
+    UringBatchReader& operator= (const UringBatchReader&);
+};
+
+// ---------------------------------------------------------------------------
+UringBatchReader::UringBatchReader (unsigned entries_)
+  :
+  ring_fd (-1),
+  sq_ring (MAP_FAILED),
+  cq_ring (MAP_FAILED),
+  sqes (0)
+{
+  io_uring_params params;
+  memset (&params, 0, sizeof(params));
+  this->ring_fd = int(syscall (__NR_io_uring_setup, entries_, &params));
+  if (this->ring_fd < 0) {
+    throw_aimio_exception ("io_uring is not available."); }
+  this->entries = params.sq_entries;
+
+  this->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  this->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single_mmap)
+    { this->sq_ring_size = this->cq_ring_size = std::max (this->sq_ring_size, this->cq_ring_size); }
+  this->sq_ring = mmap (0, this->sq_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, this->ring_fd, IORING_OFF_SQ_RING);
+  if (this->sq_ring != MAP_FAILED)
+  {
+    this->cq_ring = single_mmap ? this->sq_ring :
+                    mmap (0, this->cq_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, this->ring_fd, IORING_OFF_CQ_RING);
+  }
+  this->sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+  void* s = MAP_FAILED;
+  if (this->cq_ring != MAP_FAILED)
+  {
+    s = mmap (0, this->sqes_size, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, this->ring_fd, IORING_OFF_SQES);
+  }
+  if (s == MAP_FAILED)
+  {
+    this->Release();
+    throw_aimio_exception ("Unable to map io_uring.");
+  }
+  this->sqes = reinterpret_cast<io_uring_sqe*>(s);
+
+  char* sq = reinterpret_cast<char*>(this->sq_ring);
+  char* cq = reinterpret_cast<char*>(this->cq_ring);
+  this->sq_tail  = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  this->sq_mask  = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  this->sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+  this->cq_head  = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+  this->cq_tail  = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+  this->cq_mask  = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+  this->cqes     = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+  this->iovecs.resize (this->entries);
+}
+
+// ---------------------------------------------------------------------------
+UringBatchReader::~UringBatchReader ()
+{
+  this->Release();
+}
+
+// ---------------------------------------------------------------------------
+void UringBatchReader::Release ()
+{
+  if (this->sqes)
+    { munmap (this->sqes, this->sqes_size); }
+  if (this->cq_ring != MAP_FAILED && this->cq_ring != this->sq_ring)
+    { munmap (this->cq_ring, this->cq_ring_size); }
+  if (this->sq_ring != MAP_FAILED)
+    { munmap (this->sq_ring, this->sq_ring_size); }
+  if (this->ring_fd >= 0)
+    { close (this->ring_fd); }
+}
+
+// ---------------------------------------------------------------------------
+void UringBatchReader::ReadSome (ReadRequest* requests, size_t count)
+{
+  unsigned tail = *this->sq_tail;
+  const unsigned mask = *this->sq_mask;
+  size_t submitted = 0;
+  for (size_t i=0; i<count; ++i)
+  {
+    requests[i].result = 0;
+    requests[i].failed = true;
+    // Sources other than files are read below.
+    int fd = requests[i].file->Descriptor();
+    if (fd < 0)
+      { continue; }
+    unsigned index = (tail + unsigned(submitted)) & mask;
+    this->iovecs[i].iov_base = requests[i].buffer;
+    this->iovecs[i].iov_len = requests[i].size;
+    io_uring_sqe* sqe = this->sqes + index;
+    memset (sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->off = requests[i].offset;
+    sqe->addr = reinterpret_cast<unsigned long>(&(this->iovecs[i]));
+    sqe->len = 1;
+    sqe->user_data = i;
+    this->sq_array[index] = index;
+    ++submitted;
+  }
+  __atomic_store_n (this->sq_tail, tail + unsigned(submitted), __ATOMIC_RELEASE);
+
+  size_t to_submit = submitted;
+  size_t remaining = submitted;
+  bool polling = false;
+  while (remaining)
+  {
+    if (polling)
+    {
+      usleep (50);
+    }
+    else
+    {
+      int r = int(syscall (__NR_io_uring_enter, this->ring_fd, unsigned(to_submit),
+                           unsigned(remaining), unsigned(IORING_ENTER_GETEVENTS), 0, 0));
+      if (r < 0)
+      {
+        if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+          { continue; }
+        // Reads in flight refer to iovecs and the callers' buffers, so they
+        // must complete before returning. Withdraw the entries not yet
+        // submitted (the kernel only consumes entries during
+        // io_uring_enter), and wait for the others by polling the
+        // completion ring. The requests left failed are read below.
+        __atomic_store_n (this->sq_tail, tail + unsigned(submitted - to_submit), __ATOMIC_RELEASE);
+        remaining -= to_submit;
+        to_submit = 0;
+        polling = true;
+      }
+      else
+      {
+        to_submit -= std::min (size_t(r), to_submit);
+      }
+    }
+    unsigned head = *this->cq_head;
+    const unsigned completed = __atomic_load_n (this->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != completed; ++head)
+    {
+      const io_uring_cqe& cqe = this->cqes[head & *this->cq_mask];
+      ReadRequest& request = requests[cqe.user_data];
+      if (cqe.res >= 0)
+      {
+        request.result = size_t(cqe.res);
+        request.failed = false;
+      }
+      --remaining;
+    }
+    __atomic_store_n (this->cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  // Complete short reads (which can occur before end of file, for example
+  // on network file systems), retry failed ones, and read those not
+  // submitted, synchronously.
+  for (size_t i=0; i<count; ++i)
+  {
+    ReadRequest& request = requests[i];
+    if (!request.failed && (request.result == request.size || request.result == 0))
+      { continue; }
+    try
+    {
+      size_t done = request.failed ? 0 : request.result;
+      request.result = done + request.file->ReadAt (reinterpret_cast<char*>(request.buffer) + done,
+                                                    request.size - done,
+                                                    request.offset + done);
+      request.failed = false;
+    }
+    catch (AimIOException&)
+    {
+      request.failed = true;
+    }
+  }
+}
+
+// ---------------------------------------------------------------------------
+void UringBatchReader::Read (ReadRequest* requests, size_t count)
+{
+  while (count)
+  {
+    size_t n = std::min (count, size_t(this->entries));
+    this->ReadSome (requests, n);
+    requests += n;
+    count -= n;
+  }
+}
+
+}  // anonymous namespace
+
+#endif  // AIMIO_HAVE_IO_URING
+
+
+// ===========================================================================
+// Selection
+
+namespace
+{
+
+const unsigned ring_entries = 64;
+
+std::mutex      backend_mutex;
+io_backend_t    backend = IO_BACKEND_DEFAULT;
+
+#ifdef AIMIO_HAVE_IO_URING
+std::once_flag  uring_checked;
+bool            uring_available = false;
+#endif
+
+}  // anonymous namespace
+
+
+// ---------------------------------------------------------------------------
+bool IsIOBackendAvailable (io_backend_t b)
+{
+  if (b == IO_BACKEND_DEFAULT || b == IO_BACKEND_PREAD)
+    { return true; }
+#ifdef AIMIO_HAVE_IO_URING
+  if (b == IO_BACKEND_IO_URING)
+  {
+    // The kernel may lack io_uring, or it may be disabled or blocked.
+    std::call_once (uring_checked, [] ()
+      {
+      try
+      {
+        UringBatchReader ring (1);
+        uring_available = true;
+      }
+      catch (AimIOException&)
+      {
+        uring_available = false;
+      }
+      });
+    return uring_available;
+  }
+#endif
+  return false;
+}
+
+// ---------------------------------------------------------------------------
+void SetIOBackend (io_backend_t b)
+{
+  aimio_verbose_assert (IsIOBackendAvailable (b), "I/O backend not available.");
+  std::lock_guard<std::mutex> lock (backend_mutex);
+  backend = b;
+}
+
+// ---------------------------------------------------------------------------
+io_backend_t GetIOBackend ()
+{
+  io_backend_t b;
+  {
+    std::lock_guard<std::mutex> lock (backend_mutex);
+    b = backend;
+  }
+  if (b == IO_BACKEND_DEFAULT)
+    { b = IsIOBackendAvailable (IO_BACKEND_IO_URING) ? IO_BACKEND_IO_URING : IO_BACKEND_PREAD; }
+  return b;
+}
+
+// ---------------------------------------------------------------------------
+BatchReader& GetBatchReader ()
+{
+  static PreadBatchReader pread_reader;
+#ifdef AIMIO_HAVE_IO_URING
+  if (GetIOBackend() == IO_BACKEND_IO_URING)
+  {
+    // A ring may only be used by one thread, so each thread has its own.
+    thread_local std::unique_ptr<UringBatchReader> ring;
+    thread_local bool ring_failed = false;
+    if (!ring && !ring_failed)
+    {
+      try
+        { ring.reset (new UringBatchReader (ring_entries)); }
+      catch (AimIOException&)
+        { ring_failed = true; }   // for example, a limit on locked memory
+    }
+    if (ring)
+      { return *ring; }
+  }
+#endif
+  return pread_reader;
+}
+
+}  // namespace
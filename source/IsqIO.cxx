@@ -4,12 +4,16 @@
 #include "AimIO/IsqIO.h"
 #include "AimIO/AimIO.h"
 #include "AimIO/DateTime.h"
+#include "AimIO/IsqSlabReader.h"
 #include "Compression.h"
+#include "FileIO.h"
+#include "Parallel.h"
 #include "PlatformFloat.h"
 #include <boost/endian/conversion.hpp>
 #include <boost/endian/arithmetic.hpp>
 #include <iostream>
 #include <sstream>
+#include <cstring>
 
 
 using namespace boost::endian;
@@ -77,6 +81,7 @@ IsqFile::IsqFile ()
   dimensions_p (0,0,0),
   dimensions_um (0,0,0),
   offset (0,0,0),
+  spacing (0,0,0),
   slice_thickness_um (0),
   slice_increment_um (0),
   slice_1_pos_um (0),
@@ -94,7 +99,9 @@ IsqFile::IsqFile ()
   recon_alg (0),
   energy (0),
   intensity (0),
-  data_offset (0)
+  holder (0),
+  data_offset (0),
+  io_policy (IO_POLICY_BUFFERED)
 {
   creation_date[0] = 0;
   creation_date[1] = 0;
@@ -115,6 +122,7 @@ IsqFile::IsqFile (const char* fn)
   dimensions_p (0,0,0),
   dimensions_um (0,0,0),
   offset (0,0,0),
+  spacing (0,0,0),
   slice_thickness_um (0),
   slice_increment_um (0),
   slice_1_pos_um (0),
@@ -132,7 +140,9 @@ IsqFile::IsqFile (const char* fn)
   recon_alg (0),
   energy (0),
   intensity (0),
-  data_offset (0)
+  holder (0),
+  data_offset (0),
+  io_policy (IO_POLICY_BUFFERED)
 {
   creation_date[0] = 0;
   creation_date[1] = 0;
@@ -140,7 +150,7 @@ IsqFile::IsqFile (const char* fn)
 
 
 // ---------------------------------------------------------------------------
-void IsqFile::ReadBlockList (std::ifstream& f)
+void IsqFile::ReadBlockList (std::istream& f)
 {
 
   // Read in first 16 bytes
@@ -161,15 +171,25 @@ void IsqFile::ReadBlockList (std::ifstream& f)
   this->block_list[0].offset = 0;
   
   // The number of empty 512 data blocks is defined in the header block at offset 508.
-  this->block_list[1].offset = 512 * (1 + little_to_native(*(reinterpret_cast<boost::int32_t*>(&(buffer[0]) + 508))));
-  // ISQ data size is equal to nr_of_bytes defined in header block at offset 20 minus 
-  // the offset number of bytes to the start of ISQ data (equivalent to dimx*dimy*dimz*size) 
-  this->block_list[1].size = little_to_native(*(reinterpret_cast<boost::int32_t*>(&(buffer[0]) + 20))) - this->block_list[1].offset;
+  this->block_list[1].offset = 512 * (1 + boost::uint64_t(little_to_native(*(reinterpret_cast<boost::int32_t*>(&(buffer[0]) + 508)))));
+  // ISQ data size is dimx*dimy*dimz*sizeof(short). The dimensions are at
+  // offset 44 of the header block. (nr_of_bytes, at offset 20, is only 32 bit
+  // and so overflows for data larger than 2 GB.)
+  boost::uint64_t data_size = sizeof(short);
+  for (int i=0; i<3; ++i)
+  {
+    boost::int32_t d = little_to_native(*(reinterpret_cast<boost::int32_t*>(&(buffer[0]) + 44) + i));
+    if (d < 0) {
+      throw_aimio_exception ("Negative dimensions in ISQ header."); }
+    data_size *= d;
+  }
+  aimio_verbose_assert (data_size == size_t(data_size), "ISQ data too large for this platform.");
+  this->block_list[1].size = size_t(data_size);
   
 }
 
 // ---------------------------------------------------------------------------
-void IsqFile::ReadHeader (std::ifstream& f)
+void IsqFile::ReadHeader (std::istream& f)
 {
   aimio_assert (this->block_list.size());
   
@@ -253,12 +273,32 @@ void IsqFile::ReadHeader (std::ifstream& f)
 // ---------------------------------------------------------------------------
 void IsqFile::ReadImageInfo ()
 {
+  if (this->source)
+  {
+    std::shared_ptr<const DataSource> opened = this->source;
+    PositionalStreamBuf buffer (*opened, 64*1024);
+    std::istream f (&buffer);
+    this->ReadImageInfo (f);
+    return;
+  }
+
   // Open file.
   std::ifstream f (this->filename.c_str(), std::ios_base::in | std::ios_base::binary);
   if (!f) {
     throw_aimio_exception (std::string("Unable to open file ") + filename); }
   f.exceptions ( std::ifstream::failbit | std::ifstream::badbit );
 
+  this->ReadImageInfo (f);
+}
+
+
+// ---------------------------------------------------------------------------
+void IsqFile::ReadImageInfo (std::istream& f)
+{
+  f.exceptions ( std::istream::failbit | std::istream::badbit );
+  f.seekg (0);
+  this->mapped_data.reset();
+
   this->ReadBlockList (f);
   this->ReadHeader (f);
 }
@@ -272,24 +312,22 @@ void IsqFile::ReadAnyIsqData
   AimIO::aim_storage_format_t type
   )
 {
-  // Open file.
-  std::ifstream f (this->filename.c_str(), std::ios_base::in | std::ios_base::binary);
-  if (!f) {
-    throw_aimio_exception (std::string("Unable to open file ") + filename); }
-  f.exceptions ( std::ifstream::failbit | std::ifstream::badbit );
-
-  std::vector<char> buffer (this->block_list[buffer_number].size);
-  f.seekg (this->block_list[buffer_number].offset);
-  f.read (&(buffer[0]), this->block_list[buffer_number].size);
-
-  AimIO::Decompress (data,
-                     &(buffer[0]),
-                     buffer.size(),
-                     type,
-                     this->dimensions_p,
-                     this->offset,
-                     (this->version == AIMFILE_VERSION_30)); // boolean is always false
-                     
+  // ISQ data are uncompressed, so read them directly into the output
+  // buffer and just fix the byte order in place if required.
+  aimio_assert (type == AIMFILE_TYPE_D1Tshort);
+  aimio_assert (this->block_list[buffer_number].size == long_product(this->dimensions_p) * sizeof(short));
+  std::shared_ptr<const DataSource> file = this->OpenSource();
+  file->ReadExactlyAt (data,
+                       this->block_list[buffer_number].size,
+                       this->block_list[buffer_number].offset);
+
+  if (order::native != order::little)
+  {
+    short* out = reinterpret_cast<short*>(data);
+    size_t N = long_product(this->dimensions_p);
+    for (size_t i=0; i<N; ++i)
+      { little_to_native_inplace (out[i]); }
+  }
 }
 
 // ---------------------------------------------------------------------------
@@ -301,4 +339,247 @@ void IsqFile::ReadImageData (short* data, size_t size)
   this->ReadAnyIsqData (data, 1, AIMFILE_TYPE_D1Tshort);
 }
 
+// ---------------------------------------------------------------------------
+std::future<void> IsqFile::ReadImageDataAsync (short* data, size_t size)
+{
+  return RunAsync<void> ([this, data, size] () { this->ReadImageData (data, size); });
+}
+
+// ---------------------------------------------------------------------------
+void IsqFile::ReadImageDataAsync (short* data, size_t size, const completion_callback_t& done)
+{
+  RunWithCallback ([this, data, size] () { this->ReadImageData (data, size); }, done);
+}
+
+// ---------------------------------------------------------------------------
+void IsqFile::ReadBinnedImageData
+  (
+  short* data,
+  size_t size,
+  int bin,
+  bin_method_t method
+  )
+{
+  aimio_assert (this->block_list.size() >= 2);
+  aimio_assert (this->buffer_type == ISQFILE_TYPE_SHORT);
+  n88::tuplet<3,int> out_dims = BinnedDimensions (this->dimensions_p, bin);
+  aimio_assert (size == long_product(out_dims));
+  if (size == 0)
+    { return; }
+
+  // Reading of the following slabs overlaps with binning.
+  const size_t out_slice_size = size_t(out_dims[0]) * out_dims[1];
+  const n88::tuplet<3,int> out_slab_dims (out_dims[0], out_dims[1], 1);
+  IsqSlabReader slabs (*this, bin);
+  std::vector<short> slab;
+  int first_slice = 0;
+  int number_of_slices = 0;
+  for (int k=0; k<out_dims[2]; ++k)
+  {
+    bool got_slab = slabs.Next (slab, first_slice, number_of_slices);
+    aimio_assert (got_slab);
+    n88::tuplet<3,int> slab_dims (this->dimensions_p[0], this->dimensions_p[1], number_of_slices);
+    BinImageData (&(slab[0]), slab_dims, n88::tuplet<3,int>(0,0,0), out_slab_dims,
+                  bin, method, data + k*out_slice_size);
+  }
+}
+
+// ---------------------------------------------------------------------------
+Calibration IsqFile::GetCalibration () const
+{
+  Calibration calibration;
+  calibration.mu_scaling = this->mu_scaling;
+  return calibration;
+}
+
+// ---------------------------------------------------------------------------
+void IsqFile::ReadCalibratedImageData
+  (
+  float* data,
+  size_t size,
+  calibration_unit_t unit
+  )
+{
+  this->ReadCalibratedImageData (data, size, unit, this->GetCalibration());
+}
+
+// ---------------------------------------------------------------------------
+void IsqFile::ReadCalibratedImageData
+  (
+  float* data,
+  size_t size,
+  calibration_unit_t unit,
+  const Calibration& calibration
+  )
+{
+  aimio_assert (this->block_list.size() >= 2);
+  aimio_assert (size == long_product(this->dimensions_p));
+
+  std::shared_ptr<const DataSource> opened = this->OpenSource();
+  const DataSource& file = *opened;
+  ReadShortChunks (file, this->block_list[1].offset, size,
+    [&] (const short* chunk, size_t index, size_t count)
+      { CalibrateData (chunk, data + index, count, calibration, unit); });
+}
+
+// ---------------------------------------------------------------------------
+boost::uint64_t IsqFile::SliceOffset (int slice) const
+{
+  aimio_assert (this->block_list.size() >= 2);
+  return this->block_list[1].offset
+         + boost::uint64_t(slice) * this->dimensions_p[0] * this->dimensions_p[1] * sizeof(short);
+}
+
+// ---------------------------------------------------------------------------
+void IsqFile::ReadSlices
+  (
+  int first_slice,
+  int number_of_slices,
+  short* data,
+  size_t size
+  )
+{
+  aimio_assert (this->block_list.size() >= 2);
+  aimio_assert (this->buffer_type == ISQFILE_TYPE_SHORT);
+  aimio_verbose_assert (first_slice >= 0 && number_of_slices >= 0 &&
+                        first_slice + number_of_slices <= this->dimensions_p[2],
+    "Slice range outside image.");
+  size_t slice_size = size_t(this->dimensions_p[0]) * this->dimensions_p[1];
+  aimio_assert (size == slice_size * number_of_slices);
+  if (size == 0)
+    { return; }
+
+  std::shared_ptr<const DataSource> opened = this->OpenSource();
+  const DataSource& file = *opened;
+  file.ReadExactlyAt (data, size * sizeof(short), this->SliceOffset (first_slice));
+
+  if (order::native != order::little)
+  {
+    for (size_t i=0; i<size; ++i)
+      { little_to_native_inplace (data[i]); }
+  }
+}
+
+// ---------------------------------------------------------------------------
+n88::tuplet<3,int> IsqFile::RegionDimensions
+  (
+  const n88::tuplet<3,int>& extent,
+  const n88::tuplet<3,int>& stride
+  )
+{
+  n88::tuplet<3,int> dims;
+  for (int i=0; i<3; ++i)
+  {
+    aimio_verbose_assert (stride[i] > 0, "Stride must be positive.");
+    dims[i] = extent[i] > 0 ? (extent[i] + stride[i] - 1) / stride[i] : 0;
+  }
+  return dims;
+}
+
+// ---------------------------------------------------------------------------
+void IsqFile::ReadRegion
+  (
+  const n88::tuplet<3,int>& start,
+  const n88::tuplet<3,int>& extent,
+  const n88::tuplet<3,int>& stride,
+  short* data,
+  size_t size
+  )
+{
+  aimio_assert (this->block_list.size() >= 2);
+  aimio_assert (this->buffer_type == ISQFILE_TYPE_SHORT);
+  for (int i=0; i<3; ++i)
+  {
+    aimio_verbose_assert (start[i] >= 0 && extent[i] >= 0 &&
+                          start[i] + extent[i] <= this->dimensions_p[i],
+      "Region outside image.");
+  }
+  n88::tuplet<3,int> dims = RegionDimensions (extent, stride);
+  aimio_assert (size == long_product (dims));
+  if (size == 0)
+    { return; }
+
+  // Each output row comes from a contiguous span of bytes in the file.
+  // Spans are in increasing order of file offset.
+  const boost::uint64_t dimx = this->dimensions_p[0];
+  const boost::uint64_t span_length = (boost::uint64_t(dims[0] - 1) * stride[0] + 1) * sizeof(short);
+  const size_t number_of_rows = size_t(dims[1]) * dims[2];
+  std::vector<boost::uint64_t> span_offset (number_of_rows);
+  for (int k=0; k<dims[2]; ++k)
+  {
+    boost::uint64_t slice_offset = this->SliceOffset (start[2] + k*stride[2]);
+    for (int j=0; j<dims[1]; ++j)
+    {
+      boost::uint64_t y = start[1] + j*stride[1];
+      span_offset[size_t(k)*dims[1] + j] = slice_offset + (y*dimx + start[0]) * sizeof(short);
+    }
+  }
+
+  std::shared_ptr<const DataSource> opened = this->OpenSource();
+  const DataSource& file = *opened;
+  ReadSpans (file, span_offset, span_length,
+    [&] (size_t r, const char* src)
+    {
+      short* dest = data + r*dims[0];
+      for (int i=0; i<dims[0]; ++i)
+      {
+        // Copy bytewise: src is not necessarily aligned.
+        short v;
+        std::memcpy (&v, src + size_t(i)*stride[0]*sizeof(short), sizeof(short));
+        dest[i] = little_to_native (v);
+      }
+    });
+}
+
+// ---------------------------------------------------------------------------
+boost::uint64_t IsqFile::ImageDataSize () const
+{
+  aimio_assert (this->block_list.size() >= 2);
+  return this->block_list[1].size;
+}
+
+// ---------------------------------------------------------------------------
+const short* IsqFile::MapImageData ()
+{
+  aimio_assert (this->block_list.size() >= 2);
+  aimio_verbose_assert (order::native == order::little,
+    "Zero-copy access to ISQ data requires a little-endian platform.");
+  if (this->source)
+  {
+    aimio_verbose_assert (this->source->Data(),
+      "Zero-copy access to ISQ data requires a source in memory.");
+    aimio_verbose_assert (this->block_list[1].offset + this->block_list[1].size <= this->source->Size(),
+      "Source is shorter than expected.");
+    return reinterpret_cast<const short*>(this->source->Data() + this->block_list[1].offset);
+  }
+  if (!this->mapped_data)
+  {
+    this->mapped_data.reset (new MappedFile (this->filename,
+                                             this->block_list[1].offset,
+                                             this->block_list[1].size));
+  }
+  return reinterpret_cast<const short*>(this->mapped_data->Data());
+}
+
+// ---------------------------------------------------------------------------
+void IsqFile::UnmapImageData ()
+{
+  this->mapped_data.reset();
+}
+
+// ---------------------------------------------------------------------------
+void IsqFile::SetSource (const std::shared_ptr<const DataSource>& s)
+{
+  this->source = s;
+  this->mapped_data.reset();
+}
+
+// ---------------------------------------------------------------------------
+std::shared_ptr<const DataSource> IsqFile::OpenSource () const
+{
+  if (this->source)
+    { return this->source; }
+  return std::make_shared<PositionalFile> (this->filename, this->io_policy);
+}
+
 }  // namespace
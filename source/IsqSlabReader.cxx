@@ -0,0 +1,132 @@
+// Copyright (c) Steven Boyd
+// See LICENSE for details.
+
+#include "AimIO/IsqSlabReader.h"
+#include "FileIO.h"
+#include "Parallel.h"
+#include <boost/endian/conversion.hpp>
+#include <algorithm>
+
+
+using namespace boost::endian;
+
+namespace AimIO
+{
+
+// ---------------------------------------------------------------------------
+static std::vector<short> ReadSlab
+  (
+  std::shared_ptr<const DataSource> file,
+  boost::uint64_t offset,
+  size_t count
+  )
+{
+  std::vector<short> slab (count);
+  if (count)
+    { file->ReadExactlyAt (&(slab[0]), count * sizeof(short), offset); }
+  if (order::native != order::little)
+  {
+    for (size_t i=0; i<count; ++i)
+      { little_to_native_inplace (slab[i]); }
+  }
+  return slab;
+}
+
+
+// ---------------------------------------------------------------------------
+struct IsqSlabReader::PendingSlab
+{
+  PendingSlab (int first, int number, const std::function<std::vector<short>()>& read)
+    : first_slice (first), number_of_slices (number), data (read) {}
+
+  int                                 first_slice;
+  int                                 number_of_slices;
+  ClaimableTask<std::vector<short> >  data;
+};
+
+
+// ---------------------------------------------------------------------------
+IsqSlabReader::IsqSlabReader
+  (
+  const IsqFile& reader,
+  int thickness,
+  int ahead
+  )
+  :
+  file (reader.OpenSource()),
+  dimensions (reader.dimensions_p),
+  data_offset (reader.SliceOffset (0)),
+  slab_thickness (thickness),
+  read_ahead (ahead),
+  next_slice (0)
+{
+  aimio_verbose_assert (thickness > 0, "Slab thickness must be positive.");
+  aimio_verbose_assert (ahead >= 0, "Read-ahead must not be negative.");
+  this->ScheduleReads (this->read_ahead);
+}
+
+
+// ---------------------------------------------------------------------------
+IsqSlabReader::~IsqSlabReader ()
+{
+  // Reads in progress refer to the file; wait for them.
+  for (size_t i=0; i<this->pending.size(); ++i)
+    { this->pending[i]->data.Cancel(); }
+}
+
+
+// ---------------------------------------------------------------------------
+void IsqSlabReader::ScheduleReads (size_t count)
+{
+  size_t slice_size = size_t(this->dimensions[0]) * this->dimensions[1];
+  while (this->pending.size() < count &&
+         this->next_slice < this->dimensions[2])
+  {
+    int number_of_slices = std::min (this->slab_thickness, this->dimensions[2] - this->next_slice);
+    std::shared_ptr<const DataSource> f = this->file;
+    boost::uint64_t offset = this->data_offset + boost::uint64_t(this->next_slice) * slice_size * sizeof(short);
+    size_t count = slice_size * number_of_slices;
+    this->pending.push_back (std::unique_ptr<PendingSlab> (new PendingSlab (
+        this->next_slice, number_of_slices,
+        [f, offset, count] () { return ReadSlab (f, offset, count); })));
+    this->next_slice += number_of_slices;
+  }
+}
+
+
+// ---------------------------------------------------------------------------
+bool IsqSlabReader::Next
+  (
+  std::vector<short>& slab,
+  int& first_slice,
+  int& number_of_slices
+  )
+{
+  // Without read-ahead, nothing has been scheduled yet.
+  this->ScheduleReads (1);
+  if (this->pending.empty())
+    { return false; }
+  std::unique_ptr<PendingSlab> p (std::move (this->pending.front()));
+  this->pending.pop_front();
+  first_slice = p->first_slice;
+  number_of_slices = p->number_of_slices;
+  slab = p->data.Get();   // rethrows any read error
+  // Only now, with the previous contents of slab released, read further
+  // ahead, so that at most read_ahead+1 slabs are held.
+  this->ScheduleReads (this->read_ahead);
+  return true;
+}
+
+
+// ---------------------------------------------------------------------------
+void IsqSlabReader::Seek (int slice)
+{
+  aimio_verbose_assert (slice >= 0 && slice <= this->dimensions[2], "Slice outside image.");
+  for (size_t i=0; i<this->pending.size(); ++i)
+    { this->pending[i]->data.Cancel(); }
+  this->pending.clear();
+  this->next_slice = slice;
+  this->ScheduleReads (this->read_ahead);
+}
+
+}  // namespace
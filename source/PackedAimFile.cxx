@@ -0,0 +1,461 @@
+// Copyright (c) Eric Nodwell
+// See LICENSE for details.
+
+#include "AimIO/PackedAimFile.h"
+#include "FileIO.h"
+#include "BinaryBuffer.h"
+#include "Parallel.h"
+#include <boost/filesystem/operations.hpp>
+#include <algorithm>
+#include <fstream>
+#include <cstring>
+
+
+using n88::tuplet;
+
+namespace AimIO
+{
+
+// Packed file layout (all values little endian):
+//
+//   char[8]   "AIMIOPCK"
+//   uint32    format version
+//   uint64    size of header, including the chunk table
+//   int32     id, reference
+//   int32[3]  position, dimensions, offset, supdim, suppos, subdim, testoff
+//   float[3]  element size in mm
+//   int32     assoc id, nr, size, type
+//   string    processing log (uint32 length, then characters)
+//   uint64    number of chunks (one per z slice)
+//   then per chunk:
+//     uint64    offset of data
+//     uint32    size of data
+//
+// followed by the chunks. A chunk consists of blocks of up to block_length
+// values. Each block is one byte giving the bit width w, then the zig-zag
+// coded prediction residuals packed in w bits each, least significant bit
+// first, padded to a whole byte.
+
+static const char* packed_magic = "AIMIOPCK";
+static const boost::uint32_t packed_format_version = 1;
+static const size_t chunk_entry_size = 8 + 4;
+static const size_t block_length = 128;
+
+// The residual of each value from its prediction, zig-zag coded.
+// Arithmetic is modulo 2^16, so that any difference is representable.
+static void PredictRows (const short* in, size_t dx, size_t dy, boost::uint16_t* out)
+{
+  for (size_t j=0; j<dy; ++j)
+  {
+    const short* row = in + j*dx;
+    boost::uint16_t* z = out + j*dx;
+    boost::uint16_t first_prediction = j ? boost::uint16_t(row[-long(dx)]) : 0;
+    boost::uint16_t d = boost::uint16_t(row[0]) - first_prediction;
+    z[0] = boost::uint16_t(d << 1) ^ boost::uint16_t(-(d >> 15));
+    for (size_t i=1; i<dx; ++i)
+    {
+      d = boost::uint16_t(row[i]) - boost::uint16_t(row[i-1]);
+      z[i] = boost::uint16_t(d << 1) ^ boost::uint16_t(-(d >> 15));
+    }
+  }
+}
+
+static void UnpredictRows (const boost::uint16_t* in, size_t dx, size_t dy, short* out)
+{
+  for (size_t j=0; j<dy; ++j)
+  {
+    const boost::uint16_t* z = in + j*dx;
+    short* row = out + j*dx;
+    boost::uint16_t previous = j ? boost::uint16_t(row[-long(dx)]) : 0;
+    for (size_t i=0; i<dx; ++i)
+    {
+      boost::uint16_t d = (z[i] >> 1) ^ boost::uint16_t(-(z[i] & 1));
+      previous = boost::uint16_t(previous + d);
+      row[i] = short(previous);
+    }
+  }
+}
+
+static void PackBlock (const boost::uint16_t* z, size_t n, std::vector<char>& out)
+{
+  // Separate loops, so that the width reduction can be vectorized.
+  boost::uint16_t bits_set = 0;
+  for (size_t i=0; i<n; ++i)
+    { bits_set |= z[i]; }
+  int width = 0;
+  while (width < 16 && (bits_set >> width))
+    { ++width; }
+  out.push_back (char(width));
+  if (width == 0)
+    { return; }
+
+  boost::uint64_t accumulator = 0;
+  int bits = 0;
+  for (size_t i=0; i<n; ++i)
+  {
+    accumulator |= boost::uint64_t(z[i]) << bits;
+    bits += width;
+    while (bits >= 8)
+    {
+      out.push_back (char(accumulator & 0xff));
+      accumulator >>= 8;
+      bits -= 8;
+    }
+  }
+  if (bits > 0)
+    { out.push_back (char(accumulator & 0xff)); }
+}
+
+static const unsigned char* UnpackBlock
+  (
+  const unsigned char* in,
+  const unsigned char* in_end,
+  boost::uint16_t* z,
+  size_t n
+  )
+{
+  aimio_verbose_assert (in < in_end, "Corrupt packed data.");
+  int width = *in++;
+  aimio_verbose_assert (width <= 16, "Corrupt packed data.");
+  if (width == 0)
+  {
+    std::fill (z, z + n, 0);
+    return in;
+  }
+  size_t bytes = (n*width + 7) / 8;
+  aimio_verbose_assert (size_t(in_end - in) >= bytes, "Corrupt packed data.");
+  const boost::uint16_t mask = boost::uint16_t((1u << width) - 1);
+  boost::uint64_t accumulator = 0;
+  int bits = 0;
+  for (size_t i=0; i<n; ++i)
+  {
+    while (bits < width)
+    {
+      accumulator |= boost::uint64_t(*in++) << bits;
+      bits += 8;
+    }
+    z[i] = boost::uint16_t(accumulator) & mask;
+    accumulator >>= width;
+    bits -= width;
+  }
+  return in;
+}
+
+static void EncodeSlice (const short* in, size_t dx, size_t dy, std::vector<char>& out)
+{
+  const size_t n = dx*dy;
+  std::vector<boost::uint16_t> z (n);
+  PredictRows (in, dx, dy, &(z[0]));
+  out.clear();
+  for (size_t i=0; i<n; i+=block_length)
+    { PackBlock (&(z[i]), std::min (block_length, n - i), out); }
+}
+
+static void DecodeSlice
+  (
+  const char* in,
+  size_t size,
+  size_t dx,
+  size_t dy,
+  short* out,
+  std::vector<boost::uint16_t>& z
+  )
+{
+  const size_t n = dx*dy;
+  z.resize (n);
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(in);
+  const unsigned char* end = p + size;
+  for (size_t i=0; i<n; i+=block_length)
+    { p = UnpackBlock (p, end, &(z[i]), std::min (block_length, n - i)); }
+  aimio_verbose_assert (p == end, "Corrupt packed data.");
+  UnpredictRows (&(z[0]), dx, dy, out);
+}
+
+
+// ===========================================================================
+// PackedAimFile
+
+// ---------------------------------------------------------------------------
+PackedAimFile::PackedAimFile ()
+  :
+  id (0),
+  reference (0),
+  position (0,0,0),
+  dimensions (0,0,0),
+  offset (0,0,0),
+  supdim (0,0,0),
+  suppos (0,0,0),
+  subdim (0,0,0),
+  testoff (0,0,0),
+  element_size (0,0,0),
+  assoc_id (0),
+  assoc_nr (0),
+  assoc_size (0),
+  assoc_type (1),
+  table_offset (0),
+  write_position (0)
+{}
+
+// ---------------------------------------------------------------------------
+PackedAimFile::PackedAimFile (const char* filename_)
+  :
+  filename (filename_),
+  id (0),
+  reference (0),
+  position (0,0,0),
+  dimensions (0,0,0),
+  offset (0,0,0),
+  supdim (0,0,0),
+  suppos (0,0,0),
+  subdim (0,0,0),
+  testoff (0,0,0),
+  element_size (0,0,0),
+  assoc_id (0),
+  assoc_nr (0),
+  assoc_size (0),
+  assoc_type (1),
+  table_offset (0),
+  write_position (0)
+{}
+
+// ---------------------------------------------------------------------------
+void PackedAimFile::SetImageInfo (const AimFile& aim)
+{
+  this->processing_log = aim.processing_log;
+  this->id = aim.id;
+  this->reference = aim.reference;
+  this->position = aim.position;
+  this->dimensions = aim.dimensions;
+  this->offset = aim.offset;
+  this->supdim = aim.supdim;
+  this->suppos = aim.suppos;
+  this->subdim = aim.subdim;
+  this->testoff = aim.testoff;
+  this->element_size = aim.element_size;
+  this->assoc_id = aim.assoc_id;
+  this->assoc_nr = aim.assoc_nr;
+  this->assoc_size = aim.assoc_size;
+  this->assoc_type = aim.assoc_type;
+}
+
+// ---------------------------------------------------------------------------
+void PackedAimFile::GetImageInfo (AimFile& aim) const
+{
+  aim.version = AIMFILE_VERSION_30;
+  aim.aim_type = AIMFILE_TYPE_D1Tshort;
+  aim.buffer_type = AimFile::AIMFILE_TYPE_SHORT;
+  aim.processing_log = this->processing_log;
+  aim.id = this->id;
+  aim.reference = this->reference;
+  aim.position = this->position;
+  aim.dimensions = this->dimensions;
+  aim.offset = this->offset;
+  aim.supdim = this->supdim;
+  aim.suppos = this->suppos;
+  aim.subdim = this->subdim;
+  aim.testoff = this->testoff;
+  aim.element_size = this->element_size;
+  aim.assoc_id = this->assoc_id;
+  aim.assoc_nr = this->assoc_nr;
+  aim.assoc_size = this->assoc_size;
+  aim.assoc_type = this->assoc_type;
+}
+
+// ---------------------------------------------------------------------------
+void PackedAimFile::WriteHeader (std::ostream& f)
+{
+  BufferWriter w;
+  w.Bytes (packed_magic, 8);
+  w.Integer (packed_format_version);
+  const size_t header_size_position = w.buffer.size();
+  w.Integer (boost::uint64_t(0));
+  w.Integer (this->id);
+  w.Integer (this->reference);
+  w.Tuplet (this->position);
+  w.Tuplet (this->dimensions);
+  w.Tuplet (this->offset);
+  w.Tuplet (this->supdim);
+  w.Tuplet (this->suppos);
+  w.Tuplet (this->subdim);
+  w.Tuplet (this->testoff);
+  for (int j=0; j<3; ++j)
+    { w.Float (this->element_size[j]); }
+  w.Integer (this->assoc_id);
+  w.Integer (this->assoc_nr);
+  w.Integer (this->assoc_size);
+  w.Integer (this->assoc_type);
+  w.String (this->processing_log);
+  w.Integer (boost::uint64_t(this->dimensions[2]));
+  this->table_offset = w.buffer.size();
+  this->write_position = this->table_offset + boost::uint64_t(this->dimensions[2]) * chunk_entry_size;
+
+  BufferWriter header_size;
+  header_size.Integer (this->write_position);
+  std::copy (header_size.buffer.begin(), header_size.buffer.end(),
+             w.buffer.begin() + header_size_position);
+  // Reserve space for the chunk table.
+  w.buffer.resize (this->write_position, 0);
+  f.write (&(w.buffer[0]), w.buffer.size());
+  this->chunks.clear();
+}
+
+// ---------------------------------------------------------------------------
+void PackedAimFile::WriteSlices (std::ostream& f, const short* data, int number_of_slices)
+{
+  const size_t dx = this->dimensions[0];
+  const size_t dy = this->dimensions[1];
+  std::vector<char> encoded;
+  for (int k=0; k<number_of_slices; ++k)
+  {
+    EncodeSlice (data + k*dx*dy, dx, dy, encoded);
+    ChunkEntry e;
+    e.offset = this->write_position;
+    e.size = boost::uint32_t (encoded.size());
+    this->chunks.push_back (e);
+    if (!encoded.empty())
+      { f.write (&(encoded[0]), encoded.size()); }
+    this->write_position += encoded.size();
+  }
+}
+
+// ---------------------------------------------------------------------------
+void PackedAimFile::WriteChunkTable (std::ostream& f)
+{
+  aimio_assert (this->chunks.size() == size_t(this->dimensions[2]));
+  BufferWriter t;
+  for (size_t i=0; i<this->chunks.size(); ++i)
+  {
+    t.Integer (this->chunks[i].offset);
+    t.Integer (this->chunks[i].size);
+  }
+  if (!t.buffer.empty())
+  {
+    f.seekp (std::streamoff(this->table_offset));
+    f.write (&(t.buffer[0]), t.buffer.size());
+  }
+}
+
+// ---------------------------------------------------------------------------
+void PackedAimFile::WriteImageData (const short* data)
+{
+  std::ofstream f (this->filename.c_str(), std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+  if (!f) {
+    throw_aimio_exception (std::string("Unable to open file ") + filename); }
+  f.exceptions ( std::ofstream::failbit | std::ofstream::badbit );
+  this->WriteHeader (f);
+  this->WriteSlices (f, data, this->dimensions[2]);
+  this->WriteChunkTable (f);
+}
+
+// ---------------------------------------------------------------------------
+void PackedAimFile::Pack (AimFile& reader, const std::string& filename)
+{
+  aimio_verbose_assert (reader.aim_type == AIMFILE_TYPE_D1Tshort,
+    "Only D1Tshort AIM data can be packed.");
+  PackedAimFile packed (filename.c_str());
+  packed.SetImageInfo (reader);
+  std::ofstream f (filename.c_str(), std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+  if (!f) {
+    throw_aimio_exception (std::string("Unable to open file ") + filename); }
+  f.exceptions ( std::ofstream::failbit | std::ofstream::badbit );
+  packed.WriteHeader (f);
+  reader.ForEachSlab<short> (16,
+    [&] (short* slab, int, int number_of_slices)
+      { packed.WriteSlices (f, slab, number_of_slices); });
+  packed.WriteChunkTable (f);
+}
+
+// ---------------------------------------------------------------------------
+void PackedAimFile::ReadImageInfo ()
+{
+  std::ifstream f (this->filename.c_str(), std::ios_base::in | std::ios_base::binary);
+  if (!f) {
+    throw_aimio_exception (std::string("Unable to open file ") + filename); }
+  f.exceptions ( std::ifstream::failbit | std::ifstream::badbit );
+
+  std::vector<char> buffer (8 + 4 + 8);
+  f.read (&(buffer[0]), buffer.size());
+  BufferReader preamble (buffer, "Packed file");
+  char magic[8];
+  preamble.Bytes (magic, 8);
+  if (strncmp (magic, packed_magic, 8) != 0) {
+    throw_aimio_exception (std::string("Not an AimIO packed file: ") + filename); }
+  if (preamble.Integer<boost::uint32_t>() != packed_format_version) {
+    throw_aimio_exception (std::string("Unsupported packed file version: ") + filename); }
+  boost::uint64_t header_size = preamble.Integer<boost::uint64_t>();
+  // Checked against the file before allocating, so that a corrupt size
+  // cannot cause an enormous allocation.
+  aimio_verbose_assert (header_size > buffer.size() &&
+                        header_size <= boost::filesystem::file_size (this->filename),
+    "Corrupt packed file.");
+
+  buffer.resize (header_size);
+  f.read (buffer.data() + 20, header_size - 20);
+  BufferReader r (buffer, "Packed file");
+  r.position = 20;
+  this->id = r.Integer<boost::int32_t>();
+  this->reference = r.Integer<boost::int32_t>();
+  this->position = r.Tuplet();
+  this->dimensions = r.Tuplet();
+  this->offset = r.Tuplet();
+  this->supdim = r.Tuplet();
+  this->suppos = r.Tuplet();
+  this->subdim = r.Tuplet();
+  this->testoff = r.Tuplet();
+  for (int j=0; j<3; ++j)
+    { this->element_size[j] = r.Float(); }
+  this->assoc_id = r.Integer<boost::int32_t>();
+  this->assoc_nr = r.Integer<boost::int32_t>();
+  this->assoc_size = r.Integer<boost::int32_t>();
+  this->assoc_type = r.Integer<boost::int32_t>();
+  this->processing_log = r.String();
+  boost::uint64_t n = r.Integer<boost::uint64_t>();
+  aimio_verbose_assert (n == boost::uint64_t(std::max (this->dimensions[2], 0)), "Corrupt packed file.");
+  this->chunks.resize (n);
+  for (size_t i=0; i<n; ++i)
+  {
+    this->chunks[i].offset = r.Integer<boost::uint64_t>();
+    this->chunks[i].size = r.Integer<boost::uint32_t>();
+  }
+}
+
+// ---------------------------------------------------------------------------
+void PackedAimFile::ReadSlices (int first_slice, int number_of_slices, short* data, size_t size)
+{
+  aimio_verbose_assert (first_slice >= 0 && number_of_slices >= 0 &&
+                        first_slice + number_of_slices <= int(this->chunks.size()),
+    "Slices out of range.");
+  const size_t dx = this->dimensions[0];
+  const size_t dy = this->dimensions[1];
+  aimio_assert (size == dx * dy * number_of_slices);
+  if (size == 0)
+    { return; }
+
+  // Chunks are contiguous, so the slices are read with a single read.
+  const ChunkEntry& first = this->chunks[first_slice];
+  const ChunkEntry& last = this->chunks[first_slice + number_of_slices - 1];
+  aimio_verbose_assert (last.offset >= first.offset, "Corrupt packed file.");
+  const size_t total = last.offset + last.size - first.offset;
+  std::vector<char> encoded (std::max<size_t> (total, 1));
+  PositionalFile file (this->filename);
+  file.ReadExactlyAt (&(encoded[0]), total, first.offset);
+
+  // The slices are independent, so are decoded in parallel.
+  ParallelFor (number_of_slices, [&] (size_t k)
+    {
+    const ChunkEntry& e = this->chunks[first_slice + k];
+    aimio_verbose_assert (e.offset >= first.offset && e.offset - first.offset + e.size <= total,
+      "Corrupt packed file.");
+    std::vector<boost::uint16_t> z;
+    DecodeSlice (&(encoded[0]) + (e.offset - first.offset), e.size, dx, dy, data + k*dx*dy, z);
+    });
+}
+
+// ---------------------------------------------------------------------------
+void PackedAimFile::ReadImageData (short* data, size_t size)
+{
+  aimio_assert (size == long_product (this->dimensions));
+  this->ReadSlices (0, this->dimensions[2], data, size);
+}
+
+}  // namespace
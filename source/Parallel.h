@@ -0,0 +1,178 @@
+// Copyright (c) Eric Nodwell
+// See LICENSE for details.
+
+#ifndef __AimIO_Parallel_h
+#define __AimIO_Parallel_h
+
+#include "AimIO/ThreadPool.h"
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <future>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <mutex>
+
+
+namespace AimIO
+{
+
+/// A simple fixed-size pool of worker threads. This is the default global
+/// pool.
+///
+/// For internal use.
+class WorkerPool : public ThreadPool
+{
+  public:
+
+    /// Creates the worker threads. A value <= 0 selects the number of
+    /// hardware threads.
+    explicit WorkerPool (int number_of_threads);
+
+    /// Waits for all queued tasks to finish, then joins the workers.
+    ~WorkerPool ();
+
+    int NumberOfThreads () const
+      { return int(this->workers.size()); }
+
+    /// Queues a task. Tasks must not throw.
+    void Submit (const std::function<void()>& task);
+
+  protected:
+
+    struct Queue;
+
+    static void WorkerLoop (std::shared_ptr<Queue> queue);
+
+    std::vector<std::thread>            workers;
+    std::shared_ptr<Queue>              queue;
+
+  private:
+
+    WorkerPool (const WorkerPool&);
+    WorkerPool& operator= (const WorkerPool&);
+};
+
+/// Calls fn(i) for every i in [0,n), distributing the calls over at most
+/// max_concurrency threads of the pool. The calling thread participates, so
+/// this may safely be called from a task that is itself running on the pool.
+///
+/// Blocks until all calls are complete. If any call throws, the remaining
+/// indices are skipped and the first exception is rethrown in the calling
+/// thread.
+void ParallelFor (
+    ThreadPool& pool,
+    size_t n,
+    const std::function<void(size_t)>& fn,
+    int max_concurrency = 0);
+
+/// As above, using the global pool (see GetThreadPool). If AimIO is
+/// single-threaded, the calls are made in order by the calling thread.
+void ParallelFor (
+    size_t n,
+    const std::function<void(size_t)>& fn,
+    int max_concurrency = 0);
+
+/// Number of parts into which ParallelForRange divides n elements: enough
+/// to balance the load over the global pool, but with at least grain
+/// elements in each part.
+size_t NumberOfParts (size_t n, size_t grain);
+
+/// Elements [begin,end) of part p of n elements divided into parts.
+inline void PartRange (size_t p, size_t parts, size_t n, size_t& begin, size_t& end)
+{
+  begin = p * n / parts;
+  end = (p + 1) * n / parts;
+}
+
+/// Calls fn(begin,end) on consecutive ranges covering [0,n), of at least
+/// grain elements each, in parallel on the global pool.
+void ParallelForRange (
+    size_t n,
+    size_t grain,
+    const std::function<void(size_t begin, size_t end)>& fn);
+
+/// Runs task on the global pool, returning its result through a future.
+/// If AimIO is single-threaded, the task is run when the result is
+/// requested.
+template <typename R>
+std::future<R> RunAsync (const std::function<R()>& task)
+{
+  std::shared_ptr<ThreadPool> pool = GetThreadPool();
+  if (!pool)
+    { return std::async (std::launch::deferred, task); }
+  std::shared_ptr<std::packaged_task<R()> > packaged (new std::packaged_task<R()> (task));
+  pool->Submit ([packaged] () { (*packaged)(); });
+  return packaged->get_future();
+}
+
+/// A task queued on the global pool, which the thread that needs its result
+/// runs itself if no worker has started it. Waiting for the result therefore
+/// never depends on a free worker, even when called from a task of the pool.
+/// If AimIO is single-threaded, the task is only run by Get.
+///
+/// For internal use.
+template <typename R>
+class ClaimableTask
+{
+  public:
+
+    explicit ClaimableTask (const std::function<R()>& task)
+      :
+      state (new State (task)),
+      result (state->task.get_future())
+    {
+      std::shared_ptr<ThreadPool> pool = GetThreadPool();
+      if (pool)
+      {
+        std::shared_ptr<State> s = this->state;
+        pool->Submit ([s] () { s->Claim(); });
+      }
+    }
+
+    /// Returns the result, running the task in the calling thread if no
+    /// worker has started it. Rethrows any exception thrown by the task.
+    R Get ()
+    {
+      this->state->Claim();
+      return this->result.get();
+    }
+
+    /// Ensures that the task is not running and will not run. If no worker
+    /// has started it, it is not run at all.
+    void Cancel ()
+    {
+      if (!this->state->taken.exchange (true))
+        { return; }
+      this->result.wait();
+    }
+
+  protected:
+
+    struct State
+    {
+      explicit State (const std::function<R()>& t) : task (t), taken (false) {}
+
+      void Claim ()
+      {
+        if (!this->taken.exchange (true))
+          { this->task(); }
+      }
+
+      std::packaged_task<R()>   task;
+      std::atomic<bool>         taken;
+    };
+
+    std::shared_ptr<State>    state;
+    std::future<R>            result;
+};
+
+/// Runs task on the global pool, then calls done with the exception thrown
+/// by task, or null. If AimIO is single-threaded, both are called before
+/// returning.
+void RunWithCallback (const std::function<void()>& task, const completion_callback_t& done);
+
+}  // namespace
+
+#endif
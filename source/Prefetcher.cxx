@@ -0,0 +1,209 @@
+// Copyright (c) Eric Nodwell
+// See LICENSE for details.
+
+#include "AimIO/Prefetcher.h"
+#include "Compression.h"
+#include "FileIO.h"
+#include <boost/endian/conversion.hpp>
+#include <cstring>
+
+
+using namespace boost::endian;
+
+namespace AimIO
+{
+
+// ---------------------------------------------------------------------------
+PrefetchedImage::PrefetchedImage ()
+  :
+  format (HeaderRecord::FORMAT_UNKNOWN),
+  in_memory (false)
+  {}
+
+// ---------------------------------------------------------------------------
+void PrefetchedImage::ReadImageData (char* data, size_t size)
+{
+  aimio_verbose_assert (this->format == HeaderRecord::FORMAT_AIM, "ISQ data are short.");
+  if (!this->in_memory)
+    { this->aim.ReadImageData (data, size); return; }
+  aimio_assert (this->aim.buffer_type == AimFile::AIMFILE_TYPE_CHAR);
+  aimio_assert (size == long_product(this->aim.dimensions));
+  Decompress (data, this->image_data.data(), this->image_data.size(), this->aim.aim_type,
+              this->aim.dimensions, this->aim.offset, (this->aim.version == AIMFILE_VERSION_30));
+}
+
+// ---------------------------------------------------------------------------
+void PrefetchedImage::ReadImageData (short* data, size_t size)
+{
+  if (this->format == HeaderRecord::FORMAT_ISQ)
+  {
+    if (!this->in_memory)
+      { this->isq.ReadImageData (data, size); return; }
+    aimio_assert (size == long_product(this->isq.dimensions_p));
+    memcpy (data, this->image_data.data(), size * sizeof(short));
+    if (order::native != order::little)
+    {
+      for (size_t i=0; i<size; ++i)
+        { little_to_native_inplace (data[i]); }
+    }
+    return;
+  }
+  if (!this->in_memory)
+    { this->aim.ReadImageData (data, size); return; }
+  aimio_assert (this->aim.buffer_type == AimFile::AIMFILE_TYPE_SHORT);
+  aimio_assert (size == long_product(this->aim.dimensions));
+  Decompress (data, this->image_data.data(), this->image_data.size(), this->aim.aim_type,
+              this->aim.dimensions, this->aim.offset, (this->aim.version == AIMFILE_VERSION_30));
+}
+
+// ---------------------------------------------------------------------------
+void PrefetchedImage::ReadImageData (float* data, size_t size)
+{
+  aimio_verbose_assert (this->format == HeaderRecord::FORMAT_AIM, "ISQ data are short.");
+  if (!this->in_memory)
+    { this->aim.ReadImageData (data, size); return; }
+  aimio_assert (this->aim.buffer_type == AimFile::AIMFILE_TYPE_FLOAT);
+  aimio_assert (size == long_product(this->aim.dimensions));
+  Decompress (data, this->image_data.data(), this->image_data.size(), this->aim.aim_type,
+              this->aim.dimensions, this->aim.offset, (this->aim.version == AIMFILE_VERSION_30));
+}
+
+// ---------------------------------------------------------------------------
+Prefetcher::Prefetcher
+  (
+  const std::vector<std::string>& filenames_,
+  int depth_,
+  size_t memory_budget_
+  )
+  :
+  filenames (filenames_),
+  depth (depth_),
+  memory_budget (memory_budget_),
+  bytes_held (0),
+  number_returned (0),
+  stopped (false)
+{
+  aimio_verbose_assert (depth > 0, "Prefetch depth must be at least 1.");
+  this->thread = std::thread (&Prefetcher::Run, this);
+}
+
+// ---------------------------------------------------------------------------
+Prefetcher::~Prefetcher ()
+{
+  {
+    std::lock_guard<std::mutex> lock (this->mutex);
+    this->stopped = true;
+  }
+  this->changed.notify_all();
+  this->thread.join();
+}
+
+// ---------------------------------------------------------------------------
+void Prefetcher::Load
+  (
+  PrefetchedImage& image,
+  const std::function<bool(size_t)>& reserve
+  )
+{
+  PositionalFile file (image.filename);
+  PositionalStreamBuf buffer (file, 16384);
+  std::istream s (&buffer);
+
+  char magic[16];
+  s.read (magic, 16);
+  if (s.gcount() != 16) {
+    throw_aimio_exception (std::string("File too short to be an AIM or ISQ: ") + image.filename); }
+
+  boost::uint64_t offset = 0;
+  size_t size = 0;
+  if (strncmp (magic, "CTDATA-HEADER_V1", 16) == 0)
+  {
+    image.format = HeaderRecord::FORMAT_ISQ;
+    image.isq.filename = image.filename;
+    image.isq.ReadImageInfo (s);
+    offset = image.isq.data_offset;
+    size = long_product(image.isq.dimensions_p) * sizeof(short);
+  }
+  else
+  {
+    image.format = HeaderRecord::FORMAT_AIM;
+    image.aim.filename = image.filename;
+    image.aim.ReadImageInfo (s);
+    aimio_assert (image.aim.block_list.size() >= 3);
+    offset = image.aim.block_list[2].offset;
+    size = image.aim.block_list[2].size;
+  }
+
+  if (reserve (size))
+  {
+    image.image_data.resize (size);
+    file.ReadExactlyAt (image.image_data.data(), size, offset);
+    image.in_memory = true;
+  }
+}
+
+// ---------------------------------------------------------------------------
+void Prefetcher::Run ()
+{
+  for (size_t i=0; i<this->filenames.size(); ++i)
+  {
+    {
+      std::unique_lock<std::mutex> lock (this->mutex);
+      this->changed.wait (lock, [this] ()
+        { return this->stopped || this->ready.size() < size_t(this->depth); });
+      if (this->stopped)
+        { return; }
+    }
+
+    Entry entry;
+    entry.image.reset (new PrefetchedImage);
+    entry.image->filename = this->filenames[i];
+    entry.bytes = 0;
+    try
+    {
+      // Wait for earlier files to be taken if there is not enough room,
+      // unless the data would never fit.
+      this->Load (*entry.image, [this, &entry] (size_t bytes)
+        {
+        if (bytes > this->memory_budget)
+          { return false; }
+        std::unique_lock<std::mutex> lock (this->mutex);
+        this->changed.wait (lock, [this, bytes] ()
+          { return this->stopped || this->bytes_held + bytes <= this->memory_budget; });
+        if (this->stopped)
+          { return false; }
+        this->bytes_held += bytes;
+        entry.bytes = bytes;
+        return true;
+        });
+    }
+    catch (...)
+    {
+      entry.error = std::current_exception();
+    }
+
+    std::lock_guard<std::mutex> lock (this->mutex);
+    this->ready.push_back (entry);
+    this->changed.notify_all();
+  }
+}
+
+// ---------------------------------------------------------------------------
+std::shared_ptr<PrefetchedImage> Prefetcher::Next ()
+{
+  std::unique_lock<std::mutex> lock (this->mutex);
+  if (this->number_returned == this->filenames.size())
+    { return std::shared_ptr<PrefetchedImage>(); }
+  this->changed.wait (lock, [this] () { return !this->ready.empty(); });
+  Entry entry = this->ready.front();
+  this->ready.pop_front();
+  this->bytes_held -= entry.bytes;
+  ++this->number_returned;
+  lock.unlock();
+  this->changed.notify_all();
+  if (entry.error)
+    { std::rethrow_exception (entry.error); }
+  return entry.image;
+}
+
+}  // namespace
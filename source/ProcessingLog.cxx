@@ -0,0 +1,79 @@
+// Copyright (c) Eric Nodwell
+// See LICENSE for details.
+
+#include "AimIO/ProcessingLog.h"
+
+
+namespace AimIO
+{
+
+// ---------------------------------------------------------------------------
+static bool ParseLogLine
+  (
+  const std::string& log,
+  size_t begin,
+  size_t end,
+  std::string& name,
+  std::string& value
+  )
+{
+  const char* blanks = " \t\r";
+  size_t name_begin = log.find_first_not_of (blanks, begin);
+  if (name_begin >= end || log[name_begin] == '!')
+    { return false; }
+  size_t split = log.find ("  ", name_begin);
+  if (split >= end)
+    { split = end; }
+  size_t name_end = log.find_last_not_of (blanks, split-1);
+  name = log.substr (name_begin, name_end + 1 - name_begin);
+
+  value.clear();
+  size_t value_begin = log.find_first_not_of (blanks, split);
+  if (value_begin < end)
+  {
+    size_t value_end = log.find_last_not_of (blanks, end-1);
+    value = log.substr (value_begin, value_end + 1 - value_begin);
+  }
+  return true;
+}
+
+
+// ---------------------------------------------------------------------------
+LogFields ParseProcessingLog (const std::string& log)
+{
+  LogFields fields;
+  std::string name;
+  std::string value;
+  size_t begin = 0;
+  while (begin < log.size())
+  {
+    size_t end = log.find ('\n', begin);
+    if (end == std::string::npos)
+      { end = log.size(); }
+    if (ParseLogLine (log, begin, end, name, value))
+      { fields.insert (LogFields::value_type (name, value)); }  // keeps first
+    begin = end + 1;
+  }
+  return fields;
+}
+
+
+// ---------------------------------------------------------------------------
+std::string GetLogField (const std::string& log, const std::string& field)
+{
+  std::string name;
+  std::string value;
+  size_t begin = 0;
+  while (begin < log.size())
+  {
+    size_t end = log.find ('\n', begin);
+    if (end == std::string::npos)
+      { end = log.size(); }
+    if (ParseLogLine (log, begin, end, name, value) && name == field)
+      { return value; }
+    begin = end + 1;
+  }
+  return std::string();
+}
+
+}  // namespace
@@ -0,0 +1,406 @@
+// Copyright (c) Eric Nodwell
+// See LICENSE for details.
+
+#include "AimIO/Pyramid.h"
+#include "FileIO.h"
+#include "BinaryBuffer.h"
+#include <boost/filesystem.hpp>
+#include <boost/endian/conversion.hpp>
+#include <algorithm>
+#include <fstream>
+#include <cstring>
+
+
+using namespace boost::endian;
+using n88::tuplet;
+
+namespace AimIO
+{
+
+// Sidecar file layout (all values little endian):
+//
+//   char[8]   "AIMIOPYR"
+//   uint32    format version
+//   uint32    buffer type (AimFile::buffer_format_t)
+//   uint32    bin method
+//   uint32    number of levels
+//   uint64    size of the AIM file
+//   int64     modification time of the AIM file
+//   then per level:
+//     int32[3]  dimensions
+//     float[3]  element size in mm
+//     uint64    offset of data
+//     uint64    size of data
+//
+// The data of each level follow, each starting at a multiple of page_size.
+// Float data are stored in IEEE format.
+
+static const char* pyramid_magic = "AIMIOPYR";
+static const boost::uint32_t pyramid_format_version = 1;
+static const boost::uint64_t page_size = 4096;
+
+// Converts data in place between native order and that of the sidecar file.
+static void SwapToLittle (char*, size_t) {}
+
+static void SwapToLittle (short* data, size_t n)
+{
+  for (size_t i=0; i<n; ++i)
+    { native_to_little_inplace (data[i]); }
+}
+
+static void SwapToLittle (float* data, size_t n)
+{
+  for (size_t i=0; i<n; ++i)
+  {
+    boost::uint32_t bits;
+    memcpy (&bits, data + i, sizeof(bits));
+    native_to_little_inplace (bits);
+    memcpy (data + i, &bits, sizeof(bits));
+  }
+}
+
+static boost::uint64_t RoundUpToPage (boost::uint64_t x)
+{
+  return (x + page_size - 1) / page_size * page_size;
+}
+
+// ---------------------------------------------------------------------------
+AimPyramid::AimPyramid ()
+  :
+  buffer_type (AimFile::AIMFILE_TYPE_UNDEFINED),
+  method (BIN_AVERAGE),
+  source_size (0),
+  source_modification_time (0)
+{}
+
+// ---------------------------------------------------------------------------
+AimPyramid::AimPyramid (const char* filename_)
+  :
+  filename (filename_),
+  buffer_type (AimFile::AIMFILE_TYPE_UNDEFINED),
+  method (BIN_AVERAGE),
+  source_size (0),
+  source_modification_time (0)
+{}
+
+// ---------------------------------------------------------------------------
+std::string AimPyramid::SidecarName (const std::string& aim_filename)
+{
+  return aim_filename + ".pyr";
+}
+
+// ---------------------------------------------------------------------------
+// Bins each level by 2 as slices of the level above arrive, and writes the
+// slices of each level at their place in the file.
+template <typename T>
+struct PyramidBuilder
+{
+  struct LevelState
+  {
+    tuplet<3,int>    input_dims;  // a slab of 2 slices of the level above
+    tuplet<3,int>    output_dims; // one output slice
+    boost::uint64_t  offset;
+    std::vector<T>   pending;
+    int              pending_slices;
+    int              slices_written;
+    std::vector<T>   output;
+  };
+
+  std::ostream&            f;
+  bin_method_t             method;
+  std::vector<LevelState>  states;
+  std::vector<T>           swapped;
+
+  PyramidBuilder (std::ostream& f_, bin_method_t method_)
+    : f (f_), method (method_) {}
+
+  void Push (size_t level, const T* slice)
+  {
+    if (level >= this->states.size())
+      { return; }
+    LevelState& s = this->states[level];
+    if (s.slices_written == s.output_dims[2])
+      { return; }  // a trailing odd slice
+    size_t slice_size = size_t(s.input_dims[0]) * s.input_dims[1];
+    std::copy (slice, slice + slice_size, s.pending.begin() + s.pending_slices*slice_size);
+    if (++s.pending_slices < 2)
+      { return; }
+    s.pending_slices = 0;
+    tuplet<3,int> one_slice (s.output_dims[0], s.output_dims[1], 1);
+    BinImageData (&(s.pending[0]), s.input_dims, tuplet<3,int>(0,0,0), one_slice,
+                  2, this->method, &(s.output[0]));
+    this->Write (s.output, s.offset + boost::uint64_t(s.slices_written) * s.output.size() * sizeof(T));
+    ++s.slices_written;
+    this->Push (level + 1, &(s.output[0]));
+  }
+
+  void Write (const std::vector<T>& data, boost::uint64_t offset)
+  {
+    const T* p = &(data[0]);
+    if (order::native != order::little)
+    {
+      this->swapped = data;
+      SwapToLittle (&(this->swapped[0]), this->swapped.size());
+      p = &(this->swapped[0]);
+    }
+    this->f.seekp (std::streamoff(offset));
+    this->f.write (reinterpret_cast<const char*>(p), data.size() * sizeof(T));
+  }
+};
+
+// ---------------------------------------------------------------------------
+template <typename T>
+void AimPyramid::CreateAny
+  (
+  AimFile& reader,
+  const std::string& filename,
+  int max_levels,
+  bin_method_t method
+  )
+{
+  // Level dimensions and layout.
+  std::vector<Level> levels;
+  tuplet<3,int> dims = reader.dimensions;
+  tuplet<3,float> element_size = reader.element_size;
+  while (max_levels <= 0 || int(levels.size()) < max_levels)
+  {
+    tuplet<3,int> next = BinnedDimensions (dims, 2);
+    if (next[0] < 1 || next[1] < 1 || next[2] < 1)
+      { break; }
+    Level level;
+    level.dimensions = next;
+    level.element_size = element_size * 2.0f;
+    level.size = boost::uint64_t(long_product(next)) * sizeof(T);
+    levels.push_back (level);
+    dims = next;
+    element_size = level.element_size;
+  }
+
+  boost::uint64_t header_size = 8 + 4*4 + 8 + 8 + levels.size()*(3*4 + 3*4 + 8 + 8);
+  boost::uint64_t offset = RoundUpToPage (header_size);
+  for (size_t i=0; i<levels.size(); ++i)
+  {
+    levels[i].offset = offset;
+    offset = RoundUpToPage (offset + levels[i].size);
+  }
+
+  BufferWriter w;
+  w.Bytes (pyramid_magic, 8);
+  w.Integer (pyramid_format_version);
+  w.Integer (boost::uint32_t(reader.buffer_type));
+  w.Integer (boost::uint32_t(method));
+  w.Integer (boost::uint32_t(levels.size()));
+  w.Integer (boost::uint64_t(boost::filesystem::file_size (reader.filename)));
+  w.Integer (boost::int64_t(boost::filesystem::last_write_time (reader.filename)));
+  for (size_t i=0; i<levels.size(); ++i)
+  {
+    w.Tuplet (levels[i].dimensions);
+    for (int j=0; j<3; ++j)
+      { w.Float (levels[i].element_size[j]); }
+    w.Integer (levels[i].offset);
+    w.Integer (levels[i].size);
+  }
+  const std::vector<char>& header = w.buffer;
+  aimio_assert (header.size() == header_size);
+
+  // Write to a temporary file, which is renamed when complete.
+  std::string temporary = filename + ".tmp";
+  {
+    std::ofstream f (temporary.c_str(), std::ios_base::out | std::ios_base::binary);
+    if (!f) {
+      throw_aimio_exception (std::string("Unable to open file ") + temporary); }
+    f.exceptions ( std::ofstream::failbit | std::ofstream::badbit );
+    f.write (&(header[0]), header.size());
+
+    PyramidBuilder<T> builder (f, method);
+    builder.states.resize (levels.size());
+    tuplet<3,int> input_dims = reader.dimensions;
+    for (size_t i=0; i<levels.size(); ++i)
+    {
+      typename PyramidBuilder<T>::LevelState& s = builder.states[i];
+      s.input_dims = tuplet<3,int> (input_dims[0], input_dims[1], 2);
+      s.output_dims = levels[i].dimensions;
+      s.offset = levels[i].offset;
+      s.pending.resize (size_t(input_dims[0]) * input_dims[1] * 2);
+      s.pending_slices = 0;
+      s.slices_written = 0;
+      s.output.resize (size_t(s.output_dims[0]) * s.output_dims[1]);
+      input_dims = levels[i].dimensions;
+    }
+
+    const size_t slice_size = size_t(reader.dimensions[0]) * reader.dimensions[1];
+    reader.ForEachSlab<T> (16,
+      [&] (T* slab, int, int number_of_slices)
+      {
+        for (int k=0; k<number_of_slices; ++k)
+          { builder.Push (0, slab + k*slice_size); }
+      });
+
+    // Extend the file to the end of the last page.
+    if (!levels.empty())
+    {
+      f.seekp (std::streamoff(offset - 1));
+      f.put (0);
+    }
+  }
+  boost::filesystem::rename (temporary, filename);
+}
+
+// ---------------------------------------------------------------------------
+void AimPyramid::Create
+  (
+  AimFile& reader,
+  const std::string& filename,
+  int max_levels
+  )
+{
+  bin_method_t method = reader.buffer_type == AimFile::AIMFILE_TYPE_CHAR ? BIN_MAXIMUM : BIN_AVERAGE;
+  Create (reader, filename, max_levels, method);
+}
+
+// ---------------------------------------------------------------------------
+void AimPyramid::Create
+  (
+  AimFile& reader,
+  const std::string& filename,
+  int max_levels,
+  bin_method_t method
+  )
+{
+  switch (reader.buffer_type)
+  {
+    case AimFile::AIMFILE_TYPE_CHAR:
+      CreateAny<char> (reader, filename, max_levels, method);
+      break;
+    case AimFile::AIMFILE_TYPE_SHORT:
+      CreateAny<short> (reader, filename, max_levels, method);
+      break;
+    case AimFile::AIMFILE_TYPE_FLOAT:
+      CreateAny<float> (reader, filename, max_levels, method);
+      break;
+    default:
+      throw_aimio_exception ("Unrecognized AIM data type.");
+  }
+}
+
+// ---------------------------------------------------------------------------
+void AimPyramid::Open ()
+{
+  this->Close();
+  std::ifstream f (this->filename.c_str(), std::ios_base::in | std::ios_base::binary);
+  if (!f) {
+    throw_aimio_exception (std::string("Unable to open file ") + filename); }
+  f.exceptions ( std::ifstream::failbit | std::ifstream::badbit );
+
+  std::vector<char> fixed (8 + 4*4 + 8 + 8);
+  f.read (&(fixed[0]), fixed.size());
+  BufferReader r (fixed, "Pyramid file");
+  char magic[8];
+  r.Bytes (magic, 8);
+  if (strncmp (magic, pyramid_magic, 8) != 0) {
+    throw_aimio_exception (std::string("Not an AimIO pyramid: ") + filename); }
+  if (r.Integer<boost::uint32_t>() != pyramid_format_version) {
+    throw_aimio_exception (std::string("Unsupported pyramid version: ") + filename); }
+  this->buffer_type = AimFile::buffer_format_t (r.Integer<boost::uint32_t>());
+  this->method = bin_method_t (r.Integer<boost::uint32_t>());
+  boost::uint32_t n = r.Integer<boost::uint32_t>();
+  this->source_size = r.Integer<boost::uint64_t>();
+  this->source_modification_time = std::time_t (r.Integer<boost::int64_t>());
+  aimio_verbose_assert (n < 64, "Corrupt pyramid file.");
+
+  std::vector<char> table (n * (3*4 + 3*4 + 8 + 8));
+  if (n)
+    { f.read (&(table[0]), table.size()); }
+  BufferReader t (table, "Pyramid file");
+  this->levels.resize (n);
+  for (boost::uint32_t i=0; i<n; ++i)
+  {
+    this->levels[i].dimensions = t.Tuplet();
+    for (int j=0; j<3; ++j)
+      { this->levels[i].element_size[j] = t.Float(); }
+    this->levels[i].offset = t.Integer<boost::uint64_t>();
+    this->levels[i].size = t.Integer<boost::uint64_t>();
+  }
+  this->maps.resize (n);
+}
+
+// ---------------------------------------------------------------------------
+bool AimPyramid::IsCurrent (const std::string& aim_filename) const
+{
+  boost::system::error_code ec;
+  boost::uintmax_t size = boost::filesystem::file_size (aim_filename, ec);
+  if (ec)
+    { return false; }
+  std::time_t mtime = boost::filesystem::last_write_time (aim_filename, ec);
+  if (ec)
+    { return false; }
+  return size == this->source_size && mtime == this->source_modification_time;
+}
+
+// ---------------------------------------------------------------------------
+const AimPyramid::Level& AimPyramid::GetLevel (int level) const
+{
+  aimio_verbose_assert (level >= 1 && level <= int(this->levels.size()),
+    "Pyramid level out of range.");
+  return this->levels[level-1];
+}
+
+// ---------------------------------------------------------------------------
+const void* AimPyramid::MapLevel (int level)
+{
+  const Level& l = this->GetLevel (level);
+  aimio_verbose_assert (order::native == order::little,
+    "Zero-copy access to pyramid data requires a little-endian platform.");
+  if (!this->maps[level-1])
+  {
+    this->maps[level-1].reset (new MappedFile (this->filename, l.offset, l.size));
+  }
+  return this->maps[level-1]->Data();
+}
+
+// ---------------------------------------------------------------------------
+void AimPyramid::ReadAnyLevel
+  (
+  int level,
+  void* data,
+  size_t size,
+  AimFile::buffer_format_t type
+  )
+{
+  const Level& l = this->GetLevel (level);
+  aimio_assert (this->buffer_type == type);
+  aimio_assert (size == long_product (l.dimensions));
+  PositionalFile file (this->filename);
+  file.ReadExactlyAt (data, l.size, l.offset);
+}
+
+// ---------------------------------------------------------------------------
+void AimPyramid::ReadLevel (int level, char* data, size_t size)
+{
+  this->ReadAnyLevel (level, data, size, AimFile::AIMFILE_TYPE_CHAR);
+}
+
+// ---------------------------------------------------------------------------
+void AimPyramid::ReadLevel (int level, short* data, size_t size)
+{
+  this->ReadAnyLevel (level, data, size, AimFile::AIMFILE_TYPE_SHORT);
+  if (order::native != order::little)
+    { SwapToLittle (data, size); }  // swapping is its own inverse
+}
+
+// ---------------------------------------------------------------------------
+void AimPyramid::ReadLevel (int level, float* data, size_t size)
+{
+  this->ReadAnyLevel (level, data, size, AimFile::AIMFILE_TYPE_FLOAT);
+  if (order::native != order::little)
+    { SwapToLittle (data, size); }
+}
+
+// ---------------------------------------------------------------------------
+void AimPyramid::Close ()
+{
+  for (size_t i=0; i<this->maps.size(); ++i)
+    { this->maps[i].reset(); }
+}
+
+}  // namespace
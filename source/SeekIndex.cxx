@@ -0,0 +1,214 @@
+// Copyright (c) Eric Nodwell
+// See LICENSE for details.
+
+#include "AimIO/SeekIndex.h"
+#include "AimIO/AimIO.h"
+#include "Compression.h"
+#include "FileIO.h"
+#include "BinaryBuffer.h"
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <cstring>
+
+
+namespace AimIO
+{
+
+// Index file layout (all values little endian):
+//
+//   char[8]   "AIMIOIDX"
+//   uint32    format version
+//   uint32    AIM storage type (aim_storage_format_t)
+//   int32     number of z slices
+//   int32     interval between checkpoints
+//   uint64    size of the compressed data
+//   uint64    size of the AIM file
+//   int64     modification time of the AIM file
+//   uint64    number of checkpoints
+//   then per checkpoint:
+//     uint64    offset in the compressed data
+//     uint8     remaining run length
+//     int8      run value
+//     int8      value_1
+//     int8      value_2
+//     uint8     flags: 1 = is_value_1, 2 = change_value
+
+static const char* index_magic = "AIMIOIDX";
+static const boost::uint32_t index_format_version = 1;
+
+// ---------------------------------------------------------------------------
+AimSeekIndex::Checkpoint::Checkpoint ()
+  :
+  offset (0),
+  length (0),
+  value (0),
+  value_1 (0),
+  value_2 (0),
+  is_value_1 (true),
+  change_value (false)
+{}
+
+// ---------------------------------------------------------------------------
+AimSeekIndex::AimSeekIndex ()
+  :
+  aim_type (AIMFILE_TYPE_D1Tundef),
+  number_of_slices (0),
+  interval (0),
+  compressed_size (0),
+  source_size (0),
+  source_modification_time (0)
+{}
+
+// ---------------------------------------------------------------------------
+std::string AimSeekIndex::SidecarName (const std::string& aim_filename)
+{
+  return aim_filename + ".idx";
+}
+
+// ---------------------------------------------------------------------------
+void AimSeekIndex::Build (const AimFile& reader, int interval_)
+{
+  aimio_verbose_assert (interval_ > 0, "Seek index interval must be positive.");
+  aimio_verbose_assert (reader.aim_type == AIMFILE_TYPE_D1TcharCmp ||
+                        reader.aim_type == AIMFILE_TYPE_D1TbinCmp,
+    "A seek index is only required for D1TcharCmp and D1TbinCmp data.");
+  aimio_assert (reader.block_list.size() >= 3);
+  const MemoryBlock& block = reader.block_list[2];
+
+  std::shared_ptr<const DataSource> file = reader.OpenSource();
+  std::vector<char> buffer;
+  const char* compressed = BytesAt (*file, block.offset, block.size, buffer);
+  SliceDecompressor decompressor (compressed,
+                                  block.size,
+                                  reader.aim_type,
+                                  reader.dimensions,
+                                  reader.offset,
+                                  (reader.version == AIMFILE_VERSION_30));
+
+  this->aim_type = reader.aim_type;
+  this->number_of_slices = reader.dimensions[2];
+  this->interval = interval_;
+  this->compressed_size = block.size;
+  if (reader.source)
+  {
+    // Not a file, so IsCurrent cannot be used.
+    this->source_size = file->Size();
+    this->source_modification_time = 0;
+  }
+  else
+  {
+    this->source_size = boost::filesystem::file_size (reader.filename);
+    this->source_modification_time = boost::filesystem::last_write_time (reader.filename);
+  }
+  this->checkpoints.clear();
+  for (int z=0; z<this->number_of_slices; z+=interval_)
+  {
+    this->checkpoints.push_back (decompressor.GetState());
+    decompressor.Next (0, std::min (interval_, this->number_of_slices - z));
+  }
+}
+
+// ---------------------------------------------------------------------------
+void AimSeekIndex::Save (const std::string& filename) const
+{
+  BufferWriter w;
+  w.Bytes (index_magic, 8);
+  w.Integer (index_format_version);
+  w.Integer (boost::uint32_t(this->aim_type));
+  w.Integer (boost::int32_t(this->number_of_slices));
+  w.Integer (boost::int32_t(this->interval));
+  w.Integer (this->compressed_size);
+  w.Integer (this->source_size);
+  w.Integer (boost::int64_t(this->source_modification_time));
+  w.Integer (boost::uint64_t(this->checkpoints.size()));
+  for (size_t i=0; i<this->checkpoints.size(); ++i)
+  {
+    const Checkpoint& c = this->checkpoints[i];
+    w.Integer (c.offset);
+    w.Integer (c.length);
+    w.Integer (c.value);
+    w.Integer (c.value_1);
+    w.Integer (c.value_2);
+    w.Integer (boost::uint8_t((c.is_value_1 ? 1 : 0) | (c.change_value ? 2 : 0)));
+  }
+
+  std::ofstream f (filename.c_str(), std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+  if (!f) {
+    throw_aimio_exception (std::string("Unable to open file ") + filename); }
+  f.exceptions ( std::ofstream::failbit | std::ofstream::badbit );
+  f.write (&(w.buffer[0]), w.buffer.size());
+}
+
+// ---------------------------------------------------------------------------
+void AimSeekIndex::Load (const std::string& filename)
+{
+  std::ifstream f (filename.c_str(), std::ios_base::in | std::ios_base::binary);
+  if (!f) {
+    throw_aimio_exception (std::string("Unable to open file ") + filename); }
+  std::vector<char> buffer ((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+
+  BufferReader r (buffer, "Index file");
+  char magic[8];
+  r.Bytes (magic, 8);
+  if (strncmp (magic, index_magic, 8) != 0) {
+    throw_aimio_exception (std::string("Not an AimIO index file: ") + filename); }
+  if (r.Integer<boost::uint32_t>() != index_format_version) {
+    throw_aimio_exception (std::string("Unsupported index file version: ") + filename); }
+  this->aim_type = aim_storage_format_t (r.Integer<boost::uint32_t>());
+  this->number_of_slices = r.Integer<boost::int32_t>();
+  this->interval = r.Integer<boost::int32_t>();
+  this->compressed_size = r.Integer<boost::uint64_t>();
+  this->source_size = r.Integer<boost::uint64_t>();
+  this->source_modification_time = std::time_t (r.Integer<boost::int64_t>());
+  boost::uint64_t n = r.Integer<boost::uint64_t>();
+  aimio_verbose_assert (this->interval > 0 && this->number_of_slices >= 0 &&
+                        n == boost::uint64_t((this->number_of_slices + this->interval - 1) / this->interval),
+    "Corrupt index file.");
+  this->checkpoints.resize (n);
+  for (size_t i=0; i<n; ++i)
+  {
+    Checkpoint& c = this->checkpoints[i];
+    c.offset = r.Integer<boost::uint64_t>();
+    c.length = r.Integer<boost::uint8_t>();
+    c.value = r.Integer<char>();
+    c.value_1 = r.Integer<char>();
+    c.value_2 = r.Integer<char>();
+    boost::uint8_t flags = r.Integer<boost::uint8_t>();
+    c.is_value_1 = (flags & 1) != 0;
+    c.change_value = (flags & 2) != 0;
+    aimio_verbose_assert (c.offset <= this->compressed_size, "Corrupt index file.");
+  }
+}
+
+// ---------------------------------------------------------------------------
+bool AimSeekIndex::IsCurrent (const std::string& aim_filename) const
+{
+  boost::system::error_code ec;
+  boost::uintmax_t size = boost::filesystem::file_size (aim_filename, ec);
+  if (ec)
+    { return false; }
+  std::time_t mtime = boost::filesystem::last_write_time (aim_filename, ec);
+  if (ec)
+    { return false; }
+  return size == this->source_size && mtime == this->source_modification_time;
+}
+
+// ---------------------------------------------------------------------------
+const AimSeekIndex::Checkpoint& AimSeekIndex::Find (int slice, int& checkpoint_slice) const
+{
+  aimio_verbose_assert (slice >= 0 && slice < this->number_of_slices, "Slice out of range.");
+  size_t i = slice / this->interval;
+  checkpoint_slice = int(i) * this->interval;
+  return this->checkpoints[i];
+}
+
+// ---------------------------------------------------------------------------
+boost::uint64_t AimSeekIndex::EndOffset (int last_slice) const
+{
+  size_t i = last_slice / this->interval + 1;
+  return i < this->checkpoints.size() ? this->checkpoints[i].offset : this->compressed_size;
+}
+
+}  // namespace
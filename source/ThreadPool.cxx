@@ -0,0 +1,327 @@
+// Copyright (c) Eric Nodwell
+// See LICENSE for details.
+
+#include "Parallel.h"
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+#include <exception>
+#include <memory>
+
+
+namespace AimIO
+{
+
+// ---------------------------------------------------------------------------
+ThreadPool::~ThreadPool ()
+{}
+
+
+// ===========================================================================
+// WorkerPool
+
+// The queue is shared with the worker threads, so that a worker can outlive
+// the pool if the pool is destroyed from one of its own tasks.
+struct WorkerPool::Queue
+{
+  Queue () : stopping (false) {}
+
+  std::deque<std::function<void()> >  tasks;
+  std::mutex                          mutex;
+  std::condition_variable             condition;
+  bool                                stopping;
+};
+
+
+// ---------------------------------------------------------------------------
+WorkerPool::WorkerPool (int number_of_threads)
+  :
+  queue (new Queue)
+{
+  if (number_of_threads <= 0)
+  {
+    number_of_threads = std::thread::hardware_concurrency();
+    if (number_of_threads <= 0)
+      { number_of_threads = 1; }
+  }
+  this->workers.reserve (number_of_threads);
+  for (int i=0; i<number_of_threads; ++i)
+    { this->workers.push_back (std::thread (&WorkerPool::WorkerLoop, this->queue)); }
+}
+
+
+// ---------------------------------------------------------------------------
+WorkerPool::~WorkerPool ()
+{
+  {
+    std::lock_guard<std::mutex> lock (this->queue->mutex);
+    this->queue->stopping = true;
+  }
+  this->queue->condition.notify_all();
+  for (size_t i=0; i<this->workers.size(); ++i)
+  {
+    if (this->workers[i].get_id() == std::this_thread::get_id())
+      { this->workers[i].detach(); }
+    else
+      { this->workers[i].join(); }
+  }
+}
+
+
+// ---------------------------------------------------------------------------
+void WorkerPool::Submit (const std::function<void()>& task)
+{
+  {
+    std::lock_guard<std::mutex> lock (this->queue->mutex);
+    this->queue->tasks.push_back (task);
+  }
+  this->queue->condition.notify_one();
+}
+
+
+// ---------------------------------------------------------------------------
+void WorkerPool::WorkerLoop (std::shared_ptr<Queue> queue)
+{
+  while (true)
+  {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock (queue->mutex);
+      while (!queue->stopping && queue->tasks.empty())
+        { queue->condition.wait (lock); }
+      if (queue->tasks.empty())
+        { return; }   // stopping, and nothing left to do
+      task = queue->tasks.front();
+      queue->tasks.pop_front();
+    }
+    task();
+  }
+}
+
+
+// ===========================================================================
+// Global pool
+
+namespace
+{
+
+std::mutex                   global_mutex;
+std::shared_ptr<ThreadPool>  global_pool;
+int                          global_number_of_threads = 0;
+
+}  // anonymous namespace
+
+
+// ---------------------------------------------------------------------------
+void SetNumThreads (int number_of_threads)
+{
+  std::shared_ptr<ThreadPool> previous;
+  {
+    std::lock_guard<std::mutex> lock (global_mutex);
+    global_number_of_threads = number_of_threads;
+    previous.swap (global_pool);
+  }
+  // previous is released outside the lock, as its workers may be using it.
+}
+
+
+// ---------------------------------------------------------------------------
+void SetThreadPool (const std::shared_ptr<ThreadPool>& pool)
+{
+  std::shared_ptr<ThreadPool> previous;
+  {
+    std::lock_guard<std::mutex> lock (global_mutex);
+    previous.swap (global_pool);
+    global_pool = pool;
+  }
+}
+
+
+// ---------------------------------------------------------------------------
+std::shared_ptr<ThreadPool> GetThreadPool ()
+{
+  std::lock_guard<std::mutex> lock (global_mutex);
+  if (!global_pool)
+  {
+    int n = global_number_of_threads;
+    if (n <= 0)
+      { n = std::max (int(std::thread::hardware_concurrency()), 1); }
+    // The calling thread also works, so one less is required in the pool.
+    if (n > 1)
+      { global_pool.reset (new WorkerPool (n - 1)); }
+  }
+  return global_pool;
+}
+
+
+// ---------------------------------------------------------------------------
+int GetNumThreads ()
+{
+  std::shared_ptr<ThreadPool> pool = GetThreadPool();
+  return pool ? pool->NumberOfThreads() + 1 : 1;
+}
+
+
+// ---------------------------------------------------------------------------
+namespace
+{
+
+// State shared between the caller of ParallelFor and its helper tasks.
+// Helper tasks may still be sitting in the queue after ParallelFor returns,
+// so this is reference counted.
+struct ParallelForState
+{
+  ParallelForState (size_t n_, const std::function<void(size_t)>& fn_)
+    : n(n_), fn(fn_), next(0), active(0) {}
+
+  const size_t                        n;
+  const std::function<void(size_t)>   fn;
+  std::atomic<size_t>                 next;
+  int                                 active;
+  std::exception_ptr                  error;
+  std::mutex                          mutex;
+  std::condition_variable             done;
+
+  void Run ()
+  {
+    {
+      std::lock_guard<std::mutex> lock (this->mutex);
+      if (this->next >= this->n)
+        { return; }
+      ++this->active;
+    }
+    while (true)
+    {
+      size_t i = this->next++;
+      if (i >= this->n)
+        { break; }
+      try
+      {
+        this->fn (i);
+      }
+      catch (...)
+      {
+        std::lock_guard<std::mutex> lock (this->mutex);
+        if (!this->error)
+          { this->error = std::current_exception(); }
+        this->next = this->n;
+      }
+    }
+    {
+      std::lock_guard<std::mutex> lock (this->mutex);
+      --this->active;
+    }
+    this->done.notify_all();
+  }
+};
+
+}  // anonymous namespace
+
+
+// ---------------------------------------------------------------------------
+void ParallelFor
+  (
+  ThreadPool& pool,
+  size_t n,
+  const std::function<void(size_t)>& fn,
+  int max_concurrency
+  )
+{
+  if (n == 0)
+    { return; }
+  size_t concurrency = pool.NumberOfThreads() + 1;  // Includes calling thread
+  if (max_concurrency > 0 && size_t(max_concurrency) < concurrency)
+    { concurrency = max_concurrency; }
+  if (concurrency > n)
+    { concurrency = n; }
+
+  std::shared_ptr<ParallelForState> state (new ParallelForState (n, fn));
+  for (size_t t=1; t<concurrency; ++t)
+    { pool.Submit ([state] () { state->Run(); }); }
+  state->Run();
+
+  std::unique_lock<std::mutex> lock (state->mutex);
+  while (state->active != 0)
+    { state->done.wait (lock); }
+  if (state->error)
+    { std::rethrow_exception (state->error); }
+}
+
+
+// ---------------------------------------------------------------------------
+void ParallelFor
+  (
+  size_t n,
+  const std::function<void(size_t)>& fn,
+  int max_concurrency
+  )
+{
+  std::shared_ptr<ThreadPool> pool;
+  if (n > 1 && max_concurrency != 1)
+    { pool = GetThreadPool(); }
+  if (!pool || pool->NumberOfThreads() == 0)
+  {
+    for (size_t i=0; i<n; ++i)
+      { fn (i); }
+    return;
+  }
+  ParallelFor (*pool, n, fn, max_concurrency);
+}
+
+
+// ---------------------------------------------------------------------------
+size_t NumberOfParts (size_t n, size_t grain)
+{
+  if (n == 0)
+    { return 0; }
+  grain = std::max (grain, size_t(1));
+  size_t parts = (n + grain - 1) / grain;
+  // A few parts per thread, for load balancing.
+  return std::max (std::min (parts, size_t(4 * GetNumThreads())), size_t(1));
+}
+
+
+// ---------------------------------------------------------------------------
+void ParallelForRange
+  (
+  size_t n,
+  size_t grain,
+  const std::function<void(size_t begin, size_t end)>& fn
+  )
+{
+  size_t parts = NumberOfParts (n, grain);
+  if (parts == 1)
+  {
+    fn (0, n);
+    return;
+  }
+  ParallelFor (parts, [&] (size_t p)
+    {
+    size_t begin, end;
+    PartRange (p, parts, n, begin, end);
+    fn (begin, end);
+    });
+}
+
+// ---------------------------------------------------------------------------
+void RunWithCallback (const std::function<void()>& task, const completion_callback_t& done)
+{
+  std::function<void()> run = [task, done] ()
+    {
+    std::exception_ptr error;
+    try
+      { task(); }
+    catch (...)
+      { error = std::current_exception(); }
+    if (done)
+      { done (error); }
+    };
+  std::shared_ptr<ThreadPool> pool = GetThreadPool();
+  if (pool)
+    { pool->Submit (run); }
+  else
+    { run(); }
+}
+
+}  // namespace
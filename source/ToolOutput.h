@@ -0,0 +1,93 @@
+// Copyright (c) Eric Nodwell
+// See LICENSE for details.
+
+#ifndef __AimIO_ToolOutput_h
+#define __AimIO_ToolOutput_h
+
+#include "AimIO/HeaderScanner.h"
+#include "AimIO/ThreadPool.h"
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Helpers shared by the command-line tools (aix and ctheader).
+// For internal use.
+
+namespace AimIO
+{
+
+/// Escapes a string for inclusion in JSON output.
+inline std::string JsonString (const std::string& s)
+{
+  std::ostringstream os;
+  os << "\"";
+  for (size_t i = 0; i < s.size(); ++i)
+  {
+    unsigned char c = s[i];
+    switch (c)
+    {
+      case '"':  os << "\\\""; break;
+      case '\\': os << "\\\\"; break;
+      case '\n': os << "\\n"; break;
+      case '\r': os << "\\r"; break;
+      case '\t': os << "\\t"; break;
+      default:
+        if (c < 0x20)
+        {
+          os << "\\u" << std::hex << std::setw(4) << std::setfill('0') << int(c)
+             << std::dec << std::setfill(' ');
+        }
+        else
+          { os << c; }
+    }
+  }
+  os << "\"";
+  return os.str();
+}
+
+/// Quotes a string for inclusion in CSV output.
+inline std::string CsvString (const std::string& s)
+{
+  std::string result = "\"";
+  for (size_t i = 0; i < s.size(); ++i)
+  {
+    if (s[i] == '"')
+      { result += "\"\""; }
+    else
+      { result += s[i]; }
+  }
+  result += "\"";
+  return result;
+}
+
+/// Scan options for the -j argument of the tools. With more than one job
+/// the global pool is resized to match: the header reads mostly wait on
+/// I/O, so the pool may exceed the number of cores.
+inline ScanOptions ToolScanOptions (int jobs)
+{
+  ScanOptions options;
+  options.number_of_threads = jobs;
+  if (jobs > 1)
+    { SetNumThreads (jobs); }
+  return options;
+}
+
+/// Calls fn with consecutive batches of files, so that the headers (and
+/// processing logs) of a very large number of files are not all held in
+/// memory at once.
+template <typename F>
+void ForEachBatch (const std::vector<std::string>& files, F fn)
+{
+  const size_t batch_size = 4096;
+  for (size_t begin = 0; begin < files.size(); begin += batch_size)
+  {
+    size_t end = std::min (files.size(), begin + batch_size);
+    fn (std::vector<std::string> (files.begin() + begin, files.begin() + end));
+  }
+}
+
+}  // namespace
+
+#endif
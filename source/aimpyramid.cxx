@@ -0,0 +1,102 @@
+// Copyright (c) Steven Boyd
+// See LICENSE for details.
+
+#include "AimIO/AimIO.h"
+#include "AimIO/Pyramid.h"
+
+#include <boost/filesystem.hpp>
+#include <vector>
+#include <cstdlib>
+#include <iostream>
+
+static void show_usage()
+{
+  std::cerr << "\n"
+            << "aimpyramid Version 1.0.0. Numerics88 Solutions.\n"
+            << "\n"
+            << "Format: aimpyramid aim_file [...] [-levels n] [-force] [-output file]\n"
+            << "    --levels, -l n  : maximum number of levels (default: all)\n"
+            << "    --force, -f     : regenerate even if the sidecar is up to date\n"
+            << "    --output, -o    : sidecar file name (only for a single input)\n"
+            << "    --help, -h      : show help\n"
+            << "\n"
+            << "Creates a multi-resolution pyramid sidecar file (aim_file.pyr) with\n"
+            << "levels of 1/2, 1/4, 1/8, ... resolution, which may be memory-mapped.\n"
+            << std::endl;
+}
+
+int main(int argc, char **argv)
+  {
+
+  std::vector<std::string> inputs;
+  std::string output;
+  int max_levels = 0;
+  bool force = false;
+
+  if (argc < 2) {
+    show_usage();
+    return 1;
+  }
+
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if ((arg == "-h") || (arg == "--help")) {
+      show_usage();
+      return 0;
+    } else if ((arg == "-f") || (arg == "--force") || (arg == "-force")) {
+      force = true;
+    } else if ((arg == "-l") || (arg == "--levels") || (arg == "-levels")) {
+      if (i + 1 >= argc) {
+        show_usage();
+        return 1;
+      }
+      max_levels = std::atoi(argv[++i]);
+    } else if ((arg == "-o") || (arg == "--output") || (arg == "-output")) {
+      if (i + 1 >= argc) {
+        show_usage();
+        return 1;
+      }
+      output = argv[++i];
+    } else {
+      inputs.push_back(arg);
+    }
+  }
+
+  if (inputs.empty() || (!output.empty() && inputs.size() != 1)) {
+    show_usage();
+    return 1;
+  }
+
+  int status = 0;
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    std::string sidecar = output.empty() ? AimIO::AimPyramid::SidecarName(inputs[i]) : output;
+    try {
+      if (!force && boost::filesystem::exists(sidecar)) {
+        AimIO::AimPyramid existing(sidecar.c_str());
+        existing.Open();
+        if (existing.IsCurrent(inputs[i]) &&
+            (max_levels <= 0 || existing.NumberOfLevels() <= max_levels)) {
+          std::cout << sidecar << " is up to date." << std::endl;
+          continue;
+        }
+      }
+      AimIO::AimFile reader(inputs[i].c_str());
+      reader.ReadImageInfo();
+      AimIO::AimPyramid::Create(reader, sidecar, max_levels);
+      AimIO::AimPyramid pyramid(sidecar.c_str());
+      pyramid.Open();
+      std::cout << sidecar << ":";
+      for (int level = 1; level <= pyramid.NumberOfLevels(); ++level) {
+        const n88::tuplet<3,int>& dims = pyramid.GetLevel(level).dimensions;
+        std::cout << " " << dims[0] << "x" << dims[1] << "x" << dims[2];
+      }
+      std::cout << std::endl;
+    }
+    catch (std::exception& e) {
+      std::cout << "ERROR! " << inputs[i] << ": " << e.what() << std::endl;
+      status = 1;
+    }
+  }
+
+  return status;
+}
@@ -3,12 +3,18 @@
 
 #include "AimIO/AimIO.h"
 #include "AimIO/Definitions.h"
+#include "AimIO/HeaderScanner.h"
+#include "AimIO/ProcessingLog.h"
 #include "Compression.h"
 #include "PlatformFloat.h"  
+#include "ToolOutput.h"
 
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/algorithm/string/case_conv.hpp>
 #include <vector>
+#include <algorithm>
+#include <cstdlib>
 #include <sstream>
 #include <iostream>
 #include <iomanip>
@@ -18,34 +24,24 @@ static void show_usage()
   std::cerr << "\n"
             << "aix Version 2.0.0. Numerics88 Solutions.\n" 
             << "\n"
-            << "Format: aix aim_file [-help] [-log] [-meta]\n"
-            << "    --log, -l  : show processing log\n"
-            << "    --meta, -m : show scan meta data\n"
-            << "                 [name] [samp] [meas] [site]\n"
-            << "    --help, -h : show help\n"
+            << "Format: aix aim_file|directory [...] [-help] [-log] [-meta]\n"
+            << "                [-json|-csv] [-j N] [-recursive]\n"
+            << "    --log, -l       : show processing log\n"
+            << "    --meta, -m      : show scan meta data\n"
+            << "                      [name] [samp] [meas] [site]\n"
+            << "    --json          : one JSON record per file (JSON lines)\n"
+            << "    --csv           : one CSV record per file, with header line\n"
+            << "    --jobs, -j N    : number of files to read concurrently\n"
+            << "    --recursive, -r : descend into sub-directories\n"
+            << "    --help, -h      : show help\n"
+            << "\n"
+            << "Several files and directories may be given. For directories,\n"
+            << "all files with extension .aim are examined.\n"
             << "\n"
             << "This is a clone of AIX so behaviours may differ.\n" 
             << std::endl;
 }
 
-// Given a log from a Scanco AIM and a specific search string, finds the value
-std::string GetFieldFromLog(const std::string& log, const std::string& field) {
-
-  int s1 = log.find(field);                  // Find field string start position
-  if (s1 == std::string::npos) {             // If field not found, return result
-    return "not_found";
-  }
-  int s2 = s1 + field.length();              // Calculate field string end 
-  int s3 = log.find_first_not_of(" ",s2);    // Look forwards to find start of result
-  int s4 = log.find("\n",s2);                // Find end of line
-  int s5 = s4 - s3;                          // Difference is the result length
-  std::string result = log.substr(s3,s5);    // Grab the rough result
-  int s6 = result.find_last_not_of(" ");     // Remove trailing blank space
-  result = result.substr(0,s6+1);            // Grab the result
-
-  return result;
-}
-
 // Translates the Scanco site codes 
 std::string GetSiteName(const std::string& site) {
   if (site.compare("20")==0) {
@@ -63,70 +59,43 @@ std::string GetSiteName(const std::string& site) {
   return site;
 }
 
-//-----------------------------------------------------------------------
-int main(int argc, char **argv)
-  {
-    
-  AimIO::AimFile reader;
-  
-  std::string fname;
-  bool show_log = false;
-  bool show_meta = false;
-  
-  if (argc < 2) {
-    show_usage();
-    return 1;
-  }
-  
-  for (int i = 1; i < argc; ++i) {
-    std::string arg = argv[i];
-    if ((arg == "-h") || (arg == "--help")) {
-      show_usage();
-      return 0;
-    } else if ((arg == "-l") || (arg == "--log")) {
-      show_log = true;
-    } else if ((arg == "-m") || (arg == "--meta")) {
-      show_meta = true;
-    } else {
-      fname = arg;
-    }
+// Name of the storage type as printed in the structured output
+std::string GetTypeName(AimIO::aim_storage_format_t type) {
+  switch (type) {
+    case AimIO::AIMFILE_TYPE_D1Tchar:    return "D1Tchar";
+    case AimIO::AIMFILE_TYPE_D1TbinCmp:  return "D1TbinCmp";
+    case AimIO::AIMFILE_TYPE_D3Tbit8:    return "D3Tbit8";
+    case AimIO::AIMFILE_TYPE_D1TcharCmp: return "D1TcharCmp";
+    case AimIO::AIMFILE_TYPE_D1Tshort:   return "D1Tshort";
+    case AimIO::AIMFILE_TYPE_D1Tfloat:   return "D1Tfloat";
+    default:                             return "unknown";
   }
+}
 
-  // Check if file exists
-  if (!boost::filesystem:: exists(fname)) {
-    std::cout << "Arguments:\n"
-              << "fname = " << fname << "\n"
-              << "show_log = " << show_log << "\n"
-              << "show_meta = " << show_meta << "\n"
-              << std::endl;
-    std::cout << "ERROR! File does not exist: " << fname << std::endl;
-    return 1;
+// Name of the AIM version as printed in the structured output
+std::string GetVersionName(AimIO::aim_version_t version) {
+  switch (version) {
+    case AimIO::AIMFILE_VERSION_10: return "010";
+    case AimIO::AIMFILE_VERSION_11: return "011";
+    case AimIO::AIMFILE_VERSION_20: return "020";
+    case AimIO::AIMFILE_VERSION_30: return "030";
+    default:                        return "unknown";
   }
+}
 
-  // Read the file
-  reader.filename = fname;
-  reader.ReadImageInfo();
-
-  // Show meta data in a format that fits well with FEA workflow.
-  if (show_meta) {
-    
-    std::string patient_name = GetFieldFromLog(reader.processing_log,"Patient Name");
-    std::string index_patient = GetFieldFromLog(reader.processing_log,"Index Patient");
-    std::string index_measurement = GetFieldFromLog(reader.processing_log,"Index Measurement");
-    std::string site = GetFieldFromLog(reader.processing_log,"Site");
-    
-    std::string site_name = GetSiteName(site);
-    
-    std::cout << "\"" << patient_name << "\"" << " "
-              << "\"" << index_patient << "\"" << " "
-              << "\"" << index_measurement << "\"" << " "
-              << "\"" << site_name << "\""
-              << std::endl;
-    
-    return 0;
+// Total memory size of the image data in bytes, as shown by the standard output
+double GetMemorySize(const AimIO::HeaderRecord& record) {
+  int nbytes = 1;
+  if (record.aim_type == AimIO::AIMFILE_TYPE_D1Tshort) {
+    nbytes = 2;
+  } else if (record.aim_type == AimIO::AIMFILE_TYPE_D1Tfloat) {
+    nbytes = 4;
   }
-  
-  // Print standard examine information
+  return double(nbytes) * record.dimensions[0] * record.dimensions[1] * record.dimensions[2];
+}
+
+// Prints the standard examine information
+void PrintRecord(const AimIO::HeaderRecord& reader, bool show_log) {
   std::cout << "!%  Image Data starts at byte offset " << reader.byte_offset << std::endl;
   switch( reader.version ) {
     case AimIO::AIMFILE_VERSION_10:
@@ -147,7 +116,7 @@ int main(int argc, char **argv)
   std::cout << std::endl;
   std::cout << "!-------------------------------------------------------------------------------" << std::endl;
   std::cout << "!> " << std::left << std::setw(30) << "Volume" 
-            << std::left << std::setw(50) << fname << std::endl;
+            << std::left << std::setw(50) << reader.path << std::endl;
   std::cout << "!> " << std::left << std::setw(30) << "AIM Version" 
             << std::setw(20) << std::right << std::fixed << std::setprecision(1) << (float)reader.version << std::endl;
   std::cout << "!>" << std::endl;
@@ -178,37 +147,30 @@ int main(int argc, char **argv)
             << std::endl;
   std::cout << "!>" << std::endl;
   
-  int nbytes = 1;
   switch( reader.aim_type ) {
     case AimIO::AIMFILE_TYPE_D1Tchar:
       std::cout << "!> " << std::left << std::setw(30) << "Type of data" 
                 << std::setw(20) << "D1Tchar" << std::endl;
-      nbytes = 1;
       break;
     case AimIO::AIMFILE_TYPE_D1TbinCmp:
       std::cout << "!> " << std::left << std::setw(30) << "Type of data" 
                 << std::setw(20) << "BinCmp     1 byte/voxel" << std::endl; // D1TbinCmp
-      nbytes = 1;
       break;
     case AimIO::AIMFILE_TYPE_D3Tbit8:
       std::cout << "!> " << std::left << std::setw(30) << "Type of data" 
                 << std::setw(20) << "D3Tbit8" << std::endl;
-      nbytes = 1;
       break;
     case AimIO::AIMFILE_TYPE_D1TcharCmp:
       std::cout << "!> " << std::left << std::setw(30) << "Type of data" 
                 << std::setw(20) << "D1TcharCmp" << std::endl;
-      nbytes = 1;
       break;
     case AimIO::AIMFILE_TYPE_D1Tshort:
       std::cout << "!> " << std::left << std::setw(30) << "Type of data" 
                 << std::setw(20) << "Short      2 byte/voxel" << std::endl; // D1Tshort
-      nbytes = 2;
       break;
     case AimIO::AIMFILE_TYPE_D1Tfloat:
       std::cout << "!> " << std::left << std::setw(30) << "Type of data" 
                 << std::setw(20) << "D1Tfloat" << std::endl;
-      nbytes = 4;
 			break;
     default:
       std::cout << "!> " << std::left << std::setw(30) << "Type of data" 
@@ -217,7 +179,7 @@ int main(int argc, char **argv)
   
 	// Note that memory size result is about 5% higher than Scanco AIX output. 
 	// Actual Scanco implementation is shown at bottom, but hasn't been implemented.
-  float memory_size = nbytes * reader.dimensions[0]*reader.dimensions[1]*reader.dimensions[2];
+  float memory_size = GetMemorySize(reader);
   if (memory_size > 1e6) {
     std::cout << "!> " << std::left << std::setw(30) << "Total memory size" 
               << std::left << std::setw(10) << std::fixed << std::setprecision(1) << (memory_size/1.0e6) 
@@ -237,8 +199,209 @@ int main(int argc, char **argv)
   if (show_log) {
     std::cout << reader.processing_log << "\n";
   }
+}
+
+// A field of the processing log for the meta data output, which shows
+// missing fields as not_found.
+std::string GetMetaField(const std::string& log, const std::string& field) {
+  std::string value = AimIO::GetLogField(log, field);
+  return value.empty() ? "not_found" : value;
+}
+
+// Prints the meta data in a format that fits well with FEA workflow.
+void PrintMeta(const AimIO::HeaderRecord& reader) {
+  std::string patient_name = GetMetaField(reader.processing_log,"Patient Name");
+  std::string index_patient = GetMetaField(reader.processing_log,"Index Patient");
+  std::string index_measurement = GetMetaField(reader.processing_log,"Index Measurement");
+  std::string site = GetMetaField(reader.processing_log,"Site");
+  
+  std::string site_name = GetSiteName(site);
+  
+  std::cout << "\"" << patient_name << "\"" << " "
+            << "\"" << index_patient << "\"" << " "
+            << "\"" << index_measurement << "\"" << " "
+            << "\"" << site_name << "\""
+            << std::endl;
+}
+
+const char* csv_columns =
+  "path,error,version,type,dim_x,dim_y,dim_z,off_x,off_y,off_z,pos_x,pos_y,pos_z,"
+  "el_size_x,el_size_y,el_size_z,byte_offset,memory_size,"
+  "patient_name,index_patient,index_measurement,site";
+
+// Prints one record as a line of JSON or CSV.
+void PrintStructured(const AimIO::HeaderRecord& reader, bool json, bool show_log) {
+  std::ostringstream os;
+  os << std::setprecision(7);
+  std::string patient_name, index_patient, index_measurement, site_name;
+  if (reader.error.empty()) {
+    patient_name = AimIO::GetLogField(reader.processing_log,"Patient Name");
+    index_patient = AimIO::GetLogField(reader.processing_log,"Index Patient");
+    index_measurement = AimIO::GetLogField(reader.processing_log,"Index Measurement");
+    site_name = GetSiteName(AimIO::GetLogField(reader.processing_log,"Site"));
+  }
+  if (json) {
+    os << "{\"path\":" << AimIO::JsonString(reader.path);
+    if (!reader.error.empty()) {
+      os << ",\"error\":" << AimIO::JsonString(reader.error) << "}";
+      std::cout << os.str() << "\n";
+      return;
+    }
+    os << ",\"version\":" << AimIO::JsonString(GetVersionName(reader.version))
+       << ",\"type\":" << AimIO::JsonString(GetTypeName(reader.aim_type))
+       << ",\"dim\":[" << reader.dimensions[0] << "," << reader.dimensions[1] << "," << reader.dimensions[2] << "]"
+       << ",\"off\":[" << reader.offset[0] << "," << reader.offset[1] << "," << reader.offset[2] << "]"
+       << ",\"pos\":[" << reader.position[0] << "," << reader.position[1] << "," << reader.position[2] << "]"
+       << ",\"el_size_mm\":[" << reader.element_size[0] << "," << reader.element_size[1] << "," << reader.element_size[2] << "]"
+       << ",\"byte_offset\":" << reader.byte_offset
+       << ",\"memory_size\":" << std::fixed << std::setprecision(0) << GetMemorySize(reader) << std::setprecision(7)
+       << std::resetiosflags(std::ios_base::floatfield)
+       << ",\"patient_name\":" << AimIO::JsonString(patient_name)
+       << ",\"index_patient\":" << AimIO::JsonString(index_patient)
+       << ",\"index_measurement\":" << AimIO::JsonString(index_measurement)
+       << ",\"site\":" << AimIO::JsonString(site_name);
+    if (show_log) {
+      os << ",\"processing_log\":" << AimIO::JsonString(reader.processing_log);
+    }
+    os << "}";
+  } else {
+    os << AimIO::CsvString(reader.path) << "," << AimIO::CsvString(reader.error);
+    if (reader.error.empty()) {
+      os << "," << GetVersionName(reader.version)
+         << "," << GetTypeName(reader.aim_type)
+         << "," << reader.dimensions[0] << "," << reader.dimensions[1] << "," << reader.dimensions[2]
+         << "," << reader.offset[0] << "," << reader.offset[1] << "," << reader.offset[2]
+         << "," << reader.position[0] << "," << reader.position[1] << "," << reader.position[2]
+         << "," << reader.element_size[0] << "," << reader.element_size[1] << "," << reader.element_size[2]
+         << "," << reader.byte_offset
+         << "," << std::fixed << std::setprecision(0) << GetMemorySize(reader)
+         << std::resetiosflags(std::ios_base::floatfield)
+         << "," << AimIO::CsvString(patient_name)
+         << "," << AimIO::CsvString(index_patient)
+         << "," << AimIO::CsvString(index_measurement)
+         << "," << AimIO::CsvString(site_name);
+    } else {
+      os << ",,,,,,,,,,,,,,,,,,,,";
+    }
+    if (show_log) {
+      os << "," << AimIO::CsvString(reader.processing_log);
+    }
+  }
+  std::cout << os.str() << "\n";
+}
+
+// True if the file name has extension .aim (in any case, with optional VMS version)
+bool IsAimFileName(const boost::filesystem::path& p) {
+  std::string extension = boost::algorithm::to_lower_copy(p.extension().string());
+  return extension.compare(0, 4, ".aim") == 0;
+}
+
+//-----------------------------------------------------------------------
+int main(int argc, char **argv)
+  {
+    
+  std::vector<std::string> inputs;
+  bool show_log = false;
+  bool show_meta = false;
+  bool json = false;
+  bool csv = false;
+  bool recursive = false;
+  int jobs = 1;
+  
+  if (argc < 2) {
+    show_usage();
+    return 1;
+  }
+  
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if ((arg == "-h") || (arg == "--help")) {
+      show_usage();
+      return 0;
+    } else if ((arg == "-l") || (arg == "--log")) {
+      show_log = true;
+    } else if ((arg == "-m") || (arg == "--meta")) {
+      show_meta = true;
+    } else if ((arg == "--json") || (arg == "-json")) {
+      json = true;
+    } else if ((arg == "--csv") || (arg == "-csv")) {
+      csv = true;
+    } else if ((arg == "-r") || (arg == "--recursive") || (arg == "-recursive")) {
+      recursive = true;
+    } else if ((arg == "-j") || (arg == "--jobs")) {
+      if (i + 1 >= argc) {
+        show_usage();
+        return 1;
+      }
+      jobs = std::atoi(argv[++i]);
+    } else {
+      inputs.push_back(arg);
+    }
+  }
+
+  if (json && csv) {
+    std::cout << "ERROR! Only one of --json and --csv may be given." << std::endl;
+    return 1;
+  }
+  bool structured = json || csv;
+
+  // Expand directories
+  std::vector<std::string> files;
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    if (boost::filesystem::is_directory(inputs[i])) {
+      std::vector<std::string> listed = AimIO::ListImageFiles(inputs[i], recursive);
+      for (size_t j = 0; j < listed.size(); ++j) {
+        if (IsAimFileName(listed[j])) {
+          files.push_back(listed[j]);
+        }
+      }
+    } else {
+      files.push_back(inputs[i]);
+    }
+  }
+
+  // Check if file exists
+  if (!structured && files.size() == 1 && !boost::filesystem:: exists(files[0])) {
+    std::cout << "Arguments:\n"
+              << "fname = " << files[0] << "\n"
+              << "show_log = " << show_log << "\n"
+              << "show_meta = " << show_meta << "\n"
+              << std::endl;
+    std::cout << "ERROR! File does not exist: " << files[0] << std::endl;
+    return 1;
+  }
+
+  if (csv) {
+    std::cout << csv_columns << (show_log ? ",processing_log" : "") << "\n";
+  }
+
+  // Read the files in batches, so that the processing logs of a very large
+  // number of files are not all held in memory at once.
+  AimIO::ScanOptions options = AimIO::ToolScanOptions(jobs);
+  int status = 0;
+  AimIO::ForEachBatch(files, [&](const std::vector<std::string>& batch) {
+    std::vector<AimIO::HeaderRecord> records = AimIO::ScanHeaders(batch, options);
+    for (size_t i = 0; i < records.size(); ++i) {
+      AimIO::HeaderRecord& record = records[i];
+      if (record.error.empty() && record.format != AimIO::HeaderRecord::FORMAT_AIM) {
+        record.error = "Not an AIM file.";
+      }
+      if (!record.error.empty()) {
+        status = 1;
+      }
+      if (structured) {
+        PrintStructured(record, json, show_log);
+      } else if (!record.error.empty()) {
+        std::cout << "ERROR! " << record.path << ": " << record.error << std::endl;
+      } else if (show_meta) {
+        PrintMeta(record);
+      } else {
+        PrintRecord(record, show_log);
+      }
+    }
+  });
   
-  return 0;
+  return status;
 }
 
 // Scanco AIX implementation of memory size estimate
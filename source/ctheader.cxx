@@ -5,11 +5,16 @@
 #include "AimIO/IsqIO.h"
 #include "AimIO/DateTime.h"
 #include "AimIO/Definitions.h"
+#include "AimIO/HeaderScanner.h"
 #include "PlatformFloat.h"  
+#include "ToolOutput.h"
 
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/algorithm/string/case_conv.hpp>
 #include <vector>
+#include <algorithm>
+#include <cstdlib>
 #include <sstream>
 #include <iostream>
 #include <iomanip>
@@ -19,10 +24,18 @@ static void show_usage()
   std::cerr << "\n"
             << "ctheader Version 2.0.0. Numerics88 Solutions.\n" 
             << "\n"
-            << "Format: ctheader isq_file [-help]\n"
-            << "    --meta, -m : show scan meta data\n"
-            << "                 [name] [samp] [meas] [site]\n"
-            << "    --help, -h : show help\n"
+            << "Format: ctheader isq_file|directory [...] [-help] [-meta]\n"
+            << "                     [-json|-csv] [-j N] [-recursive]\n"
+            << "    --meta, -m      : show scan meta data\n"
+            << "                      [name] [samp] [meas] [site]\n"
+            << "    --json          : one JSON record per file (JSON lines)\n"
+            << "    --csv           : one CSV record per file, with header line\n"
+            << "    --jobs, -j N    : number of files to read concurrently\n"
+            << "    --recursive, -r : descend into sub-directories\n"
+            << "    --help, -h      : show help\n"
+            << "\n"
+            << "Several files and directories may be given. For directories,\n"
+            << "all files with extension .isq are examined.\n"
             << "\n"
             << "This is a clone of CTHEADER so behaviours may differ.\n" 
             << std::endl;
@@ -47,66 +60,40 @@ std::string GetSiteName(const std::string& site) {
   return site;
 }
 
-//-----------------------------------------------------------------------
-int main(int argc, char **argv)
-  {
-    
-  AimIO::IsqFile reader;
-  
-  std::string fname;
-  bool show_meta = false;
-  
-  if (argc < 2) {
-    show_usage();
-    return 1;
-  }
-
-  for (int i = 1; i < argc; ++i) {
-    std::string arg = argv[i];
-    if ((arg == "-h") || (arg == "--help")) {
-      show_usage();
-      return 0;
-    } else if ((arg == "-m") || (arg == "--meta")) {
-      show_meta = true;
-    } else {
-      fname = arg;
-    }
-  }
-
-  // Check if file exists
-  if (!boost::filesystem:: exists(fname)) {
-    std::cout << "Arguments:\n"
-              << "fname = " << fname << "\n"
-              << "show_meta = " << show_meta << "\n"
-              << std::endl;
-    std::cout << "ERROR! File does not exist: " << fname << std::endl;
-    return 1;
+// Removes leading and trailing white space (the decoded date ends with a newline)
+std::string Trim(const std::string& s) {
+  size_t begin = s.find_first_not_of(" \t\r\n");
+  if (begin == std::string::npos) {
+    return std::string();
   }
+  size_t end = s.find_last_not_of(" \t\r\n");
+  return s.substr(begin, end + 1 - begin);
+}
 
-  // Read the file
-  reader.filename = fname;
-  reader.ReadImageInfo();
+// True if the file name has extension .isq (in any case, with optional VMS version)
+bool IsIsqFileName(const boost::filesystem::path& p) {
+  std::string extension = boost::algorithm::to_lower_copy(p.extension().string());
+  return extension.compare(0, 4, ".isq") == 0;
+}
 
-  // Show meta data in a format that fits well with FEA workflow.
-  if (show_meta) {
-  
-    std::string patient_name = reader.name;
-    std::string index_patient = std::to_string( reader.patient_index );
-    std::string index_measurement = std::to_string( reader.index_measurement );
-    std::string site = std::to_string( reader.site );
+// Prints the meta data in a format that fits well with FEA workflow.
+void PrintMeta(const AimIO::IsqFile& reader) {
+  std::string patient_name = reader.name;
+  std::string index_patient = std::to_string( reader.patient_index );
+  std::string index_measurement = std::to_string( reader.index_measurement );
+  std::string site = std::to_string( reader.site );
 
-    std::string site_name = GetSiteName(site);
+  std::string site_name = GetSiteName(site);
 
-    std::cout << "\"" << patient_name << "\"" << " "
-              << "\"" << index_patient << "\"" << " "
-              << "\"" << index_measurement << "\"" << " "
-                << "\"" << site_name << "\""
-              << std::endl;
-  
-    return 0;
-  }
+  std::cout << "\"" << patient_name << "\"" << " "
+            << "\"" << index_patient << "\"" << " "
+            << "\"" << index_measurement << "\"" << " "
+              << "\"" << site_name << "\""
+            << std::endl;
+}
 
-  // Print header information
+// Prints the header information
+void PrintHeader(const AimIO::IsqFile& reader) {
   std::cout << std::endl;
   std::cout << "Type: IMA-Data Sequence" << std::endl;
   std::cout << std::right << std::setw(22) << "Patient Name : "  
@@ -174,5 +161,205 @@ int main(int argc, char **argv)
   std::cout << std::right << std::setw(22) << "Holder : "  
             << std::right << std::setw(6) << reader.holder << std::endl;
   
-  return 0;
+}
+
+// Every header field, in output order. Numbers are written unquoted in JSON.
+struct Field {
+  std::string name;
+  std::string value;
+  bool is_string;
+};
+
+void AddField(std::vector<Field>& fields, const std::string& name, const std::string& value) {
+  Field f = {name, value, true};
+  fields.push_back(f);
+}
+
+template <typename T>
+void AddField(std::vector<Field>& fields, const std::string& name, T value) {
+  std::ostringstream os;
+  os << std::setprecision(7) << value;
+  Field f = {name, os.str(), false};
+  fields.push_back(f);
+}
+
+std::vector<Field> GetFields(const std::string& path, const AimIO::IsqFile& reader) {
+  std::vector<Field> fields;
+  AddField(fields, "path", path);
+  AddField(fields, "data_type", reader.data_type);
+  AddField(fields, "nr_of_bytes", reader.nr_of_bytes);
+  AddField(fields, "nr_of_blocks", reader.nr_of_blocks);
+  AddField(fields, "patient_index", reader.patient_index);
+  AddField(fields, "scanner_id", reader.scanner_id);
+  AddField(fields, "creation_date_0", reader.creation_date[0]);
+  AddField(fields, "creation_date_1", reader.creation_date[1]);
+  AddField(fields, "creation_date_string", Trim(reader.creation_date_string));
+  AddField(fields, "dim_p_x", reader.dimensions_p[0]);
+  AddField(fields, "dim_p_y", reader.dimensions_p[1]);
+  AddField(fields, "dim_p_z", reader.dimensions_p[2]);
+  AddField(fields, "dim_um_x", reader.dimensions_um[0]);
+  AddField(fields, "dim_um_y", reader.dimensions_um[1]);
+  AddField(fields, "dim_um_z", reader.dimensions_um[2]);
+  AddField(fields, "off_x", reader.offset[0]);
+  AddField(fields, "off_y", reader.offset[1]);
+  AddField(fields, "off_z", reader.offset[2]);
+  AddField(fields, "spacing_x", reader.spacing[0]);
+  AddField(fields, "spacing_y", reader.spacing[1]);
+  AddField(fields, "spacing_z", reader.spacing[2]);
+  AddField(fields, "slice_thickness_um", reader.slice_thickness_um);
+  AddField(fields, "slice_increment_um", reader.slice_increment_um);
+  AddField(fields, "slice_1_pos_um", reader.slice_1_pos_um);
+  AddField(fields, "min_data_value", reader.min_data_value);
+  AddField(fields, "max_data_value", reader.max_data_value);
+  AddField(fields, "mu_scaling", reader.mu_scaling);
+  AddField(fields, "nr_of_samples", reader.nr_of_samples);
+  AddField(fields, "nr_of_projections", reader.nr_of_projections);
+  AddField(fields, "scandist_um", reader.scandist_um);
+  AddField(fields, "scanner_type", reader.scanner_type);
+  AddField(fields, "sampletime_us", reader.sampletime_us);
+  AddField(fields, "index_measurement", reader.index_measurement);
+  AddField(fields, "site", reader.site);
+  AddField(fields, "site_name", GetSiteName(std::to_string(reader.site)));
+  AddField(fields, "reference_line_um", reader.reference_line_um);
+  AddField(fields, "recon_alg", reader.recon_alg);
+  AddField(fields, "name", reader.name);
+  AddField(fields, "energy", reader.energy);
+  AddField(fields, "intensity", reader.intensity);
+  AddField(fields, "holder", reader.holder);
+  AddField(fields, "data_offset", reader.data_offset);
+  return fields;
+}
+
+// Prints one record as a line of JSON or CSV.
+void PrintStructured(const std::string& path, const AimIO::IsqFile& reader,
+                     const std::string& error, bool json) {
+  std::vector<Field> fields = GetFields(path, reader);
+  std::ostringstream os;
+  if (json) {
+    os << "{\"path\":" << AimIO::JsonString(path);
+    if (!error.empty()) {
+      os << ",\"error\":" << AimIO::JsonString(error);
+    } else {
+      for (size_t i = 1; i < fields.size(); ++i) {
+        os << ",\"" << fields[i].name << "\":"
+           << (fields[i].is_string ? AimIO::JsonString(fields[i].value) : fields[i].value);
+      }
+    }
+    os << "}";
+  } else {
+    os << AimIO::CsvString(path) << "," << AimIO::CsvString(error);
+    for (size_t i = 1; i < fields.size(); ++i) {
+      os << ",";
+      if (error.empty()) {
+        os << (fields[i].is_string ? AimIO::CsvString(fields[i].value) : fields[i].value);
+      }
+    }
+  }
+  std::cout << os.str() << "\n";
+}
+
+//-----------------------------------------------------------------------
+int main(int argc, char **argv)
+  {
+    
+  std::vector<std::string> inputs;
+  bool show_meta = false;
+  bool json = false;
+  bool csv = false;
+  bool recursive = false;
+  int jobs = 1;
+  
+  if (argc < 2) {
+    show_usage();
+    return 1;
+  }
+
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if ((arg == "-h") || (arg == "--help")) {
+      show_usage();
+      return 0;
+    } else if ((arg == "-m") || (arg == "--meta")) {
+      show_meta = true;
+    } else if ((arg == "--json") || (arg == "-json")) {
+      json = true;
+    } else if ((arg == "--csv") || (arg == "-csv")) {
+      csv = true;
+    } else if ((arg == "-r") || (arg == "--recursive") || (arg == "-recursive")) {
+      recursive = true;
+    } else if ((arg == "-j") || (arg == "--jobs")) {
+      if (i + 1 >= argc) {
+        show_usage();
+        return 1;
+      }
+      jobs = std::atoi(argv[++i]);
+    } else {
+      inputs.push_back(arg);
+    }
+  }
+
+  if (json && csv) {
+    std::cout << "ERROR! Only one of --json and --csv may be given." << std::endl;
+    return 1;
+  }
+  bool structured = json || csv;
+
+  // Expand directories
+  std::vector<std::string> files;
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    if (boost::filesystem::is_directory(inputs[i])) {
+      std::vector<std::string> listed = AimIO::ListImageFiles(inputs[i], recursive);
+      for (size_t j = 0; j < listed.size(); ++j) {
+        if (IsIsqFileName(listed[j])) {
+          files.push_back(listed[j]);
+        }
+      }
+    } else {
+      files.push_back(inputs[i]);
+    }
+  }
+
+  // Check if file exists
+  if (!structured && files.size() == 1 && !boost::filesystem:: exists(files[0])) {
+    std::cout << "Arguments:\n"
+              << "fname = " << files[0] << "\n"
+              << "show_meta = " << show_meta << "\n"
+              << std::endl;
+    std::cout << "ERROR! File does not exist: " << files[0] << std::endl;
+    return 1;
+  }
+
+  if (csv) {
+    std::vector<Field> fields = GetFields(std::string(), AimIO::IsqFile());
+    std::cout << "path,error";
+    for (size_t i = 1; i < fields.size(); ++i) {
+      std::cout << "," << fields[i].name;
+    }
+    std::cout << "\n";
+  }
+
+  // Read the files concurrently, in batches.
+  AimIO::ScanOptions options = AimIO::ToolScanOptions(jobs);
+  int status = 0;
+  AimIO::ForEachBatch(files, [&](const std::vector<std::string>& batch) {
+    std::vector<AimIO::IsqFile> readers;
+    std::vector<std::string> errors;
+    AimIO::ScanIsqHeaders(batch, readers, errors, options);
+    for (size_t i = 0; i < batch.size(); ++i) {
+      if (!errors[i].empty()) {
+        status = 1;
+      }
+      if (structured) {
+        PrintStructured(batch[i], readers[i], errors[i], json);
+      } else if (!errors[i].empty()) {
+        std::cout << "ERROR! " << batch[i] << ": " << errors[i] << std::endl;
+      } else if (show_meta) {
+        PrintMeta(readers[i]);
+      } else {
+        PrintHeader(readers[i]);
+      }
+    }
+  });
+  
+  return status;
 }
@@ -0,0 +1,211 @@
+// Copyright (c) Steven Boyd
+// See LICENSE for details.
+
+#include "AimIO/AimIO.h"
+#include "AimIO/IsqIO.h"
+#include "AimIO/IsqSlabReader.h"
+#include "AimIO/AimSliceWriter.h"
+#include "AimIO/Binning.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/algorithm/string/case_conv.hpp>
+#include <boost/algorithm/string/trim.hpp>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+
+static void show_usage()
+{
+  std::cerr << "\n"
+            << "isq2aim Version 1.0.0. Numerics88 Solutions.\n"
+            << "\n"
+            << "Format: isq2aim input.isq output.aim [-crop x0 y0 z0 nx ny nz]\n"
+            << "                [-bin n] [-slab n]\n"
+            << "    --crop, -c      : convert only the box starting at voxel (x0,y0,z0)\n"
+            << "                      with dimensions (nx,ny,nz)\n"
+            << "    --bin, -b n     : average blocks of n x n x n voxels\n"
+            << "    --slab, -s n    : number of output slices converted at a time\n"
+            << "                      (default 16)\n"
+            << "    --help, -h      : show help\n"
+            << "\n"
+            << "The ISQ file is converted to a short (D1Tshort) version 3 AIM file\n"
+            << "with an ISQ_TO_AIM style processing log. The image is streamed, so\n"
+            << "that only a few slabs are ever held in memory.\n"
+            << std::endl;
+}
+
+// Current time formatted as in Scanco logs, e.g. 13-MAY-2016 12:15:48.35
+std::string FormatNow() {
+  std::time_t t = std::time(0);
+  char buffer[64];
+  std::strftime(buffer, sizeof(buffer), "%d-%b-%Y %H:%M:%S.00", std::localtime(&t));
+  return boost::algorithm::to_upper_copy(std::string(buffer));
+}
+
+// Log lines are formatted with a name field of 30 characters.
+void LogString(std::ostream& log, const std::string& name, const std::string& value) {
+  log << std::left << std::setw(30) << name << std::setw(50) << value << std::right << "\n";
+}
+
+void LogInt(std::ostream& log, const std::string& name, int value) {
+  log << std::left << std::setw(30) << name << std::right << std::setw(23) << value << "\n";
+}
+
+void LogInts(std::ostream& log, const std::string& name, const n88::tuplet<3,int>& value) {
+  log << std::left << std::setw(30) << name << std::right << std::setw(23) << value[0]
+      << std::setw(11) << value[1] << std::setw(11) << value[2] << "\n";
+}
+
+// Creates a processing log like that written by ISQ_TO_AIM (IPL).
+std::string CreateLog(const AimIO::IsqFile& reader) {
+  const char* separator =
+    "!-------------------------------------------------------------------------------\n";
+  std::ostringstream log;
+  log << "!\n! Processing Log\n!\n" << separator;
+  LogString(log, "Created by", "ISQ_TO_AIM (isq2aim)");
+  LogString(log, "Time", FormatNow());
+  LogString(log, "Original file", reader.filename);
+  LogString(log, "Original Creation-Date", boost::algorithm::trim_copy(reader.creation_date_string));
+  LogInts(log, "Orig-ISQ-Dim-p", reader.dimensions_p);
+  LogInts(log, "Orig-ISQ-Dim-um", reader.dimensions_um);
+  log << separator;
+  LogString(log, "Patient Name", boost::algorithm::trim_copy(reader.name));
+  LogInt(log, "Index Patient", reader.patient_index);
+  LogInt(log, "Index Measurement", reader.index_measurement);
+  log << separator;
+  LogInt(log, "Site", reader.site);
+  LogInt(log, "Scanner ID", reader.scanner_id);
+  LogInt(log, "Scanner type", reader.scanner_type);
+  LogInt(log, "Position Slice 1 [um]", reader.slice_1_pos_um);
+  LogInt(log, "No. samples", reader.nr_of_samples);
+  LogInt(log, "No. projections per 180", reader.nr_of_projections);
+  LogInt(log, "Scan Distance [um]", reader.scandist_um);
+  LogInt(log, "Integration time [us]", reader.sampletime_us);
+  LogInt(log, "Reference line [um]", reader.reference_line_um);
+  LogInt(log, "Reconstruction-Alg.", reader.recon_alg);
+  LogInt(log, "Energy [V]", reader.energy);
+  LogInt(log, "Intensity [uA]", reader.intensity);
+  log << separator;
+  LogInt(log, "Mu_Scaling", reader.mu_scaling);
+  log << separator;
+  return log.str();
+}
+
+int main(int argc, char **argv)
+  {
+
+  std::vector<std::string> inputs;
+  n88::tuplet<3,int> start(0,0,0);
+  n88::tuplet<3,int> extent(-1,-1,-1);
+  int bin = 1;
+  int slab = 16;
+
+  if (argc < 3) {
+    show_usage();
+    return 1;
+  }
+
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if ((arg == "-h") || (arg == "--help")) {
+      show_usage();
+      return 0;
+    } else if ((arg == "-c") || (arg == "--crop") || (arg == "-crop")) {
+      if (i + 6 >= argc) {
+        show_usage();
+        return 1;
+      }
+      for (int d = 0; d < 3; ++d) { start[d] = std::atoi(argv[++i]); }
+      for (int d = 0; d < 3; ++d) { extent[d] = std::atoi(argv[++i]); }
+    } else if ((arg == "-b") || (arg == "--bin") || (arg == "-bin")) {
+      if (i + 1 >= argc) {
+        show_usage();
+        return 1;
+      }
+      bin = std::atoi(argv[++i]);
+    } else if ((arg == "-s") || (arg == "--slab") || (arg == "-slab")) {
+      if (i + 1 >= argc) {
+        show_usage();
+        return 1;
+      }
+      slab = std::atoi(argv[++i]);
+    } else {
+      inputs.push_back(arg);
+    }
+  }
+
+  if (inputs.size() != 2 || bin < 1 || slab < 1) {
+    show_usage();
+    return 1;
+  }
+
+  if (!boost::filesystem::exists(inputs[0])) {
+    std::cout << "ERROR! File does not exist: " << inputs[0] << std::endl;
+    return 1;
+  }
+
+  try {
+    AimIO::IsqFile reader(inputs[0].c_str());
+    reader.ReadImageInfo();
+    const n88::tuplet<3,int>& dims = reader.dimensions_p;
+
+    if (extent[0] < 0) {
+      extent = dims;
+    }
+    for (int d = 0; d < 3; ++d) {
+      if (start[d] < 0 || extent[d] < 1 || start[d] + extent[d] > dims[d]) {
+        std::cout << "ERROR! Crop region outside image." << std::endl;
+        return 1;
+      }
+    }
+
+    // Partial blocks at the upper edges are discarded.
+    n88::tuplet<3,int> out_dims = AimIO::BinnedDimensions(extent, bin);
+    for (int d = 0; d < 3; ++d) {
+      if (out_dims[d] < 1) {
+        std::cout << "ERROR! Bin size larger than image." << std::endl;
+        return 1;
+      }
+    }
+
+    AimIO::AimFile writer(inputs[1].c_str());
+    writer.version = AimIO::AIMFILE_VERSION_30;
+    writer.dimensions = out_dims;
+    writer.position = start / bin;
+    for (int d = 0; d < 3; ++d) {
+      writer.element_size[d] = reader.spacing[d] * bin / 1000.0f;
+    }
+    writer.processing_log = CreateLog(reader);
+    AimIO::AimSliceWriter slices(writer);
+
+    // Each slab of the ISQ file yields slab output slices.
+    AimIO::IsqSlabReader slabs(reader, slab * bin);
+    slabs.Seek(start[2]);
+    std::vector<short> data;
+    std::vector<short> out;
+    int first_slice = 0;
+    int number_of_slices = 0;
+    while (slices.SlicesWritten() < out_dims[2] &&
+           slabs.Next(data, first_slice, number_of_slices)) {
+      int out_slices = std::min(number_of_slices / bin, out_dims[2] - slices.SlicesWritten());
+      n88::tuplet<3,int> slab_dims(dims[0], dims[1], number_of_slices);
+      n88::tuplet<3,int> slab_out_dims(out_dims[0], out_dims[1], out_slices);
+      out.resize(long_product(slab_out_dims));
+      AimIO::BinImageData(data.data(), slab_dims, n88::tuplet<3,int>(start[0], start[1], 0),
+                          slab_out_dims, bin, AimIO::BIN_AVERAGE, out.data());
+      slices.WriteSlices(out.data(), out_slices);
+    }
+    slices.Close();
+  }
+  catch (std::exception& e) {
+    std::cout << "ERROR! " << e.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
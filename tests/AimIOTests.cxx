@@ -3,10 +3,34 @@
 
 #include "AimIO/AimIO.h"
 #include "AimIO/IsqIO.h"
+#include "AimIO/IsqSlabReader.h"
+#include "AimIO/AimSliceWriter.h"
+#include "AimIO/AimMappedWriter.h"
+#include "AimIO/Pyramid.h"
+#include "AimIO/BrickFile.h"
+#include "AimIO/SeekIndex.h"
+#include "AimIO/PackedAimFile.h"
+#include "AimIO/HeaderScanner.h"
+#include "AimIO/Catalog.h"
+#include "AimIO/ThreadPool.h"
+#include "AimIO/AimReader.h"
+#include "AimIO/Prefetcher.h"
+#include "AimIO/IOBackend.h"
+#include "AimIO/DataSource.h"
 
 #include <gtest/gtest.h>
 #define BOOST_FILESYSTEM_VERSION 3
 #include <boost/filesystem.hpp>
+#include <fstream>
+#include <future>
+#include <iterator>
+#include <mutex>
+#include <thread>
+#include <cstring>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 using n88::tuplet;
 
@@ -939,6 +963,1729 @@ TEST_F (AimIOTests, ReadImage_ISQ)
   
 }
 
+TEST_F (AimIOTests, ScanHeaders)
+{
+  boost::filesystem::path dir = boost::filesystem::path(test_dir);
+  std::vector<std::string> paths;
+  paths.push_back ((dir / "test_bincmp_v3.aim").string());
+  paths.push_back ((dir / "test_short_offset_v2.aim").string());
+  paths.push_back ((dir / "test_e0001082.isq").string());
+  paths.push_back ((dir / "no_such_file.aim").string());
+
+  AimIO::ScanOptions options;
+  options.number_of_threads = 3;
+  options.initial_read_size = 1024;   // Force additional reads for the log.
+  std::vector<AimIO::HeaderRecord> records = AimIO::ScanHeaders (paths, options);
+  ASSERT_EQ (paths.size(), records.size());
+
+  for (size_t i=0; i<2; ++i)
+  {
+    AimIO::AimFile reader;
+    reader.filename = paths[i];
+    reader.ReadImageInfo();
+    ASSERT_EQ (std::string(), records[i].error);
+    ASSERT_EQ (paths[i], records[i].path);
+    ASSERT_EQ (AimIO::HeaderRecord::FORMAT_AIM, records[i].format);
+    ASSERT_EQ (boost::filesystem::file_size(paths[i]), records[i].file_size);
+    ASSERT_EQ (reader.version, records[i].version);
+    ASSERT_EQ (reader.aim_type, records[i].aim_type);
+    ASSERT_EQ (reader.dimensions, records[i].dimensions);
+    ASSERT_EQ (reader.position, records[i].position);
+    ASSERT_EQ (reader.offset, records[i].offset);
+    ASSERT_EQ (reader.element_size, records[i].element_size);
+    ASSERT_EQ (reader.byte_offset, records[i].byte_offset);
+    ASSERT_EQ (reader.processing_log, records[i].processing_log);
+  }
+
+  AimIO::IsqFile isq;
+  isq.filename = paths[2];
+  isq.ReadImageInfo();
+  ASSERT_EQ (std::string(), records[2].error);
+  ASSERT_EQ (AimIO::HeaderRecord::FORMAT_ISQ, records[2].format);
+  ASSERT_EQ (isq.dimensions_p, records[2].dimensions);
+  ASSERT_EQ (isq.data_offset, records[2].byte_offset);
+  ASSERT_EQ (isq.site, records[2].site);
+  ASSERT_EQ (isq.mu_scaling, records[2].mu_scaling);
+  ASSERT_EQ (isq.creation_date_string, records[2].creation_date_string);
+
+  ASSERT_EQ (AimIO::HeaderRecord::FORMAT_UNKNOWN, records[3].format);
+  ASSERT_FALSE (records[3].error.empty());
+
+  std::vector<std::string> listed = AimIO::ListImageFiles (test_dir);
+  ASSERT_TRUE (std::find (listed.begin(), listed.end(), paths[2]) != listed.end());
+
+  std::vector<AimIO::IsqFile> isq_headers;
+  std::vector<std::string> errors;
+  AimIO::ScanIsqHeaders (paths, isq_headers, errors, options);
+  ASSERT_EQ (paths.size(), isq_headers.size());
+  ASSERT_FALSE (errors[0].empty());
+  ASSERT_EQ (std::string(), errors[2]);
+  ASSERT_EQ (isq.dimensions_p, isq_headers[2].dimensions_p);
+  ASSERT_EQ (isq.creation_date_string, isq_headers[2].creation_date_string);
+  ASSERT_EQ (isq.holder, isq_headers[2].holder);
+}
+
+TEST_F (AimIOTests, ParseProcessingLog)
+{
+  AimIO::LogFields fields = AimIO::ParseProcessingLog (TEST_GAUSS_LOG);
+  ASSERT_EQ (std::string("CAMOS_0709"), fields["Patient Name"]);
+  ASSERT_EQ (std::string("4818"), fields["Index Measurement"]);
+  ASSERT_EQ (std::string("38"), fields["Site"]);
+  ASSERT_EQ (std::string("2304       2304        168"), fields["Orig-ISQ-Dim-p"]);
+  ASSERT_EQ (std::string("68 kVp, BH: 200 mg HA/ccm, Scaling 8192, 0.2 CU"), fields["Calibration Data"]);
+  // First occurrence wins.
+  ASSERT_EQ (std::string("-0.13696"), fields["Minimum value"]);
+  ASSERT_EQ (std::string("D3P_SupGaussLowPass()"), fields["Procedure:"]);
+  ASSERT_EQ (std::string("1.66252405e+03"), AimIO::GetLogField (TEST_GAUSS_LOG, "Density: slope"));
+  ASSERT_EQ (std::string(), AimIO::GetLogField (TEST_GAUSS_LOG, "No such field"));
+}
+
+TEST_F (AimIOTests, Catalog_Refresh)
+{
+  namespace fs = boost::filesystem;
+  fs::path dir = "catalog_test_dir";
+  fs::remove_all (dir);
+  fs::create_directory (dir);
+
+  tuplet<3,int> dim (10,11,12);
+  std::vector<short> data (long_product(dim), 7);
+  const char* names[2] = {"a.aim", "b.AIM"};
+  for (int i=0; i<2; ++i)
+  {
+    AimIO::AimFile writer ((dir / names[i]).string().c_str());
+    writer.dimensions = dim;
+    writer.element_size = tuplet<3,float>(0.082,0.082,0.082);
+    writer.processing_log = TEST_AIM_LOG;
+    writer.WriteImageData (data.data());
+  }
+
+  AimIO::Catalog catalog ("test_catalog.aimcat");
+  AimIO::Catalog::RefreshStatistics stats = catalog.RefreshDirectory (dir.string());
+  ASSERT_EQ (2, stats.added);
+  ASSERT_EQ (2, catalog.Entries().size());
+  catalog.Save();
+
+  // Change one file.
+  {
+    tuplet<3,int> dim2 (10,11,13);
+    std::vector<short> data2 (long_product(dim2), 7);
+    AimIO::AimFile writer ((dir / names[1]).string().c_str());
+    writer.dimensions = dim2;
+    writer.element_size = tuplet<3,float>(0.082,0.082,0.082);
+    writer.processing_log = TEST_AIM_LOG;
+    writer.WriteImageData (data2.data());
+  }
+
+  AimIO::Catalog loaded ("test_catalog.aimcat");
+  loaded.Load();
+  ASSERT_EQ (2, loaded.Entries().size());
+  ASSERT_EQ (catalog.Entries()[0].fields, loaded.Entries()[0].fields);
+  stats = loaded.RefreshDirectory (dir.string());
+  ASSERT_EQ (0, stats.added);
+  ASSERT_EQ (1, stats.updated);
+  ASSERT_EQ (1, stats.unchanged);
+
+  std::vector<AimIO::CatalogEntry> hits = loaded.Query (
+    [] (const AimIO::CatalogEntry& e)
+      { return e.NumericField ("Scanner type") == 9 &&
+               e.Field ("Site") == "38" &&
+               e.dimensions[2] > 12; });
+  ASSERT_EQ (1, hits.size());
+  ASSERT_EQ ((dir / names[1]).string(), hits[0].path);
+  ASSERT_EQ (AimIO::AIMFILE_TYPE_D1Tshort, hits[0].aim_type);
+  ASSERT_NEAR (0.082, hits[0].element_size[0], 1E-6);
+
+  fs::remove (dir / names[0]);
+  stats = loaded.RefreshDirectory (dir.string());
+  ASSERT_EQ (1, stats.removed);
+  ASSERT_EQ (1, loaded.Entries().size());
+}
+
+TEST_F (AimIOTests, MapImage_ISQ)
+{
+  boost::filesystem::path filename = boost::filesystem::path(test_dir) / "test_e0001082.isq";
+
+  AimIO::IsqFile reader;
+  reader.filename = filename.string();
+  reader.ReadImageInfo();
+  size_t N = long_product(reader.dimensions_p);
+  ASSERT_EQ (N*sizeof(short), reader.ImageDataSize());
+  std::vector<short> data (N);
+  reader.ReadImageData (data.data(), N);
+
+  const short* mapped = reader.MapImageData();
+  ASSERT_TRUE (mapped != NULL);
+  for (size_t i=0; i<N; ++i)
+  {
+    ASSERT_EQ (data[i], mapped[i]);
+  }
+  reader.UnmapImageData();
+
+  // The data size must not depend on the 32 bit nr_of_bytes field, which
+  // overflows for large files.
+  const char* fcopy = "copy_of_test_e0001082.isq";
+  boost::filesystem::remove (fcopy);
+  boost::filesystem::copy_file (filename, fcopy);
+  {
+    std::fstream f (fcopy, std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+    boost::int32_t bogus = -1;
+    f.seekp (20);
+    f.write (reinterpret_cast<char*>(&bogus), sizeof(bogus));
+  }
+  AimIO::IsqFile reader2;
+  reader2.filename = fcopy;
+  reader2.ReadImageInfo();
+  ASSERT_EQ (-1, reader2.nr_of_bytes);
+  ASSERT_EQ (reader.data_offset, reader2.data_offset);
+  std::vector<short> data2 (N);
+  reader2.ReadImageData (data2.data(), N);
+  ASSERT_TRUE (data == data2);
+}
+
+TEST_F (AimIOTests, ReadSlices_ISQ)
+{
+  boost::filesystem::path filename = boost::filesystem::path(test_dir) / "test_e0001082.isq";
+
+  AimIO::IsqFile reader;
+  reader.filename = filename.string();
+  reader.ReadImageInfo();
+  size_t N = long_product(reader.dimensions_p);
+  std::vector<short> data (N);
+  reader.ReadImageData (data.data(), N);
+
+  size_t slice_size = size_t(reader.dimensions_p[0]) * reader.dimensions_p[1];
+  int nz = reader.dimensions_p[2];
+  ASSERT_EQ (boost::uint64_t(reader.data_offset + 2*slice_size*sizeof(short)), reader.SliceOffset(2));
+
+  std::vector<short> slice (slice_size);
+  reader.ReadSlice (nz-1, slice.data(), slice_size);
+  for (size_t i=0; i<slice_size; ++i)
+  {
+    ASSERT_EQ (data[(nz-1)*slice_size + i], slice[i]);
+  }
+
+  std::vector<short> range (3*slice_size);
+  reader.ReadSlices (1, 3, range.data(), range.size());
+  for (size_t i=0; i<range.size(); ++i)
+  {
+    ASSERT_EQ (data[slice_size + i], range[i]);
+  }
+
+  // Slab iterator, with a thickness that does not divide nz.
+  AimIO::IsqSlabReader slabs (reader, 3, 2);
+  std::vector<short> slab;
+  int z0 = -1;
+  int count = 0;
+  int expected_z0 = 0;
+  while (slabs.Next (slab, z0, count))
+  {
+    ASSERT_EQ (expected_z0, z0);
+    ASSERT_EQ (std::min (3, nz - z0), count);
+    ASSERT_EQ (count*slice_size, slab.size());
+    for (size_t i=0; i<slab.size(); ++i)
+    {
+      ASSERT_EQ (data[z0*slice_size + i], slab[i]);
+    }
+    expected_z0 += count;
+  }
+  ASSERT_EQ (nz, expected_z0);
+
+  slabs.Seek (nz-1);
+  ASSERT_TRUE (slabs.Next (slab, z0, count));
+  ASSERT_EQ (nz-1, z0);
+  ASSERT_EQ (1, count);
+  ASSERT_FALSE (slabs.Next (slab, z0, count));
+
+  // Without read-ahead, each slab is read by Next.
+  AimIO::IsqSlabReader unbuffered (reader, 4, 0);
+  expected_z0 = 0;
+  while (unbuffered.Next (slab, z0, count))
+  {
+    ASSERT_EQ (expected_z0, z0);
+    ASSERT_EQ (count*slice_size, slab.size());
+    ASSERT_EQ (data[z0*slice_size], slab[0]);
+    expected_z0 += count;
+  }
+  ASSERT_EQ (nz, expected_z0);
+}
+
+TEST_F (AimIOTests, ReadRegion_ISQ)
+{
+  boost::filesystem::path filename = boost::filesystem::path(test_dir) / "test_e0001082.isq";
+
+  AimIO::IsqFile reader;
+  reader.filename = filename.string();
+  reader.ReadImageInfo();
+  n88::tuplet<3,int> dims = reader.dimensions_p;
+  std::vector<short> data (long_product(dims));
+  reader.ReadImageData (data.data(), data.size());
+
+  // Decimated preview of the whole image.
+  n88::tuplet<3,int> start (0,0,0);
+  n88::tuplet<3,int> stride (4,4,4);
+  n88::tuplet<3,int> rdims = AimIO::IsqFile::RegionDimensions (dims, stride);
+  ASSERT_EQ ((dims[0]+3)/4, rdims[0]);
+  ASSERT_EQ ((dims[2]+3)/4, rdims[2]);
+  std::vector<short> preview (long_product(rdims));
+  reader.ReadRegion (start, dims, stride, preview.data(), preview.size());
+  for (int k=0; k<rdims[2]; ++k)
+    for (int j=0; j<rdims[1]; ++j)
+      for (int i=0; i<rdims[0]; ++i)
+      {
+        ASSERT_EQ (data[(size_t(4*k)*dims[1] + 4*j)*dims[0] + 4*i],
+                   preview[(size_t(k)*rdims[1] + j)*rdims[0] + i]);
+      }
+
+  // A box with mixed strides and an extent not divisible by the stride.
+  start = n88::tuplet<3,int> (3,5,1);
+  n88::tuplet<3,int> extent (17,20,6);
+  stride = n88::tuplet<3,int> (1,3,2);
+  rdims = AimIO::IsqFile::RegionDimensions (extent, stride);
+  std::vector<short> box (long_product(rdims));
+  reader.ReadRegion (start, extent, stride, box.data(), box.size());
+  for (int k=0; k<rdims[2]; ++k)
+    for (int j=0; j<rdims[1]; ++j)
+      for (int i=0; i<rdims[0]; ++i)
+      {
+        size_t x = start[0] + i*stride[0];
+        size_t y = start[1] + j*stride[1];
+        size_t z = start[2] + k*stride[2];
+        ASSERT_EQ (data[(z*dims[1] + y)*dims[0] + x],
+                   box[(size_t(k)*rdims[1] + j)*rdims[0] + i]);
+      }
+
+  ASSERT_THROW (reader.ReadRegion (start, dims, stride, box.data(), box.size()),
+                AimIO::AimIOException);
+}
+
+TEST_F (AimIOTests, ReadCalibrated)
+{
+  AimIO::Calibration calibration = AimIO::Calibration::FromProcessingLog (TEST_GAUSS_LOG);
+  ASSERT_DOUBLE_EQ (8192, calibration.mu_scaling);
+  ASSERT_DOUBLE_EQ (0.23660, calibration.mu_water);
+  ASSERT_DOUBLE_EQ (1.66252405e+03, calibration.density_slope);
+  ASSERT_DOUBLE_EQ (-3.98609009e+02, calibration.density_intercept);
+  ASSERT_EQ (std::string("mg HA/ccm"), calibration.density_unit);
+
+  double scale, shift;
+  calibration.GetLinearTransform (AimIO::CALIBRATION_HU, scale, shift);
+  ASSERT_NEAR (0, scale*0.23660*8192 + shift, 1E-9);  // water is 0 HU
+  ASSERT_THROW (AimIO::Calibration().GetLinearTransform (AimIO::CALIBRATION_DENSITY, scale, shift),
+                AimIO::AimIOException);
+
+  // AIM file: calibration from the processing log.
+  boost::filesystem::path filename = boost::filesystem::path(test_dir) / "test_short_v3.aim";
+  AimIO::AimFile reader;
+  reader.filename = filename.string();
+  reader.ReadImageInfo();
+  size_t N = long_product(reader.dimensions);
+  std::vector<short> raw (N);
+  reader.ReadImageData (raw.data(), N);
+  std::vector<float> density (N);
+  reader.ReadCalibratedImageData (density.data(), N, AimIO::CALIBRATION_DENSITY);
+  AimIO::Calibration aim_calibration = reader.GetCalibration();
+  for (size_t i=0; i<N; ++i)
+  {
+    double expected = aim_calibration.density_slope * raw[i] / aim_calibration.mu_scaling
+                      + aim_calibration.density_intercept;
+    ASSERT_NEAR (expected, density[i], 1E-3);
+  }
+
+  // ISQ file: only mu_scaling from the header.
+  filename = boost::filesystem::path(test_dir) / "test_e0001082.isq";
+  AimIO::IsqFile isq;
+  isq.filename = filename.string();
+  isq.ReadImageInfo();
+  N = long_product(isq.dimensions_p);
+  raw.resize (N);
+  isq.ReadImageData (raw.data(), N);
+  std::vector<float> mu (N);
+  isq.ReadCalibratedImageData (mu.data(), N, AimIO::CALIBRATION_LINEAR_ATTENUATION);
+  for (size_t i=0; i<N; ++i)
+  {
+    ASSERT_FLOAT_EQ (float(raw[i]) / isq.mu_scaling, mu[i]);
+  }
+  ASSERT_THROW (isq.ReadCalibratedImageData (mu.data(), N, AimIO::CALIBRATION_HU),
+                AimIO::AimIOException);
+  std::vector<float> hu (N);
+  isq.ReadCalibratedImageData (hu.data(), N, AimIO::CALIBRATION_HU, calibration);
+  for (size_t i=0; i<N; ++i)
+  {
+    ASSERT_NEAR (1000*(raw[i]/8192.0 - 0.23660)/0.23660, hu[i], 1E-2);
+  }
+}
+
+TEST_F (AimIOTests, AimSliceWriter)
+{
+  boost::filesystem::path filename = boost::filesystem::path(test_dir) / "test_short_v3.aim";
+  AimIO::AimFile reader;
+  reader.filename = filename.string();
+  reader.ReadImageInfo();
+  size_t N = long_product(reader.dimensions);
+  std::vector<short> data (N);
+  reader.ReadImageData (data.data(), N);
+
+  // Reference written in one piece.
+  boost::filesystem::path whole_file = "whole_test_short_v3.aim";
+  AimIO::AimFile writer;
+  writer.filename = whole_file.string();
+  writer.dimensions = reader.dimensions;
+  writer.position = reader.position;
+  writer.element_size = reader.element_size;
+  writer.processing_log = reader.processing_log;
+  writer.WriteImageData (data.data());
+
+  // Written in slabs of 7 slices.
+  boost::filesystem::path sliced_file = "sliced_test_short_v3.aim";
+  AimIO::AimFile header;
+  header.filename = sliced_file.string();
+  header.dimensions = reader.dimensions;
+  header.position = reader.position;
+  header.element_size = reader.element_size;
+  header.processing_log = reader.processing_log;
+  size_t slice_size = size_t(reader.dimensions[0]) * reader.dimensions[1];
+  {
+    AimIO::AimSliceWriter slices (header);
+    ASSERT_THROW (slices.Close(), AimIO::AimIOException);
+    for (int z=0; z<reader.dimensions[2]; z+=7)
+    {
+      int n = std::min (7, reader.dimensions[2] - z);
+      slices.WriteSlices (&(data[z*slice_size]), n);
+    }
+    ASSERT_EQ (reader.dimensions[2], slices.SlicesWritten());
+    ASSERT_THROW (slices.WriteSlices (data.data(), 1), AimIO::AimIOException);
+    slices.Close();
+  }
+  ASSERT_EQ (AimIO::AIMFILE_TYPE_D1Tshort, header.aim_type);
+
+  // Files should be identical.
+  std::ifstream a (whole_file.string().c_str(), std::ios_base::binary);
+  std::ifstream b (sliced_file.string().c_str(), std::ios_base::binary);
+  std::string a_contents ((std::istreambuf_iterator<char>(a)), std::istreambuf_iterator<char>());
+  std::string b_contents ((std::istreambuf_iterator<char>(b)), std::istreambuf_iterator<char>());
+  ASSERT_EQ (a_contents.size(), b_contents.size());
+  ASSERT_TRUE (a_contents == b_contents);
+}
+
+TEST_F (AimIOTests, AimMappedWriter)
+{
+  boost::filesystem::path filename = boost::filesystem::path(test_dir) / "test_short_v3.aim";
+  AimIO::AimFile reader;
+  reader.filename = filename.string();
+  reader.ReadImageInfo();
+  size_t N = long_product(reader.dimensions);
+  std::vector<short> data (N);
+  reader.ReadImageData (data.data(), N);
+
+  // Short, filled from several threads.
+  for (int version=0; version<2; ++version)
+  {
+    boost::filesystem::path mapped_file = "mapped_test_short.aim";
+    AimIO::AimFile header;
+    header.filename = mapped_file.string();
+    if (version == 1)
+      { header.version = AimIO::AIMFILE_VERSION_20; }
+    header.dimensions = reader.dimensions;
+    header.position = reader.position;
+    header.element_size = reader.element_size;
+    header.processing_log = reader.processing_log;
+    header.buffer_type = AimIO::AimFile::AIMFILE_TYPE_SHORT;
+    {
+      AimIO::AimMappedWriter writer (header);
+      ASSERT_EQ (AimIO::AIMFILE_TYPE_D1Tshort, writer.Type());
+      ASSERT_EQ (N, writer.NumberOfValues());
+      ASSERT_THROW (writer.FloatData(), AimIO::AimIOException);
+      short* out = writer.ShortData();
+      ASSERT_EQ (0, reinterpret_cast<size_t>(out) % sizeof(double));
+      std::vector<std::thread> threads;
+      for (int t=0; t<4; ++t)
+      {
+        threads.push_back (std::thread ([&, t] ()
+          {
+          for (size_t i=t*N/4; i<(t+1)*N/4; ++i)
+            { out[i] = data[i]; }
+          }));
+      }
+      for (size_t t=0; t<threads.size(); ++t)
+        { threads[t].join(); }
+      writer.Close();
+    }
+    ASSERT_EQ (AimIO::AIMFILE_TYPE_D1Tshort, header.aim_type);
+
+    AimIO::AimFile check;
+    check.filename = mapped_file.string();
+    check.ReadImageInfo();
+    ASSERT_EQ (header.version, check.version);
+    ASSERT_EQ (reader.dimensions, check.dimensions);
+    ASSERT_EQ (reader.processing_log, check.processing_log);
+    ASSERT_EQ (0, check.byte_offset % 4096);
+    ASSERT_EQ (check.byte_offset + N*sizeof(short), boost::filesystem::file_size (mapped_file));
+    std::vector<short> in (N);
+    check.ReadImageData (in.data(), N);
+    ASSERT_TRUE (in == data);
+  }
+
+  // Float and char.
+  tuplet<3,int> dims (33,17,9);
+  size_t M = long_product(dims);
+  boost::filesystem::path float_file = "mapped_test_float.aim";
+  AimIO::AimFile header;
+  header.filename = float_file.string();
+  header.dimensions = dims;
+  header.element_size = tuplet<3,float> (0.5f, 0.5f, 0.5f);
+  header.aim_type = AimIO::AIMFILE_TYPE_D1Tfloat;
+  {
+    AimIO::AimMappedWriter writer (header);
+    float* out = writer.FloatData();
+    for (size_t i=0; i<M; ++i)
+      { out[i] = 0.25f * i - 100; }
+    writer.Close();
+  }
+  AimIO::AimFile check;
+  check.filename = float_file.string();
+  check.ReadImageInfo();
+  ASSERT_EQ (AimIO::AIMFILE_TYPE_D1Tfloat, check.aim_type);
+  std::vector<float> float_in (M);
+  check.ReadImageData (float_in.data(), M);
+  for (size_t i=0; i<M; ++i)
+    { ASSERT_EQ (0.25f * i - 100, float_in[i]); }
+
+  boost::filesystem::path char_file = "mapped_test_char.aim";
+  header.filename = char_file.string();
+  header.aim_type = AimIO::AIMFILE_TYPE_D1Tchar;
+  {
+    AimIO::AimMappedWriter writer (header);
+    char* out = writer.CharData();
+    for (size_t i=0; i<M; ++i)
+      { out[i] = char(i % 127); }
+    writer.Close();
+  }
+  check.filename = char_file.string();
+  check.ReadImageInfo();
+  ASSERT_EQ (AimIO::AIMFILE_TYPE_D1Tchar, check.aim_type);
+  std::vector<char> char_in (M);
+  check.ReadImageData (char_in.data(), M);
+  for (size_t i=0; i<M; ++i)
+    { ASSERT_EQ (char(i % 127), char_in[i]); }
+
+  // Compressed types are not supported.
+  header.aim_type = AimIO::AIMFILE_TYPE_D1TcharCmp;
+  ASSERT_THROW (AimIO::AimMappedWriter writer (header), AimIO::AimIOException);
+}
+
+// Reference binning of full resolution data.
+template <typename T>
+static std::vector<T> ReferenceBin (const std::vector<T>& data, tuplet<3,int> dims, int bin, AimIO::bin_method_t method)
+{
+  tuplet<3,int> out_dims = AimIO::BinnedDimensions (dims, bin);
+  std::vector<T> out (long_product(out_dims));
+  AimIO::BinImageData (data.data(), dims, tuplet<3,int>(0,0,0), out_dims, bin, method, out.data());
+  return out;
+}
+
+TEST_F (AimIOTests, ReadBinned)
+{
+  // Binning kernel.
+  tuplet<3,int> dims (4,2,2);
+  short s[16] = {1,2, 5,5,  1,2, 5,5,  1,2, 5,5,  1,-10, 5,5};
+  short s_avg[2];
+  AimIO::BinImageData (s, dims, tuplet<3,int>(0,0,0), tuplet<3,int>(2,1,1), 2, AimIO::BIN_AVERAGE, s_avg);
+  ASSERT_EQ (0, s_avg[0]);    // (1+2+1+2+1+2+1-10)/8 = 0
+  ASSERT_EQ (5, s_avg[1]);
+  char c[16] = {1,1, 0,2,  1,1, 2,2,  0,0, 0,0,  0,0, 0,3};
+  char c_out[2];
+  AimIO::BinImageData (c, dims, tuplet<3,int>(0,0,0), tuplet<3,int>(2,1,1), 2, AimIO::BIN_MAJORITY, c_out);
+  ASSERT_EQ (1, c_out[0]);    // four 0s and four 1s: tie goes to larger
+  ASSERT_EQ (0, c_out[1]);
+  AimIO::BinImageData (c, dims, tuplet<3,int>(0,0,0), tuplet<3,int>(2,1,1), 2, AimIO::BIN_MAXIMUM, c_out);
+  ASSERT_EQ (3, c_out[1]);
+
+  // AIM files of all types, with bins that do not divide the dimensions.
+  const char* char_files[] = {"test_bincmp_v2.aim", "test_charcmp_v3.aim", "test_bit8_v3.aim"};
+  for (int f=0; f<3; ++f)
+  {
+    AimIO::AimFile reader ((boost::filesystem::path(test_dir) / char_files[f]).string().c_str());
+    reader.ReadImageInfo();
+    std::vector<char> data (long_product(reader.dimensions));
+    reader.ReadImageData (data.data(), data.size());
+    for (int bin=2; bin<=3; ++bin)
+    {
+      std::vector<char> expected = ReferenceBin (data, reader.dimensions, bin, AimIO::BIN_MAJORITY);
+      std::vector<char> binned (expected.size());
+      reader.ReadBinnedImageData (binned.data(), binned.size(), bin, AimIO::BIN_MAJORITY);
+      ASSERT_TRUE (expected == binned);
+    }
+  }
+
+  const char* short_files[] = {"test_short_v2.aim", "test_short_offset_v3.aim"};
+  for (int f=0; f<2; ++f)
+  {
+    AimIO::AimFile reader ((boost::filesystem::path(test_dir) / short_files[f]).string().c_str());
+    reader.ReadImageInfo();
+    std::vector<short> data (long_product(reader.dimensions));
+    reader.ReadImageData (data.data(), data.size());
+    std::vector<short> expected = ReferenceBin (data, reader.dimensions, 3, AimIO::BIN_AVERAGE);
+    std::vector<short> binned (expected.size());
+    reader.ReadBinnedImageData (binned.data(), binned.size(), 3);
+    ASSERT_TRUE (expected == binned);
+  }
+
+  {
+    AimIO::AimFile reader ((boost::filesystem::path(test_dir) / "test_float_v3.aim").string().c_str());
+    reader.ReadImageInfo();
+    std::vector<float> data (long_product(reader.dimensions));
+    reader.ReadImageData (data.data(), data.size());
+    std::vector<float> expected = ReferenceBin (data, reader.dimensions, 2, AimIO::BIN_AVERAGE);
+    std::vector<float> binned (expected.size());
+    reader.ReadBinnedImageData (binned.data(), binned.size(), 2);
+    ASSERT_TRUE (expected == binned);
+  }
+
+  {
+    AimIO::IsqFile reader ((boost::filesystem::path(test_dir) / "test_e0001082.isq").string().c_str());
+    reader.ReadImageInfo();
+    std::vector<short> data (long_product(reader.dimensions_p));
+    reader.ReadImageData (data.data(), data.size());
+    std::vector<short> expected = ReferenceBin (data, reader.dimensions_p, 3, AimIO::BIN_AVERAGE);
+    std::vector<short> binned (expected.size());
+    reader.ReadBinnedImageData (binned.data(), binned.size(), 3);
+    ASSERT_TRUE (expected == binned);
+  }
+}
+
+TEST_F (AimIOTests, ReadBit8Preview)
+{
+  boost::filesystem::path filename = boost::filesystem::path(test_dir) / "test_bit8_v3.aim";
+  AimIO::AimFile reader;
+  reader.filename = filename.string();
+  reader.ReadImageInfo();
+  tuplet<3,int> dims = reader.dimensions;
+  std::vector<char> data (long_product(dims));
+  reader.ReadImageData (data.data(), data.size());
+
+  tuplet<3,int> half_dims = (dims + 1)/2;
+  std::vector<char> occupancy (long_product(half_dims));
+  std::vector<char> count (long_product(half_dims));
+  reader.ReadBit8Preview (occupancy.data(), occupancy.size());
+  reader.ReadBit8Preview (count.data(), count.size(), AimIO::BIT8_PREVIEW_COUNT);
+  char value = 0;
+  for (size_t i=0; i<data.size(); ++i)
+    { if (data[i]) value = data[i]; }
+
+  for (int k=0; k<half_dims[2]; ++k)
+    for (int j=0; j<half_dims[1]; ++j)
+      for (int i=0; i<half_dims[0]; ++i)
+      {
+        int n = 0;
+        for (int kk=2*k; kk<std::min(2*k+2,dims[2]); ++kk)
+          for (int jj=2*j; jj<std::min(2*j+2,dims[1]); ++jj)
+            for (int ii=2*i; ii<std::min(2*i+2,dims[0]); ++ii)
+              { n += data[(size_t(kk)*dims[1] + jj)*dims[0] + ii] != 0; }
+        size_t index = (size_t(k)*half_dims[1] + j)*half_dims[0] + i;
+        ASSERT_EQ (n, count[index]);
+        ASSERT_EQ (n ? value : 0, occupancy[index]);
+      }
+
+  // Not available for other types.
+  AimIO::AimFile charcmp ((boost::filesystem::path(test_dir) / "test_charcmp_v3.aim").string().c_str());
+  charcmp.ReadImageInfo();
+  ASSERT_THROW (charcmp.ReadBit8Preview (count.data(), long_product((charcmp.dimensions+1)/2)),
+                AimIO::AimIOException);
+}
+
+TEST_F (AimIOTests, Pyramid)
+{
+  // For char data with BIN_MAXIMUM, each level is identical to a binned read.
+  boost::filesystem::path filename = boost::filesystem::path(test_dir) / "test_charcmp_v3.aim";
+  AimIO::AimFile reader;
+  reader.filename = filename.string();
+  reader.ReadImageInfo();
+  std::string sidecar = "test_charcmp_v3.aim.pyr";
+  AimIO::AimPyramid::Create (reader, sidecar);
+
+  AimIO::AimPyramid pyramid (sidecar.c_str());
+  pyramid.Open();
+  ASSERT_EQ (AimIO::AimFile::AIMFILE_TYPE_CHAR, pyramid.buffer_type);
+  ASSERT_EQ (AimIO::BIN_MAXIMUM, pyramid.method);
+  ASSERT_TRUE (pyramid.IsCurrent (filename.string()));
+  ASSERT_FALSE (pyramid.IsCurrent ((boost::filesystem::path(test_dir) / "test_short_v3.aim").string()));
+  // 25x27x29 -> 12x13x14 -> 6x6x7 -> 3x3x3 -> 1x1x1
+  ASSERT_EQ (4, pyramid.NumberOfLevels());
+  ASSERT_EQ ((tuplet<3,int>(1,1,1)), pyramid.GetLevel(4).dimensions);
+  for (int level=1; level<=pyramid.NumberOfLevels(); ++level)
+  {
+    const AimIO::AimPyramid::Level& l = pyramid.GetLevel (level);
+    ASSERT_EQ (0, l.offset % 4096);
+    ASSERT_FLOAT_EQ (reader.element_size[0] * (1 << level), l.element_size[0]);
+    std::vector<char> expected (long_product(l.dimensions));
+    reader.ReadBinnedImageData (expected.data(), expected.size(), 1 << level, AimIO::BIN_MAXIMUM);
+    std::vector<char> data (expected.size());
+    pyramid.ReadLevel (level, data.data(), data.size());
+    ASSERT_TRUE (expected == data);
+    const char* mapped = static_cast<const char*>(pyramid.MapLevel (level));
+    ASSERT_TRUE (std::equal (expected.begin(), expected.end(), mapped));
+  }
+  pyramid.Close();
+
+  // For float data, level 1 is a binned read and later levels bin the
+  // previous level.
+  filename = boost::filesystem::path(test_dir) / "test_float_v3.aim";
+  AimIO::AimFile float_reader;
+  float_reader.filename = filename.string();
+  float_reader.ReadImageInfo();
+  sidecar = "test_float_v3.aim.pyr";
+  AimIO::AimPyramid::Create (float_reader, sidecar, 2);
+  AimIO::AimPyramid float_pyramid (sidecar.c_str());
+  float_pyramid.Open();
+  ASSERT_EQ (2, float_pyramid.NumberOfLevels());
+  std::vector<float> level1 (long_product(float_pyramid.GetLevel(1).dimensions));
+  std::vector<float> expected (level1.size());
+  float_reader.ReadBinnedImageData (expected.data(), expected.size(), 2);
+  float_pyramid.ReadLevel (1, level1.data(), level1.size());
+  ASSERT_TRUE (expected == level1);
+  tuplet<3,int> dims2 = float_pyramid.GetLevel(2).dimensions;
+  std::vector<float> level2 (long_product(dims2));
+  float_pyramid.ReadLevel (2, level2.data(), level2.size());
+  std::vector<float> expected2 (level2.size());
+  AimIO::BinImageData (level1.data(), float_pyramid.GetLevel(1).dimensions, tuplet<3,int>(0,0,0),
+                       dims2, 2, AimIO::BIN_AVERAGE, expected2.data());
+  ASSERT_TRUE (expected2 == level2);
+}
+
+TEST_F (AimIOTests, BrickFile)
+{
+  // A small brick size, so that regions span several bricks, and edge
+  // bricks are clipped.
+  const tuplet<3,int> start (3,5,7);
+  const tuplet<3,int> extent (17,9,20);
+
+  boost::filesystem::path filename = boost::filesystem::path(test_dir) / "test_charcmp_v3.aim";
+  AimIO::AimFile char_reader;
+  char_reader.filename = filename.string();
+  char_reader.ReadImageInfo();
+  std::vector<char> char_image (long_product(char_reader.dimensions));
+  char_reader.ReadImageData (char_image.data(), char_image.size());
+  std::string cache = AimIO::AimBrickFile::SidecarName ("test_charcmp_v3.aim");
+  AimIO::AimBrickFile::Create (char_reader, cache, 8);
+  AimIO::AimBrickFile char_bricks (cache.c_str());
+  char_bricks.ReadImageInfo();
+  ASSERT_EQ (AimIO::AimFile::AIMFILE_TYPE_CHAR, char_bricks.buffer_type);
+  ASSERT_EQ (char_reader.dimensions, char_bricks.dimensions);
+  ASSERT_EQ (char_reader.position, char_bricks.position);
+  ASSERT_EQ (char_reader.processing_log, char_bricks.processing_log);
+  ASSERT_EQ ((tuplet<3,int>(4,4,4)), char_bricks.BrickGridDimensions());
+  ASSERT_TRUE (char_bricks.IsCurrent (filename.string()));
+  ASSERT_FALSE (char_bricks.IsCurrent ((boost::filesystem::path(test_dir) / "test_short_v3.aim").string()));
+  std::vector<char> char_data (char_image.size());
+  char_bricks.ReadImageData (char_data.data(), char_data.size());
+  ASSERT_TRUE (char_image == char_data);
+  // Compressible data should produce a file smaller than the image.
+  ASSERT_LT (boost::filesystem::file_size (cache), char_image.size());
+
+  std::vector<char> char_region (long_product(extent));
+  char_bricks.ReadRegion (start, extent, char_region.data(), char_region.size());
+  const tuplet<3,int>& dims = char_reader.dimensions;
+  for (int k=0; k<extent[2]; ++k)
+    for (int j=0; j<extent[1]; ++j)
+      for (int i=0; i<extent[0]; ++i)
+      {
+        ASSERT_EQ (char_image[((k+start[2])*dims[1] + j+start[1])*dims[0] + i+start[0]],
+                   char_region[(k*extent[1] + j)*extent[0] + i]);
+      }
+
+  filename = boost::filesystem::path(test_dir) / "test_short_v3.aim";
+  AimIO::AimFile short_reader;
+  short_reader.filename = filename.string();
+  short_reader.ReadImageInfo();
+  std::vector<short> short_image (long_product(short_reader.dimensions));
+  short_reader.ReadImageData (short_image.data(), short_image.size());
+  cache = AimIO::AimBrickFile::SidecarName ("test_short_v3.aim");
+  AimIO::AimBrickFile::Create (short_reader, cache, 8);
+  AimIO::AimBrickFile short_bricks (cache.c_str());
+  short_bricks.ReadImageInfo();
+  ASSERT_EQ (AimIO::AimFile::AIMFILE_TYPE_SHORT, short_bricks.buffer_type);
+  std::vector<short> short_data (short_image.size());
+  short_bricks.ReadImageData (short_data.data(), short_data.size());
+  ASSERT_TRUE (short_image == short_data);
+  std::vector<short> short_region (long_product(extent));
+  short_bricks.ReadRegion (start, extent, short_region.data(), short_region.size());
+  const tuplet<3,int>& short_dims = short_reader.dimensions;
+  for (int k=0; k<extent[2]; ++k)
+    for (int j=0; j<extent[1]; ++j)
+      for (int i=0; i<extent[0]; ++i)
+      {
+        ASSERT_EQ (short_image[((k+start[2])*short_dims[1] + j+start[1])*short_dims[0] + i+start[0]],
+                   short_region[(k*extent[1] + j)*extent[0] + i]);
+      }
+
+  filename = boost::filesystem::path(test_dir) / "test_float_v3.aim";
+  AimIO::AimFile float_reader;
+  float_reader.filename = filename.string();
+  float_reader.ReadImageInfo();
+  std::vector<float> float_image (long_product(float_reader.dimensions));
+  float_reader.ReadImageData (float_image.data(), float_image.size());
+  cache = AimIO::AimBrickFile::SidecarName ("test_float_v3.aim");
+  AimIO::AimBrickFile::Create (float_reader, cache, 8);
+  AimIO::AimBrickFile float_bricks (cache.c_str());
+  float_bricks.ReadImageInfo();
+  std::vector<float> float_data (float_image.size());
+  float_bricks.ReadImageData (float_data.data(), float_data.size());
+  ASSERT_TRUE (float_image == float_data);
+
+  // Regions outside the image are rejected.
+  ASSERT_THROW (char_bricks.ReadRegion (tuplet<3,int>(20,0,0), extent,
+                                        char_region.data(), char_region.size()),
+                AimIO::AimIOException);
+
+  // From a source in memory. The size is that of the source, and as there
+  // is no modification time, the cache is never current.
+  filename = boost::filesystem::path(test_dir) / "test_charcmp_v3.aim";
+  std::vector<char> bytes (boost::filesystem::file_size (filename));
+  std::ifstream f (filename.string().c_str(), std::ios_base::in | std::ios_base::binary);
+  f.read (bytes.data(), bytes.size());
+  AimIO::AimFile memory_reader;
+  memory_reader.SetSource (std::make_shared<AimIO::MemorySource> (bytes.data(), bytes.size()));
+  memory_reader.ReadImageInfo();
+  cache = "memory.aim.bricks";
+  AimIO::AimBrickFile::Create (memory_reader, cache, 8);
+  AimIO::AimBrickFile memory_bricks (cache.c_str());
+  memory_bricks.ReadImageInfo();
+  ASSERT_EQ (bytes.size(), memory_bricks.source_size);
+  ASSERT_FALSE (memory_bricks.IsCurrent (filename.string()));
+  memory_bricks.ReadImageData (char_data.data(), char_data.size());
+  ASSERT_TRUE (char_image == char_data);
+
+  // A failure leaves no file behind.
+  boost::filesystem::remove (cache);
+  memory_reader.SetSource (std::make_shared<AimIO::MemorySource> (bytes.data(), bytes.size() - 16));
+  ASSERT_THROW (AimIO::AimBrickFile::Create (memory_reader, cache, 8), AimIO::AimIOException);
+  ASSERT_FALSE (boost::filesystem::exists (cache));
+  ASSERT_FALSE (boost::filesystem::exists (cache + ".tmp"));
+}
+
+TEST_F (AimIOTests, ReadSlices_AIM)
+{
+  const char* names[] = {"test_charcmp_v2.aim", "test_charcmp_v3.aim",
+                         "test_bincmp_v2.aim", "test_bincmp_v3.aim"};
+  for (int n=0; n<4; ++n)
+  {
+    boost::filesystem::path filename = boost::filesystem::path(test_dir) / names[n];
+    AimIO::AimFile reader;
+    reader.filename = filename.string();
+    reader.ReadImageInfo();
+    std::vector<char> image (long_product(reader.dimensions));
+    reader.ReadImageData (image.data(), image.size());
+    const size_t slice_size = size_t(reader.dimensions[0]) * reader.dimensions[1];
+
+    // Index built on first use.
+    std::vector<char> data (slice_size * 5);
+    reader.ReadSlices (13, 5, data.data(), data.size());
+    ASSERT_TRUE (std::equal (data.begin(), data.end(), image.begin() + 13*slice_size));
+    ASSERT_EQ (2, reader.GetSeekIndex().checkpoints.size());
+
+    // Explicit index with a small interval, saved and reloaded.
+    AimIO::AimSeekIndex index;
+    index.Build (reader, 4);
+    std::string sidecar = AimIO::AimSeekIndex::SidecarName (names[n]);
+    index.Save (sidecar);
+    AimIO::AimSeekIndex loaded;
+    loaded.Load (sidecar);
+    ASSERT_EQ (8, loaded.checkpoints.size());
+    ASSERT_EQ (index.compressed_size, loaded.compressed_size);
+    ASSERT_TRUE (loaded.IsCurrent (filename.string()));
+    reader.SetSeekIndex (loaded);
+    for (int first=0; first<reader.dimensions[2]; first+=3)
+    {
+      int count = std::min (6, reader.dimensions[2] - first);
+      data.resize (slice_size * count);
+      reader.ReadSlices (first, count, data.data(), data.size());
+      ASSERT_TRUE (std::equal (data.begin(), data.end(), image.begin() + first*slice_size));
+    }
+  }
+
+  // Uncompressed data are read directly.
+  boost::filesystem::path filename = boost::filesystem::path(test_dir) / "test_short_v3.aim";
+  AimIO::AimFile reader;
+  reader.filename = filename.string();
+  reader.ReadImageInfo();
+  std::vector<short> image (long_product(reader.dimensions));
+  reader.ReadImageData (image.data(), image.size());
+  const size_t slice_size = size_t(reader.dimensions[0]) * reader.dimensions[1];
+  std::vector<short> data (slice_size * 3);
+  reader.ReadSlices (7, 3, data.data(), data.size());
+  ASSERT_TRUE (std::equal (data.begin(), data.end(), image.begin() + 7*slice_size));
+  ASSERT_THROW (reader.GetSeekIndex(), AimIO::AimIOException);
+  ASSERT_THROW (reader.ReadSlices (28, 3, data.data(), data.size()), AimIO::AimIOException);
+}
+
+TEST_F (AimIOTests, PackedAimFile)
+{
+  boost::filesystem::path filename = boost::filesystem::path(test_dir) / "test_short_offset_v3.aim";
+  AimIO::AimFile reader;
+  reader.filename = filename.string();
+  reader.ReadImageInfo();
+  std::vector<short> image (long_product(reader.dimensions));
+  reader.ReadImageData (image.data(), image.size());
+  AimIO::PackedAimFile::Pack (reader, "test_short_offset_v3.aimpk");
+
+  AimIO::PackedAimFile packed ("test_short_offset_v3.aimpk");
+  packed.ReadImageInfo();
+  ASSERT_EQ (reader.dimensions, packed.dimensions);
+  ASSERT_EQ (reader.position, packed.position);
+  ASSERT_EQ (reader.offset, packed.offset);
+  ASSERT_EQ (reader.processing_log, packed.processing_log);
+  ASSERT_FLOAT_EQ (reader.element_size[2], packed.element_size[2]);
+  std::vector<short> data (image.size());
+  packed.ReadImageData (data.data(), data.size());
+  ASSERT_TRUE (image == data);
+  ASSERT_LT (boost::filesystem::file_size ("test_short_offset_v3.aimpk"), image.size()*sizeof(short));
+
+  const size_t slice_size = size_t(packed.dimensions[0]) * packed.dimensions[1];
+  std::vector<short> slices (slice_size * 4);
+  packed.ReadSlices (11, 4, slices.data(), slices.size());
+  ASSERT_TRUE (std::equal (slices.begin(), slices.end(), image.begin() + 11*slice_size));
+
+  // Round trip to a standard AIM file.
+  AimIO::AimFile writer ("packed_round_trip.aim");
+  packed.GetImageInfo (writer);
+  writer.WriteImageData (data.data());
+  AimIO::AimFile copy ("packed_round_trip.aim");
+  copy.ReadImageInfo();
+  ASSERT_EQ (AimIO::AIMFILE_VERSION_30, copy.version);
+  ASSERT_EQ (reader.dimensions, copy.dimensions);
+  ASSERT_EQ (reader.offset, copy.offset);
+  ASSERT_EQ (reader.processing_log, copy.processing_log);
+  std::vector<short> copy_data (image.size());
+  copy.ReadImageData (copy_data.data(), copy_data.size());
+  ASSERT_TRUE (image == copy_data);
+
+  // Extreme values, for which differences wrap around.
+  AimIO::PackedAimFile extreme ("extreme.aimpk");
+  extreme.dimensions = tuplet<3,int>(131,3,2);
+  extreme.element_size = tuplet<3,float>(0.1f,0.1f,0.1f);
+  std::vector<short> values (long_product(extreme.dimensions));
+  for (size_t i=0; i<values.size(); ++i)
+    { values[i] = (i % 3 == 0) ? -32768 : ((i % 3 == 1) ? 32767 : short(i*37)); }
+  extreme.WriteImageData (values.data());
+  AimIO::PackedAimFile extreme_read ("extreme.aimpk");
+  extreme_read.ReadImageInfo();
+  std::vector<short> extreme_data (values.size());
+  extreme_read.ReadImageData (extreme_data.data(), extreme_data.size());
+  ASSERT_TRUE (values == extreme_data);
+
+  // A header size beyond the end of the file is rejected.
+  boost::filesystem::copy_file ("extreme.aimpk", "truncated.aimpk",
+                                boost::filesystem::copy_option::overwrite_if_exists);
+  boost::filesystem::resize_file ("truncated.aimpk", 64);
+  AimIO::PackedAimFile truncated ("truncated.aimpk");
+  ASSERT_THROW (truncated.ReadImageInfo(), AimIO::AimIOException);
+
+  // Only D1Tshort data can be packed.
+  filename = boost::filesystem::path(test_dir) / "test_charcmp_v3.aim";
+  AimIO::AimFile char_reader;
+  char_reader.filename = filename.string();
+  char_reader.ReadImageInfo();
+  ASSERT_THROW (AimIO::PackedAimFile::Pack (char_reader, "charcmp.aimpk"), AimIO::AimIOException);
+}
+
+// A pool that runs each task on a new thread, and counts them.
+class CountingThreadPool : public AimIO::ThreadPool
+{
+  public:
+    explicit CountingThreadPool (int n = 3) : number_of_threads (n), submitted (0) {}
+    ~CountingThreadPool ()
+    {
+      for (size_t i=0; i<threads.size(); ++i)
+        { threads[i].join(); }
+    }
+    int NumberOfThreads () const { return number_of_threads; }
+    void Submit (const std::function<void()>& task)
+    {
+      std::lock_guard<std::mutex> lock (mutex);
+      ++submitted;
+      threads.push_back (std::thread (task));
+    }
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    int number_of_threads;
+    int submitted;
+};
+
+TEST_F (AimIOTests, ThreadPool)
+{
+  AimIO::SetNumThreads (1);
+  ASSERT_EQ (1, AimIO::GetNumThreads());
+  ASSERT_FALSE (AimIO::GetThreadPool());
+  AimIO::SetNumThreads (4);
+  ASSERT_EQ (4, AimIO::GetNumThreads());
+
+  // Large enough to be divided among threads, with runs longer than 255.
+  tuplet<3,int> dims (160,150,40);
+  std::vector<char> image (long_product(dims));
+  std::vector<char> binary (image.size());
+  for (int k=0; k<dims[2]; ++k)
+    for (int j=0; j<dims[1]; ++j)
+      for (int i=0; i<dims[0]; ++i)
+      {
+        size_t n = (size_t(k)*dims[1] + j)*dims[0] + i;
+        image[n] = k < 5 ? 0 : char(((i/37 + j/13 + k/5) % 3) * 50);
+        binary[n] = k < 5 ? 0 : char(((i/40 + j/7 + k) % 2) * 127);
+      }
+
+  // Output must not depend on the number of threads.
+  const AimIO::aim_storage_format_t types[] = {
+    AimIO::AIMFILE_TYPE_D1TcharCmp, AimIO::AIMFILE_TYPE_D1TbinCmp, AimIO::AIMFILE_TYPE_D3Tbit8};
+  for (int t=0; t<3; ++t)
+  {
+    const std::vector<char>& data = (t == 0) ? image : binary;
+    std::vector<char> contents[2];
+    for (int pass=0; pass<2; ++pass)
+    {
+      AimIO::SetNumThreads (pass == 0 ? 1 : 4);
+      AimIO::AimFile writer ("threads.aim");
+      writer.dimensions = dims;
+      writer.element_size = tuplet<3,float>(0.082f,0.082f,0.082f);
+      writer.aim_type = types[t];
+      writer.WriteImageData (data.data());
+      std::ifstream f ("threads.aim", std::ios_base::binary);
+      contents[pass].assign (std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+
+      AimIO::AimFile reader ("threads.aim");
+      reader.ReadImageInfo();
+      ASSERT_EQ (types[t], reader.aim_type);
+      std::vector<char> read (data.size());
+      reader.ReadImageData (read.data(), read.size());
+      ASSERT_TRUE (data == read);
+    }
+    ASSERT_TRUE (contents[0] == contents[1]);
+  }
+
+  std::vector<short> shorts (image.size());
+  for (size_t n=0; n<shorts.size(); ++n)
+    { shorts[n] = short(n*7 - 20000); }
+  AimIO::AimFile short_writer ("threads.aim");
+  short_writer.dimensions = dims;
+  short_writer.element_size = tuplet<3,float>(0.082f,0.082f,0.082f);
+  short_writer.WriteImageData (shorts.data());
+  AimIO::AimFile short_reader ("threads.aim");
+  short_reader.ReadImageInfo();
+  std::vector<short> short_data (shorts.size());
+  short_reader.ReadImageData (short_data.data(), short_data.size());
+  ASSERT_TRUE (shorts == short_data);
+
+  // An application pool.
+  std::shared_ptr<CountingThreadPool> pool (new CountingThreadPool);
+  AimIO::SetThreadPool (pool);
+  ASSERT_EQ (4, AimIO::GetNumThreads());
+  short_reader.ReadImageData (short_data.data(), short_data.size());
+  ASSERT_TRUE (shorts == short_data);
+  ASSERT_LT (0, pool->submitted);
+  AimIO::SetThreadPool (std::shared_ptr<AimIO::ThreadPool>());
+  ASSERT_NE (pool, AimIO::GetThreadPool());
+
+  AimIO::SetNumThreads (0);
+}
+
+TEST_F (AimIOTests, ScanHeadersConcurrency)
+{
+  // Enough files for many batches.
+  std::vector<std::string> paths (600, (boost::filesystem::path(test_dir) / "test_short_v3.aim").string());
+  std::vector<AimIO::io_backend_t> backends (1, AimIO::IO_BACKEND_PREAD);
+  if (AimIO::IsIOBackendAvailable (AimIO::IO_BACKEND_IO_URING))
+    { backends.push_back (AimIO::IO_BACKEND_IO_URING); }
+  for (size_t b=0; b<backends.size(); ++b)
+  {
+    AimIO::SetIOBackend (backends[b]);
+    // number_of_threads is respected, with or without a bound on reads.
+    int outstanding[] = {0, 64, 8};
+    int expected_submitted[] = {31, 31, 7};
+    for (int o=0; o<3; ++o)
+    {
+      std::shared_ptr<CountingThreadPool> pool (new CountingThreadPool (63));
+      AimIO::SetThreadPool (pool);
+      AimIO::ScanOptions options;
+      options.number_of_threads = 32;
+      options.max_outstanding_reads = outstanding[o];
+      std::vector<AimIO::HeaderRecord> records = AimIO::ScanHeaders (paths, options);
+      ASSERT_EQ (paths.size(), records.size());
+      for (size_t i=0; i<records.size(); ++i)
+        { ASSERT_TRUE (records[i].error.empty()); }
+      AimIO::SetThreadPool (std::shared_ptr<AimIO::ThreadPool>());
+      ASSERT_EQ (expected_submitted[o], pool->submitted);
+    }
+  }
+  AimIO::SetIOBackend (AimIO::IO_BACKEND_DEFAULT);
+  AimIO::SetNumThreads (0);
+}
+
+TEST_F (AimIOTests, ReadFromPoolTask)
+{
+  // A read that itself uses the pool must complete when called from a task
+  // of the pool, even if there is no other worker.
+  boost::filesystem::path filename = boost::filesystem::path(test_dir) / "test_e0001082.isq";
+  AimIO::IsqFile reader;
+  reader.filename = filename.string();
+  reader.ReadImageInfo();
+  const int bin = 2;
+  std::vector<short> expected (long_product (AimIO::BinnedDimensions (reader.dimensions_p, bin)));
+  AimIO::SetNumThreads (1);
+  reader.ReadBinnedImageData (expected.data(), expected.size(), bin);
+
+  AimIO::SetNumThreads (2);
+  ASSERT_EQ (1, AimIO::GetThreadPool()->NumberOfThreads());
+  std::vector<short> binned (expected.size());
+  std::promise<void> done;
+  AimIO::GetThreadPool()->Submit ([&] ()
+    {
+    reader.ReadBinnedImageData (binned.data(), binned.size(), bin);
+    done.set_value();
+    });
+  ASSERT_EQ (std::future_status::ready, done.get_future().wait_for (std::chrono::seconds (60)));
+  ASSERT_TRUE (expected == binned);
+
+  // Pipelined AIM reads, which read ahead on the pool.
+  const char* aim_files[] = {"test_short_v3.aim", "test_charcmp_v3.aim"};
+  for (int f=0; f<2; ++f)
+  {
+    AimIO::AimFile aim ((boost::filesystem::path(test_dir) / aim_files[f]).string().c_str());
+    aim.ReadImageInfo();
+    aim.read_chunk_size = 1024;
+    size_t N = long_product(aim.dimensions);
+    std::vector<short> short_expected (N), short_data (N);
+    std::vector<char> char_expected (N), char_data (N);
+    const bool is_short = (aim.buffer_type == AimIO::AimFile::AIMFILE_TYPE_SHORT);
+    AimIO::SetNumThreads (1);
+    if (is_short)
+      { aim.ReadImageData (short_expected.data(), N); }
+    else
+      { aim.ReadImageData (char_expected.data(), N); }
+    AimIO::SetNumThreads (2);
+    std::promise<void> read;
+    AimIO::GetThreadPool()->Submit ([&] ()
+      {
+      if (is_short)
+        { aim.ReadImageData (short_data.data(), N); }
+      else
+        { aim.ReadImageData (char_data.data(), N); }
+      read.set_value();
+      });
+    ASSERT_EQ (std::future_status::ready, read.get_future().wait_for (std::chrono::seconds (60)));
+    ASSERT_TRUE (short_expected == short_data);
+    ASSERT_TRUE (char_expected == char_data);
+  }
+  AimIO::SetNumThreads (0);
+}
+
+TEST_F (AimIOTests, AimReader)
+{
+  // One reader is shared by several threads, each reading regions and
+  // slices of its own.
+  const char* names[] = {"test_charcmp_v2.aim", "test_bincmp_v3.aim", "test_bit8_v3.aim",
+                         "test_short_v2.aim", "test_float_v3.aim"};
+  for (int n=0; n<5; ++n)
+  {
+    boost::filesystem::path filename = boost::filesystem::path(test_dir) / names[n];
+    AimIO::AimFile header;
+    header.filename = filename.string();
+    header.ReadImageInfo();
+    SCOPED_TRACE (names[n]);
+    const AimIO::AimReader reader (header);
+    const tuplet<3,int> dims = reader.Info().dimensions;
+    const size_t slice_size = size_t(dims[0]) * dims[1];
+    const size_t element = (header.buffer_type == AimIO::AimFile::AIMFILE_TYPE_SHORT) ? sizeof(short) :
+                           (header.buffer_type == AimIO::AimFile::AIMFILE_TYPE_FLOAT) ? sizeof(float) : 1;
+
+    std::vector<char> image (long_product(dims) * element);
+    if (header.buffer_type == AimIO::AimFile::AIMFILE_TYPE_SHORT)
+      { header.ReadImageData (reinterpret_cast<short*>(image.data()), long_product(dims)); }
+    else if (header.buffer_type == AimIO::AimFile::AIMFILE_TYPE_FLOAT)
+      { header.ReadImageData (reinterpret_cast<float*>(image.data()), long_product(dims)); }
+    else
+      { header.ReadImageData (image.data(), long_product(dims)); }
+
+    std::vector<int> failures (4, 0);
+    std::vector<std::thread> threads;
+    for (int t=0; t<4; ++t)
+    {
+      threads.push_back (std::thread ([&, t] ()
+        {
+        for (int r=0; r<6; ++r)
+        {
+          tuplet<3,int> start ((3*t + r) % 10, (5*r + t) % 9, (7*t + 3*r) % 12);
+          tuplet<3,int> extent (dims[0] - start[0] - r, dims[1] - start[1] - 2, 1 + (t + 5*r) % 15);
+          size_t count = long_product(extent);
+          std::vector<char> roi (count * element);
+          std::vector<char> slices (slice_size * extent[2] * element);
+          if (header.buffer_type == AimIO::AimFile::AIMFILE_TYPE_SHORT)
+          {
+            reader.ReadRegion (start, extent, reinterpret_cast<short*>(roi.data()), count);
+            reader.ReadSlices (start[2], extent[2], reinterpret_cast<short*>(slices.data()), slice_size * extent[2]);
+          }
+          else if (header.buffer_type == AimIO::AimFile::AIMFILE_TYPE_FLOAT)
+          {
+            reader.ReadRegion (start, extent, reinterpret_cast<float*>(roi.data()), count);
+            reader.ReadSlices (start[2], extent[2], reinterpret_cast<float*>(slices.data()), slice_size * extent[2]);
+          }
+          else
+          {
+            reader.ReadRegion (start, extent, roi.data(), count);
+            reader.ReadSlices (start[2], extent[2], slices.data(), slice_size * extent[2]);
+          }
+          if (!std::equal (slices.begin(), slices.end(), image.begin() + start[2]*slice_size*element))
+            { ++failures[t]; }
+          for (int k=0; k<extent[2]; ++k)
+            for (int j=0; j<extent[1]; ++j)
+            {
+              size_t a = ((size_t(k)*extent[1] + j)*extent[0]) * element;
+              size_t b = ((size_t(start[2] + k)*dims[1] + start[1] + j)*dims[0] + start[0]) * element;
+              if (!std::equal (roi.begin() + a, roi.begin() + a + extent[0]*element, image.begin() + b))
+                { ++failures[t]; }
+            }
+        }
+        }));
+    }
+    for (size_t t=0; t<threads.size(); ++t)
+      { threads[t].join(); }
+    for (int t=0; t<4; ++t)
+      { ASSERT_EQ (0, failures[t]); }
+  }
+
+  // A reader can also open the file itself.
+  boost::filesystem::path filename = boost::filesystem::path(test_dir) / "test_charcmp_v3.aim";
+  AimIO::AimReader reader (filename.string());
+  ASSERT_EQ (AimIO::AIMFILE_TYPE_D1TcharCmp, reader.Info().aim_type);
+  std::vector<char> all (long_product(reader.Info().dimensions));
+  reader.ReadImageData (all.data(), all.size());
+  std::vector<char> out;
+  ASSERT_THROW (reader.ReadSlices (0, reader.Info().dimensions[2] + 1, out.data(), 0), AimIO::AimIOException);
+}
+
+TEST_F (AimIOTests, PipelinedRead)
+{
+  // With a small chunk size, the data are decoded while still being read.
+  // With a single worker, compressed data are decoded slice by slice as
+  // they arrive; otherwise they are decoded in parallel once read.
+  const int thread_counts[] = {2, 4};
+  for (int t=0; t<2; ++t)
+  {
+    SCOPED_TRACE (thread_counts[t]);
+    AimIO::SetNumThreads (thread_counts[t]);
+    const char* names[] = {"test_charcmp_v2.aim", "test_bincmp_v3.aim", "test_bit8_v2.aim",
+                           "test_short_v3.aim", "test_short_offset_v2.aim", "test_float_v2.aim"};
+    for (int n=0; n<6; ++n)
+    {
+      SCOPED_TRACE (names[n]);
+      boost::filesystem::path filename = boost::filesystem::path(test_dir) / names[n];
+      AimIO::AimFile reader;
+      reader.filename = filename.string();
+      reader.ReadImageInfo();
+      size_t size = long_product(reader.dimensions);
+      if (reader.buffer_type == AimIO::AimFile::AIMFILE_TYPE_SHORT)
+      {
+        std::vector<short> whole (size), pipelined (size);
+        reader.read_chunk_size = 0;
+        reader.ReadImageData (whole.data(), size);
+        reader.read_chunk_size = 100;
+        reader.ReadImageData (pipelined.data(), size);
+        ASSERT_TRUE (whole == pipelined);
+      }
+      else if (reader.buffer_type == AimIO::AimFile::AIMFILE_TYPE_FLOAT)
+      {
+        std::vector<float> whole (size), pipelined (size);
+        reader.read_chunk_size = 0;
+        reader.ReadImageData (whole.data(), size);
+        reader.read_chunk_size = 100;
+        reader.ReadImageData (pipelined.data(), size);
+        ASSERT_TRUE (whole == pipelined);
+      }
+      else
+      {
+        std::vector<char> whole (size), pipelined (size);
+        reader.read_chunk_size = 0;
+        reader.ReadImageData (whole.data(), size);
+        reader.read_chunk_size = 100;
+        reader.ReadImageData (pipelined.data(), size);
+        ASSERT_TRUE (whole == pipelined);
+      }
+    }
+  }
+
+  // Truncated compressed data are detected.
+  boost::filesystem::path filename = boost::filesystem::path(test_dir) / "test_charcmp_v3.aim";
+  boost::filesystem::remove ("truncated.aim");
+  boost::filesystem::copy_file (filename, "truncated.aim");
+  boost::filesystem::resize_file ("truncated.aim", boost::filesystem::file_size (filename) - 30);
+  AimIO::AimFile reader ("truncated.aim");
+  reader.ReadImageInfo();
+  reader.read_chunk_size = 100;
+  std::vector<char> data (long_product(reader.dimensions));
+  ASSERT_THROW (reader.ReadImageData (data.data(), data.size()), AimIO::AimIOException);
+  AimIO::SetNumThreads (0);
+}
+
+TEST_F (AimIOTests, AsyncReadWrite)
+{
+  for (int pass=0; pass<2; ++pass)
+  {
+    AimIO::SetNumThreads (pass == 0 ? 4 : 1);
+
+    boost::filesystem::path filename = boost::filesystem::path(test_dir) / "test_charcmp_v3.aim";
+    AimIO::AimFile reader;
+    reader.filename = filename.string();
+    reader.ReadImageInfo();
+    std::vector<char> expected (long_product(reader.dimensions));
+    reader.ReadImageData (expected.data(), expected.size());
+
+    // Future
+    std::vector<char> data (expected.size());
+    std::future<void> read = reader.ReadImageDataAsync (data.data(), data.size());
+    read.get();
+    ASSERT_TRUE (data == expected);
+
+    // Callback
+    AimIO::AimFile writer ("async.aim");
+    writer.dimensions = reader.dimensions;
+    writer.element_size = reader.element_size;
+    std::promise<std::exception_ptr> written;
+    writer.WriteImageDataAsync (expected.data(),
+      [&] (std::exception_ptr error) { written.set_value (error); });
+    ASSERT_FALSE (written.get_future().get());
+    AimIO::AimFile copy ("async.aim");
+    copy.ReadImageInfo();
+    std::vector<char> copy_data (expected.size());
+    copy.ReadImageDataAsync (copy_data.data(), copy_data.size()).get();
+    ASSERT_TRUE (copy_data == expected);
+
+    // ISQ
+    filename = boost::filesystem::path(test_dir) / "test_e0001082.isq";
+    AimIO::IsqFile isq (filename.string().c_str());
+    isq.ReadImageInfo();
+    std::vector<short> isq_expected (long_product(isq.dimensions_p));
+    isq.ReadImageData (isq_expected.data(), isq_expected.size());
+    std::vector<short> isq_data (isq_expected.size());
+    std::promise<std::exception_ptr> isq_read;
+    isq.ReadImageDataAsync (isq_data.data(), isq_data.size(),
+      [&] (std::exception_ptr error) { isq_read.set_value (error); });
+    ASSERT_FALSE (isq_read.get_future().get());
+    ASSERT_TRUE (isq_data == isq_expected);
+
+    // Errors are passed on.
+    std::vector<short> wrong_type (expected.size());
+    std::future<void> failed = reader.ReadImageDataAsync (wrong_type.data(), wrong_type.size());
+    ASSERT_THROW (failed.get(), AimIO::AimIOException);
+    std::promise<std::exception_ptr> failed_callback;
+    reader.ReadImageDataAsync (wrong_type.data(), wrong_type.size(),
+      [&] (std::exception_ptr error) { failed_callback.set_value (error); });
+    ASSERT_TRUE (bool (failed_callback.get_future().get()));
+  }
+  AimIO::SetNumThreads (0);
+}
+
+TEST_F (AimIOTests, Prefetcher)
+{
+  const char* names[] = {"test_charcmp_v2.aim", "test_e0001082.isq", "no_such_file.aim",
+                         "test_short_v3.aim", "test_float_v2.aim", "test_bincmp_v3.aim"};
+  std::vector<std::string> paths;
+  for (int n=0; n<6; ++n)
+    { paths.push_back ((boost::filesystem::path(test_dir) / names[n]).string()); }
+
+  // With a budget of one byte no image is held in memory; with the
+  // intermediate budget, files wait for the previous ones to be taken.
+  const size_t budgets[] = {size_t(1) << 30, 1, 100000};
+  for (int b=0; b<3; ++b)
+  {
+    AimIO::Prefetcher prefetcher (paths, 2, budgets[b]);
+    for (int n=0; n<6; ++n)
+    {
+      SCOPED_TRACE (names[n]);
+      if (n == 2)
+      {
+        ASSERT_THROW (prefetcher.Next(), AimIO::AimIOException);
+        continue;
+      }
+      std::shared_ptr<AimIO::PrefetchedImage> image = prefetcher.Next();
+      ASSERT_TRUE (bool (image));
+      ASSERT_EQ (paths[n], image->filename);
+      if (b < 2)
+        { ASSERT_EQ (b == 0, image->IsInMemory()); }
+      if (n == 1)
+      {
+        ASSERT_EQ (AimIO::HeaderRecord::FORMAT_ISQ, image->format);
+        AimIO::IsqFile isq (paths[n].c_str());
+        isq.ReadImageInfo();
+        std::vector<short> expected (long_product(isq.dimensions_p));
+        isq.ReadImageData (expected.data(), expected.size());
+        std::vector<short> data (expected.size());
+        image->ReadImageData (data.data(), data.size());
+        ASSERT_TRUE (data == expected);
+        continue;
+      }
+      ASSERT_EQ (AimIO::HeaderRecord::FORMAT_AIM, image->format);
+      AimIO::AimFile aim (paths[n].c_str());
+      aim.ReadImageInfo();
+      ASSERT_EQ (aim.dimensions, image->aim.dimensions);
+      size_t size = long_product(aim.dimensions);
+      if (aim.buffer_type == AimIO::AimFile::AIMFILE_TYPE_SHORT)
+      {
+        std::vector<short> expected (size), data (size);
+        aim.ReadImageData (expected.data(), size);
+        image->ReadImageData (data.data(), size);
+        ASSERT_TRUE (data == expected);
+      }
+      else if (aim.buffer_type == AimIO::AimFile::AIMFILE_TYPE_FLOAT)
+      {
+        std::vector<float> expected (size), data (size);
+        aim.ReadImageData (expected.data(), size);
+        image->ReadImageData (data.data(), size);
+        ASSERT_TRUE (data == expected);
+      }
+      else
+      {
+        std::vector<char> expected (size), data (size);
+        aim.ReadImageData (expected.data(), size);
+        image->ReadImageData (data.data(), size);
+        ASSERT_TRUE (data == expected);
+      }
+    }
+    ASSERT_FALSE (prefetcher.Next());
+  }
+
+  // Stopping early does not wait for the remaining files.
+  AimIO::Prefetcher prefetcher (paths, 1, 1000);
+  ASSERT_TRUE (bool (prefetcher.Next()));
+}
+
+TEST_F (AimIOTests, IOBackend)
+{
+  ASSERT_TRUE (AimIO::IsIOBackendAvailable (AimIO::IO_BACKEND_PREAD));
+  ASSERT_NE (AimIO::IO_BACKEND_DEFAULT, AimIO::GetIOBackend());
+
+  std::vector<std::string> paths = AimIO::ListImageFiles (test_dir);
+  paths.push_back ("no_such_file.aim");
+  boost::filesystem::path isq_name = boost::filesystem::path(test_dir) / "test_e0001082.isq";
+  AimIO::IsqFile isq (isq_name.string().c_str());
+  isq.ReadImageInfo();
+  tuplet<3,int> start (3,1,0);
+  tuplet<3,int> extent (isq.dimensions_p[0] - 5, isq.dimensions_p[1] - 2, isq.dimensions_p[2]);
+  tuplet<3,int> stride (2,3,1);
+
+  // Results are the same with every available backend.
+  AimIO::SetIOBackend (AimIO::IO_BACKEND_PREAD);
+  ASSERT_EQ (AimIO::IO_BACKEND_PREAD, AimIO::GetIOBackend());
+  std::vector<AimIO::HeaderRecord> expected = AimIO::ScanHeaders (paths);
+  std::vector<short> expected_region (long_product (AimIO::IsqFile::RegionDimensions (extent, stride)));
+  isq.ReadRegion (start, extent, stride, expected_region.data(), expected_region.size());
+  // Pipelined reads, whose chunks also go through the backend.
+  boost::filesystem::path aim_name = boost::filesystem::path(test_dir) / "test_short_v3.aim";
+  AimIO::AimFile aim (aim_name.string().c_str());
+  aim.ReadImageInfo();
+  aim.read_chunk_size = 100;
+  std::vector<short> expected_image (long_product (aim.dimensions));
+  aim.ReadImageData (expected_image.data(), expected_image.size());
+  if (AimIO::IsIOBackendAvailable (AimIO::IO_BACKEND_IO_URING))
+  {
+    AimIO::SetIOBackend (AimIO::IO_BACKEND_IO_URING);
+    ASSERT_EQ (AimIO::IO_BACKEND_IO_URING, AimIO::GetIOBackend());
+    AimIO::ScanOptions options;
+    options.initial_read_size = 700;   // some headers need more reads
+    std::vector<AimIO::HeaderRecord> records = AimIO::ScanHeaders (paths, options);
+    ASSERT_EQ (expected.size(), records.size());
+    for (size_t i=0; i<records.size(); ++i)
+    {
+      ASSERT_EQ (expected[i].format, records[i].format);
+      ASSERT_EQ (expected[i].dimensions, records[i].dimensions);
+      ASSERT_EQ (expected[i].byte_offset, records[i].byte_offset);
+      ASSERT_EQ (expected[i].processing_log, records[i].processing_log);
+      ASSERT_EQ (expected[i].error.empty(), records[i].error.empty());
+    }
+    std::vector<short> region (expected_region.size());
+    isq.ReadRegion (start, extent, stride, region.data(), region.size());
+    ASSERT_TRUE (region == expected_region);
+    std::vector<short> image (expected_image.size());
+    aim.ReadImageData (image.data(), image.size());
+    ASSERT_TRUE (image == expected_image);
+  }
+  else
+  {
+    ASSERT_THROW (AimIO::SetIOBackend (AimIO::IO_BACKEND_IO_URING), AimIO::AimIOException);
+  }
+  ASSERT_FALSE (expected.back().error.empty());
+  AimIO::SetIOBackend (AimIO::IO_BACKEND_DEFAULT);
+}
+
+TEST_F (AimIOTests, DataSource)
+{
+  boost::filesystem::path filename = boost::filesystem::path(test_dir) / "test_charcmp_v3.aim";
+  AimIO::AimFile reader;
+  reader.filename = filename.string();
+  reader.ReadImageInfo();
+  std::vector<char> expected (long_product(reader.dimensions));
+  reader.ReadImageData (expected.data(), expected.size());
+
+  // Writing to a sink gives the same bytes as writing a file.
+  AimIO::AimFile writer ("source.aim");
+  writer.dimensions = reader.dimensions;
+  writer.element_size = reader.element_size;
+  writer.processing_log = reader.processing_log;
+  writer.WriteImageData (expected.data());
+  std::shared_ptr<AimIO::MemorySink> sink (new AimIO::MemorySink);
+  writer.SetSink (sink);
+  writer.WriteImageData (expected.data());
+  std::ifstream f ("source.aim", std::ios_base::in | std::ios_base::binary);
+  std::vector<char> bytes ((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+  ASSERT_TRUE (sink->Buffer() == bytes);
+
+  std::vector<std::shared_ptr<const AimIO::DataSource> > sources;
+  sources.push_back (std::make_shared<AimIO::MemorySource> (bytes.data(), bytes.size()));
+  sources.push_back (std::make_shared<AimIO::MappedSource> ("source.aim"));
+  sources.push_back (std::make_shared<AimIO::CallbackSource> (bytes.size(),
+    [&] (void* buffer, size_t size, boost::uint64_t offset)
+      {
+      memcpy (buffer, bytes.data() + offset, size);
+      return size;
+      }));
+  // Short reads, as from a stream.
+  sources.push_back (std::make_shared<AimIO::CallbackSource> (bytes.size(),
+    [&] (void* buffer, size_t size, boost::uint64_t offset)
+      {
+      size = std::min (size, size_t(100));
+      memcpy (buffer, bytes.data() + offset, size);
+      return size;
+      }));
+#ifndef _WIN32
+  int fd = open ("source.aim", O_RDONLY);
+  ASSERT_GE (fd, 0);
+  sources.push_back (std::make_shared<AimIO::DescriptorSource> (fd));
+#endif
+
+  const int slice_size = reader.dimensions[0] * reader.dimensions[1];
+  for (size_t i=0; i<sources.size(); ++i)
+  {
+    ASSERT_EQ (sources[i]->Size(), bytes.size());
+    AimIO::AimFile in;
+    in.SetSource (sources[i]);
+    in.ReadImageInfo();
+    ASSERT_EQ (in.dimensions, reader.dimensions);
+    ASSERT_EQ (in.processing_log, reader.processing_log);
+    std::vector<char> data (expected.size());
+    in.ReadImageData (data.data(), data.size());
+    ASSERT_TRUE (data == expected);
+    std::vector<char> slices (3 * slice_size);
+    in.ReadSlices (5, 3, slices.data(), slices.size());
+    ASSERT_TRUE (std::equal (slices.begin(), slices.end(), expected.begin() + 5*slice_size));
+    AimIO::AimReader shared (in);
+    std::fill (data.begin(), data.end(), 0);
+    shared.ReadImageData (data.data(), data.size());
+    ASSERT_TRUE (data == expected);
+  }
+#ifndef _WIN32
+  close (fd);
+#endif
+
+  // An ISQ file in memory.
+  filename = boost::filesystem::path(test_dir) / "test_e0001082.isq";
+  AimIO::IsqFile isq (filename.string().c_str());
+  isq.ReadImageInfo();
+  std::vector<short> isq_expected (long_product(isq.dimensions_p));
+  isq.ReadImageData (isq_expected.data(), isq_expected.size());
+  std::ifstream isq_file (filename.string().c_str(), std::ios_base::in | std::ios_base::binary);
+  std::vector<char> isq_bytes ((std::istreambuf_iterator<char>(isq_file)), std::istreambuf_iterator<char>());
+  AimIO::IsqFile isq_in;
+  isq_in.SetSource (std::make_shared<AimIO::MemorySource> (isq_bytes.data(), isq_bytes.size()));
+  isq_in.ReadImageInfo();
+  ASSERT_EQ (isq_in.dimensions_p, isq.dimensions_p);
+  std::vector<short> isq_data (isq_expected.size());
+  isq_in.ReadImageData (isq_data.data(), isq_data.size());
+  ASSERT_TRUE (isq_data == isq_expected);
+  const short* mapped = isq_in.MapImageData();
+  ASSERT_EQ (reinterpret_cast<const char*>(mapped), isq_bytes.data() + isq_in.SliceOffset (0));
+  AimIO::IsqSlabReader slabs (isq_in, 4);
+  std::vector<short> slab;
+  int first_slice = 0;
+  int number_of_slices = 0;
+  ASSERT_TRUE (slabs.Next (slab, first_slice, number_of_slices));
+  ASSERT_TRUE (std::equal (slab.begin(), slab.end(), isq_expected.begin()));
+
+  // A short source is an error.
+  AimIO::AimFile truncated;
+  truncated.SetSource (std::make_shared<AimIO::MemorySource> (bytes.data(), bytes.size() - 1));
+  truncated.ReadImageInfo();
+  ASSERT_THROW (truncated.ReadImageData (expected.data(), expected.size()), AimIO::AimIOException);
+}
+
+TEST_F (AimIOTests, MemoryBuffers)
+{
+  const char* names[] = {"test_charcmp_v3.aim", "test_bincmp_v2.aim", "test_bit8_v3.aim",
+                         "test_short_v3.aim", "test_float_v2.aim"};
+  for (int n=0; n<5; ++n)
+  {
+    boost::filesystem::path filename = boost::filesystem::path(test_dir) / names[n];
+    AimIO::AimFile reader;
+    reader.filename = filename.string();
+    reader.ReadImageInfo();
+    const size_t size = long_product(reader.dimensions);
+    const size_t element_size = reader.buffer_type == AimIO::AimFile::AIMFILE_TYPE_CHAR ? 1 :
+                                reader.buffer_type == AimIO::AimFile::AIMFILE_TYPE_SHORT ? 2 : 4;
+    std::vector<char> expected (size * element_size);
+    if (element_size == 1)
+      { reader.ReadImageData (expected.data(), size); }
+    else if (element_size == 2)
+      { reader.ReadImageData (reinterpret_cast<short*>(expected.data()), size); }
+    else
+      { reader.ReadImageData (reinterpret_cast<float*>(expected.data()), size); }
+
+    // The file as written, and as written to memory.
+    AimIO::AimFile writer ("memory.aim");
+    writer.version = reader.version;
+    writer.aim_type = reader.aim_type;
+    writer.dimensions = reader.dimensions;
+    writer.element_size = reader.element_size;
+    writer.offset = reader.offset;
+    writer.processing_log = reader.processing_log;
+    std::shared_ptr<AimIO::MemorySink> grown (new AimIO::MemorySink);
+    std::vector<char> provided (expected.size() + 64*1024);
+    std::shared_ptr<AimIO::BufferSink> fixed (new AimIO::BufferSink (provided.data(), provided.size()));
+    std::vector<char> too_small (100);
+    std::shared_ptr<AimIO::DataSink> sinks[] = {
+      std::shared_ptr<AimIO::DataSink>(), grown, fixed,
+      std::make_shared<AimIO::BufferSink> (too_small.data(), too_small.size())};
+    auto write = [&] ()
+      {
+      if (element_size == 1)
+        { writer.WriteImageData (expected.data()); }
+      else if (element_size == 2)
+        { writer.WriteImageData (reinterpret_cast<const short*>(expected.data())); }
+      else
+        { writer.WriteImageData (reinterpret_cast<const float*>(expected.data())); }
+      };
+    for (int k=0; k<3; ++k)
+    {
+      writer.SetSink (sinks[k]);
+      write();
+    }
+    writer.SetSink (sinks[3]);
+    ASSERT_THROW (write(), AimIO::AimIOException);
+    std::ifstream f ("memory.aim", std::ios_base::in | std::ios_base::binary);
+    std::vector<char> bytes ((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+    ASSERT_TRUE (grown->Buffer() == bytes);
+    ASSERT_EQ (fixed->Size(), bytes.size());
+    ASSERT_TRUE (std::equal (bytes.begin(), bytes.end(), provided.begin()));
+
+    // Decoded in place.
+    AimIO::AimFile in;
+    in.ReadImageInfoFromMemory (bytes.data(), bytes.size());
+    ASSERT_EQ (in.dimensions, reader.dimensions);
+    ASSERT_EQ (in.aim_type, reader.aim_type);
+    ASSERT_EQ (in.processing_log, reader.processing_log);
+    std::vector<char> data (expected.size());
+    if (element_size == 1)
+    {
+      in.ReadImageData (data.data(), size);
+      ASSERT_TRUE (data == expected);
+      const size_t slice_size = size_t(in.dimensions[0]) * in.dimensions[1];
+      std::vector<char> slices (3 * slice_size);
+      in.ReadSlices (3, 3, slices.data(), slices.size());
+      ASSERT_TRUE (std::equal (slices.begin(), slices.end(), expected.begin() + 3*slice_size));
+    }
+    else if (element_size == 2)
+    {
+      in.ReadImageData (reinterpret_cast<short*>(data.data()), size);
+      ASSERT_TRUE (data == expected);
+    }
+    else
+    {
+      in.ReadImageData (reinterpret_cast<float*>(data.data()), size);
+      ASSERT_TRUE (data == expected);
+    }
+  }
+}
+
+TEST_F (AimIOTests, IOPolicy)
+{
+  // Large enough to span several chunks of the aligned transfers, and not
+  // a multiple of the block size.
+  tuplet<3,int> dims (101, 103, 107);
+  std::vector<short> expected (long_product(dims));
+  for (size_t i=0; i<expected.size(); ++i)
+    { expected[i] = short(i*7919); }
+  boost::filesystem::path filename = boost::filesystem::path(test_dir) / "test_charcmp_v3.aim";
+  AimIO::AimFile charcmp;
+  charcmp.filename = filename.string();
+  charcmp.ReadImageInfo();
+  std::vector<char> char_expected (long_product(charcmp.dimensions));
+  charcmp.ReadImageData (char_expected.data(), char_expected.size());
+
+  AimIO::io_policy_t policies[] = {AimIO::IO_POLICY_BUFFERED, AimIO::IO_POLICY_DIRECT, AimIO::IO_POLICY_STREAMING};
+  for (int w=0; w<3; ++w)
+  {
+    AimIO::AimFile writer ("policy.aim");
+    writer.io_policy = policies[w];
+    writer.dimensions = dims;
+    writer.element_size = tuplet<3,float>(0.1f, 0.1f, 0.1f);
+    writer.processing_log = TEST_AIM_LOG;
+    writer.WriteImageData (expected.data());
+    AimIO::AimFile char_writer ("policy_char.aim");
+    char_writer.io_policy = policies[w];
+    char_writer.dimensions = charcmp.dimensions;
+    char_writer.element_size = charcmp.element_size;
+    char_writer.WriteImageData (char_expected.data());
+
+    for (int r=0; r<3; ++r)
+    {
+      AimIO::AimFile reader ("policy.aim");
+      reader.io_policy = policies[r];
+      reader.ReadImageInfo();
+      ASSERT_EQ (reader.dimensions, dims);
+      ASSERT_EQ (reader.processing_log, std::string(TEST_AIM_LOG));
+      std::vector<short> data (expected.size());
+      reader.ReadImageData (data.data(), data.size());
+      ASSERT_TRUE (data == expected);
+      // Pipelined
+      AimIO::SetNumThreads (2);
+      reader.read_chunk_size = 100000;
+      std::fill (data.begin(), data.end(), 0);
+      reader.ReadImageData (data.data(), data.size());
+      ASSERT_TRUE (data == expected);
+      AimIO::SetNumThreads (0);
+      // Region
+      AimIO::AimReader shared (reader);
+      tuplet<3,int> start (3, 5, 7);
+      tuplet<3,int> extent (50, 60, 70);
+      std::vector<short> region (long_product(extent));
+      shared.ReadRegion (start, extent, region.data(), region.size());
+      for (int k=0; k<extent[2]; ++k)
+        for (int j=0; j<extent[1]; ++j)
+          for (int i=0; i<extent[0]; ++i)
+          {
+            size_t index = (size_t(k + start[2])*dims[1] + j + start[1])*dims[0] + i + start[0];
+            ASSERT_EQ (region[(size_t(k)*extent[1] + j)*extent[0] + i], expected[index]);
+          }
+
+      AimIO::AimFile char_reader ("policy_char.aim");
+      char_reader.io_policy = policies[r];
+      char_reader.ReadImageInfo();
+      std::vector<char> char_data (char_expected.size());
+      char_reader.ReadImageData (char_data.data(), char_data.size());
+      ASSERT_TRUE (char_data == char_expected);
+    }
+  }
+
+  filename = boost::filesystem::path(test_dir) / "test_e0001082.isq";
+  AimIO::IsqFile isq (filename.string().c_str());
+  isq.ReadImageInfo();
+  std::vector<short> isq_expected (long_product(isq.dimensions_p));
+  isq.ReadImageData (isq_expected.data(), isq_expected.size());
+  for (int r=0; r<3; ++r)
+  {
+    AimIO::IsqFile isq_reader (filename.string().c_str());
+    isq_reader.io_policy = policies[r];
+    isq_reader.ReadImageInfo();
+    std::vector<short> isq_data (isq_expected.size());
+    isq_reader.ReadImageData (isq_data.data(), isq_data.size());
+    ASSERT_TRUE (isq_data == isq_expected);
+  }
+}
+
 // --------------------------------------------------------------------
 // main: custom in order to handle argument.
 